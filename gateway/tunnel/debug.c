@@ -0,0 +1,53 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "debug.h"
+
+int debug_level = LEVEL_INFO;
+
+int debug_ratelimit (struct debug_ratelimit* rl, const char* file, int line) {
+  struct timespec ts;
+  uint64_t now, window;
+  unsigned missed;
+
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  now = ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+
+  // Whichever thread moves the interval on starts its count again
+  window = __atomic_load_n(&rl->window, __ATOMIC_RELAXED);
+  if ((window == 0 || now - window >= DEBUG_RATELIMIT_MS) &&
+      __atomic_compare_exchange_n(&rl->window, &window, now, 0,
+                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&rl->count, 0, __ATOMIC_RELAXED);
+    missed = __atomic_exchange_n(&rl->suppressed, 0, __ATOMIC_RELAXED);
+    if (missed > 0) {
+      WARN("%u messages from %s:%d suppressed\n", missed, file, line);
+    }
+  }
+
+  if (__atomic_fetch_add(&rl->count, 1, __ATOMIC_RELAXED) < DEBUG_RATELIMIT_BURST) {
+    return 1;
+  }
+  __atomic_fetch_add(&rl->suppressed, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+int debug_parse_level (const char* arg) {
+  static const char* names[] = {"error", "warn", "info", "debug"};
+  char* end;
+  long level;
+  int i;
+
+  for (i=0; i<4; i++) {
+    if (strcmp(arg, names[i]) == 0) {
+      return i;
+    }
+  }
+
+  level = strtol(arg, &end, 10);
+  if (*arg == '\0' || *end != '\0' || level < LEVEL_ERROR || level > LEVEL_DEBUG) {
+    return -1;
+  }
+  return level;
+}
@@ -1,21 +1,66 @@
 #ifndef __DEBUG_H__
 #define __DEBUG_H__
 
+#include <stdio.h>
+#include <stdint.h>
 
-#define DBG(...)\
+// Messages have a level. Levels above DEBUG_LEVEL are compiled out, so
+// they cost nothing; build with `make DEBUG_LEVEL=3` to keep DBG(). Of the
+// rest, those above debug_level, set at run time, are skipped before any
+// formatting is done.
+#define LEVEL_ERROR 0
+#define LEVEL_WARN  1
+#define LEVEL_INFO  2
+#define LEVEL_DEBUG 3
+
+#ifndef DEBUG_LEVEL
+#define DEBUG_LEVEL LEVEL_INFO
+#endif
+
+extern int debug_level;
+
+#define DEBUG_ENABLED(level) ((level) <= DEBUG_LEVEL && (level) <= debug_level)
+
+#define DEBUG_PRINT(level, stream, ...)\
   do {\
-    flockfile(stdout);\
-    printf("%s:%d:\t", __FILE__, __LINE__);\
-    printf(__VA_ARGS__);\
-    funlockfile(stdout);\
+    if (DEBUG_ENABLED(level)) {\
+      flockfile(stream);\
+      fprintf(stream, "%s:%d\t", __FILE__, __LINE__);\
+      fprintf(stream, __VA_ARGS__);\
+      funlockfile(stream);\
+    }\
   } while (0)
 
-#define ERROR(...)\
+#define DBG(...)   DEBUG_PRINT(LEVEL_DEBUG, stdout, __VA_ARGS__)
+#define INFO(...)  DEBUG_PRINT(LEVEL_INFO, stdout, __VA_ARGS__)
+#define WARN(...)  DEBUG_PRINT(LEVEL_WARN, stderr, __VA_ARGS__)
+#define ERROR(...) DEBUG_PRINT(LEVEL_ERROR, stderr, __VA_ARGS__)
+
+// For warnings that can come once per packet. Each call site prints at
+// most DEBUG_RATELIMIT_BURST of them every DEBUG_RATELIMIT_MS, and then
+// says how many it left out.
+#define DEBUG_RATELIMIT_MS    5000
+#define DEBUG_RATELIMIT_BURST 10
+
+struct debug_ratelimit {
+  uint64_t window;      // When the current interval started, ms
+  unsigned count;       // Printed in it
+  unsigned suppressed;  // Left out since the last one printed
+};
+
+// Returns 1 if the message may be printed. Safe from any thread.
+int debug_ratelimit (struct debug_ratelimit* rl, const char* file, int line);
+
+#define WARN_LIMITED(...)\
   do {\
-    flockfile(stderr);\
-    fprintf(stderr, "%s:%d\t", __FILE__, __LINE__);\
-    fprintf(stderr, __VA_ARGS__);\
-    funlockfile(stderr);\
+    static struct debug_ratelimit _rl;\
+    if (DEBUG_ENABLED(LEVEL_WARN) && debug_ratelimit(&_rl, __FILE__, __LINE__)) {\
+      WARN(__VA_ARGS__);\
+    }\
   } while (0)
 
+// Parses "error", "warn", "info", "debug" or a number. Returns -1 if it is
+// none of them.
+int debug_parse_level (const char* arg);
+
 #endif
@@ -0,0 +1,174 @@
+// Checks the prefix assignment table, reading the assignments file and
+// comparing two versions of it:
+//
+//   make test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "tunnel-assign.h"
+#include "tunnel-test.h"
+
+#define NUM_ASSIGN 3000
+
+static void make_ll (struct in6_addr* ll, uint32_t i) {
+  memset(ll, 0, sizeof(struct in6_addr));
+  ll->s6_addr[0] = 0xfe;
+  ll->s6_addr[1] = 0x80;
+  ll->s6_addr[12] = i >> 24;
+  ll->s6_addr[13] = i >> 16;
+  ll->s6_addr[14] = i >> 8;
+  ll->s6_addr[15] = i;
+}
+
+static void make_block (struct in6_addr* block, uint32_t i) {
+  memset(block, 0, sizeof(struct in6_addr));
+  block->s6_addr[0] = 0x20;
+  block->s6_addr[1] = 0x01;
+  block->s6_addr[4] = i >> 8;
+  block->s6_addr[5] = i;
+  block->s6_addr[6] = 0x10;
+}
+
+// Adding and removing many entries, which grows the table and moves
+// entries on delete.
+static void test_table (void) {
+  struct assign_table at;
+  struct assign_table copy;
+  struct in6_addr ll, block;
+  const struct assign_entry* e;
+  uint32_t i;
+
+  CHECK(assign_table_init(&at) == 0);
+
+  for (i=0; i<NUM_ASSIGN; i++) {
+    make_ll(&ll, i);
+    make_block(&block, i);
+    CHECK(assign_set(&at, &ll, &block, 60) == 0);
+  }
+  CHECK(at.count == NUM_ASSIGN);
+
+  // Every other one gone
+  for (i=0; i<NUM_ASSIGN; i+=2) {
+    make_ll(&ll, i);
+    assign_del(&at, &ll);
+  }
+  CHECK(at.count == NUM_ASSIGN / 2);
+
+  for (i=0; i<NUM_ASSIGN; i++) {
+    make_ll(&ll, i);
+    make_block(&block, i);
+    e = assign_lookup(&at, &ll);
+    if (i % 2 == 0) {
+      CHECK(e == NULL);
+    } else {
+      CHECK(e != NULL && e->plen == 60 &&
+            memcmp(&e->block, &block, sizeof(block)) == 0);
+    }
+  }
+
+  // Replacing keeps one entry
+  make_ll(&ll, 1);
+  make_block(&block, 7);
+  CHECK(assign_set(&at, &ll, &block, 56) == 0);
+  CHECK(at.count == NUM_ASSIGN / 2);
+  e = assign_lookup(&at, &ll);
+  CHECK(e != NULL && e->plen == 56 && memcmp(&e->block, &block, sizeof(block)) == 0);
+
+  CHECK(assign_table_copy(&copy, &at) == 0);
+  assign_table_free(&at);
+  CHECK(copy.count == NUM_ASSIGN / 2);
+  CHECK(assign_lookup(&copy, &ll) != NULL);
+  assign_table_free(&copy);
+}
+
+static int diff_set;
+static int diff_del;
+static int diff_bad;
+
+static void count_diff (void* ctx, const struct in6_addr* ll,
+                        const struct assign_entry* e) {
+  const struct assign_table* new = ctx;
+
+  if (e == NULL) {
+    diff_del++;
+    if (assign_lookup(new, ll) != NULL) {
+      diff_bad++;
+    }
+  } else {
+    diff_set++;
+    if (memcmp(&e->ll, ll, sizeof(struct in6_addr)) != 0) {
+      diff_bad++;
+    }
+  }
+}
+
+// Two versions of the file: one added, one changed, one removed, one the
+// same, and lines that do not parse.
+static void test_load_diff (void) {
+  char path[] = "/tmp/tunnel-assign-test.XXXXXX";
+  struct assign_table old, new;
+  struct in6_addr ll, block;
+  const struct assign_entry* e;
+  FILE* f;
+  int fd;
+
+  fd = mkstemp(path);
+  CHECK(fd >= 0);
+  if (fd < 0) {
+    return;
+  }
+  f = fdopen(fd, "w");
+  fprintf(f, "fe80::1 2001:db8:0:10::/60\n");
+  fprintf(f, "fe80::2 2001:db8:0:20::\n");
+  fprintf(f, "fe80::3 2001:db8:0:30::/60 extra\n");
+  fprintf(f, "not an address 2001:db8::/60\n");
+  fprintf(f, "fe80::4\n");
+  fprintf(f, "fe80::5 nonsense/60\n");
+  fclose(f);
+
+  CHECK(assign_table_init(&old) == 0);
+  CHECK(assign_load(&old, path, 60) == 0);
+  CHECK(old.count == 3);
+
+  inet_pton(AF_INET6, "fe80::2", &ll);
+  inet_pton(AF_INET6, "2001:db8:0:20::", &block);
+  e = assign_lookup(&old, &ll);
+  CHECK(e != NULL && e->plen == 60 && memcmp(&e->block, &block, sizeof(block)) == 0);
+
+  f = fopen(path, "w");
+  fprintf(f, "fe80::1 2001:db8:0:10::/60\n");
+  fprintf(f, "fe80::2 2001:db8:0:40::/60\n");
+  fprintf(f, "fe80::6 2001:db8:0:60::/60\n");
+  fclose(f);
+
+  CHECK(assign_table_init(&new) == 0);
+  CHECK(assign_load(&new, path, 60) == 0);
+  CHECK(new.count == 3);
+
+  assign_diff(&old, &new, count_diff, &new);
+  CHECK(diff_set == 2);
+  CHECK(diff_del == 1);
+  CHECK(diff_bad == 0);
+
+  // Nothing changed, nothing to do
+  diff_set = diff_del = 0;
+  assign_diff(&new, &new, count_diff, &new);
+  CHECK(diff_set == 0 && diff_del == 0);
+
+  unlink(path);
+  CHECK(assign_load(&new, path, 60) < 0);
+
+  assign_table_free(&old);
+  assign_table_free(&new);
+}
+
+int main (void) {
+  test_table();
+  test_load_diff();
+
+  return test_result();
+}
@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "tunnel-assign.h"
+#include "tunnel-route.h"
+
+#define ASSIGN_INIT_SLOTS 64
+
+static size_t assign_slot (const struct in6_addr* ll, size_t mask) {
+  uint64_t h = in6_iid(ll);
+  uint64_t net;
+
+  memcpy(&net, ll->s6_addr, sizeof(net));
+  h = (h ^ net) * 0x9e3779b97f4a7c15ULL;
+  return (size_t) (h ^ (h >> 32)) & mask;
+}
+
+int assign_table_init (struct assign_table* at) {
+  at->slots = calloc(ASSIGN_INIT_SLOTS, sizeof(struct assign_entry));
+  if (at->slots == NULL) {
+    return -1;
+  }
+  at->mask = ASSIGN_INIT_SLOTS - 1;
+  at->count = 0;
+  return 0;
+}
+
+void assign_table_free (struct assign_table* at) {
+  free(at->slots);
+  at->slots = NULL;
+  at->count = 0;
+}
+
+int assign_table_copy (struct assign_table* dst, const struct assign_table* src) {
+  dst->slots = malloc((src->mask + 1) * sizeof(struct assign_entry));
+  if (dst->slots == NULL) {
+    return -1;
+  }
+  memcpy(dst->slots, src->slots, (src->mask + 1) * sizeof(struct assign_entry));
+  dst->mask = src->mask;
+  dst->count = src->count;
+  return 0;
+}
+
+// Where ll is, or the empty slot that ends its probe run.
+static size_t assign_find (const struct assign_table* at, const struct in6_addr* ll) {
+  size_t s = assign_slot(ll, at->mask);
+
+  while (at->slots[s].plen != 0 &&
+         memcmp(&at->slots[s].ll, ll, sizeof(struct in6_addr)) != 0) {
+    s = (s + 1) & at->mask;
+  }
+  return s;
+}
+
+const struct assign_entry* assign_lookup (const struct assign_table* at,
+                                          const struct in6_addr* ll) {
+  size_t s = assign_find(at, ll);
+
+  return at->slots[s].plen != 0 ? &at->slots[s] : NULL;
+}
+
+// Double the table once it is half full to keep probe runs short.
+static int assign_grow (struct assign_table* at) {
+  struct assign_table bigger;
+  size_t i, s;
+
+  bigger.mask = at->mask * 2 + 1;
+  bigger.slots = calloc(bigger.mask + 1, sizeof(struct assign_entry));
+  if (bigger.slots == NULL) {
+    return -1;
+  }
+
+  for (i=0; i<=at->mask; i++) {
+    if (at->slots[i].plen != 0) {
+      s = assign_find(&bigger, &at->slots[i].ll);
+      bigger.slots[s] = at->slots[i];
+    }
+  }
+
+  free(at->slots);
+  at->slots = bigger.slots;
+  at->mask = bigger.mask;
+  return 0;
+}
+
+int assign_set (struct assign_table* at, const struct in6_addr* ll,
+                const struct in6_addr* block, uint32_t plen) {
+  size_t s;
+
+  if (plen == 0) {
+    return -1;
+  }
+  if ((at->count + 1) * 2 > at->mask + 1 && assign_grow(at) < 0) {
+    return -1;
+  }
+
+  s = assign_find(at, ll);
+  if (at->slots[s].plen == 0) {
+    at->slots[s].ll = *ll;
+    at->count++;
+  }
+  at->slots[s].block = *block;
+  at->slots[s].plen = plen;
+  return 0;
+}
+
+void assign_del (struct assign_table* at, const struct in6_addr* ll) {
+  size_t s = assign_find(at, ll);
+  size_t next, home;
+
+  if (at->slots[s].plen == 0) {
+    return;
+  }
+
+  // Shift later entries of the probe run back so no lookup stops early at
+  // the hole.
+  next = s;
+  while (1) {
+    next = (next + 1) & at->mask;
+    if (at->slots[next].plen == 0) {
+      break;
+    }
+    home = assign_slot(&at->slots[next].ll, at->mask);
+    // Move it only if its home slot is not between the hole and where it is
+    if (((next - home) & at->mask) >= ((next - s) & at->mask)) {
+      at->slots[s] = at->slots[next];
+      s = next;
+    }
+  }
+
+  at->slots[s].plen = 0;
+  at->count--;
+}
+
+int assign_load (struct assign_table* at, const char* path, uint32_t default_plen) {
+  FILE* f;
+  char line[512];
+  char* block;
+  char* end;
+  struct in6_addr ll;
+  struct in6_addr prefix;
+  uint32_t plen;
+
+  f = fopen(path, "r");
+  if (f == NULL) {
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), f) != NULL) {
+    // "link-local block", anything after the block is ignored
+    block = strchr(line, ' ');
+    if (block == NULL) {
+      continue;
+    }
+    *block++ = '\0';
+    end = block + strcspn(block, " \t\r\n");
+    *end = '\0';
+
+    if (inet_pton(AF_INET6, line, &ll) != 1 ||
+        in6_parse_prefix(block, &prefix, &plen, default_plen) < 0 ||
+        plen == 0) {
+      continue;
+    }
+    if (assign_set(at, &ll, &prefix, plen) < 0) {
+      fclose(f);
+      return -1;
+    }
+  }
+
+  fclose(f);
+  return 0;
+}
+
+void assign_diff (const struct assign_table* old, const struct assign_table* new,
+                  void (*fn) (void* ctx, const struct in6_addr* ll,
+                              const struct assign_entry* e),
+                  void* ctx) {
+  const struct assign_entry* e;
+  size_t i;
+
+  // Added or changed
+  for (i=0; i<=new->mask; i++) {
+    if (new->slots[i].plen == 0) {
+      continue;
+    }
+    e = assign_lookup(old, &new->slots[i].ll);
+    if (e == NULL || e->plen != new->slots[i].plen ||
+        memcmp(&e->block, &new->slots[i].block, sizeof(struct in6_addr)) != 0) {
+      fn(ctx, &new->slots[i].ll, &new->slots[i]);
+    }
+  }
+
+  // Removed
+  for (i=0; i<=old->mask; i++) {
+    if (old->slots[i].plen != 0 && assign_lookup(new, &old->slots[i].ll) == NULL) {
+      fn(ctx, &old->slots[i].ll, NULL);
+    }
+  }
+}
@@ -0,0 +1,62 @@
+#ifndef __TUNNEL_ASSIGN_H__
+#define __TUNNEL_ASSIGN_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+// The prefixes the DHCP server has delegated to gateways, as written to
+// the assignments file, one per line:
+//
+//   fe80::1:2:3:4 2607:4::/60
+//
+// The whole file is read into a table keyed by the gateway's link-local
+// address. When the file changes, a fresh table is read and compared with
+// the old one, so only the assignments that changed need to be acted on.
+
+#define ASSIGN_DIR  "/etc/dibbler"
+#define ASSIGN_NAME "client_assignments"
+#define ASSIGN_FILE ASSIGN_DIR "/" ASSIGN_NAME
+
+struct assign_entry {
+  struct in6_addr ll;
+  struct in6_addr block;
+  uint32_t        plen;   // 0 if the slot is empty
+};
+
+struct assign_table {
+  struct assign_entry* slots;
+  size_t               mask;   // slots - 1, slots is a power of 2
+  size_t               count;
+};
+
+int  assign_table_init (struct assign_table* at);
+void assign_table_free (struct assign_table* at);
+
+// Make dst a copy of src. dst must not be initialized. Returns -1 if out
+// of memory.
+int assign_table_copy (struct assign_table* dst, const struct assign_table* src);
+
+// The assignment for ll, or NULL.
+const struct assign_entry* assign_lookup (const struct assign_table* at,
+                                          const struct in6_addr* ll);
+
+// Assign block/plen to ll, replacing what it had. Returns -1 if out of
+// memory.
+int  assign_set (struct assign_table* at, const struct in6_addr* ll,
+                 const struct in6_addr* block, uint32_t plen);
+void assign_del (struct assign_table* at, const struct in6_addr* ll);
+
+// Add every line of the file at path, with default_plen for blocks that
+// do not give a length. Lines that do not parse are skipped. Returns -1
+// if the file cannot be read.
+int assign_load (struct assign_table* at, const char* path, uint32_t default_plen);
+
+// Call fn for every link-local address whose assignment is different in
+// new than in old: with its entry in new, or with NULL if it is gone.
+void assign_diff (const struct assign_table* old, const struct assign_table* new,
+                  void (*fn) (void* ctx, const struct in6_addr* ll,
+                              const struct assign_entry* e),
+                  void* ctx);
+
+#endif
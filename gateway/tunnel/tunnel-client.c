@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <inttypes.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
@@ -13,6 +14,10 @@
 #include <linux/if_tun.h>
 #include <linux/ioctl.h>
 #include <sys/ioctl.h>
+#include <linux/sockios.h>
+
+#include "tunnel-frame.h"
+#include "tunnel-metrics.h"
 
 // #include "ini/ini.h"
 // #include "jsmn/jsmn.h"
@@ -32,6 +37,9 @@
 #define TUNNEL_SERVER_HOST "141.212.11.200"
 #define TUNNEL_SERVER_PORT 32100
 
+// On 127.0.0.1
+#define TUNNEL_CLIENT_METRICS_PORT 32102
+
 // Holds the parsed values from the config.ini file
 // config_ini_t cfg = {NULL, 0};
 
@@ -46,6 +54,24 @@ char cmd_lladdr_buf[4096];
 int tcp_socket = -1;
 int tun_file = -1;
 
+// Frames from the server being reassembled
+struct tunnel_rxbuf tcp_rx;
+
+// Counters for /metrics. Everything, scrapes included, happens on the one
+// thread, so they are plain increments.
+struct client_stats {
+	uint64_t tun_rx_packets;  // Read from TUN and sent to the server
+	uint64_t tun_rx_bytes;
+	uint64_t tun_tx_packets;  // From the server and written to TUN
+	uint64_t tun_tx_bytes;
+	uint64_t drop_tun_write;
+	uint64_t drop_send;       // Could not be sent, the connection was lost
+	uint64_t drop_framing;    // Times the framing with the server was lost
+	uint64_t reconnects;
+} __attribute__((aligned(METRICS_CACHE_LINE)));
+
+struct client_stats stats;
+
 
 // Runs a command on the local system using the kernel command interpreter.
 int ssystem(const char *fmt, ...) {
@@ -148,6 +174,9 @@ int connect_tcp () {
 
 	//make_nonblocking(tcp_socket);
 
+	// Nothing left over from the last connection is valid on this one
+	tunnel_rxbuf_init(&tcp_rx);
+
 	freeaddrinfo(strmSvr);
 
 	printf("Connected to server.\n");
@@ -216,6 +245,11 @@ int connect_tcp () {
 // Simple function that calls the functions needed to reconnect
 void reconnect () {
 
+	// Only the first connection is not a reconnect
+	if (tcp_socket >= 0) {
+		stats.reconnects++;
+	}
+
 	// Sit an spin until this works
 	while (1) {
 		if (connect_tcp() < 0) {
@@ -235,6 +269,54 @@ loop:
 	ssystem(cmd_lladdr_buf);
 }
 
+// Answer a scrape of the metrics port once its request is in. Whatever
+// the socket does not take goes out from the select() loop.
+void answer_metrics (struct metrics_conn* scrape) {
+	struct metrics_buf b;
+	int outq = 0;
+
+	// Bytes the kernel has not sent to the server yet
+	if (ioctl(tcp_socket, SIOCOUTQ, &outq) < 0) {
+		outq = 0;
+	}
+
+	metrics_buf_init(&b);
+	metrics_header(&b, "tunnel_client_tun_rx_packets_total", "counter",
+		"Packets read from TUN and sent to the server.");
+	metrics_printf(&b, "tunnel_client_tun_rx_packets_total %" PRIu64 "\n", stats.tun_rx_packets);
+	metrics_header(&b, "tunnel_client_tun_rx_bytes_total", "counter",
+		"Bytes read from TUN and sent to the server.");
+	metrics_printf(&b, "tunnel_client_tun_rx_bytes_total %" PRIu64 "\n", stats.tun_rx_bytes);
+	metrics_header(&b, "tunnel_client_tun_tx_packets_total", "counter",
+		"Packets from the server written to TUN.");
+	metrics_printf(&b, "tunnel_client_tun_tx_packets_total %" PRIu64 "\n", stats.tun_tx_packets);
+	metrics_header(&b, "tunnel_client_tun_tx_bytes_total", "counter",
+		"Bytes from the server written to TUN.");
+	metrics_printf(&b, "tunnel_client_tun_tx_bytes_total %" PRIu64 "\n", stats.tun_tx_bytes);
+	metrics_header(&b, "tunnel_client_drops_total", "counter", "Packets dropped, by reason.");
+	metrics_printf(&b, "tunnel_client_drops_total{reason=\"tun_write\"} %" PRIu64 "\n",
+		stats.drop_tun_write);
+	metrics_printf(&b, "tunnel_client_drops_total{reason=\"send\"} %" PRIu64 "\n",
+		stats.drop_send);
+	metrics_header(&b, "tunnel_client_framing_errors_total", "counter",
+		"Times the framing with the server was lost.");
+	metrics_printf(&b, "tunnel_client_framing_errors_total %" PRIu64 "\n", stats.drop_framing);
+	metrics_header(&b, "tunnel_client_reconnects_total", "counter",
+		"Times the connection to the server was made again.");
+	metrics_printf(&b, "tunnel_client_reconnects_total %" PRIu64 "\n", stats.reconnects);
+	metrics_header(&b, "tunnel_client_send_queue_bytes", "gauge",
+		"Bytes sent to the server that the kernel still holds.");
+	metrics_printf(&b, "tunnel_client_send_queue_bytes %d\n", outq);
+	metrics_header(&b, "tunnel_client_rx_partial_bytes", "gauge",
+		"Bytes of a frame from the server waiting for the rest.");
+	metrics_printf(&b, "tunnel_client_rx_partial_bytes %zu\n", tcp_rx.end - tcp_rx.start);
+
+	if (metrics_conn_respond(scrape, &b) < 0) {
+		fprintf(stderr, "Could not answer a metrics scrape\n");
+	}
+	metrics_buf_free(&b);
+}
+
 int main () {
 
 	// Used to setup the tunnel
@@ -244,12 +326,15 @@ int main () {
     int macfile;
     char macbuf[128];
 
+    int metrics_fd;
+    struct metrics_conn scrape;
+
     // Used for the select
 	fd_set rfds;
+	fd_set wfds;
 	uint8_t nfds = 0;
 
     ssize_t read_len;
-    ssize_t sent_len;
     uint8_t buf[4096];
 
     int ret;
@@ -325,6 +410,17 @@ int main () {
 	macbuf[16] = '\0';
 	snprintf(cmd_lladdr_buf, 4096, "ifconfig %s add fe80::c298:e5ff:fe%s/64", ifr.ifr_name, macbuf+9);
 
+	// Metrics on loopback, the tunnel runs without them if need be
+	// Scrapes are answered from the loop below and must never block it.
+	metrics_fd = metrics_listen(TUNNEL_CLIENT_METRICS_PORT);
+	if (metrics_fd < 0) {
+		fprintf(stderr, "Could not listen for metrics on port %d\n",
+			TUNNEL_CLIENT_METRICS_PORT);
+	} else {
+		make_nonblocking(metrics_fd);
+	}
+	metrics_conn_init(&scrape);
+
 	// Create the connection to the IPv6 tunnel server
 	reconnect();
 
@@ -334,6 +430,7 @@ int main () {
 	while (1) {
 		// Clear the struct and set all fd that aren't 1
 		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
 		// Reset these each time in case tcp_socket changes after a reconnect
 		FD_SET(tcp_socket, &rfds);
 		nfds = tcp_socket + 1;
@@ -341,9 +438,21 @@ int main () {
 		if (tun_file + 1 > nfds) {
 			nfds = tun_file + 1;
 		}
+		if (metrics_fd >= 0) {
+			FD_SET(metrics_fd, &rfds);
+			if (metrics_fd + 1 > nfds) {
+				nfds = metrics_fd + 1;
+			}
+		}
+		if (scrape.fd >= 0) {
+			FD_SET(scrape.fd, scrape.responding ? &wfds : &rfds);
+			if (scrape.fd + 1 > nfds) {
+				nfds = scrape.fd + 1;
+			}
+		}
 
 		// This blocks
-		ret = select(nfds, &rfds, NULL, NULL, NULL);
+		ret = select(nfds, &rfds, &wfds, NULL, NULL);
 
 		if (ret < 0) {
 			if (errno == EINTR) {
@@ -359,8 +468,12 @@ int main () {
 		} else {
 			if (FD_ISSET(tcp_socket, &rfds)) {
 				// read from tcp
+				uint8_t* rxptr;
+				size_t rxlen;
+				struct tunnel_frame frame;
 
-				read_len = recv(tcp_socket, buf, 4096, 0);
+				rxlen = tunnel_rxbuf_space(&tcp_rx, &rxptr);
+				read_len = recv(tcp_socket, rxptr, rxlen, 0);
 				if (read_len == 0) {
 					reconnect();
 				} else if (read_len < 0) {
@@ -372,13 +485,36 @@ int main () {
 							reconnect();
 					}
 				} else {
-					ret = write(tun_file, buf, read_len);
+					// Hand every complete packet to the kernel. A partial
+					// one waits in tcp_rx for the rest.
+					tunnel_rxbuf_commit(&tcp_rx, read_len);
+					while ((ret = tunnel_rxbuf_next(&tcp_rx, &frame)) == 1) {
+						if (frame.type == TUNNEL_FRAME_PACKET) {
+							if (write(tun_file, frame.data, frame.len) < 0) {
+								stats.drop_tun_write++;
+							} else {
+								stats.tun_tx_packets++;
+								stats.tun_tx_bytes += frame.len;
+							}
+						} else if (frame.type == TUNNEL_FRAME_ECHO_REQ) {
+							if (tunnel_frame_send(tcp_socket, TUNNEL_FRAME_ECHO_REP,
+							                      frame.data, frame.len) < 0) {
+								ret = -1;
+								break;
+							}
+						}
+					}
+					if (ret < 0) {
+						fprintf(stderr, "Lost framing with the server\n");
+						stats.drop_framing++;
+						reconnect();
+					}
 				}
 			}
 
 			if (FD_ISSET(tun_file, &rfds)) {
 				// read from tun
-				read_len = read(tun_file, buf, 4906);
+				read_len = read(tun_file, buf, sizeof(buf));
 				if (read_len < 0) {
 					switch (errno) {
 						case EAGAIN:
@@ -389,12 +525,31 @@ int main () {
 							return -1;
 					}
 				} else {
-					sent_len = send(tcp_socket, buf, read_len, 0);
-					if (sent_len < 0) {
+					ret = tunnel_frame_send(tcp_socket, TUNNEL_FRAME_PACKET, buf, read_len);
+					if (ret < 0) {
+						stats.drop_send++;
 						reconnect();
+					} else {
+						stats.tun_rx_packets++;
+						stats.tun_rx_bytes += read_len;
 					}
 				}
 			}
+
+			if (scrape.fd >= 0 && !scrape.responding && FD_ISSET(scrape.fd, &rfds)) {
+				if (metrics_conn_read(&scrape) == 1) {
+					answer_metrics(&scrape);
+				}
+			} else if (scrape.fd >= 0 && scrape.responding && FD_ISSET(scrape.fd, &wfds)) {
+				if (metrics_conn_write(&scrape) < 0) {
+					fprintf(stderr, "Could not answer a metrics scrape\n");
+				}
+			}
+
+			// After the scrape in progress, which a new one replaces
+			if (metrics_fd >= 0 && FD_ISSET(metrics_fd, &rfds)) {
+				metrics_conn_accept(&scrape, metrics_fd);
+			}
 		}
 	}
 
@@ -0,0 +1,189 @@
+// Checks the tunnel framing against streams split and merged the way TCP
+// may deliver them:
+//
+//   make test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "tunnel-frame.h"
+#include "tunnel-test.h"
+
+#define NUM_FRAMES 5
+
+static const uint16_t frame_lens[NUM_FRAMES] = {40, 0, 1280, TUNNEL_FRAME_MAX_LEN, 1};
+static const uint8_t frame_types[NUM_FRAMES] = {
+  TUNNEL_FRAME_PACKET, TUNNEL_FRAME_ECHO_REQ, TUNNEL_FRAME_PACKET,
+  TUNNEL_FRAME_PACKET, 0xfe,
+};
+
+// Lay out the test frames back to back, payload bytes numbered so a frame
+// taken out of the wrong place is noticed. Returns the stream length.
+static size_t build_stream (uint8_t* stream) {
+  size_t off = 0;
+  int i, j;
+
+  for (i=0; i<NUM_FRAMES; i++) {
+    tunnel_frame_header(stream+off, frame_types[i], frame_lens[i]);
+    off += TUNNEL_FRAME_HEADER_LEN;
+    for (j=0; j<frame_lens[i]; j++) {
+      stream[off++] = i + j;
+    }
+  }
+  return off;
+}
+
+static int check_frame (struct tunnel_frame* frame, int i) {
+  int j;
+
+  if (frame->type != frame_types[i] || frame->len != frame_lens[i]) {
+    return 0;
+  }
+  for (j=0; j<frame->len; j++) {
+    if (frame->data[j] != (uint8_t) (i + j)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Feed the stream in chunks of at most chunk bytes, as separate reads
+// would return it, and check every frame comes out whole and in order.
+static void feed (const uint8_t* stream, size_t len, size_t chunk) {
+  struct tunnel_rxbuf* rx = malloc(sizeof(struct tunnel_rxbuf));
+  struct tunnel_frame frame;
+  size_t off = 0;
+  int got = 0;
+  int ret;
+
+  tunnel_rxbuf_init(rx);
+
+  while (off < len) {
+    uint8_t* ptr;
+    size_t space = tunnel_rxbuf_space(rx, &ptr);
+    size_t n = len - off;
+
+    if (n > chunk) n = chunk;
+    if (n > space) n = space;
+    CHECK(n > 0);
+
+    memcpy(ptr, stream+off, n);
+    tunnel_rxbuf_commit(rx, n);
+    off += n;
+
+    while ((ret = tunnel_rxbuf_next(rx, &frame)) == 1) {
+      CHECK(got < NUM_FRAMES && check_frame(&frame, got));
+      got++;
+    }
+    CHECK(ret == 0);
+  }
+
+  CHECK(got == NUM_FRAMES);
+  free(rx);
+}
+
+static void test_split_and_merged (void) {
+  uint8_t* stream = malloc(NUM_FRAMES * (TUNNEL_FRAME_HEADER_LEN + TUNNEL_FRAME_MAX_LEN));
+  size_t len = build_stream(stream);
+
+  feed(stream, len, 1);
+  feed(stream, len, 3);
+  feed(stream, len, 1000);
+  feed(stream, len, len);
+
+  free(stream);
+}
+
+// Frames parsed straight out of one big read, and a frame cut short.
+static void test_parse (void) {
+  uint8_t* stream = malloc(NUM_FRAMES * (TUNNEL_FRAME_HEADER_LEN + TUNNEL_FRAME_MAX_LEN));
+  size_t len = build_stream(stream);
+  struct tunnel_frame frame;
+  size_t off = 0;
+  int ret;
+  int i;
+
+  for (i=0; i<NUM_FRAMES; i++) {
+    ret = tunnel_frame_parse(stream+off, len-off, &frame);
+    CHECK(ret == TUNNEL_FRAME_HEADER_LEN + frame_lens[i] && check_frame(&frame, i));
+    off += TUNNEL_FRAME_HEADER_LEN + frame_lens[i];
+  }
+  CHECK(off == len);
+  CHECK(tunnel_frame_parse(stream+off, 0, &frame) == 0);
+
+  // Everything but the last byte of the third frame
+  off = 2 * TUNNEL_FRAME_HEADER_LEN + frame_lens[0] + frame_lens[1];
+  CHECK(tunnel_frame_parse(stream+off, TUNNEL_FRAME_HEADER_LEN + frame_lens[2] - 1, &frame) == 0);
+  CHECK(tunnel_frame_parse(stream+off, 2, &frame) == 0);
+
+  free(stream);
+}
+
+// Anything that is not our framing closes the connection.
+static void test_bad_stream (void) {
+  struct tunnel_rxbuf* rx = malloc(sizeof(struct tunnel_rxbuf));
+  struct tunnel_frame frame;
+  uint8_t* ptr;
+  // The start of a bare IPv6 packet, as an unframed peer would send
+  uint8_t bare[8] = {0x60, 0x00, 0x00, 0x00, 0x00, 0x24, 0x00, 0x01};
+  uint8_t big[TUNNEL_FRAME_HEADER_LEN];
+
+  tunnel_rxbuf_init(rx);
+  tunnel_rxbuf_space(rx, &ptr);
+  memcpy(ptr, bare, sizeof(bare));
+  tunnel_rxbuf_commit(rx, sizeof(bare));
+  CHECK(tunnel_rxbuf_next(rx, &frame) == -1);
+
+  tunnel_rxbuf_init(rx);
+  tunnel_frame_header(big, TUNNEL_FRAME_PACKET, TUNNEL_FRAME_MAX_LEN + 1);
+  tunnel_rxbuf_space(rx, &ptr);
+  memcpy(ptr, big, sizeof(big));
+  tunnel_rxbuf_commit(rx, sizeof(big));
+  CHECK(tunnel_rxbuf_next(rx, &frame) == -1);
+
+  free(rx);
+}
+
+// Frames written with tunnel_frame_send() read back the same.
+static void test_send (void) {
+  struct tunnel_rxbuf* rx = malloc(sizeof(struct tunnel_rxbuf));
+  struct tunnel_frame frame;
+  uint8_t pkt[100];
+  uint8_t* ptr;
+  ssize_t n;
+  int sv[2];
+
+  memset(pkt, 0xab, sizeof(pkt));
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+  CHECK(tunnel_frame_send(sv[0], TUNNEL_FRAME_PACKET, pkt, sizeof(pkt)) == 0);
+  CHECK(tunnel_frame_send(sv[0], TUNNEL_FRAME_ECHO_REP, pkt, 3) == 0);
+
+  tunnel_rxbuf_init(rx);
+  tunnel_rxbuf_space(rx, &ptr);
+  n = recv(sv[1], ptr, 2*TUNNEL_FRAME_HEADER_LEN + sizeof(pkt) + 3, MSG_WAITALL);
+  CHECK(n == 2*TUNNEL_FRAME_HEADER_LEN + sizeof(pkt) + 3);
+  tunnel_rxbuf_commit(rx, n);
+
+  CHECK(tunnel_rxbuf_next(rx, &frame) == 1);
+  CHECK(frame.type == TUNNEL_FRAME_PACKET && frame.len == sizeof(pkt));
+  CHECK(memcmp(frame.data, pkt, sizeof(pkt)) == 0);
+  CHECK(tunnel_rxbuf_next(rx, &frame) == 1);
+  CHECK(frame.type == TUNNEL_FRAME_ECHO_REP && frame.len == 3);
+  CHECK(tunnel_rxbuf_next(rx, &frame) == 0);
+
+  close(sv[0]);
+  close(sv[1]);
+  free(rx);
+}
+
+int main (void) {
+  test_split_and_merged();
+  test_parse();
+  test_bad_stream();
+  test_send();
+
+  return test_result();
+}
@@ -0,0 +1,101 @@
+#include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#include "tunnel-frame.h"
+
+void tunnel_frame_header (uint8_t* hdr, uint8_t type, uint16_t len) {
+  hdr[0] = TUNNEL_FRAME_VERSION;
+  hdr[1] = type;
+  hdr[2] = len >> 8;
+  hdr[3] = len & 0xff;
+}
+
+int tunnel_frame_send (int fd, uint8_t type, const uint8_t* data, uint16_t len) {
+  uint8_t hdr[TUNNEL_FRAME_HEADER_LEN];
+  struct iovec iov[2];
+  int iovcnt = 2;
+  ssize_t ret;
+
+  tunnel_frame_header(hdr, type, len);
+  iov[0].iov_base = hdr;
+  iov[0].iov_len  = TUNNEL_FRAME_HEADER_LEN;
+  iov[1].iov_base = (void*) data;
+  iov[1].iov_len  = len;
+
+  // Keep going until the whole frame is out
+  while (iovcnt > 0) {
+    ret = writev(fd, &iov[2-iovcnt], iovcnt);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+
+    while (iovcnt > 0 && (size_t) ret >= iov[2-iovcnt].iov_len) {
+      ret -= iov[2-iovcnt].iov_len;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov[2-iovcnt].iov_base = (uint8_t*) iov[2-iovcnt].iov_base + ret;
+      iov[2-iovcnt].iov_len -= ret;
+    }
+  }
+
+  return 0;
+}
+
+void tunnel_rxbuf_init (struct tunnel_rxbuf* rx) {
+  rx->start = 0;
+  rx->end   = 0;
+}
+
+size_t tunnel_rxbuf_space (struct tunnel_rxbuf* rx, uint8_t** ptr) {
+  if (rx->start > 0) {
+    memmove(rx->buf, rx->buf + rx->start, rx->end - rx->start);
+    rx->end  -= rx->start;
+    rx->start = 0;
+  }
+
+  *ptr = rx->buf + rx->end;
+  return TUNNEL_RXBUF_LEN - rx->end;
+}
+
+void tunnel_rxbuf_commit (struct tunnel_rxbuf* rx, size_t len) {
+  rx->end += len;
+}
+
+int tunnel_frame_parse (const uint8_t* buf, size_t len, struct tunnel_frame* frame) {
+  uint16_t flen;
+
+  if (len < TUNNEL_FRAME_HEADER_LEN) {
+    return 0;
+  }
+
+  flen = (buf[2] << 8) | buf[3];
+  if (buf[0] != TUNNEL_FRAME_VERSION || flen > TUNNEL_FRAME_MAX_LEN) {
+    return -1;
+  }
+
+  if (len < TUNNEL_FRAME_HEADER_LEN + (size_t) flen) {
+    return 0;
+  }
+
+  frame->type = buf[1];
+  frame->len  = flen;
+  frame->data = (uint8_t*) buf + TUNNEL_FRAME_HEADER_LEN;
+
+  return TUNNEL_FRAME_HEADER_LEN + flen;
+}
+
+int tunnel_rxbuf_next (struct tunnel_rxbuf* rx, struct tunnel_frame* frame) {
+  int ret = tunnel_frame_parse(rx->buf + rx->start, rx->end - rx->start, frame);
+
+  if (ret <= 0) {
+    return ret;
+  }
+
+  rx->start += ret;
+  return 1;
+}
@@ -0,0 +1,74 @@
+#ifndef __TUNNEL_FRAME_H__
+#define __TUNNEL_FRAME_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Framing for the TCP connection between tunnel-client and tunnel-server.
+//
+// TCP is a byte stream, so every packet is sent with a small header that
+// says how long it is:
+//
+//   [version][type][length hi][length lo][length bytes of payload]
+//
+// Types below 0x80 carry data, types with 0x80 set are control frames.
+// A receiver skips control frames it does not know. A frame with the wrong
+// version or a length over TUNNEL_FRAME_MAX_LEN means the two ends are out
+// of sync, and the connection has to be dropped.
+
+#define TUNNEL_FRAME_VERSION    1
+#define TUNNEL_FRAME_HEADER_LEN 4
+#define TUNNEL_FRAME_MAX_LEN    4096
+
+// Frame types
+#define TUNNEL_FRAME_PACKET     0x00  // one IPv6 packet
+#define TUNNEL_FRAME_CONTROL    0x80
+#define TUNNEL_FRAME_ECHO_REQ   0x80  // answered with an ECHO_REP, same payload
+#define TUNNEL_FRAME_ECHO_REP   0x81
+
+// Room for one full frame plus the start of the next.
+#define TUNNEL_RXBUF_LEN (2 * (TUNNEL_FRAME_HEADER_LEN + TUNNEL_FRAME_MAX_LEN))
+
+// Reassembly buffer, one per connection. Bytes are read in at end and
+// frames taken out from start.
+struct tunnel_rxbuf {
+  size_t  start;
+  size_t  end;
+  uint8_t buf[TUNNEL_RXBUF_LEN];
+};
+
+// A frame taken out of a tunnel_rxbuf. data points into the buffer and is
+// valid until the next call to tunnel_rxbuf_space().
+struct tunnel_frame {
+  uint8_t  type;
+  uint16_t len;
+  uint8_t* data;
+};
+
+// Fill in the four byte header for a frame.
+void tunnel_frame_header (uint8_t* hdr, uint8_t type, uint16_t len);
+
+// Write a whole frame to a blocking fd. Returns 0 on success, -1 with errno
+// set on failure.
+int tunnel_frame_send (int fd, uint8_t type, const uint8_t* data, uint16_t len);
+
+void tunnel_rxbuf_init (struct tunnel_rxbuf* rx);
+
+// Where to read the next bytes from the socket into. Moves any partial
+// frame to the front of the buffer first. Returns how many bytes fit.
+size_t tunnel_rxbuf_space (struct tunnel_rxbuf* rx, uint8_t** ptr);
+
+// Mark len bytes read into the space from tunnel_rxbuf_space().
+void tunnel_rxbuf_commit (struct tunnel_rxbuf* rx, size_t len);
+
+// Parse the frame at the start of len bytes of buf. Returns how many bytes
+// the frame takes and fills in frame if it is complete, 0 if more bytes
+// are needed, and -1 if the bytes are not valid framing.
+int tunnel_frame_parse (const uint8_t* buf, size_t len, struct tunnel_frame* frame);
+
+// Take the next complete frame out of the buffer. Returns 1 and fills in
+// frame if there was one, 0 if more bytes are needed, and -1 if the stream
+// is not valid framing.
+int tunnel_rxbuf_next (struct tunnel_rxbuf* rx, struct tunnel_frame* frame);
+
+#endif
@@ -0,0 +1,120 @@
+// Checks the mailbox the server's workers talk through, with several
+// threads posting at once while one takes:
+//
+//   make test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <poll.h>
+
+#include "tunnel-mailbox.h"
+#include "tunnel-test.h"
+
+#define NUM_POSTERS 4
+#define NUM_POSTS   200000
+
+struct test_msg {
+  struct mailbox_node node;
+  int                 poster;
+  int                 seq;
+};
+
+static struct mailbox mb;
+
+static void* poster (void* arg) {
+  int id = (int) (long) arg;
+  struct test_msg* msg;
+  int i;
+
+  for (i=0; i<NUM_POSTS; i++) {
+    msg = malloc(sizeof(struct test_msg));
+    msg->poster = id;
+    msg->seq = i;
+    mailbox_post(&mb, &msg->node);
+  }
+  return NULL;
+}
+
+static void test_single (void) {
+  struct test_msg a, b;
+  struct pollfd pfd;
+
+  CHECK(mailbox_init(&mb) == 0);
+  pfd.fd = mb.efd;
+  pfd.events = POLLIN;
+
+  CHECK(mailbox_take(&mb) == NULL);
+  CHECK(poll(&pfd, 1, 0) == 0);
+
+  mailbox_post(&mb, &a.node);
+  mailbox_post(&mb, &b.node);
+  CHECK(poll(&pfd, 1, 0) == 1);
+
+  mailbox_ack(&mb);
+  CHECK(poll(&pfd, 1, 0) == 0);
+  CHECK(mailbox_take(&mb) == &a.node);
+  CHECK(mailbox_take(&mb) == &b.node);
+  CHECK(mailbox_take(&mb) == NULL);
+
+  // The last node can be taken, and the mailbox still works after
+  mailbox_post(&mb, &a.node);
+  mailbox_ack(&mb);
+  CHECK(mailbox_take(&mb) == &a.node);
+  CHECK(mailbox_take(&mb) == NULL);
+
+  mailbox_close(&mb);
+}
+
+// Every post arrives once, in order per poster, and the owner is never
+// left asleep with something to take.
+static void test_threads (void) {
+  pthread_t threads[NUM_POSTERS];
+  int next[NUM_POSTERS];
+  struct mailbox_node* node;
+  struct test_msg* msg;
+  struct pollfd pfd;
+  int taken = 0;
+  int i;
+
+  CHECK(mailbox_init(&mb) == 0);
+  memset(next, 0, sizeof(next));
+
+  for (i=0; i<NUM_POSTERS; i++) {
+    CHECK(pthread_create(&threads[i], NULL, poster, (void*) (long) i) == 0);
+  }
+
+  pfd.fd = mb.efd;
+  pfd.events = POLLIN;
+  while (taken < NUM_POSTERS * NUM_POSTS) {
+    // A lost wakeup shows up as a timeout
+    if (poll(&pfd, 1, 5000) != 1) {
+      CHECK(!"woken");
+      break;
+    }
+    mailbox_ack(&mb);
+    while ((node = mailbox_take(&mb)) != NULL) {
+      msg = (struct test_msg*) node;
+      CHECK(msg->seq == next[msg->poster]);
+      next[msg->poster] = msg->seq + 1;
+      free(msg);
+      taken++;
+    }
+  }
+
+  for (i=0; i<NUM_POSTERS; i++) {
+    pthread_join(threads[i], NULL);
+    CHECK(next[i] == NUM_POSTS);
+  }
+  CHECK(mailbox_take(&mb) == NULL);
+
+  mailbox_close(&mb);
+}
+
+int main (void) {
+  test_single();
+  test_threads();
+
+  return test_result();
+}
@@ -0,0 +1,95 @@
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "tunnel-mailbox.h"
+
+// The list always holds at least one node, starting with stub, so posting
+// only has to swap tail and link the old tail to the new node. Between
+// those two steps the list is briefly cut; the owner stops there and
+// comes back when the poster signals.
+
+int mailbox_init (struct mailbox* mb) {
+  atomic_store(&mb->stub.next, NULL);
+  atomic_store(&mb->tail, &mb->stub);
+  mb->head = &mb->stub;
+  atomic_store(&mb->signalled, 0);
+
+  mb->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (mb->efd < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+void mailbox_close (struct mailbox* mb) {
+  close(mb->efd);
+  mb->efd = -1;
+}
+
+static void mailbox_link (struct mailbox* mb, struct mailbox_node* node) {
+  struct mailbox_node* prev;
+
+  atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+  prev = atomic_exchange_explicit(&mb->tail, node, memory_order_acq_rel);
+  atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+void mailbox_post (struct mailbox* mb, struct mailbox_node* node) {
+  uint64_t one = 1;
+  ssize_t ret;
+
+  mailbox_link(mb, node);
+
+  // Only the first post since the owner's last mailbox_ack() needs to
+  // wake it
+  if (atomic_exchange(&mb->signalled, 1) == 0) {
+    // Can only fail if the counter is about to overflow, in which case
+    // the owner is woken anyway
+    ret = write(mb->efd, &one, sizeof(one));
+    (void) ret;
+  }
+}
+
+void mailbox_ack (struct mailbox* mb) {
+  uint64_t count;
+  ssize_t ret;
+
+  ret = read(mb->efd, &count, sizeof(count));
+  (void) ret;
+  atomic_store(&mb->signalled, 0);
+}
+
+struct mailbox_node* mailbox_take (struct mailbox* mb) {
+  struct mailbox_node* head = mb->head;
+  struct mailbox_node* next = atomic_load_explicit(&head->next, memory_order_acquire);
+
+  // Step over the stub
+  if (head == &mb->stub) {
+    if (next == NULL) {
+      return NULL;
+    }
+    mb->head = next;
+    head = next;
+    next = atomic_load_explicit(&head->next, memory_order_acquire);
+  }
+
+  if (next != NULL) {
+    mb->head = next;
+    return head;
+  }
+
+  // head looks like the last node. If a post is halfway through, wait for
+  // it; otherwise put the stub back behind head so head can be taken.
+  if (atomic_load_explicit(&mb->tail, memory_order_acquire) != head) {
+    return NULL;
+  }
+  mailbox_link(mb, &mb->stub);
+
+  next = atomic_load_explicit(&head->next, memory_order_acquire);
+  if (next != NULL) {
+    mb->head = next;
+    return head;
+  }
+  return NULL;
+}
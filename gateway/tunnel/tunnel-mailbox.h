@@ -0,0 +1,48 @@
+#ifndef __TUNNEL_MAILBOX_H__
+#define __TUNNEL_MAILBOX_H__
+
+#include <stdatomic.h>
+
+// A queue that any number of threads post to and one thread takes from,
+// used by the server's workers to hand each other packets and route
+// changes.
+//
+// Posting never takes a lock: it is one atomic exchange, plus a write to
+// an eventfd if the owner has not been woken since it last looked. The
+// owner keeps the eventfd in its epoll set, and on wakeup calls
+// mailbox_ack() and then mailbox_take() until it returns NULL. Messages
+// from one thread come out in the order they were posted.
+//
+// Messages embed a struct mailbox_node, and the mailbox does not copy or
+// free them.
+
+struct mailbox_node {
+  struct mailbox_node* _Atomic next;
+};
+
+struct mailbox {
+  struct mailbox_node* _Atomic tail;  // Last posted, where posters add
+  struct mailbox_node*         head;  // Next to take, only the owner uses it
+  struct mailbox_node          stub;  // Keeps the list from ever being empty
+  atomic_int                   signalled;
+  int                          efd;   // Readable when there is something to take
+};
+
+// Returns 0 on success, -1 if the eventfd could not be made.
+int  mailbox_init (struct mailbox* mb);
+
+// Closes the eventfd. Anything not taken is left alone.
+void mailbox_close (struct mailbox* mb);
+
+// Add a message. Safe from any thread.
+void mailbox_post (struct mailbox* mb, struct mailbox_node* node);
+
+// Clear the wakeup. Call before taking messages, so that a post made
+// while they are being taken wakes the owner again.
+void mailbox_ack (struct mailbox* mb);
+
+// The oldest message, or NULL if there is none. A post that is still in
+// progress may not show up yet; its poster wakes the owner again.
+struct mailbox_node* mailbox_take (struct mailbox* mb);
+
+#endif
@@ -0,0 +1,167 @@
+// Checks building a metrics response and answering a scrape over
+// loopback:
+//
+//   make test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "tunnel-metrics.h"
+#include "tunnel-test.h"
+
+#define NUM_LINES 5000
+
+// Many lines, so the buffer has to grow several times.
+static void test_buf (void) {
+  struct metrics_buf b;
+  char line[64];
+  char* ptr;
+  int i;
+
+  metrics_buf_init(&b);
+  metrics_header(&b, "tunnel_test_total", "counter", "Lines written.");
+  for (i=0; i<NUM_LINES; i++) {
+    metrics_printf(&b, "tunnel_test_total{line=\"%d\"} %d\n", i, i * 7);
+  }
+  CHECK(!b.failed);
+  CHECK(b.len == strlen(b.data));
+
+  CHECK(strncmp(b.data, "# HELP tunnel_test_total Lines written.\n"
+                        "# TYPE tunnel_test_total counter\n", 65) == 0);
+
+  snprintf(line, sizeof(line), "tunnel_test_total{line=\"%d\"} %d\n",
+           NUM_LINES - 1, (NUM_LINES - 1) * 7);
+  ptr = strstr(b.data, line);
+  CHECK(ptr != NULL && ptr + strlen(line) == b.data + b.len);
+
+  metrics_buf_free(&b);
+  CHECK(b.data == NULL && b.len == 0);
+}
+
+static int connect_to (int lfd) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int fd;
+
+  if (getsockname(lfd, (struct sockaddr*) &addr, &len) < 0) {
+    return -1;
+  }
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr*) &addr, len) < 0) {
+    return -1;
+  }
+  return fd;
+}
+
+// A scrape is answered with the buffer, and one that sends nothing is not.
+static void test_respond (void) {
+  const char* get = "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  struct metrics_buf b;
+  char response[4096];
+  size_t have = 0;
+  ssize_t n;
+  int lfd, fd;
+
+  metrics_buf_init(&b);
+  metrics_header(&b, "tunnel_up", "gauge", "Always 1.");
+  metrics_printf(&b, "tunnel_up 1\n");
+
+  lfd = metrics_listen(0);
+  CHECK(lfd >= 0);
+  if (lfd < 0) {
+    metrics_buf_free(&b);
+    return;
+  }
+
+  fd = connect_to(lfd);
+  CHECK(fd >= 0);
+  CHECK(write(fd, get, strlen(get)) == (ssize_t) strlen(get));
+  CHECK(metrics_respond(metrics_accept(lfd), &b) == 0);
+  while ((n = read(fd, response + have, sizeof(response) - 1 - have)) > 0) {
+    have += n;
+  }
+  response[have] = '\0';
+  close(fd);
+
+  CHECK(strncmp(response, "HTTP/1.0 200 OK\r\n", 17) == 0);
+  CHECK(strstr(response, "Content-Type: text/plain; version=0.0.4\r\n") != NULL);
+  CHECK(have > b.len && strcmp(response + have - b.len, b.data) == 0);
+
+  // Gone before it asked anything
+  fd = connect_to(lfd);
+  CHECK(fd >= 0);
+  close(fd);
+  CHECK(metrics_accept(lfd) < 0);
+
+  close(lfd);
+  metrics_buf_free(&b);
+}
+
+// The same from a select() loop: nothing waits on a scraper that is slow
+// to ask, or never does.
+static void test_conn (void) {
+  const char* get = "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  struct metrics_conn c;
+  struct metrics_buf b;
+  char response[4096];
+  size_t have = 0;
+  ssize_t n;
+  int lfd, fd, silent;
+
+  metrics_buf_init(&b);
+  metrics_printf(&b, "tunnel_up 1\n");
+  metrics_conn_init(&c);
+
+  lfd = metrics_listen(0);
+  CHECK(lfd >= 0);
+  if (lfd < 0) {
+    metrics_buf_free(&b);
+    return;
+  }
+
+  // Connected but silent, then replaced by a scrape that asks in pieces
+  silent = connect_to(lfd);
+  metrics_conn_accept(&c, lfd);
+  CHECK(c.fd >= 0);
+  CHECK(metrics_conn_read(&c) == 0);
+
+  fd = connect_to(lfd);
+  CHECK(fd >= 0);
+  metrics_conn_accept(&c, lfd);
+  CHECK(read(silent, response, sizeof(response)) == 0);
+  close(silent);
+
+  CHECK(write(fd, get, 10) == 10);
+  usleep(10000);
+  CHECK(metrics_conn_read(&c) == 0);
+  CHECK(write(fd, get + 10, strlen(get) - 10) == (ssize_t) (strlen(get) - 10));
+  usleep(10000);
+  CHECK(metrics_conn_read(&c) == 1);
+
+  CHECK(metrics_conn_respond(&c, &b) == 0);
+  CHECK(c.fd == -1);
+  while ((n = read(fd, response + have, sizeof(response) - 1 - have)) > 0) {
+    have += n;
+  }
+  response[have] = '\0';
+  close(fd);
+
+  CHECK(strncmp(response, "HTTP/1.0 200 OK\r\n", 17) == 0);
+  CHECK(have > b.len && strcmp(response + have - b.len, b.data) == 0);
+
+  close(lfd);
+  metrics_buf_free(&b);
+}
+
+int main (void) {
+  test_buf();
+  test_respond();
+  test_conn();
+
+  return test_result();
+}
@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "tunnel-metrics.h"
+
+void metrics_buf_init (struct metrics_buf* b) {
+  memset(b, 0, sizeof(struct metrics_buf));
+}
+
+void metrics_buf_free (struct metrics_buf* b) {
+  free(b->data);
+  memset(b, 0, sizeof(struct metrics_buf));
+}
+
+void metrics_printf (struct metrics_buf* b, const char* fmt, ...) {
+  va_list ap;
+  size_t cap;
+  char* data;
+  int n;
+
+  if (b->failed) {
+    return;
+  }
+
+  while (1) {
+    va_start(ap, fmt);
+    n = vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+      b->failed = 1;
+      return;
+    }
+    if (b->len + n < b->cap) {
+      b->len += n;
+      return;
+    }
+
+    cap = b->cap ? b->cap * 2 : 4096;
+    while (cap <= b->len + n) {
+      cap *= 2;
+    }
+    data = realloc(b->data, cap);
+    if (data == NULL) {
+      b->failed = 1;
+      return;
+    }
+    b->data = data;
+    b->cap = cap;
+  }
+}
+
+void metrics_header (struct metrics_buf* b, const char* name, const char* type,
+                     const char* help) {
+  metrics_printf(b, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+int metrics_listen (uint16_t port) {
+  struct sockaddr_in addr;
+  int one = 1;
+  int fd;
+
+  fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(fd, 8) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Write all of len bytes, unless the socket fails or times out.
+static int write_all (int fd, const char* data, size_t len) {
+  ssize_t n;
+
+  while (len > 0) {
+    n = send(fd, data, len, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return -1;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Whether request holds the end of the request headers. Whatever was asked
+// for, the answer is the same, so only wait for that, and the scraper is
+// not answered too early.
+static int request_done (const char* request) {
+  return strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL;
+}
+
+// The status line and headers of the answer with b.
+static int response_header (char* header, size_t len, const struct metrics_buf* b) {
+  if (b->failed) {
+    return snprintf(header, len,
+                    "HTTP/1.0 500 Internal Server Error\r\n"
+                    "Content-Length: 0\r\nConnection: close\r\n\r\n");
+  }
+  return snprintf(header, len,
+                  "HTTP/1.0 200 OK\r\n"
+                  "Content-Type: text/plain; version=0.0.4\r\n"
+                  "Content-Length: %zu\r\nConnection: close\r\n\r\n", b->len);
+}
+
+int metrics_accept (int lfd) {
+  struct timeval timeout = {1, 0};
+  char request[METRICS_REQUEST_LEN];
+  size_t have = 0;
+  ssize_t n;
+  int fd;
+
+  fd = accept(lfd, NULL, NULL);
+  if (fd < 0) {
+    return -1;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  while (have < sizeof(request) - 1) {
+    n = recv(fd, request + have, sizeof(request) - 1 - have, 0);
+    if (n <= 0) {
+      close(fd);
+      return -1;
+    }
+    have += n;
+    request[have] = '\0';
+    if (request_done(request)) {
+      break;
+    }
+  }
+  return fd;
+}
+
+int metrics_respond (int fd, const struct metrics_buf* b) {
+  char header[256];
+  int ret = -1;
+  int n;
+
+  n = response_header(header, sizeof(header), b);
+  if (b->failed) {
+    write_all(fd, header, n);
+    close(fd);
+    return -1;
+  }
+
+  if (write_all(fd, header, n) == 0 && write_all(fd, b->data, b->len) == 0) {
+    ret = 0;
+  }
+
+  close(fd);
+  return ret;
+}
+
+void metrics_conn_init (struct metrics_conn* c) {
+  memset(c, 0, sizeof(struct metrics_conn));
+  c->fd = -1;
+}
+
+void metrics_conn_close (struct metrics_conn* c) {
+  if (c->fd >= 0) {
+    close(c->fd);
+  }
+  metrics_buf_free(&c->out);
+  metrics_conn_init(c);
+}
+
+void metrics_conn_accept (struct metrics_conn* c, int lfd) {
+  int fd = accept(lfd, NULL, NULL);
+
+  if (fd < 0) {
+    return;
+  }
+  if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+    close(fd);
+    return;
+  }
+  metrics_conn_close(c);
+  c->fd = fd;
+}
+
+int metrics_conn_read (struct metrics_conn* c) {
+  ssize_t n;
+
+  while (c->have < sizeof(c->request) - 1) {
+    n = recv(c->fd, c->request + c->have, sizeof(c->request) - 1 - c->have, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+      return 0;
+    }
+    if (n <= 0) {
+      metrics_conn_close(c);
+      return -1;
+    }
+    c->have += n;
+    c->request[c->have] = '\0';
+    if (request_done(c->request)) {
+      break;
+    }
+  }
+  return 1;
+}
+
+int metrics_conn_respond (struct metrics_conn* c, const struct metrics_buf* b) {
+  char header[256];
+
+  response_header(header, sizeof(header), b);
+  metrics_printf(&c->out, "%s", header);
+  if (!b->failed && b->len > 0) {
+    metrics_printf(&c->out, "%.*s", (int) b->len, b->data);
+  }
+  c->responding = 1;
+  c->sent = 0;
+  return metrics_conn_write(c);
+}
+
+int metrics_conn_write (struct metrics_conn* c) {
+  ssize_t n;
+
+  while (!c->out.failed && c->sent < c->out.len) {
+    n = send(c->fd, c->out.data + c->sent, c->out.len - c->sent, MSG_NOSIGNAL);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+      return 1;
+    }
+    if (n <= 0) {
+      break;
+    }
+    c->sent += n;
+  }
+
+  n = !c->out.failed && c->sent == c->out.len ? 0 : -1;
+  metrics_conn_close(c);
+  return n;
+}
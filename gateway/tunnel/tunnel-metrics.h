@@ -0,0 +1,85 @@
+#ifndef __TUNNEL_METRICS_H__
+#define __TUNNEL_METRICS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Counters for Prometheus. The server and the client each answer HTTP on a
+// loopback port with their counters in the Prometheus text format:
+//
+//   curl http://127.0.0.1:32101/metrics
+//
+// Counters are written on the packet path by the thread that owns them
+// and read whenever a scrape comes in. Each thread's counters are kept on
+// cache lines of their own so the reads do not slow the writer down.
+
+#define METRICS_CACHE_LINE 64
+
+// Most of a request that is read. The rest is not looked at.
+#define METRICS_REQUEST_LEN 4096
+
+// Text of a response being put together.
+struct metrics_buf {
+  char*  data;
+  size_t len;
+  size_t cap;
+  int    failed;   // Ran out of memory, some of it is missing
+};
+
+void metrics_buf_init (struct metrics_buf* b);
+void metrics_buf_free (struct metrics_buf* b);
+
+void metrics_printf (struct metrics_buf* b, const char* fmt, ...)
+  __attribute__ ((format (printf, 2, 3)));
+
+// The # HELP and # TYPE lines that go before a metric's samples. type is
+// "counter" or "gauge".
+void metrics_header (struct metrics_buf* b, const char* name, const char* type,
+                     const char* help);
+
+// A listening socket on 127.0.0.1:port. Returns -1 on failure.
+int metrics_listen (uint16_t port);
+
+// Accept one connection on the listening socket and read its request.
+// Returns the connection, or -1 if there was no request. A slow or broken
+// scraper is given up on after a second.
+int metrics_accept (int lfd);
+
+// Answer the request on fd with b, and close it. Returns -1 if the answer
+// could not be sent.
+int metrics_respond (int fd, const struct metrics_buf* b);
+
+// A scrape answered a piece at a time from a select() loop, for a program
+// that has no thread to spare for blocking on the scraper. One is handled
+// at a time, and a new connection takes the place of one still going, so
+// a scraper that never sends anything holds nothing up.
+struct metrics_conn {
+  int                fd;          // -1 if there is none
+  int                responding;  // Wait to write, not to read
+  char               request[METRICS_REQUEST_LEN];
+  size_t             have;        // Request bytes read
+  struct metrics_buf out;         // The whole response
+  size_t             sent;
+};
+
+void metrics_conn_init (struct metrics_conn* c);
+void metrics_conn_close (struct metrics_conn* c);
+
+// Accept a connection on the listening socket without blocking.
+void metrics_conn_accept (struct metrics_conn* c, int lfd);
+
+// Read what the scraper has sent. Returns 1 once the request is in, and it
+// is time for metrics_conn_respond(), 0 if more is needed, and -1 if the
+// connection went away and was closed.
+int metrics_conn_read (struct metrics_conn* c);
+
+// Answer with b, and send what the socket takes right away. Returns the
+// same as metrics_conn_write().
+int metrics_conn_respond (struct metrics_conn* c, const struct metrics_buf* b);
+
+// Send more of the answer. Returns 0 once all of it is sent, 1 if there is
+// more, and -1 if it could not be sent. The connection is closed unless
+// there is more.
+int metrics_conn_write (struct metrics_conn* c);
+
+#endif
@@ -0,0 +1,166 @@
+// Checks the tunnel routing table against a plain scan of the same routes:
+//
+//   make test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "tunnel-route.h"
+#include "tunnel-test.h"
+
+#define NUM_ROUTES 4000
+
+struct ref_route {
+  struct in6_addr prefix;
+  uint32_t        plen;
+  route_value_t   value;  // ROUTE_NONE once removed
+};
+
+static struct ref_route ref[NUM_ROUTES];
+
+static route_value_t ref_lookup (const struct in6_addr* addr) {
+  uint32_t best_plen = 0;
+  route_value_t best = ROUTE_NONE;
+  int i;
+
+  for (i=0; i<NUM_ROUTES; i++) {
+    if (ref[i].value != ROUTE_NONE && (best == ROUTE_NONE || ref[i].plen >= best_plen) &&
+        in6_prefix_match(addr, &ref[i].prefix, ref[i].plen)) {
+      best = ref[i].value;
+      best_plen = ref[i].plen;
+    }
+  }
+  return best;
+}
+
+// A random address inside 2001:db8:543::/48, where all the test prefixes
+// are, so lookups actually hit them.
+static void random_addr (struct in6_addr* a) {
+  int i;
+
+  inet_pton(AF_INET6, "2001:db8:543::", a);
+  for (i=6; i<16; i++) {
+    a->s6_addr[i] = rand();
+  }
+}
+
+static void test_in6 (void) {
+  struct in6_addr a, b;
+
+  inet_pton(AF_INET6, "2001:db8:543:1230::", &a);
+  inet_pton(AF_INET6, "2001:db8:543:123f::1", &b);
+  CHECK(in6_prefix_match(&a, &b, 60));
+  CHECK(!in6_prefix_match(&a, &b, 62));
+  CHECK(in6_prefix_match(&a, &b, 0));
+  CHECK(!in6_prefix_match(&a, &b, 128));
+
+  inet_pton(AF_INET6, "fe80::c298:e5ff:feaa:11bb", &a);
+  CHECK(in6_iid(&a) == 0xc298e5fffeaa11bbULL);
+}
+
+// Prefixes of /52 to /64 inside one /48, with overlaps, some removed again.
+static void test_prefix (void) {
+  struct route_table rt;
+  struct in6_addr addr;
+  int i, j;
+
+  CHECK(route_table_init(&rt) == 0);
+
+  for (i=0; i<NUM_ROUTES; i++) {
+    random_addr(&ref[i].prefix);
+    ref[i].plen = 52 + rand() % 13;
+    ref[i].value = i + 1;
+    // A later route for the same prefix replaces the earlier one
+    for (j=0; j<i; j++) {
+      if (ref[j].value != ROUTE_NONE && ref[j].plen == ref[i].plen &&
+          in6_prefix_match(&ref[j].prefix, &ref[i].prefix, ref[i].plen)) {
+        ref[j].value = ROUTE_NONE;
+      }
+    }
+    CHECK(route_add_prefix(&rt, &ref[i].prefix, ref[i].plen, ref[i].value) == 0);
+  }
+
+  for (i=0; i<NUM_ROUTES; i+=3) {
+    if (ref[i].value != ROUTE_NONE) {
+      route_del_prefix(&rt, &ref[i].prefix, ref[i].plen, ref[i].value);
+      ref[i].value = ROUTE_NONE;
+    }
+  }
+  // Removing a route that goes somewhere else does nothing
+  for (i=1; i<NUM_ROUTES; i+=3) {
+    route_del_prefix(&rt, &ref[i].prefix, ref[i].plen, NUM_ROUTES + 1);
+  }
+
+  for (i=0; i<20000; i++) {
+    random_addr(&addr);
+    CHECK(route_lookup_prefix(&rt, &addr) == ref_lookup(&addr));
+  }
+  for (i=0; i<NUM_ROUTES; i++) {
+    CHECK(route_lookup_prefix(&rt, &ref[i].prefix) == ref_lookup(&ref[i].prefix));
+  }
+
+  // Everything removed leaves an empty trie
+  for (i=0; i<NUM_ROUTES; i++) {
+    if (ref[i].value != ROUTE_NONE) {
+      route_del_prefix(&rt, &ref[i].prefix, ref[i].plen, ref[i].value);
+    }
+  }
+  CHECK(rt.num_prefixes == 0);
+  CHECK(rt.root->child[0] == NULL && rt.root->child[1] == NULL);
+
+  route_table_free(&rt);
+}
+
+// Enough gateways to make the hash grow, with removals in between.
+static void test_iid (void) {
+  struct route_table rt;
+  struct in6_addr addr;
+  int i;
+
+  CHECK(route_table_init(&rt) == 0);
+
+  inet_pton(AF_INET6, "fe80::", &addr);
+  for (i=0; i<NUM_ROUTES; i++) {
+    // Close together, like MAC based identifiers are
+    addr.s6_addr[14] = i >> 8;
+    addr.s6_addr[15] = i & 0xff;
+    CHECK(route_add_iid(&rt, &addr, i + 1) == 0);
+  }
+  for (i=0; i<NUM_ROUTES; i+=2) {
+    addr.s6_addr[14] = i >> 8;
+    addr.s6_addr[15] = i & 0xff;
+    route_del_iid(&rt, &addr, i + 1);
+  }
+  CHECK(rt.hash_count == NUM_ROUTES/2);
+
+  // The prefix does not matter, only the identifier
+  inet_pton(AF_INET6, "2607:f017:999:1::", &addr);
+  for (i=0; i<NUM_ROUTES; i++) {
+    addr.s6_addr[14] = i >> 8;
+    addr.s6_addr[15] = i & 0xff;
+    CHECK(route_lookup_iid(&rt, &addr) == (i % 2 ? i + 1 : ROUTE_NONE));
+  }
+
+  // Replacing keeps one entry
+  addr.s6_addr[14] = 0;
+  addr.s6_addr[15] = 1;
+  CHECK(route_add_iid(&rt, &addr, 7) == 0);
+  CHECK(route_lookup_iid(&rt, &addr) == 7);
+  route_del_iid(&rt, &addr, 2);
+  CHECK(route_lookup_iid(&rt, &addr) == 7);
+  CHECK(rt.hash_count == NUM_ROUTES/2);
+
+  route_table_free(&rt);
+}
+
+int main (void) {
+  srand(1);
+
+  test_in6();
+  test_prefix();
+  test_iid();
+
+  return test_result();
+}
@@ -0,0 +1,320 @@
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "tunnel-route.h"
+
+#define ROUTE_HASH_INIT_SLOTS 64
+
+static int in6_bit (const struct in6_addr* a, uint32_t bit) {
+  return (a->s6_addr[bit / 8] >> (7 - (bit % 8))) & 1;
+}
+
+int in6_prefix_match (const struct in6_addr* a, const struct in6_addr* b, uint32_t plen) {
+  uint32_t bytes = plen / 8;
+  uint32_t bits = plen % 8;
+  uint8_t mask;
+
+  if (plen > 128) {
+    return 0;
+  }
+  if (memcmp(a->s6_addr, b->s6_addr, bytes) != 0) {
+    return 0;
+  }
+  if (bits == 0) {
+    return 1;
+  }
+  mask = 0xff << (8 - bits);
+  return (a->s6_addr[bytes] & mask) == (b->s6_addr[bytes] & mask);
+}
+
+uint64_t in6_iid (const struct in6_addr* a) {
+  uint64_t iid = 0;
+  int i;
+
+  for (i=8; i<16; i++) {
+    iid = (iid << 8) | a->s6_addr[i];
+  }
+  return iid;
+}
+
+uint64_t in6_net (const struct in6_addr* a) {
+  uint64_t net = 0;
+  int i;
+
+  for (i=0; i<8; i++) {
+    net = (net << 8) | a->s6_addr[i];
+  }
+  return net;
+}
+
+int in6_parse_prefix (const char* arg, struct in6_addr* addr, uint32_t* plen,
+                      uint32_t default_plen) {
+  char buf[INET6_ADDRSTRLEN + 4];
+  char* slash;
+  char* end;
+
+  strncpy(buf, arg, sizeof(buf)-1);
+  buf[sizeof(buf)-1] = '\0';
+
+  *plen = default_plen;
+  slash = strchr(buf, '/');
+  if (slash != NULL) {
+    *slash = '\0';
+    *plen = strtoul(slash+1, &end, 10);
+    if (end == slash+1 || *end != '\0' || *plen > 128) {
+      return -1;
+    }
+  }
+
+  if (inet_pton(AF_INET6, buf, addr) != 1) {
+    return -1;
+  }
+  return 0;
+}
+
+static struct route_trie_node* route_trie_node_new (void) {
+  struct route_trie_node* node = calloc(1, sizeof(struct route_trie_node));
+
+  if (node != NULL) {
+    node->value = ROUTE_NONE;
+  }
+  return node;
+}
+
+static void route_trie_free (struct route_trie_node* node) {
+  if (node == NULL) {
+    return;
+  }
+  route_trie_free(node->child[0]);
+  route_trie_free(node->child[1]);
+  free(node);
+}
+
+static struct route_hash_entry* route_hash_alloc (size_t slots) {
+  struct route_hash_entry* hash = malloc(slots * sizeof(struct route_hash_entry));
+  size_t i;
+
+  if (hash == NULL) {
+    return NULL;
+  }
+  for (i=0; i<slots; i++) {
+    hash[i].value = ROUTE_NONE;
+  }
+  return hash;
+}
+
+int route_table_init (struct route_table* rt) {
+  memset(rt, 0, sizeof(struct route_table));
+
+  rt->root = route_trie_node_new();
+  rt->hash = route_hash_alloc(ROUTE_HASH_INIT_SLOTS);
+  if (rt->root == NULL || rt->hash == NULL) {
+    route_table_free(rt);
+    return -1;
+  }
+  rt->hash_mask = ROUTE_HASH_INIT_SLOTS - 1;
+
+  return 0;
+}
+
+void route_table_free (struct route_table* rt) {
+  route_trie_free(rt->root);
+  free(rt->hash);
+  memset(rt, 0, sizeof(struct route_table));
+}
+
+int route_add_prefix (struct route_table* rt, const struct in6_addr* prefix,
+                      uint32_t plen, route_value_t value) {
+  struct route_trie_node* node = rt->root;
+  uint32_t bit;
+
+  if (plen > 128) {
+    return -1;
+  }
+
+  for (bit=0; bit<plen; bit++) {
+    int b = in6_bit(prefix, bit);
+
+    if (node->child[b] == NULL) {
+      node->child[b] = route_trie_node_new();
+      if (node->child[b] == NULL) {
+        return -1;
+      }
+    }
+    node = node->child[b];
+  }
+
+  if (node->value == ROUTE_NONE) {
+    rt->num_prefixes++;
+  }
+  node->value = value;
+  return 0;
+}
+
+void route_del_prefix (struct route_table* rt, const struct in6_addr* prefix,
+                       uint32_t plen, route_value_t value) {
+  struct route_trie_node* path[129];
+  struct route_trie_node* node = rt->root;
+  uint32_t bit;
+
+  if (plen > 128) {
+    return;
+  }
+
+  path[0] = node;
+  for (bit=0; bit<plen; bit++) {
+    node = node->child[in6_bit(prefix, bit)];
+    if (node == NULL) {
+      return;
+    }
+    path[bit+1] = node;
+  }
+
+  if (node->value != value || value == ROUTE_NONE) {
+    return;
+  }
+  node->value = ROUTE_NONE;
+  rt->num_prefixes--;
+
+  // Prune the nodes that no longer lead to a route
+  for (bit=plen; bit>0; bit--) {
+    node = path[bit];
+    if (node->value != ROUTE_NONE || node->child[0] != NULL || node->child[1] != NULL) {
+      break;
+    }
+    path[bit-1]->child[in6_bit(prefix, bit-1)] = NULL;
+    free(node);
+  }
+}
+
+route_value_t route_lookup_prefix (const struct route_table* rt,
+                                   const struct in6_addr* addr) {
+  const struct route_trie_node* node = rt->root;
+  route_value_t best = ROUTE_NONE;
+  uint32_t bit = 0;
+
+  while (node != NULL) {
+    if (node->value != ROUTE_NONE) {
+      best = node->value;
+    }
+    if (bit == 128) {
+      break;
+    }
+    node = node->child[in6_bit(addr, bit++)];
+  }
+
+  return best;
+}
+
+static size_t route_hash_slot (uint64_t iid, size_t mask) {
+  iid *= 0x9e3779b97f4a7c15ULL;
+  return (size_t) (iid ^ (iid >> 32)) & mask;
+}
+
+// Double the table once it is half full to keep probe runs short.
+static int route_hash_grow (struct route_table* rt) {
+  struct route_hash_entry* old = rt->hash;
+  size_t old_slots = rt->hash_mask + 1;
+  size_t mask = old_slots * 2 - 1;
+  struct route_hash_entry* hash;
+  size_t i, s;
+
+  hash = route_hash_alloc(mask + 1);
+  if (hash == NULL) {
+    return -1;
+  }
+
+  for (i=0; i<old_slots; i++) {
+    if (old[i].value == ROUTE_NONE) {
+      continue;
+    }
+    s = route_hash_slot(old[i].iid, mask);
+    while (hash[s].value != ROUTE_NONE) {
+      s = (s + 1) & mask;
+    }
+    hash[s] = old[i];
+  }
+
+  free(old);
+  rt->hash = hash;
+  rt->hash_mask = mask;
+  return 0;
+}
+
+int route_add_iid (struct route_table* rt, const struct in6_addr* addr,
+                   route_value_t value) {
+  uint64_t iid = in6_iid(addr);
+  size_t s;
+
+  if (value == ROUTE_NONE) {
+    return -1;
+  }
+  if ((rt->hash_count + 1) * 2 > rt->hash_mask + 1) {
+    if (route_hash_grow(rt) < 0) {
+      return -1;
+    }
+  }
+
+  s = route_hash_slot(iid, rt->hash_mask);
+  while (rt->hash[s].value != ROUTE_NONE) {
+    if (rt->hash[s].iid == iid) {
+      rt->hash[s].value = value;
+      return 0;
+    }
+    s = (s + 1) & rt->hash_mask;
+  }
+
+  rt->hash[s].iid = iid;
+  rt->hash[s].value = value;
+  rt->hash_count++;
+  return 0;
+}
+
+void route_del_iid (struct route_table* rt, const struct in6_addr* addr,
+                    route_value_t value) {
+  uint64_t iid = in6_iid(addr);
+  size_t mask = rt->hash_mask;
+  size_t s, next, home;
+
+  s = route_hash_slot(iid, mask);
+  while (rt->hash[s].value != ROUTE_NONE && rt->hash[s].iid != iid) {
+    s = (s + 1) & mask;
+  }
+  if (rt->hash[s].value == ROUTE_NONE || rt->hash[s].value != value) {
+    return;
+  }
+
+  // Shift later entries of the probe run back so no lookup stops early at
+  // the hole.
+  next = s;
+  while (1) {
+    next = (next + 1) & mask;
+    if (rt->hash[next].value == ROUTE_NONE) {
+      break;
+    }
+    home = route_hash_slot(rt->hash[next].iid, mask);
+    // Move it only if its home slot is not between the hole and where it is
+    if (((next - home) & mask) >= ((next - s) & mask)) {
+      rt->hash[s] = rt->hash[next];
+      s = next;
+    }
+  }
+
+  rt->hash[s].value = ROUTE_NONE;
+  rt->hash_count--;
+}
+
+route_value_t route_lookup_iid (const struct route_table* rt,
+                                const struct in6_addr* addr) {
+  uint64_t iid = in6_iid(addr);
+  size_t s = route_hash_slot(iid, rt->hash_mask);
+
+  while (rt->hash[s].value != ROUTE_NONE) {
+    if (rt->hash[s].iid == iid) {
+      return rt->hash[s].value;
+    }
+    s = (s + 1) & rt->hash_mask;
+  }
+  return ROUTE_NONE;
+}
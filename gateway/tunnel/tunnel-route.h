@@ -0,0 +1,80 @@
+#ifndef __TUNNEL_ROUTE_H__
+#define __TUNNEL_ROUTE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+// Routes from destination address to the client session that should get
+// the packet.
+//
+// Prefixes delegated to gateways go in a binary trie and are found by
+// longest prefix match, so lookups take at most one step per bit of the
+// longest prefix no matter how many gateways there are. Gateways' own
+// addresses are found by their 64 bit interface identifier in a hash table.
+
+// What a route leads to. The server stores session ids.
+typedef uint64_t route_value_t;
+#define ROUTE_NONE 0
+
+struct route_trie_node {
+  struct route_trie_node* child[2];
+  route_value_t value;  // ROUTE_NONE if no prefix ends here
+};
+
+struct route_hash_entry {
+  uint64_t      iid;
+  route_value_t value;  // ROUTE_NONE if the slot is empty
+};
+
+struct route_table {
+  struct route_trie_node* root;
+  size_t                  num_prefixes;
+
+  struct route_hash_entry* hash;
+  size_t                   hash_mask;  // slots - 1, slots is a power of 2
+  size_t                   hash_count;
+};
+
+int  route_table_init (struct route_table* rt);
+void route_table_free (struct route_table* rt);
+
+// Whether the first plen bits of a and b are the same.
+int in6_prefix_match (const struct in6_addr* a, const struct in6_addr* b, uint32_t plen);
+
+// The interface identifier, the low 64 bits of the address.
+uint64_t in6_iid (const struct in6_addr* a);
+
+// The network, the high 64 bits of the address.
+uint64_t in6_net (const struct in6_addr* a);
+
+// Parse "address" or "address/length" into addr and plen. Returns -1 if it
+// is not an IPv6 prefix.
+int in6_parse_prefix (const char* arg, struct in6_addr* addr, uint32_t* plen,
+                      uint32_t default_plen);
+
+// Route prefix/plen to value, replacing any route for the same prefix.
+// Returns 0 on success, -1 if out of memory.
+int route_add_prefix (struct route_table* rt, const struct in6_addr* prefix,
+                      uint32_t plen, route_value_t value);
+
+// Remove the route for prefix/plen if it goes to value.
+void route_del_prefix (struct route_table* rt, const struct in6_addr* prefix,
+                       uint32_t plen, route_value_t value);
+
+// The value of the longest prefix containing addr, or ROUTE_NONE.
+route_value_t route_lookup_prefix (const struct route_table* rt, const struct in6_addr* addr);
+
+// Route addresses with the same interface identifier as addr to value.
+// Returns 0 on success, -1 if out of memory.
+int route_add_iid (struct route_table* rt, const struct in6_addr* addr,
+                   route_value_t value);
+
+// Remove the route for addr's interface identifier if it goes to value.
+void route_del_iid (struct route_table* rt, const struct in6_addr* addr,
+                    route_value_t value);
+
+// The value for addr's interface identifier, or ROUTE_NONE.
+route_value_t route_lookup_iid (const struct route_table* rt, const struct in6_addr* addr);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -11,6 +12,7 @@
 // #include <linux/ipv6.h>
 // #include <linux/in6.h>
 #include <stdarg.h>
+#include <getopt.h>
 #include <stddef.h>
 #include <errno.h>
 #include <sys/types.h>
@@ -19,12 +21,130 @@
 #include <arpa/inet.h>
 #include <sys/epoll.h>
 #include <asm/byteorder.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <signal.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "debug.h"
+#include "tunnel-assign.h"
+#include "tunnel-frame.h"
+#include "tunnel-mailbox.h"
+#include "tunnel-metrics.h"
+#include "tunnel-route.h"
+#include "tunnel-session.h"
+#include "tunnel-trace.h"
+#include "tunnel-uring.h"
 
 #define TUNNEL_SERVER_LISTEN_PORT 32100
+#define TUNNEL_SERVER_METRICS_PORT 32101
 #define MAXEVENTS 64
 
+// Packets read from TUN before any of them are sent on
+#define TUN_BATCH      SESSION_SEND_MAX
+#define TUN_PACKET_LEN 4096
+
+// Most bytes read from a client socket at once
+#define CLIENT_READ_LEN (64 * 1024)
+
+// The io_uring engine. Client sockets receive into a shared group of
+// buffers, so memory does not grow with the number of clients.
+#define URING_ENTRIES      8192
+#define URING_RECV_BUFS    256       // A power of 2
+#define URING_RECV_BUF_LEN (16 * 1024)
+#define URING_MAX_FILES    65536
+
+// Most writes one receive is linked into: a frame finished from an earlier
+// receive, then a buffer full of empty frames. A chain has to fit in the
+// submission queue in one piece.
+#define URING_CHAIN_MAX (1 + URING_RECV_BUF_LEN / TUNNEL_FRAME_HEADER_LEN)
+_Static_assert(URING_CHAIN_MAX <= URING_ENTRIES, "io_uring too small for a chain");
+
+// user_data of io_uring requests: what the request is in the top bits, and
+// below them the session id (its top generation bits cut off) or buffer.
+#define URING_OP_SHIFT  60
+#define URING_UD_MASK   ((1ULL << URING_OP_SHIFT) - 1)
+#define URING_UD(op, v) (((uint64_t) (op) << URING_OP_SHIFT) | ((v) & URING_UD_MASK))
+#define URING_UD_OP(ud) ((unsigned) ((ud) >> URING_OP_SHIFT))
+
+enum uring_op {
+  URING_IGNORE,     // Nothing to do when it completes
+  URING_TUN_READ,   // Into tun_bufs[v]
+  URING_TUN_WRITE,  // A packet from a client to TUN
+  URING_BUF_DONE,   // Last write of the chain from receive buffer v
+  URING_ACCEPT,
+  URING_RECV,       // From session v
+  URING_POLLOUT,    // Session v can take more
+  URING_INBOX,
+  URING_NOTIFY,     // The assignments file changed
+  URING_SIGNAL,
+};
+
+// What goes in a worker's trace, see tunnel-trace.h. Sessions are by id.
+enum trace_event {
+  TRACE_TUN_READ,       // a packets read from TUN
+  TRACE_TO_CLIENT,      // a packets from TUN for session b
+  TRACE_FROM_CLIENT,    // A packet of a bytes from session b
+  TRACE_TUN_WRITE_FAIL, // Errno a writing a packet from session b
+  TRACE_NO_ROUTE,       // To a:b, the destination's two halves
+  TRACE_NOT_IPV6,       // a bytes from TUN
+  TRACE_OPEN,           // Session a on descriptor b
+  TRACE_CLOSE,          // Session a on descriptor b
+  TRACE_PREFIX,         // Session a delegated a /b, 0 once taken away
+};
+
+static const char* trace_formats[] = {
+  [TRACE_TUN_READ]       = "read %" PRIu64 " packets from TUN",
+  [TRACE_TO_CLIENT]      = "%" PRIu64 " packets to session %" PRIx64,
+  [TRACE_FROM_CLIENT]    = "packet of %" PRIu64 " bytes from session %" PRIx64,
+  [TRACE_TUN_WRITE_FAIL] = "errno %" PRIu64 " writing to TUN from session %" PRIx64,
+  [TRACE_NO_ROUTE]       = "no route to %016" PRIx64 "%016" PRIx64,
+  [TRACE_NOT_IPV6]       = "%" PRIu64 " bytes from TUN are not IPv6",
+  [TRACE_OPEN]           = "session %" PRIx64 " opened on descriptor %" PRIu64,
+  [TRACE_CLOSE]          = "session %" PRIx64 " closed on descriptor %" PRIu64,
+  [TRACE_PREFIX]         = "session %" PRIx64 " delegated a /%" PRIu64,
+};
+
+#define TRACE(w, event, a, b) trace_write((w)->trace, (event), (a), (b))
+
+// Prefix lengths used when the command line or the assignments file does
+// not give one
+#define DEFAULT_PLEN_BLOCK    52
+#define DEFAULT_PLEN_GATEWAYS 64
+#define DEFAULT_PLEN_PD       62
+
+// Bytes that may wait for a slow client before packets to it are dropped
+#define DEFAULT_TXQ_BYTES (64 * 1024)
+
+// If the assignments file cannot be watched, a packet with no route makes
+// worker 0 read it again, at most once every ASSIGN_RELOAD_MS. Each worker
+// remembers the /64s that had no route for NOROUTE_MS, so more packets to
+// them cost only a lookup.
+#define ASSIGN_RELOAD_MS 1000
+#define NOROUTE_BITS     8
+#define NOROUTE_MS       2000
+
+// A receive buffer of the io_uring engine, while a chain of writes from it
+// is in flight or it waits for the session's earlier chain to finish.
+struct uring_recv {
+  uint64_t owner;    // Session the bytes came from
+  uint8_t* staged;   // Copy of a frame finished from an earlier receive
+  uint32_t len;      // Bytes received
+  uint16_t next;     // Next buffer waiting for the same session
+};
+
+struct noroute_entry {
+  uint64_t net;       // First half of the destination
+  uint64_t expires;   // ms
+};
+
 struct ifreq6 {
   struct in6_addr addr;
   uint32_t prefix_len;
@@ -36,14 +156,163 @@ struct ifreq6 {
 // // The global IP addresses for each client
 // #define SLASH_64 "2607:f017:999:1::0"
 
-// Data structure to hold all routing information for each connected client
-struct socket_prefix {
-  struct in6_addr addr_pd;  // The /60 (or whatever) that was assigned to this client. pd == prefix delegation
-  uint32_t        plen_pd;  // 0 if not set, 60 (or the actual prefix) if set
-  struct in6_addr addr_ll;  // The link local assigned to this client
-  uint32_t        plen_ll;  // 0 if not set, 128 if valid
+// How workers wait for and do I/O
+enum tunnel_engine {
+  TUNNEL_ENGINE_EPOLL,
+  TUNNEL_ENGINE_URING,  // Falls back to epoll if io_uring cannot be used
+};
+
+// The address ranges this server is responsible for
+struct tunnel_config {
+  struct in6_addr block;          // Every prefix delegated to a gateway is in here
+  uint32_t        plen_block;
+  struct in6_addr gateways;       // The gateways' own addresses
+  uint32_t        plen_gateways;
+  uint32_t        plen_pd;        // Delegated prefix length if the assignment has none
+
+  size_t          txq_bytes;      // Most bytes queued for one client
+  enum session_drop_policy drop_policy;
+
+  unsigned        num_workers;    // Event loop threads
+  int             first_cpu;      // Worker i runs on CPU first_cpu + i, -1 to not pin
+  enum tunnel_engine engine;
+
+  uint16_t        metrics_port;   // On 127.0.0.1, 0 for no metrics
+};
+
+struct tunnel_worker;
+
+struct tunnel_server {
+  struct tunnel_config  config;
+  struct tunnel_worker* workers;  // config.num_workers of them
+  int                   metrics_fd;
+  pthread_t             metrics_thread;
+};
+
+// A worker's counters for /metrics. Only the worker changes them, with
+// STAT_ADD(), and the metrics thread reads them at any time. They are on
+// cache lines of their own so those reads do not get in the worker's way.
+struct worker_stats {
+  uint64_t tun_rx_packets;   // Read from TUN
+  uint64_t tun_rx_bytes;
+  uint64_t tun_tx_packets;   // Written to TUN
+  uint64_t tun_tx_bytes;
+  uint64_t drop_no_route;    // From TUN with no client to go to
+  uint64_t drop_not_ipv6;
+  uint64_t drop_tun_write;   // From a client, TUN would not take it
+  uint64_t drop_queue_full;  // For a client whose queue was full
+  uint64_t connections;
+  uint64_t disconnects;
+  uint64_t assign_reloads;   // Times the assignments file was read
+} __attribute__ ((aligned(METRICS_CACHE_LINE)));
+
+// The store is atomic so the metrics thread never sees half of one, but
+// nothing is locked, since nobody else writes.
+#define STAT_ADD(w, field, n)\
+  __atomic_store_n(&(w)->stats.field, (w)->stats.field + (n), __ATOMIC_RELAXED)
+
+// One event loop thread. Each worker has its own TUN queue, listening
+// socket, clients and copy of the route table, so nothing is shared or
+// locked on the packet path. The kernel spreads new connections across the
+// listening sockets and outgoing packets across the TUN queues, so a packet
+// often arrives at a worker other than the one with its client. It is then
+// passed to that worker's inbox. Routes change only in the worker with the
+// client, which passes the change on to the other workers the same way.
+struct tunnel_worker {
+  struct tunnel_server* srv;
+  unsigned             index;      // Also the shard in its session ids
+  pthread_t            thread;
+  struct session_table sessions;
+  struct route_table   routes;
+  struct mailbox       inbox;      // Messages from other workers
+  int                  tun_file;
+  int                  sfd;
+  int                  efd;
+
+  // Packets read from TUN, see read_tun()
+  uint8_t              (*tun_bufs)[TUN_PACKET_LEN];
+  // Client reads, with room in front for a partial frame, see read_client()
+  uint8_t*             rx_batch;
+
+  // The io_uring engine, ring is NULL with epoll. Descriptors below
+  // num_files are in the ring's fixed file table at their own number.
+  struct uring*        ring;
+  struct uring_bufs    recv_bufs;
+  struct uring_recv    recvs[URING_RECV_BUFS];
+  unsigned             num_files;
+
+  // Ids of the sessions that had frames queued this loop iteration
+  uint64_t*            dirty;
+  size_t               dirty_len;
+  size_t               dirty_cap;
+
+  // Who gets which delegated prefix. Worker 0 reads the file and passes
+  // on what changed, so every worker has the same copy.
+  struct assign_table  assignments;
+  int                  notify_fd;      // inotify on the file, worker 0 only, or -1
+  uint64_t             assign_loaded;  // When worker 0 last read it, ms
+  struct noroute_entry noroute[1 << NOROUTE_BITS];
+
+  // What the worker did last, printed on SIGUSR1, which worker 0 reads
+  // from signal_fd. Only worker 0 has signal_fd, the others have -1.
+  struct trace_ring*   trace;
+  int                  signal_fd;
+
+  struct worker_stats  stats;
+};
+
+// What workers send each other
+enum worker_msg_type {
+  WORKER_MSG_PACKET,      // Queue a frame for session id
+  WORKER_MSG_ADD_IID,     // Route changes, the same as the route_ calls
+  WORKER_MSG_DEL_IID,
+  WORKER_MSG_ADD_PREFIX,
+  WORKER_MSG_DEL_PREFIX,
+  WORKER_MSG_ASSIGN_SET,  // The assignment for ll is now addr/plen
+  WORKER_MSG_ASSIGN_DEL,  // ll has no assignment any more
+  WORKER_MSG_RELOAD,      // To worker 0: a packet had no route, read the file
+  WORKER_MSG_METRICS,     // From the metrics thread: copy the sessions to scrape
+};
+
+struct worker_msg {
+  struct mailbox_node node;
+  uint8_t             type;
+  uint8_t             frame_type;
+  uint64_t            id;
+  struct in6_addr     addr;
+  uint32_t            plen;
+  struct in6_addr     ll;
+  struct metrics_scrape* scrape;
+  uint16_t            len;
+  uint8_t             data[];
 };
 
+// A session as /metrics shows it, copied by its worker.
+struct session_metrics {
+  uint64_t             id;
+  int                  fd;
+  struct in6_addr      addr_ll;
+  uint32_t             plen_ll;
+  struct in6_addr      addr_pd;
+  uint32_t             plen_pd;
+  struct session_stats stats;
+  uint64_t             txq_frames;
+  uint64_t             txq_bytes;
+};
+
+// One scrape. Only a worker can look at its sessions, so the metrics
+// thread asks every worker to copy them into its part, and the last to
+// finish wakes it through efd.
+struct metrics_part {
+  struct session_metrics* sessions;
+  size_t                  count;
+};
+
+struct metrics_scrape {
+  struct metrics_part* parts;    // One per worker
+  unsigned             pending;  // Workers not done yet
+  int                  efd;
+};
 
 struct ipv6hdr {
  #if defined(__LITTLE_ENDIAN_BITFIELD)
@@ -86,12 +355,15 @@ int make_nonblocking (int fd) {
 }
 
 
-static int create_and_bind () {
+// With reuseport set, every worker can bind its own socket to the port and
+// the kernel spreads connections across them.
+static int create_and_bind (int reuseport) {
   struct addrinfo hints;
   struct addrinfo *result;
   struct addrinfo *rp;
   int s;
   int sfd;
+  int one = 1;
 
   memset(&hints, 0, sizeof(struct addrinfo));
   hints.ai_family   = AF_INET;
@@ -110,141 +382,1859 @@ static int create_and_bind () {
       continue;
     }
 
+    if (reuseport &&
+        setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+      perror("SO_REUSEPORT");
+      close(sfd);
+      continue;
+    }
+
     s = bind(sfd, rp->ai_addr, rp->ai_addrlen);
     if (s == 0) {
       // We managed to bind successfully!
       break;
     }
 
-    close(sfd);
+    close(sfd);
+  }
+
+  if (rp == NULL) {
+    ERROR("Could not bind\n");
+    return -1;
+  }
+
+  freeaddrinfo(result);
+
+  return sfd;
+}
+
+// a as text, written to buf, which has room for INET6_ADDRSTRLEN.
+static const char* in6_ntop (const struct in6_addr* a, char* buf) {
+  if (inet_ntop(AF_INET6, a->s6_addr, buf, INET6_ADDRSTRLEN) == NULL) {
+    strcpy(buf, "?");
+  }
+  return buf;
+}
+
+static struct worker_msg* worker_msg_new (uint8_t type, uint64_t id,
+                                          const struct in6_addr* addr,
+                                          uint32_t plen, uint16_t len) {
+  struct worker_msg* msg = malloc(sizeof(struct worker_msg) + len);
+
+  if (msg == NULL) {
+    WARN_LIMITED("Could not allocate message for another worker\n");
+    return NULL;
+  }
+  msg->type = type;
+  msg->id   = id;
+  if (addr != NULL) {
+    memcpy(&msg->addr, addr, sizeof(struct in6_addr));
+  }
+  msg->plen = plen;
+  msg->len  = len;
+  return msg;
+}
+
+// Make one route change in a worker's table. Returns -1 if a route could
+// not be added.
+static int route_apply (struct route_table* routes, uint8_t type,
+                        const struct in6_addr* addr, uint32_t plen, uint64_t id) {
+  switch (type) {
+    case WORKER_MSG_ADD_IID:
+      return route_add_iid(routes, addr, id);
+    case WORKER_MSG_DEL_IID:
+      route_del_iid(routes, addr, id);
+      return 0;
+    case WORKER_MSG_ADD_PREFIX:
+      return route_add_prefix(routes, addr, plen, id);
+    case WORKER_MSG_DEL_PREFIX:
+      route_del_prefix(routes, addr, plen, id);
+      return 0;
+  }
+  return 0;
+}
+
+// Change a route here and in every other worker. Only the worker that owns
+// session id does this. Removals only take out a route that still goes to
+// id, so it does not matter in which order changes from different workers
+// arrive. Returns -1 if the route could not be added here, in which case
+// no other worker is told.
+static int route_update (struct tunnel_worker* w, uint8_t type,
+                         const struct in6_addr* addr, uint32_t plen, uint64_t id) {
+  struct tunnel_server* srv = w->srv;
+  struct worker_msg* msg;
+  unsigned i;
+
+  if (route_apply(&w->routes, type, addr, plen, id) < 0) {
+    return -1;
+  }
+
+  for (i=0; i<srv->config.num_workers; i++) {
+    if (i == w->index) {
+      continue;
+    }
+    msg = worker_msg_new(type, id, addr, plen, 0);
+    if (msg != NULL) {
+      mailbox_post(&srv->workers[i].inbox, &msg->node);
+    }
+  }
+  return 0;
+}
+
+// Route the delegated prefix block/plen to one of this worker's clients.
+static void assign_prefix (struct tunnel_worker* w, struct session* prefix,
+                           const struct in6_addr* block, uint32_t plen) {
+  char str[INET6_ADDRSTRLEN];
+
+  // Allow pd to be updated in case it changes
+  if (prefix->plen_pd != 0) {
+    route_update(w, WORKER_MSG_DEL_PREFIX, &prefix->addr_pd, prefix->plen_pd, prefix->id);
+  }
+  memcpy(prefix->addr_pd.s6_addr, block->s6_addr, 16);
+  prefix->plen_pd = plen;
+  if (route_update(w, WORKER_MSG_ADD_PREFIX, &prefix->addr_pd, plen, prefix->id) < 0) {
+    ERROR("Could not add route\n");
+    prefix->plen_pd = 0;
+    return;
+  }
+  TRACE(w, TRACE_PREFIX, prefix->id, plen);
+  INFO("Delegated %s/%u to descriptor %d\n",
+       in6_ntop(&prefix->addr_pd, str), plen, prefix->fd);
+}
+
+// Milliseconds on a clock that is cheap to read and only goes forward.
+static uint64_t now_ms (void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+// The assignment for ll changed to e, or went away if e is NULL. If this
+// worker has the client on ll, its prefix route follows.
+static void assignment_changed (struct tunnel_worker* w, const struct in6_addr* ll,
+                                const struct assign_entry* e) {
+  uint64_t id = route_lookup_iid(&w->routes, ll);
+  struct session* client;
+
+  if (id == ROUTE_NONE || SESSION_ID_SHARD(id) != w->index) {
+    return;
+  }
+  client = session_get(&w->sessions, id);
+  if (client == NULL || memcmp(client->addr_ll.s6_addr, ll->s6_addr, 16) != 0) {
+    return;
+  }
+
+  if (e != NULL) {
+    assign_prefix(w, client, &e->block, e->plen);
+  } else if (client->plen_pd != 0) {
+    route_update(w, WORKER_MSG_DEL_PREFIX, &client->addr_pd, client->plen_pd, client->id);
+    client->plen_pd = 0;
+    TRACE(w, TRACE_PREFIX, client->id, 0);
+  }
+}
+
+// Worker 0: pass one change in the file on to every worker.
+static void publish_assignment (void* ctx, const struct in6_addr* ll,
+                                const struct assign_entry* e) {
+  struct tunnel_worker* w = ctx;
+  struct worker_msg* msg;
+  unsigned i;
+
+  for (i=1; i<w->srv->config.num_workers; i++) {
+    if (e != NULL) {
+      msg = worker_msg_new(WORKER_MSG_ASSIGN_SET, 0, &e->block, e->plen, 0);
+    } else {
+      msg = worker_msg_new(WORKER_MSG_ASSIGN_DEL, 0, NULL, 0, 0);
+    }
+    if (msg != NULL) {
+      memcpy(&msg->ll, ll, sizeof(struct in6_addr));
+      mailbox_post(&w->srv->workers[i].inbox, &msg->node);
+    }
+  }
+
+  assignment_changed(w, ll, e);
+}
+
+// Worker 0: read the assignments file and act on what is different from
+// the last time. If it cannot be read, what was there before stays.
+static void reload_assignments (struct tunnel_worker* w) {
+  struct assign_table fresh;
+
+  w->assign_loaded = now_ms();
+
+  if (assign_table_init(&fresh) < 0) {
+    ERROR("Could not allocate assignments\n");
+    return;
+  }
+  if (assign_load(&fresh, ASSIGN_FILE, w->srv->config.plen_pd) < 0) {
+    ERROR("Could not read %s\n", ASSIGN_FILE);
+    assign_table_free(&fresh);
+    return;
+  }
+
+  STAT_ADD(w, assign_reloads, 1);
+  assign_diff(&w->assignments, &fresh, publish_assignment, w);
+  assign_table_free(&w->assignments);
+  w->assignments = fresh;
+}
+
+// A packet had no route and the file is not watched, so it may have
+// changed. Only worker 0 reads it.
+static void request_reload (struct tunnel_worker* w) {
+  struct worker_msg* msg;
+
+  if (w->index != 0) {
+    msg = worker_msg_new(WORKER_MSG_RELOAD, 0, NULL, 0, 0);
+    if (msg != NULL) {
+      mailbox_post(&w->srv->workers[0].inbox, &msg->node);
+    }
+    return;
+  }
+
+  if (now_ms() - w->assign_loaded >= ASSIGN_RELOAD_MS) {
+    reload_assignments(w);
+  }
+}
+
+// Returns 1 if dst's /64 had no route a moment ago. Otherwise remembers
+// that it has none now and returns 0.
+static int noroute_seen (struct tunnel_worker* w, const struct in6_addr* dst) {
+  struct noroute_entry* e;
+  uint64_t net;
+  uint64_t now = now_ms();
+
+  memcpy(&net, dst->s6_addr, sizeof(net));
+  e = &w->noroute[(net * 0x9e3779b97f4a7c15ULL) >> (64 - NOROUTE_BITS)];
+  if (e->net == net && e->expires > now) {
+    return 1;
+  }
+  e->net = net;
+  e->expires = now + NOROUTE_MS;
+  return 0;
+}
+
+// Watch the directory of the assignments file, which is then read again
+// whenever it is written or replaced. Returns the inotify descriptor, or
+// -1 if the file cannot be watched.
+static int watch_assignments (void) {
+  int fd;
+
+  fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd < 0) {
+    perror("inotify_init1");
+    return -1;
+  }
+  if (inotify_add_watch(fd, ASSIGN_DIR, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    ERROR("Could not watch %s, reading %s when a packet has no route\n",
+          ASSIGN_DIR, ASSIGN_NAME);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Worker 0: read what inotify saw, and the assignments file again if it
+// was among it.
+static void handle_notify (struct tunnel_worker* w) {
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event* ev;
+  char* ptr;
+  ssize_t len;
+  int changed = 0;
+
+  while ((len = read(w->notify_fd, buf, sizeof(buf))) > 0) {
+    for (ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + ev->len) {
+      ev = (const struct inotify_event*) ptr;
+      if ((ev->mask & IN_Q_OVERFLOW) ||
+          (ev->len > 0 && strcmp(ev->name, ASSIGN_NAME) == 0)) {
+        changed = 1;
+      }
+    }
+  }
+
+  if (changed) {
+    reload_assignments(w);
+  }
+}
+
+// Print what every worker did last, oldest first.
+static void dump_traces (struct tunnel_server* srv) {
+  static struct trace_record records[TRACE_RING_LEN];
+  struct trace_record* rec;
+  size_t n, k;
+  unsigned i;
+
+  flockfile(stderr);
+  for (i=0; i<srv->config.num_workers; i++) {
+    n = trace_ring_read(srv->workers[i].trace, records, TRACE_RING_LEN);
+    fprintf(stderr, "worker %u trace, %zu records\n", i, n);
+    for (k=0; k<n; k++) {
+      rec = &records[k];
+      fprintf(stderr, "%" PRIu64 ".%09" PRIu64 " %u ", rec->time / 1000000000,
+              rec->time % 1000000000, i);
+      fprintf(stderr, trace_formats[rec->event], rec->a, rec->b);
+      fputc('\n', stderr);
+    }
+  }
+  funlockfile(stderr);
+}
+
+// Worker 0: SIGUSR1 arrived.
+static void handle_signal (struct tunnel_worker* w) {
+  struct signalfd_siginfo info;
+  int dump = 0;
+
+  while (read(w->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+    dump = 1;
+  }
+  if (dump) {
+    dump_traces(w->srv);
+  }
+}
+
+// A submission entry for the worker's ring, submitting what is prepared if
+// the queue is full. Running out of them means the ring cannot be
+// submitted to at all, and the worker cannot go on.
+static struct io_uring_sqe* worker_sqe (struct tunnel_worker* w) {
+  struct io_uring_sqe* sqe = uring_get_sqe(w->ring);
+
+  if (sqe == NULL) {
+    if (uring_submit(w->ring, 0) >= 0) {
+      sqe = uring_get_sqe(w->ring);
+    }
+    if (sqe == NULL) {
+      perror("io_uring_enter");
+      exit(1);
+    }
+  }
+  return sqe;
+}
+
+// Make room for n entries taken one after another, so a chain of linked
+// requests is never split by a submit in the middle of it.
+static void worker_sqe_reserve (struct tunnel_worker* w, unsigned n) {
+  if (uring_sq_space(w->ring) >= n) {
+    return;
+  }
+  if (uring_submit(w->ring, 0) < 0 || uring_sq_space(w->ring) < n) {
+    perror("io_uring_enter");
+    exit(1);
+  }
+}
+
+// Point a request at fd, through the fixed file table when it fits.
+static void worker_sqe_file (struct tunnel_worker* w, struct io_uring_sqe* sqe, int fd) {
+  sqe->fd = fd;
+  if ((unsigned) fd < w->num_files) {
+    sqe->flags |= IOSQE_FIXED_FILE;
+  }
+}
+
+// Ask to hear when a blocked client can take more. With epoll the
+// client's EPOLLOUT is always armed, so there is nothing to do.
+static void wait_writable (struct tunnel_worker* w, struct session* client) {
+  struct io_uring_sqe* sqe;
+
+  if (w->ring == NULL) {
+    return;
+  }
+
+  sqe = worker_sqe(w);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  worker_sqe_file(w, sqe, client->fd);
+  sqe->poll32_events = POLLOUT;
+  sqe->user_data = URING_UD(URING_POLLOUT, client->id);
+}
+
+// Stop every request on a client's socket and take it out of the fixed
+// file table, so it really closes. Called before the descriptor is closed.
+static void uring_forget (struct tunnel_worker* w, struct session* client) {
+  struct io_uring_sqe* sqe;
+  int none = -1;
+
+  sqe = worker_sqe(w);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  sqe->fd = client->fd;
+  if ((unsigned) client->fd < w->num_files) {
+    sqe->cancel_flags |= IORING_ASYNC_CANCEL_FD_FIXED;
+  }
+  sqe->user_data = URING_UD(URING_IGNORE, 0);
+
+  // The cancel has to see the descriptor before it goes
+  if (uring_submit(w->ring, 0) < 0) {
+    perror("io_uring_enter");
+  }
+
+  // Receives still waiting to be written will not be
+  while (client->rx_waiting > 0) {
+    uring_bufs_put(&w->recv_bufs, client->rx_wait_head);
+    client->rx_wait_head = w->recvs[client->rx_wait_head].next;
+    client->rx_waiting--;
+  }
+  if ((unsigned) client->fd < w->num_files &&
+      uring_update_files(w->ring, client->fd, &none, 1) < 0) {
+    perror("io_uring files update");
+  }
+}
+
+// Drop a client connection and forget its routes.
+static void close_client (struct tunnel_worker* w, struct session* client) {
+  char ll[INET6_ADDRSTRLEN];
+  char pd[INET6_ADDRSTRLEN];
+
+  TRACE(w, TRACE_CLOSE, client->id, client->fd);
+  STAT_ADD(w, disconnects, 1);
+  INFO("Closed descriptor %d (%s, %s/%u)\n", client->fd,
+       client->plen_ll ? in6_ntop(&client->addr_ll, ll) : "-",
+       client->plen_pd ? in6_ntop(&client->addr_pd, pd) : "-", client->plen_pd);
+
+  if (w->ring != NULL) {
+    uring_forget(w, client);
+  }
+
+  // Closing the descriptor will make epoll remove it
+  // from the set of descriptors which are monitored.
+  close(client->fd);
+  if (client->plen_ll != 0) {
+    route_update(w, WORKER_MSG_DEL_IID, &client->addr_ll, 128, client->id);
+  }
+  if (client->plen_pd != 0) {
+    route_update(w, WORKER_MSG_DEL_PREFIX, &client->addr_pd, client->plen_pd, client->id);
+  }
+  session_free(&w->sessions, client);
+}
+
+// Remember to flush this client at the end of the loop iteration.
+static void mark_dirty (struct tunnel_worker* w, struct session* client) {
+  uint64_t* dirty;
+
+  if (client->dirty) {
+    return;
+  }
+
+  if (w->dirty_len == w->dirty_cap) {
+    size_t cap = w->dirty_cap ? w->dirty_cap * 2 : 64;
+    dirty = realloc(w->dirty, cap * sizeof(uint64_t));
+    if (dirty == NULL) {
+      // Still queued, it goes out with the client's next flush
+      return;
+    }
+    w->dirty = dirty;
+    w->dirty_cap = cap;
+  }
+
+  w->dirty[w->dirty_len++] = client->id;
+  client->dirty = 1;
+}
+
+// Queue one frame for a client. Nothing is written here; everything
+// queued for a client during a loop iteration goes out together in
+// flush_clients(). A client on another worker gets a copy through that
+// worker's inbox.
+static void send_to_client (struct tunnel_worker* w, uint64_t id,
+                            uint8_t type, const uint8_t* data, uint16_t len) {
+  struct session* client;
+  struct worker_msg* msg;
+  unsigned owner = SESSION_ID_SHARD(id);
+  uint64_t drops;
+
+  if (owner != w->index) {
+    msg = worker_msg_new(WORKER_MSG_PACKET, id, NULL, 0, len);
+    if (msg != NULL) {
+      msg->frame_type = type;
+      memcpy(msg->data, data, len);
+      mailbox_post(&w->srv->workers[owner].inbox, &msg->node);
+    }
+    return;
+  }
+
+  client = session_get(&w->sessions, id);
+  if (client == NULL) {
+    return;
+  }
+
+  drops = client->stats.tx_drops;
+  session_txq_push(client, type, data, len, w->srv->config.txq_bytes,
+                   w->srv->config.drop_policy);
+  STAT_ADD(w, drop_queue_full, client->stats.tx_drops - drops);
+  mark_dirty(w, client);
+}
+
+// Write out what was queued for each client during this loop iteration.
+// Clients whose sockets are full wait for EPOLLOUT instead.
+static void flush_clients (struct tunnel_worker* w) {
+  struct session* client;
+  size_t i;
+  int ret;
+
+  for (i=0; i<w->dirty_len; i++) {
+    client = session_get(&w->sessions, w->dirty[i]);
+    if (client == NULL) {
+      // Closed since it was queued
+      continue;
+    }
+    client->dirty = 0;
+    if (client->blocked) {
+      continue;
+    }
+    ret = session_txq_flush(client);
+    if (ret < 0) {
+      ERROR("Could not write to descriptor %d\n", client->fd);
+      close_client(w, client);
+    } else if (ret == 1) {
+      wait_writable(w, client);
+    }
+  }
+  w->dirty_len = 0;
+}
+
+// Copy this worker's sessions for a scrape, and wake the metrics thread
+// if this was the last worker it was waiting for.
+static void copy_session_metrics (struct tunnel_worker* w, struct metrics_scrape* scrape) {
+  struct metrics_part* part = &scrape->parts[w->index];
+  struct session_metrics* m;
+  struct session* s;
+  uint64_t one = 1;
+  size_t fd;
+
+  part->count = 0;
+  part->sessions = malloc(w->sessions.count * sizeof(struct session_metrics));
+
+  for (fd=0; part->sessions != NULL && fd<w->sessions.len; fd++) {
+    s = session_get_fd(&w->sessions, fd);
+    if (s == NULL || part->count == w->sessions.count) {
+      continue;
+    }
+    m = &part->sessions[part->count++];
+    m->id         = s->id;
+    m->fd         = s->fd;
+    m->addr_ll    = s->addr_ll;
+    m->plen_ll    = s->plen_ll;
+    m->addr_pd    = s->addr_pd;
+    m->plen_pd    = s->plen_pd;
+    m->stats      = s->stats;
+    m->txq_frames = s->txq_count;
+    m->txq_bytes  = s->txq_bytes;
+  }
+
+  if (__atomic_sub_fetch(&scrape->pending, 1, __ATOMIC_ACQ_REL) == 0 &&
+      write(scrape->efd, &one, sizeof(one)) < 0) {
+    perror("metrics eventfd");
+  }
+}
+
+// Handle everything other workers have sent.
+static void handle_inbox (struct tunnel_worker* w) {
+  struct mailbox_node* node;
+  struct worker_msg* msg;
+
+  mailbox_ack(&w->inbox);
+
+  while ((node = mailbox_take(&w->inbox)) != NULL) {
+    msg = (struct worker_msg*) node;
+
+    if (msg->type == WORKER_MSG_PACKET) {
+      send_to_client(w, msg->id, msg->frame_type, msg->data, msg->len);
+    } else if (msg->type == WORKER_MSG_ASSIGN_SET) {
+      if (assign_set(&w->assignments, &msg->ll, &msg->addr, msg->plen) < 0) {
+        ERROR("Could not allocate assignments\n");
+      }
+      assignment_changed(w, &msg->ll, assign_lookup(&w->assignments, &msg->ll));
+    } else if (msg->type == WORKER_MSG_ASSIGN_DEL) {
+      assign_del(&w->assignments, &msg->ll);
+      assignment_changed(w, &msg->ll, NULL);
+    } else if (msg->type == WORKER_MSG_RELOAD) {
+      request_reload(w);
+    } else if (msg->type == WORKER_MSG_METRICS) {
+      copy_session_metrics(w, msg->scrape);
+    } else if (route_apply(&w->routes, msg->type, &msg->addr, msg->plen, msg->id) < 0) {
+      ERROR("Could not add route\n");
+    }
+
+    free(msg);
+  }
+}
+
+// Which client a packet from TUN goes to, or ROUTE_NONE.
+static uint64_t route_tun_packet (struct tunnel_worker* w, const uint8_t* buf, size_t count) {
+  struct tunnel_server* srv = w->srv;
+  struct ipv6hdr *iph = (struct ipv6hdr*) buf;
+  uint64_t j = ROUTE_NONE;
+
+  // Got a packet from the TUN device. Now we have to figure out
+  // which TCP socket to send it to.
+  if (count < sizeof(struct ipv6hdr) || iph->version != 6) {
+    TRACE(w, TRACE_NOT_IPV6, count, 0);
+    STAT_ADD(w, drop_not_ipv6, 1);
+    return ROUTE_NONE;
+  }
+
+  // Check to see if the packet is in the block that this tunnel
+  // is responsible for
+  if (in6_prefix_match(&iph->daddr, &srv->config.block, srv->config.plen_block)) {
+
+    // Need to find the delegated prefix for this destination
+    j = route_lookup_prefix(&w->routes, &iph->daddr);
+
+    // With the file watched, every assignment is already routed
+    if (j == ROUTE_NONE && srv->workers[0].notify_fd < 0 &&
+        !noroute_seen(w, &iph->daddr)) {
+      request_reload(w);
+      if (w->index == 0) {
+        // Read it already
+        j = route_lookup_prefix(&w->routes, &iph->daddr);
+      }
+      // Other workers only asked. They pick up the new routes on their
+      // next mailbox drain, and this packet is dropped.
+    }
+
+  // Check to see if destination is one of the gateways or ll
+  } else if (in6_prefix_match(&iph->daddr, &srv->config.gateways, srv->config.plen_gateways) ||
+             (iph->daddr.s6_addr[0] == 0xfe &&
+              iph->daddr.s6_addr[1] == 0x80)) {
+    // Gateways are found by their interface identifier
+    j = route_lookup_iid(&w->routes, &iph->daddr);
+  }
+
+  if (j == ROUTE_NONE) {
+    TRACE(w, TRACE_NO_ROUTE, in6_net(&iph->daddr), in6_iid(&iph->daddr));
+    STAT_ADD(w, drop_no_route, 1);
+  }
+  return j;
+}
+
+// Send packets from TUN to one client. They go out in one writev() unless
+// the client already has frames waiting.
+static void send_packets_to_client (struct tunnel_worker* w, uint64_t id,
+                                    const struct iovec* pkts, unsigned n) {
+  struct session* client;
+  uint64_t drops;
+  unsigned i;
+  int blocked;
+  int ret;
+
+  TRACE(w, TRACE_TO_CLIENT, n, id);
+
+  if (SESSION_ID_SHARD(id) != w->index) {
+    for (i=0; i<n; i++) {
+      send_to_client(w, id, TUNNEL_FRAME_PACKET, pkts[i].iov_base, pkts[i].iov_len);
+    }
+    return;
+  }
+
+  client = session_get(&w->sessions, id);
+  if (client == NULL) {
+    return;
+  }
+  blocked = client->blocked;
+  drops = client->stats.tx_drops;
+
+  ret = session_send(client, TUNNEL_FRAME_PACKET, pkts, n, w->srv->config.txq_bytes,
+                     w->srv->config.drop_policy);
+  STAT_ADD(w, drop_queue_full, client->stats.tx_drops - drops);
+  if (ret < 0) {
+    ERROR("Could not write to descriptor %d\n", client->fd);
+    close_client(w, client);
+    return;
+  }
+  if (client->blocked && !blocked) {
+    wait_writable(w, client);
+  }
+  if (client->txq_count > 0) {
+    mark_dirty(w, client);
+  }
+}
+
+// Send packets read from TUN. Each client's packets from the batch are
+// sent together.
+static void send_tun_batch (struct tunnel_worker* w, const struct iovec* batch,
+                            unsigned n) {
+  struct iovec pkts[TUN_BATCH];
+  uint64_t dest[TUN_BATCH];
+  uint64_t id;
+  size_t bytes;
+  unsigned i, j, m;
+
+  if (n == 0) {
+    return;
+  }
+  TRACE(w, TRACE_TUN_READ, n, 0);
+
+  for (i=0, bytes=0; i<n; i++) {
+    dest[i] = route_tun_packet(w, batch[i].iov_base, batch[i].iov_len);
+    bytes += batch[i].iov_len;
+  }
+  STAT_ADD(w, tun_rx_packets, n);
+  STAT_ADD(w, tun_rx_bytes, bytes);
+
+  // Gather the packets for each client, keeping their order
+  for (i=0; i<n; i++) {
+    id = dest[i];
+    if (id == ROUTE_NONE) {
+      continue;
+    }
+    for (j=i, m=0; j<n; j++) {
+      if (dest[j] == id) {
+        pkts[m++] = batch[j];
+        dest[j] = ROUTE_NONE;
+      }
+    }
+    send_packets_to_client(w, id, pkts, m);
+  }
+}
+
+// Read everything waiting on TUN, TUN_BATCH packets at a time.
+static void read_tun (struct tunnel_worker* w) {
+  struct iovec batch[TUN_BATCH];
+  ssize_t count;
+  unsigned n;
+
+  do {
+    for (n=0; n<TUN_BATCH; n++) {
+      count = read(w->tun_file, w->tun_bufs[n], TUN_PACKET_LEN);
+      if (count == -1) {
+        // If errno == EAGAIN, that means we have read all
+        // data. So go back to the main loop.
+        if (errno == EAGAIN) {
+          break;
+        }
+        perror ("read");
+      }
+      if (count <= 0) {
+        ERROR("Could not read from TUN\n");
+        exit(1);
+      }
+
+      batch[n].iov_base = w->tun_bufs[n];
+      batch[n].iov_len  = count;
+    }
+
+    send_tun_batch(w, batch, n);
+  } while (n == TUN_BATCH);
+}
+
+// Handle one frame from a client. Returns 1 if it is a packet to be
+// written to TUN.
+static int handle_frame (struct tunnel_worker* w, struct session* client,
+                         struct tunnel_frame* frame) {
+  if (frame->type == TUNNEL_FRAME_ECHO_REQ) {
+    send_to_client(w, client->id, TUNNEL_FRAME_ECHO_REP,
+                   frame->data, frame->len);
+    return 0;
+  } else if (frame->type != TUNNEL_FRAME_PACKET) {
+    // Control frame we do not know about, skip it
+    return 0;
+  }
+
+  // Check to see if we know the link local address of this client.
+  if (client->plen_ll == 0) {
+    // We do not know the link local address of this node. That is
+    // bad, because we will not know how to route to it when we get
+    // packets for it.
+
+    // Inspect the packet to determine the IPv6 source address
+    struct ipv6hdr *iph = (struct ipv6hdr*) frame->data;
+
+    if (frame->len >= sizeof(struct ipv6hdr) && iph->version == 6) {
+      // OK good, got IPv6 packet
+
+      if (iph->saddr.s6_addr[0] == 0xfe &&
+          iph->saddr.s6_addr[1] == 0x80) {
+        // This came from link-local address. Great.
+        // Save this
+        memcpy(&client->addr_ll, &iph->saddr, sizeof(struct in6_addr));
+        client->plen_ll = 128;
+        if (route_update(w, WORKER_MSG_ADD_IID, &client->addr_ll, 128, client->id) < 0) {
+          ERROR("Could not add route\n");
+          client->plen_ll = 0;
+        } else {
+          // Its prefix may have been assigned already
+          const struct assign_entry* e = assign_lookup(&w->assignments, &client->addr_ll);
+          if (e != NULL) {
+            assign_prefix(w, client, &e->block, e->plen);
+          }
+        }
+      }
+    }
+  }
+
+  TRACE(w, TRACE_FROM_CLIENT, frame->len, client->id);
+  return 1;
+}
+
+// Dump a packet from a client to the TUN device.
+static void write_tun (struct tunnel_worker* w, struct session* client,
+                       struct tunnel_frame* frame) {
+  int err;
+
+  err = write(w->tun_file, frame->data, frame->len);
+  if (err > 0) {
+    client->stats.rx_packets++;
+    client->stats.rx_bytes += err;
+    STAT_ADD(w, tun_tx_packets, 1);
+    STAT_ADD(w, tun_tx_bytes, err);
+  } else {
+    TRACE(w, TRACE_TUN_WRITE_FAIL, errno, client->id);
+    STAT_ADD(w, drop_tun_write, 1);
+    WARN_LIMITED("Could not write to TUN: %s\n", strerror(errno));
+  }
+}
+
+// Read everything a client has sent and handle every complete frame.
+// Reads go into the worker's big buffer, so one read brings in many
+// frames. A partial frame at the end waits in the client's rx buffer and
+// is put back in front of the next read.
+static void read_client (struct tunnel_worker* w, struct session* client) {
+  struct tunnel_frame frame;
+  uint8_t* start;
+  size_t have;
+  ssize_t count;
+  int ret;
+
+  // Loop until we have all of the data
+  while (1) {
+    count = read(client->fd, w->rx_batch + TUNNEL_RXBUF_LEN, CLIENT_READ_LEN);
+    if (count == -1) {
+      // If errno == EAGAIN, that means we have read all
+      // data. So go back to the main loop.
+      if (errno == EAGAIN) {
+        return;
+      }
+      perror ("read");
+      close_client(w, client);
+      return;
+    } else if (count == 0) {
+      // End of file. The remote has closed the
+      // connection.
+      close_client(w, client);
+      return;
+    }
+
+    have = client->rx.end - client->rx.start;
+    start = w->rx_batch + TUNNEL_RXBUF_LEN - have;
+    memcpy(start, client->rx.buf + client->rx.start, have);
+    have += count;
+
+    while ((ret = tunnel_frame_parse(start, have, &frame)) > 0) {
+      start += ret;
+      have -= ret;
+      if (handle_frame(w, client, &frame)) {
+        write_tun(w, client, &frame);
+      }
+    }
+
+    if (ret < 0) {
+      // Whatever is on the other end is not speaking our framing,
+      // or we lost our place in the stream.
+      ERROR("Bad frame from descriptor %d, closing\n", client->fd);
+      close_client(w, client);
+      return;
+    }
+
+    tunnel_rxbuf_init(&client->rx);
+    memcpy(client->rx.buf, start, have);
+    tunnel_rxbuf_commit(&client->rx, have);
+  }
+}
+
+// Open one queue of the TUN device. With more than one worker the device
+// is multi-queue, and every worker opens its own queue of it.
+static int open_tun (struct ifreq* ifr, int multi_queue) {
+  int tun_file;
+  int err;
+
+  // Need to open a TUN device to get packets from linux and to send packets
+  // to the kernel to be routed
+  tun_file = open("/dev/net/tun", O_RDWR);
+  if (tun_file < 0) {
+    // error
+    ERROR("Could not create a tun interface. errno: %i\n", errno);
+    ERROR("%s\n", strerror(errno));
+    return -1;
+  }
+
+  // Clear the ifr struct
+  memset(ifr, 0, sizeof(struct ifreq));
+
+  // Set the TUN name
+  strncpy(ifr->ifr_name, "ipv6-tun", IFNAMSIZ);
+
+  // Select a TUN device
+  ifr->ifr_flags = IFF_TUN | IFF_NO_PI;
+  if (multi_queue) {
+    ifr->ifr_flags |= IFF_MULTI_QUEUE;
+  }
+
+  // Make up a HW address
+
+
+  // Setup the interface
+  err = ioctl(tun_file, TUNSETIFF, (void *) ifr);
+  if (err < 0) {
+    ERROR("ioctl could not set up tun interface\n");
+    // A persistent device keeps the queue mode it was made with
+    ERROR("if ipv6-tun exists with a different number of queues, delete it "
+          "with `ip tuntap del ipv6-tun mode tun`\n");
+    close(tun_file);
+    return -1;
+  }
+
+  // Make nonblocking in case select() gives us trouble
+  make_nonblocking(tun_file);
+
+  return tun_file;
+}
+
+// The epoll engine: wait for descriptors to be ready, then read and
+// write them. Does not return.
+static void worker_loop_epoll (struct tunnel_worker* w) {
+  struct epoll_event event;
+  struct epoll_event *events;
+  int err;
+
+  w->efd = epoll_create1(0);
+  if (w->efd == -1) {
+    perror("epoll_create");
+    exit(1);
+  }
+
+  // Add the TCP socket to epoll
+  event.data.u64 = SESSION_ID(w->sfd, 0);
+  event.events = EPOLLIN | EPOLLET;
+  err = epoll_ctl(w->efd, EPOLL_CTL_ADD, w->sfd, &event);
+  if (err == -1) {
+    perror("epoll_ctl - TCP");
+    exit(1);
+  }
+
+  // Add the TUN device to epoll
+  event.data.u64 = SESSION_ID(w->tun_file, 0);
+  event.events = EPOLLIN | EPOLLET;
+  err = epoll_ctl(w->efd, EPOLL_CTL_ADD, w->tun_file, &event);
+  if (err == -1) {
+    perror("epoll_ctl - TUN");
+    exit(1);
+  }
+
+  // Add the inbox to epoll
+  event.data.u64 = SESSION_ID(w->inbox.efd, 0);
+  event.events = EPOLLIN | EPOLLET;
+  err = epoll_ctl(w->efd, EPOLL_CTL_ADD, w->inbox.efd, &event);
+  if (err == -1) {
+    perror("epoll_ctl - inbox");
+    exit(1);
+  }
+
+  // Add the assignments file watch to epoll
+  if (w->notify_fd >= 0) {
+    event.data.u64 = SESSION_ID(w->notify_fd, 0);
+    event.events = EPOLLIN | EPOLLET;
+    err = epoll_ctl(w->efd, EPOLL_CTL_ADD, w->notify_fd, &event);
+    if (err == -1) {
+      perror("epoll_ctl - inotify");
+      exit(1);
+    }
+  }
+
+  // Add the signals to epoll
+  if (w->signal_fd >= 0) {
+    event.data.u64 = SESSION_ID(w->signal_fd, 0);
+    event.events = EPOLLIN | EPOLLET;
+    err = epoll_ctl(w->efd, EPOLL_CTL_ADD, w->signal_fd, &event);
+    if (err == -1) {
+      perror("epoll_ctl - signalfd");
+      exit(1);
+    }
+  }
+
+  // Buffer where events are returned
+  events = calloc(MAXEVENTS, sizeof(event));
+
+
+
+
+  // The event loop
+  while (1) {
+    int n, i;
+
+    // Wait for something to happen on one of the file descriptors
+    // we are waiting on
+    n = epoll_wait(w->efd, events, MAXEVENTS, -1);
+
+    // Iterate all of the active events
+    for (i = 0; i < n; i++) {
+      int fd = SESSION_ID_FD(events[i].data.u64);
+
+      // Check that everything is kosher
+      if ((events[i].events & EPOLLERR) ||
+          (events[i].events & EPOLLHUP) ||
+          (!(events[i].events & (EPOLLIN | EPOLLOUT)))) {
+        // An error has occured on this fd, or the socket is not
+        // ready for reading or writing (why were we notified then?)
+        struct session* client = session_get(&w->sessions, events[i].data.u64);
+        if (client != NULL) {
+          // The client is gone
+          close_client(w, client);
+        } else {
+          ERROR("epoll error\n");
+        }
+        continue;
+
+      // Check if another worker sent something
+      } else if (fd == w->inbox.efd) {
+        handle_inbox(w);
+        continue;
+
+      // Check if the assignments file changed
+      } else if (fd == w->notify_fd) {
+        handle_notify(w);
+        continue;
+
+      // Check if we were asked for the traces
+      } else if (fd == w->signal_fd) {
+        handle_signal(w);
+        continue;
+
+      // Check if this is a new connection on the TCP listening socket
+      } else if (fd == w->sfd) {
+        while (1) {
+          struct sockaddr in_addr;
+          socklen_t in_len;
+          int infd;
+          struct session* client;
+          char hbuf[NI_MAXHOST];
+          char sbuf[NI_MAXSERV];
+
+          in_len = sizeof(in_addr);
+          infd = accept(w->sfd, &in_addr, &in_len);
+          if (infd == -1) {
+            if ((errno == EAGAIN) ||
+              (errno == EWOULDBLOCK)) {
+              // We have processed all incoming connections.
+              break;
+            } else {
+              perror("accept");
+              break;
+            }
+          }
+
+          err = getnameinfo(&in_addr,
+                          in_len,
+                          hbuf,
+                          sizeof(hbuf),
+                          sbuf,
+                          sizeof(sbuf),
+                          NI_NUMERICHOST | NI_NUMERICSERV);
+          if (err == 0) {
+            INFO("Accepted connection on descriptor %d "
+                 "(host=%s, port=%s, worker %u)\n", infd, hbuf, sbuf, w->index);
+          }
+
+          client = session_new(&w->sessions, infd);
+          if (client == NULL) {
+            ERROR("Could not allocate session for descriptor %d\n", infd);
+            close(infd);
+            continue;
+          }
+          TRACE(w, TRACE_OPEN, client->id, infd);
+          STAT_ADD(w, connections, 1);
+
+          // Make the incoming socket non-blocking and add it to the
+          // list of fds to monitor.
+          err = make_nonblocking(infd);
+          if (err == -1) {
+            ERROR("Could not make nonblocking\n");
+            exit(1);
+          }
+
+          // Edge triggered EPOLLOUT only fires when a full socket has
+          // room again, so it can stay on.
+          event.data.u64 = client->id;
+          event.events   = EPOLLIN | EPOLLOUT | EPOLLET;
+          err = epoll_ctl(w->efd, EPOLL_CTL_ADD, infd, &event);
+          if (err == -1) {
+            perror ("epoll_ctl");
+            exit(1);
+          }
+        }
+
+        continue;
+
+      // Check if we got data on the tun device
+      } else if (fd == w->tun_file) {
+        read_tun(w);
+        continue;
+
+      } else {
+        // A client has data ready, or room for more.
+        struct session* client = session_get(&w->sessions, events[i].data.u64);
+
+        if (client == NULL) {
+          // Already closed while handling an earlier event
+          continue;
+        }
+
+        if ((events[i].events & EPOLLOUT) && client->blocked) {
+          // The client's socket has room again, send what is queued
+          client->blocked = 0;
+          mark_dirty(w, client);
+        }
+        if (events[i].events & EPOLLIN) {
+          read_client(w, client);
+        }
+      }
+    }
+
+    // Everything queued for a client during this iteration goes out in
+    // one go
+    flush_clients(w);
+  }
+
+  free (events);
+}
+
+// Set up the io_uring engine for a worker: the ring, a fixed file table
+// holding TUN, the listening socket and the inbox, TUN's read buffers
+// registered with the kernel, and the buffer group for client receives,
+// which are multishot. Returns -1 if any of it is not supported, leaving
+// the worker as it was.
+static int worker_uring_init (struct tunnel_worker* w) {
+  struct iovec iov[TUN_BATCH];
+  struct rlimit nofile;
+  int* files;
+  unsigned i;
+
+  w->ring = malloc(sizeof(struct uring));
+  if (w->ring == NULL) {
+    return -1;
+  }
+  if (uring_init(w->ring, URING_ENTRIES) < 0) {
+    perror("io_uring_setup");
+    goto fail_ring;
+  }
+
+  // One slot per descriptor number the process can have
+  w->num_files = URING_MAX_FILES;
+  if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < w->num_files) {
+    w->num_files = nofile.rlim_cur;
+  }
+  files = malloc(w->num_files * sizeof(int));
+  if (files == NULL) {
+    goto fail_files;
+  }
+  for (i=0; i<w->num_files; i++) {
+    files[i] = -1;
+  }
+  if ((unsigned) w->tun_file < w->num_files) {
+    files[w->tun_file] = w->tun_file;
+  }
+  if ((unsigned) w->sfd < w->num_files) {
+    files[w->sfd] = w->sfd;
+  }
+  if ((unsigned) w->inbox.efd < w->num_files) {
+    files[w->inbox.efd] = w->inbox.efd;
+  }
+  if (w->notify_fd >= 0 && (unsigned) w->notify_fd < w->num_files) {
+    files[w->notify_fd] = w->notify_fd;
+  }
+  if (w->signal_fd >= 0 && (unsigned) w->signal_fd < w->num_files) {
+    files[w->signal_fd] = w->signal_fd;
+  }
+  if (uring_register(w->ring, IORING_REGISTER_FILES, files, w->num_files) < 0) {
+    perror("io_uring register files");
+    free(files);
+    goto fail_files;
+  }
+  free(files);
+
+  for (i=0; i<TUN_BATCH; i++) {
+    iov[i].iov_base = w->tun_bufs[i];
+    iov[i].iov_len  = TUN_PACKET_LEN;
+  }
+  if (uring_register(w->ring, IORING_REGISTER_BUFFERS, iov, TUN_BATCH) < 0) {
+    perror("io_uring register buffers");
+    goto fail_files;
+  }
+
+  if (uring_bufs_init(w->ring, &w->recv_bufs, 0, URING_RECV_BUFS,
+                      URING_RECV_BUF_LEN) < 0) {
+    perror("io_uring buffer ring");
+    goto fail_files;
+  }
+  if (uring_probe_recv_multishot(w->ring, &w->recv_bufs) < 0) {
+    perror("io_uring multishot receive");
+    uring_bufs_free(w->ring, &w->recv_bufs);
+    goto fail_files;
+  }
+
+  // The ring waits for TUN itself. A nonblocking read would just fail.
+  fcntl(w->tun_file, F_SETFL, fcntl(w->tun_file, F_GETFL, 0) & ~O_NONBLOCK);
+
+  return 0;
+
+fail_files:
+  w->num_files = 0;
+  uring_free(w->ring);
+fail_ring:
+  free(w->ring);
+  w->ring = NULL;
+  return -1;
+}
+
+static void uring_read_tun (struct tunnel_worker* w, unsigned k) {
+  struct io_uring_sqe* sqe = worker_sqe(w);
+
+  sqe->opcode = IORING_OP_READ_FIXED;
+  worker_sqe_file(w, sqe, w->tun_file);
+  sqe->addr      = (uint64_t) (uintptr_t) w->tun_bufs[k];
+  sqe->len       = TUN_PACKET_LEN;
+  sqe->buf_index = k;
+  sqe->user_data = URING_UD(URING_TUN_READ, k);
+}
+
+static void uring_accept (struct tunnel_worker* w) {
+  struct io_uring_sqe* sqe = worker_sqe(w);
+
+  sqe->opcode = IORING_OP_ACCEPT;
+  worker_sqe_file(w, sqe, w->sfd);
+  sqe->ioprio    = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = URING_UD(URING_ACCEPT, 0);
+}
+
+static void uring_recv (struct tunnel_worker* w, struct session* client) {
+  struct io_uring_sqe* sqe = worker_sqe(w);
+
+  sqe->opcode = IORING_OP_RECV;
+  worker_sqe_file(w, sqe, client->fd);
+  sqe->ioprio    = IORING_RECV_MULTISHOT;
+  sqe->flags    |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = w->recv_bufs.group;
+  sqe->user_data = URING_UD(URING_RECV, client->id);
+}
+
+// Hear every time fd has something to read.
+static void uring_poll_in (struct tunnel_worker* w, int fd, enum uring_op op) {
+  struct io_uring_sqe* sqe = worker_sqe(w);
+
+  sqe->opcode = IORING_OP_POLL_ADD;
+  worker_sqe_file(w, sqe, fd);
+  sqe->len           = IORING_POLL_ADD_MULTI;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data     = URING_UD(op, 0);
+}
+
+// The client a receive or poll completion is for, or NULL if it has gone.
+static struct session* uring_client (struct tunnel_worker* w, uint64_t ud) {
+  struct session* client = session_get_fd(&w->sessions, SESSION_ID_FD(ud));
+
+  if (client == NULL || (client->id & URING_UD_MASK) != (ud & URING_UD_MASK)) {
+    return NULL;
+  }
+  return client;
+}
+
+static void uring_client_accepted (struct tunnel_worker* w, int infd) {
+  struct session* client;
+
+  INFO("Accepted connection on descriptor %d (worker %u)\n", infd, w->index);
+
+  client = session_new(&w->sessions, infd);
+  if (client == NULL) {
+    ERROR("Could not allocate session for descriptor %d\n", infd);
+    close(infd);
+    return;
+  }
+  TRACE(w, TRACE_OPEN, client->id, infd);
+  STAT_ADD(w, connections, 1);
+
+  // Sends still go out with writev() straight from the queue, which
+  // must not block.
+  if (make_nonblocking(infd) == -1) {
+    ERROR("Could not make nonblocking\n");
+    exit(1);
+  }
+
+  if ((unsigned) infd < w->num_files &&
+      uring_update_files(w->ring, infd, &infd, 1) < 0) {
+    perror("io_uring files update");
+    close_client(w, client);
+    return;
+  }
+
+  uring_recv(w, client);
+}
+
+// Queue a write of a packet to TUN, hard linked to whatever is queued
+// after it. A hard link keeps the order and goes on past a failed write.
+static struct io_uring_sqe* uring_write_tun (struct tunnel_worker* w, struct session* client,
+                                             const uint8_t* data, size_t len) {
+  struct io_uring_sqe* sqe = worker_sqe(w);
+
+  sqe->opcode = IORING_OP_WRITE;
+  worker_sqe_file(w, sqe, w->tun_file);
+  sqe->flags    |= IOSQE_IO_HARDLINK;
+  sqe->addr      = (uint64_t) (uintptr_t) data;
+  sqe->len       = len;
+  sqe->user_data = URING_UD(URING_TUN_WRITE, 0);
+
+  client->stats.rx_packets++;
+  client->stats.rx_bytes += len;
+  return sqe;
+}
+
+// Handle what a client sent into receive buffer bid. Packets go to TUN as
+// one chain of writes straight from the buffer, and the buffer is handed
+// back when the last of them completes. A frame cut across two receives
+// is put together in the client's rx buffer and copied out to go first in
+// the chain. TUN writes from different chains can run at the same time,
+// so a client only has one chain in flight; see uring_client_recv().
+static void uring_client_data (struct tunnel_worker* w, struct session* client,
+                               uint16_t bid) {
+  struct uring_recv* recv = &w->recvs[bid];
+  uint8_t* data = uring_bufs_get(&w->recv_bufs, bid);
+  size_t len = recv->len;
+  struct io_uring_sqe* last = NULL;
+  struct tunnel_frame frame;
+  uint8_t* staged = NULL;
+  size_t staged_len = 0;
+  uint8_t* ptr;
+  size_t have, need, take;
+  unsigned count = 0;
+  int whole;
+  int ret = 0;
+
+  // Finish a frame started in an earlier receive
+  while (client->rx.end > client->rx.start && len > 0) {
+    have = client->rx.end - client->rx.start;
+    need = TUNNEL_FRAME_HEADER_LEN;
+    if (have >= TUNNEL_FRAME_HEADER_LEN) {
+      ptr = client->rx.buf + client->rx.start;
+      need += (ptr[2] << 8) | ptr[3];
+    }
+
+    if (need > TUNNEL_FRAME_HEADER_LEN + TUNNEL_FRAME_MAX_LEN) {
+      ret = -1;
+      break;
+    }
+
+    take = need - have < len ? need - have : len;
+    tunnel_rxbuf_space(&client->rx, &ptr);
+    memcpy(ptr, data, take);
+    tunnel_rxbuf_commit(&client->rx, take);
+    data += take;
+    len -= take;
+
+    ret = tunnel_rxbuf_next(&client->rx, &frame);
+    if (ret < 0) {
+      break;
+    } else if (ret == 1 && handle_frame(w, client, &frame)) {
+      // The rx buffer is reused, and the session may be gone, before
+      // the write runs
+      staged = malloc(frame.len ? frame.len : 1);
+      if (staged == NULL) {
+        STAT_ADD(w, drop_tun_write, 1);
+        WARN_LIMITED("Could not stage a packet from descriptor %d\n", client->fd);
+      } else {
+        memcpy(staged, frame.data, frame.len);
+        staged_len = frame.len;
+      }
+    }
+  }
+
+  // Then whole frames, straight from the buffer. All the writes are
+  // linked, so room for all of them is made before the first is taken.
+  whole = ret >= 0 && client->rx.end == client->rx.start;
+  if (whole) {
+    ptr = data;
+    have = len;
+    while ((ret = tunnel_frame_parse(ptr, have, &frame)) > 0) {
+      ptr += ret;
+      have -= ret;
+      if (frame.type == TUNNEL_FRAME_PACKET) {
+        count++;
+      }
+    }
+  }
+  worker_sqe_reserve(w, count + (staged != NULL));
+
+  if (staged != NULL) {
+    last = uring_write_tun(w, client, staged, staged_len);
+  }
+
+  if (whole) {
+    while ((ret = tunnel_frame_parse(data, len, &frame)) > 0) {
+      data += ret;
+      len -= ret;
+      if (handle_frame(w, client, &frame)) {
+        last = uring_write_tun(w, client, frame.data, frame.len);
+      }
+    }
+
+    if (ret == 0) {
+      // Keep the start of the next frame
+      tunnel_rxbuf_init(&client->rx);
+      memcpy(client->rx.buf, data, len);
+      tunnel_rxbuf_commit(&client->rx, len);
+    }
+  }
+
+  if (last != NULL) {
+    last->flags &= ~IOSQE_IO_HARDLINK;
+    last->user_data = URING_UD(URING_BUF_DONE, bid);
+    recv->owner  = client->id;
+    recv->staged = staged;
+    client->rx_busy = 1;
+  } else {
+    uring_bufs_put(&w->recv_bufs, bid);
+  }
+
+  if (ret < 0) {
+    // Whatever is on the other end is not speaking our framing,
+    // or we lost our place in the stream.
+    ERROR("Bad frame from descriptor %d, closing\n", client->fd);
+    close_client(w, client);
+  }
+}
+
+// len bytes from a client arrived in receive buffer bid. They are handled
+// now, or once the client's chain of writes in flight has finished.
+static void uring_client_recv (struct tunnel_worker* w, struct session* client,
+                               uint16_t bid, uint32_t len) {
+  w->recvs[bid].len = len;
+
+  if (!client->rx_busy) {
+    uring_client_data(w, client, bid);
+    return;
+  }
+
+  if (client->rx_waiting == 0) {
+    client->rx_wait_head = bid;
+  } else {
+    w->recvs[client->rx_wait_tail].next = bid;
+  }
+  client->rx_wait_tail = bid;
+  client->rx_waiting++;
+}
+
+// The chain of writes from receive buffer bid has finished. The buffer can
+// be reused, and the client's next receive can go.
+static void uring_chain_done (struct tunnel_worker* w, uint16_t bid) {
+  struct uring_recv* recv = &w->recvs[bid];
+  uint64_t id = recv->owner;
+  struct session* client;
+
+  free(recv->staged);
+  recv->staged = NULL;
+  uring_bufs_put(&w->recv_bufs, bid);
+
+  client = session_get(&w->sessions, id);
+  if (client == NULL) {
+    return;
+  }
+  client->rx_busy = 0;
+
+  // Stops at the next receive that makes a chain, or if the client
+  // sent something bad and was closed
+  while (client != NULL && !client->rx_busy && client->rx_waiting > 0) {
+    bid = client->rx_wait_head;
+    client->rx_wait_head = w->recvs[bid].next;
+    client->rx_waiting--;
+    uring_client_data(w, client, bid);
+    client = session_get(&w->sessions, id);
+  }
+
+  if (client != NULL && !client->rx_busy && client->rx_eof) {
+    close_client(w, client);
+  }
+}
+
+// The io_uring engine: reads, receives and accepts stay queued in the
+// kernel, and the worker only handles what has completed. Does not
+// return.
+static void worker_loop_uring (struct tunnel_worker* w) {
+  struct io_uring_cqe* cqe;
+  struct iovec batch[TUN_BATCH];
+  unsigned rearm[TUN_BATCH];
+  unsigned n, num_rearm, i;
+  struct session* client;
+  uint64_t ud;
+  uint32_t flags;
+  int res;
+
+  INFO("Worker %u using io_uring\n", w->index);
+
+  uring_accept(w);
+  uring_poll_in(w, w->inbox.efd, URING_INBOX);
+  if (w->notify_fd >= 0) {
+    uring_poll_in(w, w->notify_fd, URING_NOTIFY);
+  }
+  if (w->signal_fd >= 0) {
+    uring_poll_in(w, w->signal_fd, URING_SIGNAL);
+  }
+  for (i=0; i<TUN_BATCH; i++) {
+    uring_read_tun(w, i);
+  }
+
+  while (1) {
+    if (uring_submit(w->ring, 1) < 0) {
+      perror("io_uring_enter");
+      exit(1);
+    }
+
+    n = 0;
+    num_rearm = 0;
+
+    while ((cqe = uring_peek_cqe(w->ring)) != NULL) {
+      ud    = cqe->user_data;
+      res   = cqe->res;
+      flags = cqe->flags;
+      uring_cqe_seen(w->ring);
+
+      switch (URING_UD_OP(ud)) {
+        case URING_TUN_READ:
+          i = ud & URING_UD_MASK;
+          if (res > 0) {
+            batch[n].iov_base = w->tun_bufs[i];
+            batch[n].iov_len  = res;
+            n++;
+          } else if (res != -EAGAIN && res != -EINTR) {
+            ERROR("Could not read from TUN: %s\n", strerror(-res));
+            exit(1);
+          }
+          rearm[num_rearm++] = i;
+          break;
+
+        case URING_TUN_WRITE:
+        case URING_BUF_DONE:
+          if (res > 0) {
+            STAT_ADD(w, tun_tx_packets, 1);
+            STAT_ADD(w, tun_tx_bytes, res);
+          } else {
+            STAT_ADD(w, drop_tun_write, 1);
+          }
+          if (URING_UD_OP(ud) == URING_BUF_DONE) {
+            uring_chain_done(w, ud & URING_UD_MASK);
+          }
+          break;
+
+        case URING_ACCEPT:
+          if (res >= 0) {
+            uring_client_accepted(w, res);
+          } else if (res != -EAGAIN && res != -EINTR) {
+            ERROR("accept: %s\n", strerror(-res));
+          }
+          if (!(flags & IORING_CQE_F_MORE)) {
+            uring_accept(w);
+          }
+          break;
+
+        case URING_RECV:
+          client = uring_client(w, ud);
+          if (flags & IORING_CQE_F_BUFFER) {
+            uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+            if (client != NULL && res > 0) {
+              uring_client_recv(w, client, bid, res);
+              // Closed if it sent something bad
+              client = uring_client(w, ud);
+            } else {
+              uring_bufs_put(&w->recv_bufs, bid);
+            }
+          }
+          if (client == NULL) {
+            break;
+          }
+          if (res == 0 && client->rx_busy) {
+            // End of file, but what came before it is still being
+            // written. Closed once it is.
+            client->rx_eof = 1;
+          } else if (res == 0 || (res < 0 && res != -ENOBUFS && res != -EAGAIN && res != -EINTR)) {
+            // End of file, or the connection failed
+            close_client(w, client);
+          } else if (!(flags & IORING_CQE_F_MORE)) {
+            // Ran out of buffers or the kernel stopped for another
+            // reason; ask again
+            uring_recv(w, client);
+          }
+          break;
+
+        case URING_POLLOUT:
+          client = uring_client(w, ud);
+          if (client != NULL && client->blocked) {
+            // The client's socket has room again, send what is queued
+            client->blocked = 0;
+            mark_dirty(w, client);
+          }
+          break;
+
+        case URING_INBOX:
+          handle_inbox(w);
+          if (!(flags & IORING_CQE_F_MORE)) {
+            uring_poll_in(w, w->inbox.efd, URING_INBOX);
+          }
+          break;
+
+        case URING_NOTIFY:
+          handle_notify(w);
+          if (!(flags & IORING_CQE_F_MORE)) {
+            uring_poll_in(w, w->notify_fd, URING_NOTIFY);
+          }
+          break;
+
+        case URING_SIGNAL:
+          handle_signal(w);
+          if (!(flags & IORING_CQE_F_MORE)) {
+            uring_poll_in(w, w->signal_fd, URING_SIGNAL);
+          }
+          break;
+      }
+    }
+
+    send_tun_batch(w, batch, n);
+    for (i=0; i<num_rearm; i++) {
+      uring_read_tun(w, rearm[i]);
+    }
+
+    // Everything queued for a client during this iteration goes out in
+    // one go
+    flush_clients(w);
   }
+}
 
-  if (rp == NULL) {
-    ERROR("Could not bind\n");
-    return -1;
+// Runs one worker's event loop. Does not return.
+static void* worker_run (void* arg) {
+  struct tunnel_worker* w = arg;
+  struct tunnel_server* srv = w->srv;
+  int err;
+
+  if (srv->config.first_cpu >= 0) {
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(srv->config.first_cpu + w->index, &cpus);
+    err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (err != 0) {
+      ERROR("Could not pin worker %u to CPU %u: %s\n", w->index,
+            srv->config.first_cpu + w->index, strerror(err));
+    }
   }
 
-  freeaddrinfo(result);
+  if (srv->config.engine == TUNNEL_ENGINE_URING) {
+    if (worker_uring_init(w) == 0) {
+      worker_loop_uring(w);
+    }
+    ERROR("Worker %u could not use io_uring, falling back to epoll\n", w->index);
+  }
+  worker_loop_epoll(w);
 
-  return sfd;
+  return NULL;
 }
 
-void print_in6addr (struct in6_addr* a) {
-  char str[INET6_ADDRSTRLEN];
-  const char* ptr;
-  ptr = inet_ntop(AF_INET6, a->s6_addr, str, INET6_ADDRSTRLEN);
-  if (ptr == NULL) {
-    perror("inet ntop");
+// A counter every worker has, one sample per worker.
+static void metrics_worker_counter (struct metrics_buf* b, struct tunnel_server* srv,
+                                    const char* name, const char* help,
+                                    size_t offset) {
+  uint64_t* value;
+  unsigned i;
+
+  metrics_header(b, name, "counter", help);
+  for (i=0; i<srv->config.num_workers; i++) {
+    value = (uint64_t*) ((uint8_t*) &srv->workers[i].stats + offset);
+    metrics_printf(b, "%s{worker=\"%u\"} %" PRIu64 "\n", name, i,
+                   __atomic_load_n(value, __ATOMIC_RELAXED));
   }
-  printf("%s\n", str);
-  // printf("%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x\n",
-  //   a->s6_addr[0],a->s6_addr[1], a->s6_addr[2], a->s6_addr[3], a->s6_addr[4],
-  //   a->s6_addr[5], a->s6_addr[6], a->s6_addr[7],
-  //   a->s6_addr[8],a->s6_addr[9], a->s6_addr[10], a->s6_addr[11], a->s6_addr[12],
-  //   a->s6_addr[13], a->s6_addr[14], a->s6_addr[15]);
 }
 
-static int parse_prefixes (struct socket_prefix* prefixes) {
-
-  FILE* prefix_file;
-  int read_len;
-  int err;
+// A value every session has, one sample per session. labels has each
+// session's labels, in the order of the parts.
+static void metrics_session_value (struct metrics_buf* b, struct metrics_scrape* scrape,
+                                   unsigned num_workers, char (*labels)[256],
+                                   const char* name, const char* type,
+                                   const char* help, size_t offset) {
+  struct metrics_part* part;
+  size_t k, n = 0;
+  unsigned i;
+
+  metrics_header(b, name, type, help);
+  for (i=0; i<num_workers; i++) {
+    part = &scrape->parts[i];
+    for (k=0; k<part->count; k++, n++) {
+      metrics_printf(b, "%s{%s} %" PRIu64 "\n", name, labels[n],
+                     *(uint64_t*) ((uint8_t*) &part->sessions[k] + offset));
+    }
+  }
+}
 
-  prefix_file = fopen("/etc/dibbler/client_assignments", "r");
-  if (!prefix_file) {
-    ERROR("Could not open file with prefixes.\n");
-    ERROR("Does it exist?.\n");
-    exit(1);
+static void metrics_format (struct metrics_buf* b, struct tunnel_server* srv,
+                            struct metrics_scrape* scrape) {
+  static const struct {
+    const char* reason;
+    size_t      offset;
+  } drops[] = {
+    {"no_route",   offsetof(struct worker_stats, drop_no_route)},
+    {"not_ipv6",   offsetof(struct worker_stats, drop_not_ipv6)},
+    {"tun_write",  offsetof(struct worker_stats, drop_tun_write)},
+    {"queue_full", offsetof(struct worker_stats, drop_queue_full)},
+  };
+  unsigned num_workers = srv->config.num_workers;
+  char ll[INET6_ADDRSTRLEN];
+  char pd[INET6_ADDRSTRLEN + 4];
+  char (*labels)[256];
+  struct session_metrics* m;
+  uint64_t queued;
+  size_t k, n, total = 0;
+  unsigned i, d;
+
+  metrics_worker_counter(b, srv, "tunnel_tun_rx_packets_total",
+      "Packets read from TUN.", offsetof(struct worker_stats, tun_rx_packets));
+  metrics_worker_counter(b, srv, "tunnel_tun_rx_bytes_total",
+      "Bytes read from TUN.", offsetof(struct worker_stats, tun_rx_bytes));
+  metrics_worker_counter(b, srv, "tunnel_tun_tx_packets_total",
+      "Packets from clients written to TUN.", offsetof(struct worker_stats, tun_tx_packets));
+  metrics_worker_counter(b, srv, "tunnel_tun_tx_bytes_total",
+      "Bytes from clients written to TUN.", offsetof(struct worker_stats, tun_tx_bytes));
+  metrics_worker_counter(b, srv, "tunnel_connections_total",
+      "Client connections accepted.", offsetof(struct worker_stats, connections));
+  metrics_worker_counter(b, srv, "tunnel_disconnects_total",
+      "Client connections closed.", offsetof(struct worker_stats, disconnects));
+  metrics_worker_counter(b, srv, "tunnel_assignment_reloads_total",
+      "Times the prefix assignments were read.", offsetof(struct worker_stats, assign_reloads));
+
+  metrics_header(b, "tunnel_drops_total", "counter", "Packets dropped, by reason.");
+  for (d=0; d<sizeof(drops)/sizeof(drops[0]); d++) {
+    for (i=0; i<num_workers; i++) {
+      metrics_printf(b, "tunnel_drops_total{worker=\"%u\",reason=\"%s\"} %" PRIu64 "\n",
+                     i, drops[d].reason, __atomic_load_n((uint64_t*)
+                       ((uint8_t*) &srv->workers[i].stats + drops[d].offset), __ATOMIC_RELAXED));
+    }
   }
 
+  metrics_header(b, "tunnel_sessions", "gauge", "Clients connected.");
+  for (i=0; i<num_workers; i++) {
+    metrics_printf(b, "tunnel_sessions{worker=\"%u\"} %zu\n", i, scrape->parts[i].count);
+    total += scrape->parts[i].count;
+  }
 
-  // Each line is:
-  // fe80::1:2:3:4 2607:4::/60
-  while (1) {
-    char line[512];
-    char* ptr;
-    char* ptr2;
-    int passes = 0;
-    struct in6_addr local;
-    struct in6_addr block;
-    int match = 0;
+  metrics_header(b, "tunnel_queue_bytes", "gauge", "Bytes waiting to be sent to clients.");
+  for (i=0; i<num_workers; i++) {
+    queued = 0;
+    for (k=0; k<scrape->parts[i].count; k++) {
+      queued += scrape->parts[i].sessions[k].txq_bytes;
+    }
+    metrics_printf(b, "tunnel_queue_bytes{worker=\"%u\"} %" PRIu64 "\n", i, queued);
+  }
 
+  // Every session sample has the same labels, worked out once
+  labels = malloc((total ? total : 1) * sizeof(*labels));
+  if (labels == NULL) {
+    b->failed = 1;
+    return;
+  }
+  for (i=0, n=0; i<num_workers; i++) {
+    for (k=0; k<scrape->parts[i].count; k++, n++) {
+      m = &scrape->parts[i].sessions[k];
+      pd[0] = '\0';
+      if (m->plen_pd) {
+        in6_ntop(&m->addr_pd, pd);
+        snprintf(pd + strlen(pd), 5, "/%u", m->plen_pd);
+      }
+      snprintf(labels[n], sizeof(labels[n]),
+               "worker=\"%u\",session=\"%016" PRIx64 "\",fd=\"%d\",ll=\"%s\",prefix=\"%s\"",
+               i, m->id, m->fd, m->plen_ll ? in6_ntop(&m->addr_ll, ll) : "", pd);
+    }
+  }
 
-    fgets(line, 512, prefix_file);
+  metrics_session_value(b, scrape, num_workers, labels, "tunnel_session_tx_packets_total",
+      "counter", "Packets sent to the client.",
+      offsetof(struct session_metrics, stats.tx_packets));
+  metrics_session_value(b, scrape, num_workers, labels, "tunnel_session_tx_bytes_total",
+      "counter", "Bytes sent to the client.",
+      offsetof(struct session_metrics, stats.tx_bytes));
+  metrics_session_value(b, scrape, num_workers, labels, "tunnel_session_tx_drops_total",
+      "counter", "Packets for the client dropped because its queue was full.",
+      offsetof(struct session_metrics, stats.tx_drops));
+  metrics_session_value(b, scrape, num_workers, labels, "tunnel_session_tx_blocked_total",
+      "counter", "Times the client's socket would not take everything queued.",
+      offsetof(struct session_metrics, stats.tx_blocked));
+  metrics_session_value(b, scrape, num_workers, labels, "tunnel_session_rx_packets_total",
+      "counter", "Packets from the client written to TUN.",
+      offsetof(struct session_metrics, stats.rx_packets));
+  metrics_session_value(b, scrape, num_workers, labels, "tunnel_session_rx_bytes_total",
+      "counter", "Bytes from the client written to TUN.",
+      offsetof(struct session_metrics, stats.rx_bytes));
+  metrics_session_value(b, scrape, num_workers, labels, "tunnel_session_queue_frames",
+      "gauge", "Frames waiting to be sent to the client.",
+      offsetof(struct session_metrics, txq_frames));
+  metrics_session_value(b, scrape, num_workers, labels, "tunnel_session_queue_bytes",
+      "gauge", "Bytes waiting to be sent to the client.",
+      offsetof(struct session_metrics, txq_bytes));
+
+  free(labels);
+}
 
-    if (feof(prefix_file)) {
-      break;
+// Ask every worker for its sessions and wait until all have answered.
+static void metrics_collect (struct tunnel_server* srv, struct metrics_scrape* scrape) {
+  struct worker_msg* msg;
+  uint64_t done;
+  unsigned i;
+
+  memset(scrape->parts, 0, srv->config.num_workers * sizeof(struct metrics_part));
+  scrape->pending = srv->config.num_workers;
+
+  for (i=0; i<srv->config.num_workers; i++) {
+    msg = worker_msg_new(WORKER_MSG_METRICS, 0, NULL, 0, 0);
+    if (msg == NULL) {
+      // That worker will show no sessions. If the others are already
+      // done, nobody is left to write efd.
+      if (__atomic_sub_fetch(&scrape->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        return;
+      }
+      continue;
     }
+    msg->scrape = scrape;
+    mailbox_post(&srv->workers[i].inbox, &msg->node);
+  }
 
+  while (read(scrape->efd, &done, sizeof(done)) < 0 && errno == EINTR);
+}
 
-    ptr = line;
-    while (1) {
-      if (*ptr == '\0') {
-        break;
-      }
-      if (passes == 0) {
-        if (*ptr == ' ') {
-          *ptr = '\0';
-          ptr2 = ptr+1;
-          err = inet_pton(AF_INET6, line, &local);
-          if (err == 0) {
-            printf("could not convert %s\n", line);
-          }
-          passes++;
-        }
-      } else {
-        if (*ptr == '\n') {
-          *ptr = '\0';
-          *(ptr-1) = '0';
-          *(ptr-2) = '0';
-          *(ptr-3) = '0';
-          err = inet_pton(AF_INET6, ptr2, &block);
-          if (err == 0) {
-            printf("could not convert %s\n", ptr2);
-          }
-          match = 1;
-          break;
-        }
-      }
-      ptr++;
-    }
-
-    if (match) {
-
-      printf("Got local and block\n");
-      print_in6addr(&local);
-      print_in6addr(&block);
-
-      // Got link local and the block.
-      // Now match the link-local address and add the block.
-      int j;
-      for (j=0; j<512; j++) {
-        struct socket_prefix* prefix = &prefixes[j];
-        if (prefix->plen_ll != 0) {
-          // Allow pd to be updated in case it changes
-          printf("trying %i\n", j);
-
-          // This could be the prefix match
-          if (memcmp(prefix->addr_ll.s6_addr, local.s6_addr, 16) == 0) {
-            // Found match!
-            memcpy(prefix->addr_pd.s6_addr, block.s6_addr, 16);
-            prefix->plen_pd = 62;
-            printf("set %i as %02x\n", j, prefix->addr_pd.s6_addr[15]);
-            print_in6addr(&prefix->addr_pd);
-            break;
-          }
-        }
-      }
+// Answers scrapes of the metrics port, one at a time.
+static void* metrics_run (void* arg) {
+  struct tunnel_server* srv = arg;
+  struct metrics_scrape scrape;
+  struct metrics_buf b;
+  unsigned i;
+  int fd;
+
+  scrape.parts = calloc(srv->config.num_workers, sizeof(struct metrics_part));
+  scrape.efd = eventfd(0, EFD_CLOEXEC);
+  if (scrape.parts == NULL || scrape.efd < 0) {
+    ERROR("Could not set up metrics\n");
+    return NULL;
+  }
+
+  while (1) {
+    fd = metrics_accept(srv->metrics_fd);
+    if (fd < 0) {
+      continue;
     }
 
+    metrics_collect(srv, &scrape);
+    metrics_buf_init(&b);
+    metrics_format(&b, srv, &scrape);
+    if (metrics_respond(fd, &b) < 0) {
+      WARN_LIMITED("Could not answer a metrics scrape\n");
+    }
+    metrics_buf_free(&b);
+
+    for (i=0; i<srv->config.num_workers; i++) {
+      free(scrape.parts[i].sessions);
+    }
   }
 
-  // read_len = read(macfile, macbuf, 128);
-  // if (read_len < 0) {
-  //  fprintf(stderr, "Could not read MAC address file.\n");
-  //  return -1;
-  // }
-  close(prefix_file);
+  return NULL;
 }
 
 
@@ -254,74 +2244,172 @@ int main (int argc, char** argv) {
   int err;
   char cmdbuf[4096];
   int sockfd;
-  int tun_file;
-
-  int sfd;
-  int efd;
-  struct epoll_event event;
-  struct epoll_event *events;
 
-  FILE* prefix_file;
-  int num_valid_prefixes = 0;
-  struct socket_prefix prefixes[512];
+  struct tunnel_server srv;
+  struct tunnel_worker* w;
+  sigset_t sigs;
+  unsigned i;
+  int opt;
 
-  struct in6_addr prefix_slash_52;
-  struct in6_addr prefix_slash_64;
+  // INIT
+  // Messages are few now, so each can go out as it happens
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  memset(&srv, 0, sizeof(srv));
+  srv.config.plen_pd = DEFAULT_PLEN_PD;
+  srv.config.txq_bytes = DEFAULT_TXQ_BYTES;
+  srv.config.drop_policy = SESSION_DROP_TAIL;
+  srv.config.num_workers = 1;
+  srv.config.first_cpu = -1;
+  srv.config.engine = TUNNEL_ENGINE_EPOLL;
+  srv.config.metrics_port = TUNNEL_SERVER_METRICS_PORT;
+  srv.metrics_fd = -1;
+
+  while ((opt = getopt(argc, argv, "p:q:D:w:c:e:l:m:")) != -1) {
+    switch (opt) {
+      case 'p':
+        srv.config.plen_pd = atoi(optarg);
+        break;
+      case 'q':
+        srv.config.txq_bytes = strtoul(optarg, NULL, 0);
+        break;
+      case 'D':
+        if (strcmp(optarg, "head") == 0) {
+          srv.config.drop_policy = SESSION_DROP_HEAD;
+        } else if (strcmp(optarg, "tail") == 0) {
+          srv.config.drop_policy = SESSION_DROP_TAIL;
+        } else {
+          argc = 0;
+        }
+        break;
+      case 'w':
+        srv.config.num_workers = atoi(optarg);
+        break;
+      case 'c':
+        srv.config.first_cpu = atoi(optarg);
+        break;
+      case 'e':
+        if (strcmp(optarg, "epoll") == 0) {
+          srv.config.engine = TUNNEL_ENGINE_EPOLL;
+        } else if (strcmp(optarg, "uring") == 0) {
+          srv.config.engine = TUNNEL_ENGINE_URING;
+        } else {
+          argc = 0;
+        }
+        break;
+      case 'm':
+        srv.config.metrics_port = atoi(optarg);
+        break;
+      case 'l':
+        err = debug_parse_level(optarg);
+        if (err < 0) {
+          argc = 0;
+        } else {
+          debug_level = err;
+        }
+        break;
+      default:
+        argc = 0;
+        break;
+    }
+  }
 
-  if (argc != 3) {
-    ERROR("usage: %s </52 full address> </64 full address>\n", argv[0]);
+  if (argc - optind != 2 || srv.config.plen_pd > 128 ||
+      srv.config.num_workers < 1 || srv.config.num_workers > SESSION_MAX_SHARDS ||
+      srv.config.first_cpu + (int) srv.config.num_workers > CPU_SETSIZE ||
+      in6_parse_prefix(argv[optind], &srv.config.block, &srv.config.plen_block,
+                       DEFAULT_PLEN_BLOCK) < 0 ||
+      in6_parse_prefix(argv[optind+1], &srv.config.gateways, &srv.config.plen_gateways,
+                       DEFAULT_PLEN_GATEWAYS) < 0) {
+    ERROR("usage: %s [-p delegated prefix length] [-q client queue bytes] "
+          "[-D head|tail] [-w workers] [-c first cpu] [-e epoll|uring] "
+          "[-l error|warn|info|debug] [-m metrics port, 0 for none] "
+          "<block>[/52] <gateways>[/64]\n", argv[0]);
     exit(1);
   }
 
-
-  // INIT
-  memset(prefixes, 0, sizeof(prefixes));
-  inet_pton(AF_INET6, argv[1], &prefix_slash_52);
-  inet_pton(AF_INET6, argv[2], &prefix_slash_64);
-
-
-
-
-  // Need to open a TUN device to get packets from linux and to send packets
-  // to the kernel to be routed
-  tun_file = open("/dev/net/tun", O_RDWR);
-  if (tun_file < 0) {
-    // error
-    ERROR("Could not create a tun interface. errno: %i\n", errno);
-    ERROR("%s\n", strerror(errno));
+  // Workers start on a cache line, so their counters do too
+  srv.workers = aligned_alloc(METRICS_CACHE_LINE,
+                              srv.config.num_workers * sizeof(struct tunnel_worker));
+  if (srv.workers == NULL) {
+    ERROR("Could not allocate workers\n");
     exit(1);
   }
+  memset(srv.workers, 0, srv.config.num_workers * sizeof(struct tunnel_worker));
+
+  for (i=0; i<srv.config.num_workers; i++) {
+    w = &srv.workers[i];
+    w->srv = &srv;
+    w->index = i;
+    w->notify_fd = -1;
+    w->signal_fd = -1;
+    session_table_init(&w->sessions, i);
+    if (route_table_init(&w->routes) < 0) {
+      ERROR("Could not allocate routing table\n");
+      exit(1);
+    }
+    w->tun_bufs = malloc(TUN_BATCH * TUN_PACKET_LEN);
+    w->rx_batch = malloc(TUNNEL_RXBUF_LEN + CLIENT_READ_LEN);
+    w->trace = malloc(sizeof(struct trace_ring));
+    if (w->tun_bufs == NULL || w->rx_batch == NULL || w->trace == NULL) {
+      ERROR("Could not allocate worker buffers\n");
+      exit(1);
+    }
+    trace_ring_init(w->trace);
+    if (mailbox_init(&w->inbox) < 0) {
+      ERROR("Could not create worker inbox\n");
+      perror("eventfd");
+      exit(1);
+    }
+  }
 
-  // Clear the ifr struct
-  memset(&ifr, 0, sizeof(ifr));
-
-  // Set the TUN name
-  strncpy(ifr.ifr_name, "ipv6-tun", IFNAMSIZ);
+  // Worker 0 watches the assignments file and tells the others what
+  // changes. The watch comes first so no change is missed.
+  srv.workers[0].notify_fd = watch_assignments();
+
+  // SIGUSR1 prints the traces. It is blocked here, before the other
+  // workers start, so no thread takes it and worker 0 reads it instead.
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+  srv.workers[0].signal_fd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (srv.workers[0].signal_fd < 0) {
+    perror("signalfd");
+  }
+  if (assign_table_init(&srv.workers[0].assignments) < 0) {
+    ERROR("Could not allocate assignments\n");
+    exit(1);
+  }
+  if (assign_load(&srv.workers[0].assignments, ASSIGN_FILE, srv.config.plen_pd) < 0) {
+    ERROR("Could not read %s, no prefixes are delegated until it can be\n",
+          ASSIGN_FILE);
+  }
+  srv.workers[0].assign_loaded = now_ms();
+  for (i=1; i<srv.config.num_workers; i++) {
+    if (assign_table_copy(&srv.workers[i].assignments, &srv.workers[0].assignments) < 0) {
+      ERROR("Could not allocate assignments\n");
+      exit(1);
+    }
+  }
 
-  // Select a TUN device
-  ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
 
-  // Make up a HW address
 
 
-  // Setup the interface
-  err = ioctl(tun_file, TUNSETIFF, (void *) &ifr);
-  if (err < 0) {
-    ERROR("ioctl could not set up tun interface\n");
-    close(tun_file);
-    exit(1);
+  // One TUN queue per worker. The kernel spreads packets for the TUN
+  // device across the queues by flow.
+  for (i=0; i<srv.config.num_workers; i++) {
+    srv.workers[i].tun_file = open_tun(&ifr, srv.config.num_workers > 1);
+    if (srv.workers[i].tun_file < 0) {
+      exit(1);
+    }
   }
 
   // Make it persistent
-  err = ioctl(tun_file, TUNSETPERSIST, 1);
+  err = ioctl(srv.workers[0].tun_file, TUNSETPERSIST, 1);
   if (err < 0) {
     ERROR("Could not make persistent\n");
     exit(1);
   }
 
-  // Make nonblocking in case select() gives us trouble
-  make_nonblocking(tun_file);
-
   // Save the name of the tun interface
   // strncpy(tun_name, ifr.ifr_name, MAX_TUN_NAME_LEN);
 
@@ -333,7 +2421,6 @@ int main (int argc, char** argv) {
   err = ioctl(sockfd, SIOCGIFFLAGS, &ifr);
   if (err < 0) {
     ERROR("ioctl could not get flags.\n");
-    close(tun_file);
     exit(1);
   }
   ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
@@ -342,7 +2429,6 @@ int main (int argc, char** argv) {
     ERROR("ioctl could not bring up the TUN network interface.\n");
     perror("tup up");
     ERROR("errno: %i\n", errno);
-    close(tun_file);
     exit(1);
   }
 
@@ -352,7 +2438,6 @@ int main (int argc, char** argv) {
   err = ioctl(sockfd, SIOCSIFMTU, &ifr);
   if (err < 0) {
     ERROR("ioctl could not set the MTU of the TUN network interface.\n");
-    close(tun_file);
     exit(1);
   }
 
@@ -360,7 +2445,6 @@ int main (int argc, char** argv) {
   err = ioctl(sockfd, SIOCGIFINDEX, &ifr);
   if (err < 0) {
     ERROR("ioctl could not get ifindex.\n");
-    close(tun_file);
     exit(1);
   }
 
@@ -445,328 +2529,81 @@ int main (int argc, char** argv) {
 
   // ACCEPT TCP CONNECTIONS FOR TUNNEL CLIENTS
 
-  // Create a socket
-  sfd = create_and_bind();
-  if (sfd == -1) {
-    ERROR("Could not create a socket\n");
-    exit(1);
-  }
+  // A listening socket per worker
+  for (i=0; i<srv.config.num_workers; i++) {
+    w = &srv.workers[i];
 
-  err = make_nonblocking(sfd);
-  if (err == -1) {
-    ERROR("Could not make socket nonblocking\n");
-    exit(1);
-  }
+    // Create a socket
+    w->sfd = create_and_bind(srv.config.num_workers > 1);
+    if (w->sfd == -1) {
+      ERROR("Could not create a socket\n");
+      exit(1);
+    }
 
-  err = listen(sfd, SOMAXCONN);
-  if (err == -1) {
-    ERROR("Could not listen on socket.\n");
-    perror("listen");
-    exit(1);
-  }
+    err = make_nonblocking(w->sfd);
+    if (err == -1) {
+      ERROR("Could not make socket nonblocking\n");
+      exit(1);
+    }
 
-  efd = epoll_create1(0);
-  if (efd == -1) {
-    perror("epoll_create");
-    exit(1);
+    err = listen(w->sfd, SOMAXCONN);
+    if (err == -1) {
+      ERROR("Could not listen on socket.\n");
+      perror("listen");
+      exit(1);
+    }
   }
 
-  // Add the TCP socket to epoll
-  event.data.fd = sfd;
-  event.events = EPOLLIN | EPOLLET;
-  err = epoll_ctl(efd, EPOLL_CTL_ADD, sfd, &event);
-  if (err == -1) {
-    perror("epoll_ctl - TCP");
-    exit(1);
+  // Worker 0 runs on this thread
+  for (i=1; i<srv.config.num_workers; i++) {
+    err = pthread_create(&srv.workers[i].thread, NULL, worker_run, &srv.workers[i]);
+    if (err != 0) {
+      ERROR("Could not start worker %u: %s\n", i, strerror(err));
+      exit(1);
+    }
   }
 
-  // Add the TUN device to epoll
-  event.data.fd = tun_file;
-  event.events = EPOLLIN | EPOLLET;
-  err = epoll_ctl(efd, EPOLL_CTL_ADD, tun_file, &event);
-  if (err == -1) {
-    perror("epoll_ctl - TUN");
-    exit(1);
+  // Metrics on loopback
+  if (srv.config.metrics_port != 0) {
+    srv.metrics_fd = metrics_listen(srv.config.metrics_port);
+    if (srv.metrics_fd < 0) {
+      ERROR("Could not listen for metrics on port %u\n", srv.config.metrics_port);
+      perror("metrics");
+    } else if ((err = pthread_create(&srv.metrics_thread, NULL, metrics_run, &srv)) != 0) {
+      ERROR("Could not start metrics: %s\n", strerror(err));
+    }
   }
 
-  // Buffer where events are returned
-  events = calloc(MAXEVENTS, sizeof(event));
-
-
-
-
-  // The event loop
-  while (1) {
-    int n, i;
-
-    // Wait for something to happen on one of the file descriptors
-    // we are waiting on
-    n = epoll_wait(efd, events, MAXEVENTS, -1);
-
-    // Iterate all of the active events
-    for (i = 0; i < n; i++) {
-
-      // Check that everything is kosher
-      if ((events[i].events & EPOLLERR) ||
-          (events[i].events & EPOLLHUP) ||
-          (!(events[i].events & EPOLLIN))) {
-        // An error has occured on this fd, or the socket is not
-        // ready for reading (why were we notified then?)
-        ERROR("epoll error\n");
-        continue;
-
-      // Check if this is a new connection on the TCP listening socket
-      } else if (events[i].data.fd == sfd) {
-        while (1) {
-          struct sockaddr in_addr;
-          socklen_t in_len;
-          int infd;
-          char hbuf[NI_MAXHOST];
-          char sbuf[NI_MAXSERV];
-
-          in_len = sizeof(in_addr);
-          infd = accept(sfd, &in_addr, &in_len);
-          if (infd == -1) {
-            if ((errno == EAGAIN) ||
-              (errno == EWOULDBLOCK)) {
-              // We have processed all incoming connections.
-              break;
-            } else {
-              perror("accept");
-              break;
-            }
-          }
-
-          err = getnameinfo(&in_addr,
-                          in_len,
-                          hbuf,
-                          sizeof(hbuf),
-                          sbuf,
-                          sizeof(sbuf),
-                          NI_NUMERICHOST | NI_NUMERICSERV);
-          if (err == 0) {
-            DBG("Accepted connection on descriptor %d "
-                   "(host=%s, port=%s)\n", infd, hbuf, sbuf);
-          }
-
-          // Make the incoming socket non-blocking and add it to the
-          // list of fds to monitor.
-          err = make_nonblocking(infd);
-          if (err == -1) {
-            ERROR("Could not make nonblocking\n");
-            exit(1);
-          }
-
-          event.data.fd = infd;
-          event.events  = EPOLLIN | EPOLLET;
-          err = epoll_ctl(efd, EPOLL_CTL_ADD, infd, &event);
-          if (err == -1) {
-            perror ("epoll_ctl");
-            exit(1);
-          }
-        }
-
-        continue;
-
-      // Check if we got data on the tun device
-      // } else if (events[i].data.fd == tun_file) {
-
-      // }
-
-      } else {
-        // Some socket has data ready. Read it all and handle it.
-
-        int done = 0;
-
-        // Loop until we have all of the data
-        while (1) {
-          ssize_t count;
-          char buf[4096];
-
-          count = read(events[i].data.fd, buf, sizeof(buf));
-          if (count == -1){
-            // If errno == EAGAIN, that means we have read all
-            // data. So go back to the main loop.
-            if (errno != EAGAIN) {
-              perror ("read");
-              done = 1;
-            }
-            break;
-          } else if (count == 0) {
-            // End of file. The remote has closed the
-            // connection.
-            done = 1;
-            break;
-          }
-
-          if (events[i].data.fd == tun_file) {
-            // Got a packet from the TUN device. Now we have to figure out
-            // which TCP socket to send it to.
-            printf("GOT DATA FROM TUN\n");
-
-            struct ipv6hdr *iph = (struct ipv6hdr*) buf;
-
-            if (iph->version == 6) {
-
-              // Check to see if the packet is in the /52 that this tunnel
-              // is responsible for
-              if (memcmp(iph->daddr.s6_addr, prefix_slash_52.s6_addr, 6) == 0 &&
-                  ((iph->daddr.s6_addr[6] & 0xf0) == (prefix_slash_52.s6_addr[6] & 0xf0))) {
-                printf("This dest in /52\n");
-
-                // This is in the /52
-                // Need to find a match for this destination
-                int j;
-                int match = 0;
-                for (j=0; j<512; j++) {
-                  if (prefixes[j].plen_pd != 0 &&
-                      memcmp(iph->daddr.s6_addr, prefixes[j].addr_pd.s6_addr, 7) == 0 &&
-                      ((iph->daddr.s6_addr[7] & 0xfc) == (prefixes[j].addr_pd.s6_addr[7] & 0xfc))) {
-                    // Found match
-                    printf("Found destination with matching /62.\n");
-                    err = write(j, buf, count);
-                    match = 1;
-                    break;
-                  }
-                }
-
-                if (!match) {
-                  printf("Could not find match originally. Reading assignments\n");
-                  parse_prefixes(prefixes);
-
-                  // Check for matches again
-                  for (j=0; j<512; j++) {
-                    if (prefixes[j].plen_pd != 0 &&
-                        memcmp(iph->daddr.s6_addr, prefixes[j].addr_pd.s6_addr, 7) == 0 &&
-                        ((iph->daddr.s6_addr[7] & 0xfc) == (prefixes[j].addr_pd.s6_addr[7] & 0xfc))) {
-                      // Found match
-                      printf("Found destination with matching /62 after loading prefixes.\n");
-                      err = write(j, buf, count);
-                      break;
-                    }
-                  }
-                }
-
-              // Check to see if destination is in /64 or ll
-              } else if (memcmp(iph->daddr.s6_addr, prefix_slash_64.s6_addr, 8) == 0 ||
-                         (iph->daddr.s6_addr[0] == 0xfe &&
-                          iph->daddr.s6_addr[1] == 0x80)) {
-                printf("This dest in /64 or link local\n");
-
-                // Need to find a match for this destination
-                int j=0;
-                for (j=0; j<512; j++) {
-                  if (prefixes[j].plen_ll != 0) {
-                    printf("checking tcp %i\n", j);
-                    printf("%02x%02x%02x%02x%02x%02x%02x%02x\n", iph->daddr.s6_addr[8],
-                      iph->daddr.s6_addr[9], iph->daddr.s6_addr[10], iph->daddr.s6_addr[11], iph->daddr.s6_addr[12],
-                      iph->daddr.s6_addr[13], iph->daddr.s6_addr[14], iph->daddr.s6_addr[15]);
-                    printf("%02x%02x%02x%02x%02x%02x%02x%02x\n", prefixes[j].addr_ll.s6_addr[8],
-                      prefixes[j].addr_ll.s6_addr[9], prefixes[j].addr_ll.s6_addr[10], prefixes[j].addr_ll.s6_addr[11], prefixes[j].addr_ll.s6_addr[12],
-                      prefixes[j].addr_ll.s6_addr[13], prefixes[j].addr_ll.s6_addr[14], prefixes[j].addr_ll.s6_addr[15]);
-                  }
-                  if (prefixes[j].plen_ll != 0 &&
-                      memcmp(iph->daddr.s6_addr+8, prefixes[j].addr_ll.s6_addr+8, 8) == 0) {
-                    // Found match
-                    printf("Found TCP destination for packet.\n");
-                    err = write(j, buf, count);
-                    break;
-                  }
-                }
-
-
-              } else {
-                printf("some other packet, can't forward\n");
-              }
-            }
-
-          } else {
-            // Got this from one of the TCP connections
-
-            if (events[i].data.fd < 512) {
-              // Not outside the bounds
-              struct socket_prefix* prefix = &prefixes[events[i].data.fd];
-
-              // Check to see if we know the link local address of this client.
-              if (prefix->plen_ll == 0) {
-                // We do not know the link local address of this node. That is
-                // bad, because we will not know how to route to it when we get
-                // packets for it.
-
-                // Inspect the packet to determine the IPv6 source address
-                struct ipv6hdr *iph = (struct ipv6hdr*) buf;
-
-                if (iph->version == 6) {
-                  // OK good, got IPv6 packet
-
-                  if (iph->saddr.s6_addr[0] == 0xfe &&
-                      iph->saddr.s6_addr[1] == 0x80) {
-                    // This came from link-local address. Great.
-                    // Save this
-                    memcpy(&prefix->addr_ll, &iph->saddr, sizeof(struct in6_addr));
-                    prefix->plen_ll = 128;
-                  }
-                }
-              }
-            }
-
-
-//6 00 00000 0024 00 01 fe800000000000000000000099990001 ff0200000000000000000000000000163a000502000001008f00d66e0000000104000000ff020000000000000000000000000002
-
-
-
-
-              int arghhh;
-              for (arghhh = 0; arghhh < count; ++arghhh)
-              {
-                 // code
-                printf("%02x", buf[arghhh]);
-              }
-              printf("\n");
-
-
-            // }
-
-
-
-            // Now dump it to the TUN device
-            err = write(tun_file, buf, count);
-
-            printf("wrote to tun\n");
-
-          }
-
-
-          /* Write the buffer to standard output */
-          // err = write(1, buf, count);
-          // if (err == -1) {
-          //   perror ("write");
-          //   abort ();
-          // }
-        }
-
-        if (done) {
-            printf("CLOSED\n");
-            printf("  descriptor %d\n", events[i].data.fd);
-            printf("  ");
-            print_in6addr(&prefixes[events[i].data.fd].addr_ll);
-            printf("  ");
-            print_in6addr(&prefixes[events[i].data.fd].addr_pd);
-
-            // Closing the descriptor will make epoll remove it
-            // from the set of descriptors which are monitored.
-            close (events[i].data.fd);
-            prefixes[events[i].data.fd].plen_ll = 0;
-            prefixes[events[i].data.fd].plen_pd = 0;
-          }
-      }
+  worker_run(&srv.workers[0]);
+
+  for (i=0; i<srv.config.num_workers; i++) {
+    w = &srv.workers[i];
+    free (w->dirty);
+    free (w->tun_bufs);
+    free (w->rx_batch);
+    if (w->ring != NULL) {
+      uring_bufs_free(w->ring, &w->recv_bufs);
+      uring_free(w->ring);
+      free (w->ring);
+    }
+    route_table_free(&w->routes);
+    session_table_free(&w->sessions);
+    assign_table_free(&w->assignments);
+    if (w->notify_fd >= 0) {
+      close (w->notify_fd);
+    }
+    if (w->signal_fd >= 0) {
+      close (w->signal_fd);
     }
+    free (w->trace);
+    mailbox_close(&w->inbox);
+    close (w->sfd);
+    close (w->tun_file);
+  }
+  free (srv.workers);
+  if (srv.metrics_fd >= 0) {
+    close (srv.metrics_fd);
   }
-
-  free (events);
-
-  close (sfd);
-  close (tun_file);
 
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,246 @@
+// Checks the tunnel server's session table, in particular that an id stops
+// working once its descriptor goes to a new connection, and the per-client
+// output queues:
+//
+//   make test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "tunnel-session.h"
+#include "tunnel-test.h"
+
+#define NUM_SESSIONS 20000
+
+static void test_reuse (void) {
+  struct session_table st;
+  struct session* a;
+  struct session* b;
+  uint64_t id;
+
+  session_table_init(&st, 0);
+
+  a = session_new(&st, 5);
+  CHECK(a != NULL);
+  id = a->id;
+  CHECK(id != 0 && SESSION_ID_FD(id) == 5 && SESSION_ID_GEN(id) != 0);
+  CHECK(session_get(&st, id) == a);
+  CHECK(session_get_fd(&st, 5) == a);
+
+  // Same descriptor, new connection
+  session_free(&st, a);
+  CHECK(session_get(&st, id) == NULL);
+  b = session_new(&st, 5);
+  CHECK(b != NULL && b->id != id);
+  CHECK(session_get(&st, id) == NULL);
+  CHECK(session_get(&st, b->id) == b);
+  CHECK(st.count == 1);
+
+  // Generation 0 is for the listening socket and TUN, never a session
+  CHECK(session_get(&st, SESSION_ID(5, 0)) == NULL);
+  CHECK(session_get(&st, SESSION_ID(70000, 1)) == NULL);
+
+  session_table_free(&st);
+}
+
+// Descriptors well past the old limit of 512, added and removed, in a
+// table that is not the first shard.
+static void test_many (void) {
+  struct session_table st;
+  static uint64_t ids[NUM_SESSIONS];
+  struct session* s;
+  int fd;
+
+  session_table_init(&st, 3);
+
+  for (fd=0; fd<NUM_SESSIONS; fd++) {
+    s = session_new(&st, fd);
+    CHECK(s != NULL);
+    ids[fd] = s->id;
+    CHECK(SESSION_ID_SHARD(s->id) == 3);
+    CHECK(fd == 0 || SESSION_ID_GEN(s->id) != SESSION_ID_GEN(ids[fd-1]));
+  }
+  CHECK(st.count == NUM_SESSIONS);
+
+  for (fd=0; fd<NUM_SESSIONS; fd+=2) {
+    session_free(&st, session_get(&st, ids[fd]));
+  }
+  CHECK(st.count == NUM_SESSIONS/2);
+
+  for (fd=0; fd<NUM_SESSIONS; fd++) {
+    s = session_get(&st, ids[fd]);
+    CHECK(fd % 2 ? (s != NULL && s->fd == fd) : s == NULL);
+  }
+
+  session_table_free(&st);
+}
+
+// A socket pair whose sending end fills up after a few frames.
+static void small_socketpair (int* sv) {
+  int size = 4096;
+
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+  setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+  setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  fcntl(sv[0], F_SETFL, O_NONBLOCK);
+  fcntl(sv[1], F_SETFL, O_NONBLOCK);
+}
+
+// Read everything waiting on fd and check it is whole frames whose first
+// payload byte counts up from *next, allowing gaps where packets were
+// dropped. Returns how many frames there were.
+static int drain (int fd, struct tunnel_rxbuf* rx, int* next) {
+  struct tunnel_frame frame;
+  uint8_t* ptr;
+  size_t space;
+  ssize_t n;
+  int got = 0;
+  int ret;
+
+  while (1) {
+    space = tunnel_rxbuf_space(rx, &ptr);
+    n = read(fd, ptr, space);
+    if (n <= 0) {
+      break;
+    }
+    tunnel_rxbuf_commit(rx, n);
+    while ((ret = tunnel_rxbuf_next(rx, &frame)) == 1) {
+      CHECK(frame.len == 1000);
+      CHECK(frame.data[0] >= *next);
+      *next = frame.data[0] + 1;
+      got++;
+    }
+    CHECK(ret == 0);
+  }
+  return got;
+}
+
+// A client that does not read: the queue fills to its limit, packets are
+// dropped by the policy, and what does go out is never cut mid-frame.
+static void test_txq (enum session_drop_policy policy) {
+  struct session_table st;
+  struct tunnel_rxbuf* rx = malloc(sizeof(struct tunnel_rxbuf));
+  struct session* s;
+  uint8_t pkt[1000];
+  int next = 0;
+  int got = 0;
+  int sv[2];
+  int i;
+
+  session_table_init(&st, 0);
+  tunnel_rxbuf_init(rx);
+  small_socketpair(sv);
+  s = session_new(&st, sv[0]);
+
+  // Far more than the socket and a 10 frame queue take
+  for (i=0; i<200; i++) {
+    pkt[0] = i;
+    session_txq_push(s, TUNNEL_FRAME_PACKET, pkt, sizeof(pkt), 10 * 1004, policy);
+    if (session_txq_flush(s) == 1) {
+      CHECK(s->blocked);
+    }
+    CHECK(s->txq_bytes <= 10 * 1004);
+  }
+  CHECK(s->blocked);
+  CHECK(s->stats.tx_drops > 0);
+  CHECK(s->stats.tx_blocked > 0);
+
+  // The client catches up
+  while (s->txq_count > 0) {
+    got += drain(sv[1], rx, &next);
+    s->blocked = 0;
+    CHECK(session_txq_flush(s) >= 0);
+  }
+  got += drain(sv[1], rx, &next);
+
+  CHECK(got + s->stats.tx_drops == 200);
+  CHECK(got == s->stats.tx_packets);
+  CHECK(rx->end == rx->start);
+  if (policy == SESSION_DROP_HEAD) {
+    // The newest packets were kept
+    CHECK(next == 200);
+  } else {
+    CHECK(next < 200);
+  }
+
+  session_free(&st, s);
+  session_table_free(&st);
+  close(sv[0]);
+  close(sv[1]);
+  free(rx);
+}
+
+// Batches go straight out while the socket has room, and queue behind
+// each other once it is full, still in order and whole.
+static void test_send (void) {
+  struct session_table st;
+  struct tunnel_rxbuf* rx = malloc(sizeof(struct tunnel_rxbuf));
+  struct session* s;
+  static uint8_t pkts[100][1000];
+  struct iovec iov[SESSION_SEND_MAX];
+  int next = 0;
+  int got = 0;
+  int sv[2];
+  int i, j;
+
+  session_table_init(&st, 0);
+  tunnel_rxbuf_init(rx);
+  small_socketpair(sv);
+  s = session_new(&st, sv[0]);
+
+  for (i=0; i<100; i++) {
+    pkts[i][0] = i;
+  }
+
+  // A small batch fits in the socket and nothing is queued
+  for (j=0; j<2; j++) {
+    iov[j].iov_base = pkts[j];
+    iov[j].iov_len  = 1000;
+  }
+  CHECK(session_send(s, TUNNEL_FRAME_PACKET, iov, 2, 1000 * 1004, SESSION_DROP_TAIL) == 0);
+  CHECK(s->txq_count == 0 && s->stats.tx_packets == 2);
+  got += drain(sv[1], rx, &next);
+  CHECK(got == 2 && next == 2);
+
+  // Then more than the socket takes, in batches of 9
+  for (i=2; i<100; i+=j) {
+    for (j=0; j<9 && i+j<100; j++) {
+      iov[j].iov_base = pkts[i+j];
+      iov[j].iov_len  = 1000;
+    }
+    CHECK(session_send(s, TUNNEL_FRAME_PACKET, iov, j, 1000 * 1004, SESSION_DROP_TAIL) == 0);
+  }
+  CHECK(s->txq_count > 0);
+  CHECK(s->stats.tx_drops == 0);
+
+  while (s->txq_count > 0) {
+    got += drain(sv[1], rx, &next);
+    s->blocked = 0;
+    CHECK(session_txq_flush(s) >= 0);
+  }
+  got += drain(sv[1], rx, &next);
+
+  CHECK(got == 100 && next == 100);
+  CHECK(s->stats.tx_packets == 100);
+  CHECK(rx->end == rx->start);
+
+  session_free(&st, s);
+  session_table_free(&st);
+  close(sv[0]);
+  close(sv[1]);
+  free(rx);
+}
+
+int main (void) {
+  test_reuse();
+  test_many();
+  test_txq(SESSION_DROP_TAIL);
+  test_txq(SESSION_DROP_HEAD);
+  test_send();
+
+  return test_result();
+}
@@ -0,0 +1,288 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "tunnel-session.h"
+
+#define SESSION_TABLE_INIT_LEN 64
+
+void session_table_init (struct session_table* st, uint32_t shard) {
+  memset(st, 0, sizeof(struct session_table));
+  st->shard = shard;
+}
+
+// Free everything still queued.
+static void session_txq_clear (struct session* s) {
+  while (s->txq_count > 0) {
+    free(s->txq[s->txq_head]);
+    s->txq_head = (s->txq_head + 1) % SESSION_TXQ_LEN;
+    s->txq_count--;
+  }
+  s->txq_bytes = 0;
+  s->txq_off = 0;
+}
+
+void session_table_free (struct session_table* st) {
+  size_t i;
+
+  for (i=0; i<st->len; i++) {
+    if (st->by_fd[i] != NULL) {
+      session_txq_clear(st->by_fd[i]);
+      free(st->by_fd[i]);
+    }
+  }
+  free(st->by_fd);
+  session_table_init(st, st->shard);
+}
+
+// Make room in by_fd for fd, doubling so growth is amortized.
+static int session_table_grow (struct session_table* st, int fd) {
+  struct session** by_fd;
+  size_t len = st->len ? st->len : SESSION_TABLE_INIT_LEN;
+
+  while (len <= (size_t) fd) {
+    len *= 2;
+  }
+
+  by_fd = realloc(st->by_fd, len * sizeof(struct session*));
+  if (by_fd == NULL) {
+    return -1;
+  }
+  memset(by_fd + st->len, 0, (len - st->len) * sizeof(struct session*));
+  st->by_fd = by_fd;
+  st->len = len;
+  return 0;
+}
+
+struct session* session_new (struct session_table* st, int fd) {
+  struct session* s;
+
+  if (fd < 0) {
+    return NULL;
+  }
+  if ((size_t) fd >= st->len && session_table_grow(st, fd) < 0) {
+    return NULL;
+  }
+
+  s = calloc(1, sizeof(struct session));
+  if (s == NULL) {
+    return NULL;
+  }
+
+  // Count above the shard bits, skipping 0 when the counter wraps
+  st->generation += SESSION_MAX_SHARDS;
+  if (st->generation == 0) {
+    st->generation = SESSION_MAX_SHARDS;
+  }
+
+  s->id = SESSION_ID(fd, st->generation | st->shard);
+  s->fd = fd;
+  tunnel_rxbuf_init(&s->rx);
+
+  // A session still on this descriptor was never freed. Its descriptor
+  // is gone, so drop it.
+  if (st->by_fd[fd] != NULL) {
+    session_txq_clear(st->by_fd[fd]);
+    free(st->by_fd[fd]);
+  } else {
+    st->count++;
+  }
+  st->by_fd[fd] = s;
+
+  return s;
+}
+
+void session_free (struct session_table* st, struct session* s) {
+  if (s->fd >= 0 && (size_t) s->fd < st->len && st->by_fd[s->fd] == s) {
+    st->by_fd[s->fd] = NULL;
+    st->count--;
+  }
+  session_txq_clear(s);
+  free(s);
+}
+
+struct session* session_get (const struct session_table* st, uint64_t id) {
+  struct session* s = session_get_fd(st, SESSION_ID_FD(id));
+
+  if (s == NULL || s->id != id) {
+    return NULL;
+  }
+  return s;
+}
+
+struct session* session_get_fd (const struct session_table* st, int fd) {
+  if (fd < 0 || (size_t) fd >= st->len) {
+    return NULL;
+  }
+  return st->by_fd[fd];
+}
+
+// Drop the oldest frame that has not started going out. Returns -1 if
+// there is none.
+static int session_txq_drop_head (struct session* s) {
+  unsigned victim = s->txq_head;
+
+  // Half a frame is already on the wire, the rest of it has to follow
+  if (s->txq_off > 0) {
+    if (s->txq_count < 2) {
+      return -1;
+    }
+    victim = (s->txq_head + 1) % SESSION_TXQ_LEN;
+  }
+
+  s->txq_bytes -= s->txq[victim]->len;
+  free(s->txq[victim]);
+  // Slide the partly written frame, if any, into the hole
+  s->txq[victim] = s->txq[s->txq_head];
+  s->txq_head = (s->txq_head + 1) % SESSION_TXQ_LEN;
+  s->txq_count--;
+  s->stats.tx_drops++;
+  return 0;
+}
+
+int session_txq_push (struct session* s, uint8_t type, const uint8_t* data,
+                      uint16_t len, size_t max_bytes,
+                      enum session_drop_policy policy) {
+  size_t frame_len = TUNNEL_FRAME_HEADER_LEN + len;
+  struct session_txbuf* buf;
+
+  // Always take a frame into an empty queue, however big
+  while (s->txq_count > 0 &&
+         (s->txq_count == SESSION_TXQ_LEN || s->txq_bytes + frame_len > max_bytes)) {
+    if (policy != SESSION_DROP_HEAD || session_txq_drop_head(s) < 0) {
+      s->stats.tx_drops++;
+      return -1;
+    }
+  }
+
+  buf = malloc(sizeof(struct session_txbuf) + frame_len);
+  if (buf == NULL) {
+    s->stats.tx_drops++;
+    return -1;
+  }
+  buf->len = frame_len;
+  tunnel_frame_header(buf->data, type, len);
+  memcpy(buf->data + TUNNEL_FRAME_HEADER_LEN, data, len);
+
+  s->txq[(s->txq_head + s->txq_count) % SESSION_TXQ_LEN] = buf;
+  s->txq_count++;
+  s->txq_bytes += frame_len;
+  return 0;
+}
+
+int session_txq_flush (struct session* s) {
+  struct iovec iov[SESSION_TXQ_LEN];
+  struct session_txbuf* buf;
+  unsigned i;
+  ssize_t ret;
+  size_t left;
+
+  while (s->txq_count > 0) {
+    for (i=0; i<s->txq_count; i++) {
+      buf = s->txq[(s->txq_head + i) % SESSION_TXQ_LEN];
+      iov[i].iov_base = buf->data;
+      iov[i].iov_len  = buf->len;
+    }
+    iov[0].iov_base = (uint8_t*) iov[0].iov_base + s->txq_off;
+    iov[0].iov_len -= s->txq_off;
+
+    ret = writev(s->fd, iov, s->txq_count);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        s->blocked = 1;
+        s->stats.tx_blocked++;
+        return 1;
+      }
+      return -1;
+    }
+
+    s->stats.tx_bytes += ret;
+    s->txq_bytes -= ret;
+
+    // Retire everything that went out completely
+    while (ret > 0) {
+      buf = s->txq[s->txq_head];
+      left = buf->len - s->txq_off;
+      if ((size_t) ret < left) {
+        s->txq_off += ret;
+        break;
+      }
+      ret -= left;
+      free(buf);
+      s->txq_head = (s->txq_head + 1) % SESSION_TXQ_LEN;
+      s->txq_count--;
+      s->txq_off = 0;
+      s->stats.tx_packets++;
+    }
+  }
+
+  return 0;
+}
+
+int session_send (struct session* s, uint8_t type, const struct iovec* pkts,
+                  unsigned n, size_t max_bytes, enum session_drop_policy policy) {
+  uint8_t hdr[SESSION_SEND_MAX][TUNNEL_FRAME_HEADER_LEN];
+  struct iovec iov[2 * SESSION_SEND_MAX];
+  ssize_t ret = 0;
+  size_t len;
+  unsigned i;
+  int queued;
+
+  if (n > SESSION_SEND_MAX) {
+    n = SESSION_SEND_MAX;
+  }
+
+  // Anything already queued has to go first
+  if (s->txq_count == 0 && !s->blocked) {
+    for (i=0; i<n; i++) {
+      tunnel_frame_header(hdr[i], type, pkts[i].iov_len);
+      iov[2*i].iov_base = hdr[i];
+      iov[2*i].iov_len  = TUNNEL_FRAME_HEADER_LEN;
+      iov[2*i+1] = pkts[i];
+    }
+
+    do {
+      ret = writev(s->fd, iov, 2 * n);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        return -1;
+      }
+      s->blocked = 1;
+      s->stats.tx_blocked++;
+      ret = 0;
+    }
+    s->stats.tx_bytes += ret;
+  }
+
+  // Skip the frames that went out whole
+  for (i=0; i<n; i++) {
+    len = TUNNEL_FRAME_HEADER_LEN + pkts[i].iov_len;
+    if ((size_t) ret < len) {
+      break;
+    }
+    ret -= len;
+    s->stats.tx_packets++;
+  }
+
+  // Queue the rest. If one went out in part, it is the first in the
+  // (empty) queue, so it is never dropped.
+  for (; i<n; i++) {
+    queued = session_txq_push(s, type, pkts[i].iov_base, pkts[i].iov_len,
+                              max_bytes, policy);
+    if (ret > 0) {
+      if (queued < 0) {
+        // The rest of the frame is lost, the stream cannot go on
+        return -1;
+      }
+      s->txq_off = ret;
+      s->txq_bytes -= ret;
+      ret = 0;
+    }
+  }
+
+  return 0;
+}
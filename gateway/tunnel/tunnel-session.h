@@ -0,0 +1,146 @@
+#ifndef __TUNNEL_SESSION_H__
+#define __TUNNEL_SESSION_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
+
+#include "tunnel-frame.h"
+
+// Per-connection state in the tunnel server.
+//
+// Sessions are found by descriptor through a table that grows with the
+// highest descriptor in use, so memory follows the number of clients. The
+// kernel hands a closed descriptor to the next connection, so anything that
+// holds on to a session (routes, epoll events) keeps its id instead: the
+// descriptor plus a generation number that is new for every session. An id
+// whose session has gone no longer finds anything, even when the
+// descriptor has been reused.
+
+// Generation 0 is never given to a session, so an id is never 0 and can be
+// stored in the route table, and the listening socket and TUN can use
+// SESSION_ID(fd, 0) in epoll.
+#define SESSION_ID(fd, gen) (((uint64_t) (gen) << 32) | (uint32_t) (fd))
+#define SESSION_ID_FD(id)   ((int) (uint32_t) (id))
+#define SESSION_ID_GEN(id)  ((uint32_t) ((id) >> 32))
+
+// The low bits of the generation say which table the session is in, so a
+// server with several tables (one per worker thread) can tell from an id
+// alone which one to ask.
+#define SESSION_SHARD_BITS  8
+#define SESSION_MAX_SHARDS  (1 << SESSION_SHARD_BITS)
+#define SESSION_ID_SHARD(id) (SESSION_ID_GEN(id) & (SESSION_MAX_SHARDS - 1))
+
+// Frames waiting to go out to a client. The queue is bounded by
+// SESSION_TXQ_LEN frames and by the byte limit given to session_txq_push();
+// a client that cannot keep up loses packets instead of holding up the
+// server.
+#define SESSION_TXQ_LEN 128
+
+// Most packets session_send() takes at once.
+#define SESSION_SEND_MAX 64
+
+// What to do with a packet for a client whose queue is full.
+enum session_drop_policy {
+  SESSION_DROP_TAIL,  // Drop the new packet
+  SESSION_DROP_HEAD,  // Drop the oldest packet that has not started going out
+};
+
+// One frame, header included.
+struct session_txbuf {
+  uint16_t len;
+  uint8_t  data[];
+};
+
+struct session_stats {
+  uint64_t tx_packets;  // Frames written to the socket
+  uint64_t tx_bytes;
+  uint64_t tx_drops;    // Frames dropped because the queue was full
+  uint64_t tx_blocked;  // Times the socket would not take everything queued
+  uint64_t rx_packets;  // Packets from the client written to TUN
+  uint64_t rx_bytes;
+};
+
+struct session {
+  uint64_t        id;
+  int             fd;
+
+  struct in6_addr addr_pd;  // The /60 (or whatever) that was assigned to this client. pd == prefix delegation
+  uint32_t        plen_pd;  // 0 if not set, 60 (or the actual prefix) if set
+  struct in6_addr addr_ll;  // The link local assigned to this client
+  uint32_t        plen_ll;  // 0 if not set, 128 if valid
+
+  struct tunnel_rxbuf rx;   // Frames from this client being reassembled
+
+  // Frames waiting to be written, oldest at txq_head. The first has
+  // txq_off bytes written already.
+  struct session_txbuf* txq[SESSION_TXQ_LEN];
+  unsigned        txq_head;
+  unsigned        txq_count;
+  size_t          txq_bytes;   // Queued bytes not written yet
+  size_t          txq_off;
+  int             blocked;     // The socket is full, wait for EPOLLOUT
+  int             dirty;       // Queued to be flushed this loop iteration
+
+  // io_uring engine: a chain of writes to TUN from this client is in
+  // flight, and rx_waiting receive buffers wait for it, from rx_wait_head.
+  // If the client has closed its end, rx_eof is set until they are done.
+  int             rx_busy;
+  unsigned        rx_waiting;
+  uint16_t        rx_wait_head;
+  uint16_t        rx_wait_tail;
+  int             rx_eof;
+
+  struct session_stats stats;
+};
+
+struct session_table {
+  struct session** by_fd;
+  size_t           len;         // Slots in by_fd
+  size_t           count;       // Sessions open
+  uint32_t         generation;  // Given to the last session created
+  uint32_t         shard;       // Put in the id of every session created
+};
+
+// shard is below SESSION_MAX_SHARDS, 0 if there is only one table.
+void session_table_init (struct session_table* st, uint32_t shard);
+
+// Free every session left and the table. Does not close descriptors.
+void session_table_free (struct session_table* st);
+
+// Create a session for a newly accepted descriptor. Returns NULL if out of
+// memory.
+struct session* session_new (struct session_table* st, int fd);
+
+// Remove a session from the table and free it, along with anything still
+// queued. Does not close the descriptor.
+void session_free (struct session_table* st, struct session* s);
+
+// The session with this id, or NULL if it is gone.
+struct session* session_get (const struct session_table* st, uint64_t id);
+
+// The session currently on fd, or NULL.
+struct session* session_get_fd (const struct session_table* st, int fd);
+
+// Queue a frame for the client. If the queue already holds max_bytes or
+// SESSION_TXQ_LEN frames, one packet is dropped according to policy.
+// Returns 0 if the frame was queued, -1 if it was dropped.
+int session_txq_push (struct session* s, uint8_t type, const uint8_t* data,
+                      uint16_t len, size_t max_bytes,
+                      enum session_drop_policy policy);
+
+// Write as much of the queue as the socket takes, in as few writev() calls
+// as possible. Returns 0 if the queue is empty, 1 if the socket is full
+// (s->blocked is set), and -1 if the connection failed.
+int session_txq_flush (struct session* s);
+
+// Send up to SESSION_SEND_MAX packets, each as a frame of the given type.
+// If nothing is queued ahead of them they go straight to the socket in one
+// writev(), without being copied; whatever the socket does not take is
+// queued as by session_txq_push(). Returns 0, or -1 if the connection
+// failed. Frames are left queued if s->txq_count is not 0 afterwards.
+int session_send (struct session* s, uint8_t type, const struct iovec* pkts,
+                  unsigned n, size_t max_bytes, enum session_drop_policy policy);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef __TUNNEL_TEST_H__
+#define __TUNNEL_TEST_H__
+
+#include <stdio.h>
+
+// What the tunnel's tests are built from. A CHECK() that fails says where
+// and the test carries on, so one run shows every failure. main() ends
+// with return test_result().
+
+static int failures;
+
+#define CHECK(cond) do {                                           \
+  if (!(cond)) {                                                   \
+    fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);     \
+    failures++;                                                    \
+  }                                                                \
+} while (0)
+
+// Report how the checks went. Returns the exit status.
+static inline int test_result (void) {
+  if (failures) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("all checks passed\n");
+  return 0;
+}
+
+#endif
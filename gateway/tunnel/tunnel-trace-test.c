@@ -0,0 +1,95 @@
+// Checks the trace ring, alone and read while another thread writes it:
+//
+//   make test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "tunnel-trace.h"
+#include "tunnel-test.h"
+
+#define NUM_WRITES 2000000
+
+static struct trace_ring ring;
+static struct trace_record out[TRACE_RING_LEN];
+
+// Fewer records than fit, then enough to go around more than once.
+static void test_wrap (void) {
+  size_t n, i;
+
+  trace_ring_init(&ring);
+  CHECK(trace_ring_read(&ring, out, TRACE_RING_LEN) == 0);
+
+  for (i=0; i<10; i++) {
+    trace_write(&ring, 1, i, i * 3);
+  }
+  n = trace_ring_read(&ring, out, TRACE_RING_LEN);
+  CHECK(n == 10);
+  for (i=0; i<n; i++) {
+    CHECK(out[i].event == 1 && out[i].a == i && out[i].b == i * 3);
+    CHECK(i == 0 || out[i].time >= out[i-1].time);
+  }
+
+  // Only the newest few
+  n = trace_ring_read(&ring, out, 4);
+  CHECK(n == 4 && out[0].a == 6 && out[3].a == 9);
+
+  for (i=10; i<TRACE_RING_LEN * 2 + 5; i++) {
+    trace_write(&ring, 2, i, i * 3);
+  }
+  n = trace_ring_read(&ring, out, TRACE_RING_LEN);
+  CHECK(n == TRACE_RING_LEN);
+  CHECK(out[0].a == TRACE_RING_LEN + 5);
+  CHECK(out[n-1].a == TRACE_RING_LEN * 2 + 4);
+}
+
+static void* writer (void* arg) {
+  uint64_t i;
+
+  (void) arg;
+  for (i=0; i<NUM_WRITES; i++) {
+    trace_write(&ring, 3, i, i * 3);
+  }
+  return NULL;
+}
+
+// Every record read while the ring is being written is whole, and they
+// come out in order.
+static void test_concurrent (void) {
+  pthread_t thread;
+  uint64_t head;
+  size_t n, i;
+  int bad = 0;
+  int reads = 0;
+
+  trace_ring_init(&ring);
+  CHECK(pthread_create(&thread, NULL, writer, NULL) == 0);
+
+  do {
+    head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+    n = trace_ring_read(&ring, out, TRACE_RING_LEN);
+    for (i=0; i<n; i++) {
+      if (out[i].event != 3 || out[i].b != out[i].a * 3 ||
+          out[i].seq != out[i].a + 1 || (i > 0 && out[i].a <= out[i-1].a)) {
+        bad++;
+      }
+    }
+    reads++;
+  } while (head < NUM_WRITES);
+
+  pthread_join(thread, NULL);
+  CHECK(bad == 0);
+  CHECK(reads > 0);
+
+  n = trace_ring_read(&ring, out, TRACE_RING_LEN);
+  CHECK(n == TRACE_RING_LEN && out[n-1].a == NUM_WRITES - 1);
+}
+
+int main (void) {
+  test_wrap();
+  test_concurrent();
+
+  return test_result();
+}
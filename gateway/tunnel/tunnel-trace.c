@@ -0,0 +1,41 @@
+#include <string.h>
+
+#include "tunnel-trace.h"
+
+void trace_ring_init (struct trace_ring* r) {
+  memset(r, 0, sizeof(struct trace_ring));
+}
+
+size_t trace_ring_read (struct trace_ring* r, struct trace_record* out, size_t max) {
+  volatile struct trace_record* rec;
+  uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  uint64_t first = 0;
+  uint64_t seq, i;
+  size_t n = 0;
+
+  if (max > TRACE_RING_LEN) {
+    max = TRACE_RING_LEN;
+  }
+  if (head > max) {
+    first = head - max;
+  }
+
+  for (i=first; i<head; i++) {
+    rec = &r->records[i & (TRACE_RING_LEN - 1)];
+
+    seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+    out[n].time  = rec->time;
+    out[n].a     = rec->a;
+    out[n].b     = rec->b;
+    out[n].event = rec->event;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    // Written again since, or being written
+    if (seq != i + 1 || __atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != seq) {
+      continue;
+    }
+    out[n].seq = seq;
+    n++;
+  }
+  return n;
+}
@@ -0,0 +1,53 @@
+#ifndef __TUNNEL_TRACE_H__
+#define __TUNNEL_TRACE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+// A record of the last TRACE_RING_LEN things a thread did, kept in binary
+// so writing one costs a clock read and a few stores, with nothing
+// formatted. One thread writes a ring; any thread can copy it out at any
+// time to print, and records that are overwritten while being copied are
+// left out.
+
+#define TRACE_RING_LEN 4096   // A power of 2
+
+struct trace_record {
+  uint64_t seq;     // Its number + 1 once written, 0 while being written
+  uint64_t time;    // ns, CLOCK_MONOTONIC
+  uint64_t a;       // What a and b are depends on event
+  uint64_t b;
+  uint16_t event;
+};
+
+struct trace_ring {
+  uint64_t            head;   // Records ever written
+  struct trace_record records[TRACE_RING_LEN];
+};
+
+void trace_ring_init (struct trace_ring* r);
+
+static inline void trace_write (struct trace_ring* r, uint16_t event,
+                                uint64_t a, uint64_t b) {
+  uint64_t n = r->head;
+  struct trace_record* rec = &r->records[n & (TRACE_RING_LEN - 1)];
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  // Readers see seq change around the write and skip the record
+  __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  rec->time  = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  rec->a     = a;
+  rec->b     = b;
+  rec->event = event;
+  __atomic_store_n(&rec->seq, n + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&r->head, n + 1, __ATOMIC_RELEASE);
+}
+
+// Copy up to max of the newest records, oldest first. Returns how many.
+size_t trace_ring_read (struct trace_ring* r, struct trace_record* out, size_t max);
+
+#endif
@@ -0,0 +1,180 @@
+// Checks the io_uring wrapper the tunnel server's uring engine is built on,
+// with the features the server uses: fixed files, registered buffers,
+// linked requests and multishot receive into provided buffers. Skipped
+// where the kernel does not allow io_uring:
+//
+//   make test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "tunnel-uring.h"
+#include "tunnel-test.h"
+
+// A write and then a read, linked, both on fixed files and registered
+// buffers.
+static void test_linked (struct uring* r) {
+  static uint8_t bufs[2][64];
+  struct iovec iov[2];
+  struct io_uring_sqe* sqe;
+  struct io_uring_cqe* cqe;
+  int fds[2];
+  int seen = 0;
+
+  CHECK(pipe(fds) == 0);
+  CHECK(uring_register(r, IORING_REGISTER_FILES, fds, 2) == 0);
+  iov[0].iov_base = bufs[0];
+  iov[0].iov_len  = sizeof(bufs[0]);
+  iov[1].iov_base = bufs[1];
+  iov[1].iov_len  = sizeof(bufs[1]);
+  CHECK(uring_register(r, IORING_REGISTER_BUFFERS, iov, 2) == 0);
+
+  memcpy(bufs[0], "tunnel", 6);
+
+  sqe = uring_get_sqe(r);
+  sqe->opcode    = IORING_OP_WRITE_FIXED;
+  sqe->flags     = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+  sqe->fd        = 1;
+  sqe->addr      = (uint64_t) (uintptr_t) bufs[0];
+  sqe->len       = 6;
+  sqe->buf_index = 0;
+  sqe->user_data = 1;
+
+  sqe = uring_get_sqe(r);
+  sqe->opcode    = IORING_OP_READ_FIXED;
+  sqe->flags     = IOSQE_FIXED_FILE;
+  sqe->fd        = 0;
+  sqe->addr      = (uint64_t) (uintptr_t) bufs[1];
+  sqe->len       = sizeof(bufs[1]);
+  sqe->buf_index = 1;
+  sqe->user_data = 2;
+
+  CHECK(uring_submit(r, 2) == 2);
+  while ((cqe = uring_peek_cqe(r)) != NULL) {
+    CHECK(cqe->res == 6);
+    CHECK(cqe->user_data == (uint64_t) seen + 1);
+    seen++;
+    uring_cqe_seen(r);
+  }
+  CHECK(seen == 2);
+  CHECK(memcmp(bufs[1], "tunnel", 6) == 0);
+
+  // Emptying a slot
+  fds[0] = -1;
+  CHECK(uring_update_files(r, 1, fds, 1) == 1);
+
+  CHECK(uring_register(r, IORING_UNREGISTER_BUFFERS, NULL, 0) == 0);
+  CHECK(uring_register(r, IORING_UNREGISTER_FILES, NULL, 0) == 0);
+}
+
+// A full queue hands out no more entries until it is submitted.
+static void test_full (struct uring* r) {
+  struct io_uring_sqe* sqe;
+  unsigned i, n;
+
+  n = uring_sq_space(r);
+  CHECK(n == 8);
+  for (i=0; i<n; i++) {
+    sqe = uring_get_sqe(r);
+    CHECK(sqe != NULL);
+    if (sqe != NULL) {
+      sqe->opcode    = IORING_OP_NOP;
+      sqe->user_data = i;
+    }
+  }
+  CHECK(uring_sq_space(r) == 0);
+  CHECK(uring_get_sqe(r) == NULL);
+
+  CHECK(uring_submit(r, n) == (int) n);
+  CHECK(uring_sq_space(r) == n);
+  for (i=0; i<n && uring_peek_cqe(r) != NULL; i++) {
+    uring_cqe_seen(r);
+  }
+  CHECK(i == n);
+}
+
+// One receive request, many completions, each in a buffer from the group.
+static void test_multishot (struct uring* r) {
+  struct uring_bufs b;
+  struct io_uring_sqe* sqe;
+  struct io_uring_cqe* cqe;
+  char msg[16];
+  int sv[2];
+  int got = 0;
+  int i;
+
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+  if (uring_bufs_init(r, &b, 7, 4, 32) < 0) {
+    printf("provided buffer rings not supported, skipped\n");
+    close(sv[0]);
+    close(sv[1]);
+    return;
+  }
+  CHECK(uring_probe_recv_multishot(r, &b) == 0);
+
+  sqe = uring_get_sqe(r);
+  sqe->opcode    = IORING_OP_RECV;
+  sqe->ioprio    = IORING_RECV_MULTISHOT;
+  sqe->flags     = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 7;
+  sqe->fd        = sv[0];
+  sqe->user_data = 42;
+  CHECK(uring_submit(r, 0) == 1);
+
+  // More messages than buffers, handing each back after use
+  for (i=0; i<10; i++) {
+    snprintf(msg, sizeof(msg), "message %d", i);
+    CHECK(write(sv[1], msg, strlen(msg)) == (ssize_t) strlen(msg));
+
+    CHECK(uring_submit(r, 1) >= 0);
+    cqe = uring_peek_cqe(r);
+    CHECK(cqe != NULL);
+    if (cqe == NULL) {
+      break;
+    }
+    CHECK(cqe->user_data == 42);
+    CHECK(cqe->res == (int) strlen(msg));
+    CHECK(cqe->flags & IORING_CQE_F_BUFFER);
+    CHECK(cqe->flags & IORING_CQE_F_MORE);
+    CHECK(memcmp(uring_bufs_get(&b, cqe->flags >> IORING_CQE_BUFFER_SHIFT),
+                 msg, strlen(msg)) == 0);
+    uring_bufs_put(&b, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    uring_cqe_seen(r);
+    got++;
+  }
+  CHECK(got == 10);
+
+  // The end of the stream ends the request
+  close(sv[1]);
+  CHECK(uring_submit(r, 1) >= 0);
+  cqe = uring_peek_cqe(r);
+  CHECK(cqe != NULL && cqe->res == 0 && !(cqe->flags & IORING_CQE_F_MORE));
+  if (cqe != NULL) {
+    uring_cqe_seen(r);
+  }
+
+  uring_bufs_free(r, &b);
+  close(sv[0]);
+}
+
+int main (void) {
+  struct uring r;
+
+  if (uring_init(&r, 8) < 0) {
+    printf("io_uring not available (%s), skipped\n", strerror(errno));
+    return 0;
+  }
+
+  test_linked(&r);
+  test_full(&r);
+  test_multishot(&r);
+
+  uring_free(&r);
+
+  return test_result();
+}
@@ -0,0 +1,286 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "tunnel-uring.h"
+
+static int sys_io_uring_setup (unsigned entries, struct io_uring_params* p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter (int fd, unsigned to_submit, unsigned min_complete,
+                               unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int uring_init (struct uring* r, unsigned entries) {
+  struct io_uring_params p;
+  uint8_t* sq;
+  uint8_t* cq;
+  unsigned i;
+
+  memset(r, 0, sizeof(struct uring));
+  memset(&p, 0, sizeof(p));
+
+  r->fd = sys_io_uring_setup(entries, &p);
+  if (r->fd < 0) {
+    return -1;
+  }
+
+  r->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP && r->cq_ring_len > r->sq_ring_len) {
+    r->sq_ring_len = r->cq_ring_len;
+  }
+
+  r->sq_ring = mmap(NULL, r->sq_ring_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ring == MAP_FAILED) {
+    goto fail;
+  }
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    r->cq_ring = r->sq_ring;
+    r->cq_ring_len = 0;
+  } else {
+    r->cq_ring = mmap(NULL, r->cq_ring_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_ring == MAP_FAILED) {
+      r->cq_ring = NULL;
+      goto fail;
+    }
+  }
+
+  r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    r->sqes = NULL;
+    goto fail;
+  }
+
+  sq = r->sq_ring;
+  r->sq_head    = (unsigned*) (sq + p.sq_off.head);
+  r->sq_tail    = (unsigned*) (sq + p.sq_off.tail);
+  r->sq_mask    = *(unsigned*) (sq + p.sq_off.ring_mask);
+  r->sq_entries = p.sq_entries;
+  r->sqe_tail   = *r->sq_tail;
+
+  // Submission entries are always used in order
+  for (i=0; i<p.sq_entries; i++) {
+    ((unsigned*) (sq + p.sq_off.array))[i] = i;
+  }
+
+  cq = r->cq_ring;
+  r->cq_head = (unsigned*) (cq + p.cq_off.head);
+  r->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+  r->cq_mask = *(unsigned*) (cq + p.cq_off.ring_mask);
+  r->cqes    = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+
+  return 0;
+
+fail:
+  uring_free(r);
+  return -1;
+}
+
+void uring_free (struct uring* r) {
+  if (r->sqes != NULL) {
+    munmap(r->sqes, r->sqes_len);
+  }
+  if (r->cq_ring != NULL && r->cq_ring != r->sq_ring) {
+    munmap(r->cq_ring, r->cq_ring_len);
+  }
+  if (r->sq_ring != NULL && r->sq_ring != MAP_FAILED) {
+    munmap(r->sq_ring, r->sq_ring_len);
+  }
+  if (r->fd >= 0) {
+    close(r->fd);
+  }
+  memset(r, 0, sizeof(struct uring));
+  r->fd = -1;
+}
+
+struct io_uring_sqe* uring_get_sqe (struct uring* r) {
+  struct io_uring_sqe* sqe;
+
+  if (uring_sq_space(r) == 0) {
+    return NULL;
+  }
+
+  sqe = &r->sqes[r->sqe_tail & r->sq_mask];
+  r->sqe_tail++;
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  return sqe;
+}
+
+unsigned uring_sq_space (struct uring* r) {
+  return r->sq_entries - (r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE));
+}
+
+int uring_submit (struct uring* r, unsigned wait_nr) {
+  unsigned to_submit;
+  int ret;
+
+  __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+  to_submit = r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+  if (to_submit == 0 && wait_nr == 0) {
+    return 0;
+  }
+
+  do {
+    ret = sys_io_uring_enter(r->fd, to_submit, wait_nr,
+                             wait_nr ? IORING_ENTER_GETEVENTS : 0);
+  } while (ret < 0 && errno == EINTR);
+
+  return ret;
+}
+
+struct io_uring_cqe* uring_peek_cqe (struct uring* r) {
+  unsigned head = *r->cq_head;
+
+  if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  return &r->cqes[head & r->cq_mask];
+}
+
+void uring_cqe_seen (struct uring* r) {
+  __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_register (struct uring* r, unsigned opcode, const void* arg, unsigned nr) {
+  return syscall(__NR_io_uring_register, r->fd, opcode, arg, nr);
+}
+
+int uring_update_files (struct uring* r, unsigned offset, const int* fds, unsigned nr) {
+  struct io_uring_files_update up;
+
+  memset(&up, 0, sizeof(up));
+  up.offset = offset;
+  up.fds    = (uint64_t) (uintptr_t) fds;
+  return uring_register(r, IORING_REGISTER_FILES_UPDATE, &up, nr);
+}
+
+int uring_bufs_init (struct uring* r, struct uring_bufs* b, uint16_t group,
+                     unsigned count, unsigned buf_len) {
+  struct io_uring_buf_reg reg;
+  unsigned i;
+
+  memset(b, 0, sizeof(struct uring_bufs));
+  b->group   = group;
+  b->count   = count;
+  b->buf_len = buf_len;
+
+  // The kernel wants the ring page aligned
+  b->ring_len = count * sizeof(struct io_uring_buf);
+  b->ring = mmap(NULL, b->ring_len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (b->ring == MAP_FAILED) {
+    b->ring = NULL;
+    return -1;
+  }
+  b->data = malloc((size_t) count * buf_len);
+  if (b->data == NULL) {
+    uring_bufs_free(r, b);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr    = (uint64_t) (uintptr_t) b->ring;
+  reg.ring_entries = count;
+  reg.bgid         = group;
+  if (uring_register(r, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    free(b->data);
+    b->data = NULL;
+    munmap(b->ring, b->ring_len);
+    b->ring = NULL;
+    return -1;
+  }
+
+  for (i=0; i<count; i++) {
+    uring_bufs_put(b, i);
+  }
+  return 0;
+}
+
+void uring_bufs_free (struct uring* r, struct uring_bufs* b) {
+  struct io_uring_buf_reg reg;
+
+  if (b->ring != NULL && b->data != NULL) {
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = b->group;
+    uring_register(r, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+  }
+  if (b->ring != NULL) {
+    munmap(b->ring, b->ring_len);
+  }
+  free(b->data);
+  memset(b, 0, sizeof(struct uring_bufs));
+}
+
+uint8_t* uring_bufs_get (struct uring_bufs* b, uint16_t bid) {
+  return b->data + (size_t) bid * b->buf_len;
+}
+
+int uring_probe_recv_multishot (struct uring* r, struct uring_bufs* b) {
+  struct io_uring_sqe* sqe;
+  struct io_uring_cqe* cqe;
+  int sv[2];
+  int res;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    return -1;
+  }
+
+  sqe = uring_get_sqe(r);
+  if (sqe == NULL) {
+    close(sv[0]);
+    close(sv[1]);
+    errno = EBUSY;
+    return -1;
+  }
+  sqe->opcode    = IORING_OP_RECV;
+  sqe->ioprio    = IORING_RECV_MULTISHOT;
+  sqe->flags     = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = b->group;
+  sqe->fd        = sv[0];
+
+  // The end of the stream finishes the receive if it was taken. Kernels
+  // without multishot receives refuse it with EINVAL.
+  close(sv[1]);
+  if (uring_submit(r, 1) < 0) {
+    res = -errno;
+  } else if ((cqe = uring_peek_cqe(r)) == NULL) {
+    res = -EIO;
+  } else {
+    res = cqe->res;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+      uring_bufs_put(b, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+    uring_cqe_seen(r);
+  }
+  close(sv[0]);
+
+  if (res < 0) {
+    errno = -res;
+    return -1;
+  }
+  return 0;
+}
+
+void uring_bufs_put (struct uring_bufs* b, uint16_t bid) {
+  struct io_uring_buf* buf = &b->ring->bufs[b->tail & (b->count - 1)];
+
+  buf->addr = (uint64_t) (uintptr_t) uring_bufs_get(b, bid);
+  buf->len  = b->buf_len;
+  buf->bid  = bid;
+  b->tail++;
+  __atomic_store_n(&b->ring->tail, b->tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,92 @@
+#ifndef __TUNNEL_URING_H__
+#define __TUNNEL_URING_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+// Just enough io_uring for the tunnel server, straight on the system calls
+// so nothing beyond the kernel headers is needed.
+//
+// Submissions are prepared with uring_get_sqe() and go to the kernel with
+// the next uring_submit(). Completions are read with uring_peek_cqe() and
+// handed back with uring_cqe_seen(). Only one thread may use a ring.
+
+struct uring {
+  int                  fd;
+
+  // Submission queue, shared with the kernel
+  unsigned*            sq_head;
+  unsigned*            sq_tail;
+  unsigned             sq_mask;
+  unsigned             sq_entries;
+  struct io_uring_sqe* sqes;
+  unsigned             sqe_tail;   // Prepared, the kernel is told at submit
+
+  // Completion queue, shared with the kernel
+  unsigned*            cq_head;
+  unsigned*            cq_tail;
+  unsigned             cq_mask;
+  struct io_uring_cqe* cqes;
+
+  void*                sq_ring;
+  size_t               sq_ring_len;
+  void*                cq_ring;
+  size_t               cq_ring_len;
+  size_t               sqes_len;
+};
+
+// A ring of buffers the kernel picks from for receives
+// (IOSQE_BUFFER_SELECT), each buf_len bytes, numbered 0 to count-1.
+struct uring_bufs {
+  struct io_uring_buf_ring* ring;
+  size_t                    ring_len;
+  uint8_t*                  data;
+  unsigned                  count;     // A power of 2
+  unsigned                  buf_len;
+  uint16_t                  group;
+  uint16_t                  tail;
+};
+
+// Returns 0 on success, -1 with errno set if io_uring cannot be used.
+int  uring_init (struct uring* r, unsigned entries);
+void uring_free (struct uring* r);
+
+// A cleared submission entry, or NULL if the queue is full. Never submits,
+// so entries taken one after another stay together.
+struct io_uring_sqe* uring_get_sqe (struct uring* r);
+
+// How many entries uring_get_sqe() can hand out before the next submit.
+unsigned uring_sq_space (struct uring* r);
+
+// Give the kernel everything prepared, and wait until there are at least
+// wait_nr completions. Returns the number submitted, or -1 with errno set.
+int uring_submit (struct uring* r, unsigned wait_nr);
+
+// The next completion, or NULL if there is none yet.
+struct io_uring_cqe* uring_peek_cqe (struct uring* r);
+void uring_cqe_seen (struct uring* r);
+
+// io_uring_register(2). Returns -1 with errno set on failure.
+int uring_register (struct uring* r, unsigned opcode, const void* arg, unsigned nr);
+
+// Replace fixed files from slot offset on; -1 empties a slot.
+int uring_update_files (struct uring* r, unsigned offset, const int* fds, unsigned nr);
+
+// Allocate count buffers and register them as buffer group group.
+// Returns -1 with errno set on failure.
+int  uring_bufs_init (struct uring* r, struct uring_bufs* b, uint16_t group,
+                      unsigned count, unsigned buf_len);
+void uring_bufs_free (struct uring* r, struct uring_bufs* b);
+
+uint8_t* uring_bufs_get (struct uring_bufs* b, uint16_t bid);
+
+// Give a buffer back for the kernel to fill again.
+void uring_bufs_put (struct uring_bufs* b, uint16_t bid);
+
+// Try a multishot receive (Linux 6.0) into buffers from b on a socket pair
+// of its own. Nothing else may be queued on the ring. Returns 0 if it
+// works, -1 with errno set if not.
+int uring_probe_recv_multishot (struct uring* r, struct uring_bufs* b);
+
+#endif
@@ -14,80 +14,839 @@
 #include <linux/delay.h>
 #include <linux/poll.h>
 #include <linux/of_gpio.h>
+#include <linux/gpio/consumer.h>
+#include <linux/completion.h>
+#include <linux/workqueue.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "gapspi.h"
 
 #include "debug.h"
 
+#define CREATE_TRACE_POINTS
+#include "gapspi_trace.h"
+
 #define DRIVER_AUTHOR  "Neal Jackson <nealjack@umich.edu>"
 #define DRIVER_DESC    "A driver for the GAP Beaglebone Black \"Zigbeag\" cape SPI control."
 #define DRIVER_VERSION "0.1"
 
-static void gapspi_cs_mux(int id);
+// The parts of spi_device.mode the real controller has to be set up for.
+#define GAPSPI_MODE_BITS (SPI_CPHA | SPI_CPOL | SPI_CS_HIGH | SPI_LSB_FIRST)
 
 const char gapspi_name[] = "gapspi";
 
-// Device and Pin config
-int num_demux_ctrl_pins;
-int demux_ctrl_pins[3];
-
 // Defines the level of debug output
 uint8_t debug_print = DEBUG_PRINT_ERR;
 
-struct spi_device* gapspi_spi_device;
+// Bus usage of one mux output, shown in debugfs.
+struct gapspi_stats {
+	u64 messages;
+	u64 bytes;
+	u64 errors;
+	u64 busy_ns;   // time its messages occupied the controller
+	u64 wait_ns;   // time it had a message ready but not on the controller
+	u64 switches;  // times the mux was switched to it
+};
+
+// Messages waiting for one mux output.
+struct gapspi_target {
+	struct list_head queue;
+	int priority;       // higher goes first
+	u64 latency_ns;     // longest a waiting target is passed over, 0 for none
+	u64 waiting_since;  // when the message at the head of queue became next
+	u32 mode;           // SPI mode of the device behind this output
+
+	// The virtual controller devices on this output are registered on.
+	struct spi_controller *ctlr;
+
+	struct gapspi_stats stats;
+};
+
+// A message handed to the controller. Its completion is routed through
+// gapspi so the next one can be picked.
+struct gapspi_slot {
+	struct spi_message *msg;
+	void (*complete)(void *context);
+	void *context;
+	struct spi_device *spi;  // who sent it, restored on completion
+
+	int id;
+	unsigned int len;
+	u64 start_ns;
+};
+
+// One gapspi instance: a real SPI master and the mux in front of it.
+struct gapspi_bus {
+	struct spi_device *spi;  // gapspi's device on the real controller
+
+	int num_pins;
+	int pins[GAPSPI_MAX_PINS];
+	struct gpio_desc *descs[GAPSPI_MAX_PINS];
+	int num_targets;
+
+	spinlock_t lock;
+	struct gapspi_target targets[GAPSPI_MAX_TARGETS];
+	struct gapspi_slot slots[GAPSPI_DEPTH];
+	int inflight;
+	int current_target;  // last target given the bus, -1 for none
+	int burst;           // messages in a row for current_target
+	int mux;             // what the mux pins are set to, -1 if unknown
+
+	// Changing the controller's SPI mode may sleep, so it is done here.
+	bool switching;
+	int switch_to;
+	struct work_struct switch_work;
+
+	// Messages the controller would not take after their sender had
+	// returned. They are completed from fail_work, never from inside
+	// gapspi_dispatch(), where the sender may hold its own locks.
+	struct list_head failed;
+	struct work_struct fail_work;
+
+	wait_queue_head_t idle_queue;
+
+	u64 last_end_ns;     // when the controller last finished a message
+	u64 stats_since_ns;  // when the stats were last cleared
+	struct dentry *debugfs;
+};
+
+// What a virtual controller knows about itself.
+struct gapspi_output {
+	struct gapspi_bus *bus;
+	int id;
+};
+
+// The bus gap_spi_async() and gap_spi_sync() use: the first one probed.
+static struct gapspi_bus *gapspi_default;
+static DEFINE_MUTEX(gapspi_default_lock);
+
+// /sys/kernel/debug/gapspi, shared by all buses.
+static struct dentry *gapspi_debugfs_root;
+static int gapspi_num_buses;
+
+static int gapspi_dispatch(struct gapspi_bus *bus, struct spi_message *own);
+
+// Use this function to set the DEMUX. All pins are written at once so the
+// mux never passes through an unrelated output, and not at all if the mux
+// already points at id. Only called with nothing on the wire.
+static void gapspi_cs_mux(struct gapspi_bus *bus, int id)
+{
+	unsigned long values = id;
+
+	if (bus->mux == id) {
+		return;
+	}
+	gpiod_set_array_value(bus->num_pins, bus->descs, NULL, &values);
+	trace_gapspi_mux_switch(bus->spi->controller->bus_num, bus->mux, id);
+	bus->targets[id].stats.switches++;
+	bus->mux = id;
+}
+
+static unsigned int gapspi_message_len(struct spi_message *msg)
+{
+	struct spi_transfer *t;
+	unsigned int len = 0;
+
+	list_for_each_entry(t, &msg->transfers, transfer_list) {
+		len += t->len;
+	}
+	return len;
+}
+
+static void gapspi_switch_work(struct work_struct *work);
+static void gapspi_fail_work(struct work_struct *work);
 
-// Use this function to set the DEMUX
-static void gapspi_cs_mux(int id)
+static void gapspi_bus_init(struct gapspi_bus *bus, struct spi_device *spi, int num_pins)
 {
 	int i;
-	for (i = 0; i < num_demux_ctrl_pins; ++i) {
-		if (id & (1<<i)) {
-			gpio_set_value(demux_ctrl_pins[i], 1);
+
+	bus->spi = spi;
+	bus->num_pins = num_pins;
+	bus->num_targets = 1 << num_pins;
+
+	spin_lock_init(&bus->lock);
+	for (i=0; i<GAPSPI_MAX_TARGETS; i++) {
+		INIT_LIST_HEAD(&bus->targets[i].queue);
+		bus->targets[i].priority = 0;
+		bus->targets[i].latency_ns = 0;
+		bus->targets[i].mode = spi->mode & GAPSPI_MODE_BITS;
+		bus->targets[i].ctlr = NULL;
+	}
+	for (i=0; i<GAPSPI_DEPTH; i++) {
+		bus->slots[i].msg = NULL;
+	}
+	bus->inflight = 0;
+	bus->current_target = -1;
+	bus->burst = 0;
+	bus->mux = -1;
+	bus->switching = false;
+	INIT_WORK(&bus->switch_work, gapspi_switch_work);
+	INIT_LIST_HEAD(&bus->failed);
+	INIT_WORK(&bus->fail_work, gapspi_fail_work);
+	init_waitqueue_head(&bus->idle_queue);
+	bus->last_end_ns = 0;
+	bus->stats_since_ns = ktime_get_ns();
+}
+
+// Choose which target gets the bus next, or -1 if nothing is waiting.
+// Must hold bus->lock.
+//
+// A target that has waited longer than its latency budget goes first, the
+// most overdue first. Otherwise the highest priority wins, and among equals
+// the target that already has the mux keeps it for up to GAPSPI_MAX_BURST
+// messages before the others get a turn.
+static int gapspi_pick(struct gapspi_bus *bus, u64 now)
+{
+	struct gapspi_target *t;
+	int best = -1;
+	u64 overdue, most_overdue = 0;
+	int priority;
+	int i, id;
+
+	for (i=0; i<bus->num_targets; i++) {
+		t = &bus->targets[i];
+		if (list_empty(&t->queue) || t->latency_ns == 0) {
+			continue;
+		}
+		if (now - t->waiting_since > t->latency_ns) {
+			overdue = now - t->waiting_since - t->latency_ns;
+			if (best < 0 || overdue > most_overdue) {
+				best = i;
+				most_overdue = overdue;
+			}
+		}
+	}
+	if (best >= 0) {
+		return best;
+	}
+
+	// Only the highest priority with something queued is considered.
+	for (i=0; i<bus->num_targets; i++) {
+		t = &bus->targets[i];
+		if (!list_empty(&t->queue) && (best < 0 || t->priority > bus->targets[best].priority)) {
+			best = i;
+		}
+	}
+	if (best < 0) {
+		return -1;
+	}
+	priority = bus->targets[best].priority;
+
+	// Round robin among those, starting with the target that has the mux.
+	// It keeps the bus until its burst is used up and someone else is
+	// waiting.
+	id = bus->current_target < 0 ? best : bus->current_target;
+	for (i=0; i<bus->num_targets; i++, id=(id+1) % bus->num_targets) {
+		t = &bus->targets[id];
+		if (list_empty(&t->queue) || t->priority != priority) {
+			continue;
+		}
+		if (id == bus->current_target && bus->burst >= GAPSPI_MAX_BURST) {
+			continue;
+		}
+		return id;
+	}
+
+	// Only the current target is waiting
+	return best;
+}
+
+static void gapspi_complete(void *context)
+{
+	struct gapspi_slot *slot = context;
+	struct spi_message *msg = slot->msg;
+	struct gapspi_bus *bus = spi_get_drvdata(msg->spi);
+	struct gapspi_stats *stats;
+	unsigned long flags;
+	unsigned int len;
+	u64 now, busy;
+	int id;
+
+	msg->complete = slot->complete;
+	msg->context = slot->context;
+	msg->spi = slot->spi;
+
+	spin_lock_irqsave(&bus->lock, flags);
+	// Messages run in order on the controller, so this one started when
+	// the previous one finished if it was queued behind it.
+	now = ktime_get_ns();
+	busy = now - max(slot->start_ns, bus->last_end_ns);
+	bus->last_end_ns = now;
+	id = slot->id;
+	len = slot->len;
+	stats = &bus->targets[id].stats;
+	stats->messages++;
+	stats->bytes += len;
+	stats->busy_ns += busy;
+	if (msg->status) {
+		stats->errors++;
+	}
+	slot->msg = NULL;
+	if (--bus->inflight == 0) {
+		wake_up(&bus->idle_queue);
+	}
+	spin_unlock_irqrestore(&bus->lock, flags);
+
+	trace_gapspi_message_end(bus->spi->controller->bus_num, id, len, msg->status, busy);
+
+	gapspi_dispatch(bus, NULL);
+
+	if (msg->complete) {
+		msg->complete(msg->context);
+	}
+}
+
+// Hand messages to the controller until GAPSPI_DEPTH are outstanding or
+// nothing is waiting. The mux is only switched once everything for the
+// previous output has finished.
+//
+// If own, the message its caller is queueing, cannot be handed to the
+// controller, it is not completed and the error is returned, as spi_async()
+// would. Any other message that fails is completed later from fail_work.
+static int gapspi_dispatch(struct gapspi_bus *bus, struct spi_message *own)
+{
+	struct gapspi_target *t;
+	struct gapspi_slot *slot = NULL;
+	struct spi_message *msg;
+	unsigned long flags;
+	unsigned int len;
+	u64 now, wait;
+	int id, i;
+	int err, own_err = 0;
+
+	while (1) {
+		spin_lock_irqsave(&bus->lock, flags);
+		if (bus->switching || bus->inflight >= GAPSPI_DEPTH) {
+			spin_unlock_irqrestore(&bus->lock, flags);
+			return own_err;
+		}
+		now = ktime_get_ns();
+		id = gapspi_pick(bus, now);
+		if (id < 0) {
+			spin_unlock_irqrestore(&bus->lock, flags);
+			return own_err;
+		}
+
+		t = &bus->targets[id];
+		if (id != bus->mux) {
+			if (bus->inflight > 0) {
+				// Let the bus drain, the last completion comes back here.
+				spin_unlock_irqrestore(&bus->lock, flags);
+				return own_err;
+			}
+			if (t->mode != (bus->spi->mode & GAPSPI_MODE_BITS)) {
+				bus->switching = true;
+				bus->switch_to = id;
+				spin_unlock_irqrestore(&bus->lock, flags);
+				schedule_work(&bus->switch_work);
+				return own_err;
+			}
+			gapspi_cs_mux(bus, id);
+		}
+
+		msg = list_first_entry(&t->queue, struct spi_message, queue);
+		list_del_init(&msg->queue);
+		wait = now - t->waiting_since;
+		t->stats.wait_ns += wait;
+		t->waiting_since = now;
+		len = gapspi_message_len(msg);
+
+		if (id == bus->current_target) {
+			bus->burst++;
 		} else {
-			gpio_set_value(demux_ctrl_pins[i], 0);
+			bus->current_target = id;
+			bus->burst = 1;
+		}
+
+		for (i=0; i<GAPSPI_DEPTH; i++) {
+			if (bus->slots[i].msg == NULL) {
+				slot = &bus->slots[i];
+				break;
+			}
+		}
+		slot->msg = msg;
+		slot->complete = msg->complete;
+		slot->context = msg->context;
+		slot->spi = msg->spi;
+		slot->id = id;
+		slot->len = len;
+		slot->start_ns = now;
+		msg->complete = gapspi_complete;
+		msg->context = slot;
+		bus->inflight++;
+		spin_unlock_irqrestore(&bus->lock, flags);
+
+		trace_gapspi_message_start(bus->spi->controller->bus_num, id, len, wait);
+
+		err = spi_async(bus->spi, msg);
+		if (err) {
+			ERR(KERN_ALERT, "spi_async to mux output %i failed: %i\n", id, err);
+
+			msg->complete = slot->complete;
+			msg->context = slot->context;
+			msg->spi = slot->spi;
+			msg->status = err;
+
+			spin_lock_irqsave(&bus->lock, flags);
+			t->stats.errors++;
+			slot->msg = NULL;
+			if (msg == own) {
+				own_err = err;
+			} else {
+				list_add_tail(&msg->queue, &bus->failed);
+				schedule_work(&bus->fail_work);
+			}
+			if (--bus->inflight == 0) {
+				wake_up(&bus->idle_queue);
+			}
+			spin_unlock_irqrestore(&bus->lock, flags);
 		}
 	}
 }
 
+// Complete the messages gapspi_dispatch() could not send.
+static void gapspi_fail_work(struct work_struct *work)
+{
+	struct gapspi_bus *bus = container_of(work, struct gapspi_bus, fail_work);
+	struct spi_message *msg;
+	unsigned long flags;
+
+	while (1) {
+		spin_lock_irqsave(&bus->lock, flags);
+		msg = list_first_entry_or_null(&bus->failed, struct spi_message, queue);
+		if (msg) {
+			list_del_init(&msg->queue);
+		}
+		spin_unlock_irqrestore(&bus->lock, flags);
+
+		if (msg == NULL) {
+			break;
+		}
+		if (msg->complete) {
+			msg->complete(msg->context);
+		}
+	}
+}
+
+
+// Set the real controller up for the device behind the next output, then
+// carry on dispatching.
+static void gapspi_switch_work(struct work_struct *work)
+{
+	struct gapspi_bus *bus = container_of(work, struct gapspi_bus, switch_work);
+	unsigned long flags;
+	int id = bus->switch_to;
+	int err;
+
+	bus->spi->mode = (bus->spi->mode & ~GAPSPI_MODE_BITS) | bus->targets[id].mode;
+	err = spi_setup(bus->spi);
+	if (err) {
+		ERR(KERN_ALERT, "Could not set SPI mode %x for mux output %i: %i\n",
+		    bus->targets[id].mode, id, err);
+	}
+
+	spin_lock_irqsave(&bus->lock, flags);
+	gapspi_cs_mux(bus, id);
+	bus->switching = false;
+	spin_unlock_irqrestore(&bus->lock, flags);
+
+	gapspi_dispatch(bus, NULL);
+}
+
+// Queue a message for mux output id. Returns an error, without completing
+// the message, if the controller would not take it straight away. Once
+// queued it completes through its complete callback, including when it
+// could not be sent, and never from inside this call.
+static int gapspi_queue(struct gapspi_bus *bus, struct spi_message *message, int id)
+{
+	struct gapspi_target *t = &bus->targets[id];
+	unsigned long flags;
+
+	message->status = -EINPROGRESS;
+	message->actual_length = 0;
+
+	spin_lock_irqsave(&bus->lock, flags);
+	if (list_empty(&t->queue)) {
+		t->waiting_since = ktime_get_ns();
+	}
+	list_add_tail(&message->queue, &t->queue);
+	spin_unlock_irqrestore(&bus->lock, flags);
+
+	return gapspi_dispatch(bus, message);
+}
+
+// Send a message to the device behind mux output dev_id on the default
+// gapspi bus. This is for drivers that address the mux directly; others
+// can sit on the output's own SPI controller instead.
 int gap_spi_async(struct spi_message * message, int dev_id)
 {
-	// Save the device id (which CS line to use) in the state
-	// variable of the message.
-	message->state = (void*) dev_id;
-	return spi_async(gapspi_spi_device, message);
+	struct gapspi_bus *bus = READ_ONCE(gapspi_default);
+
+	if (bus == NULL) {
+		return -ENODEV;
+	}
+	if (dev_id < 0 || dev_id >= bus->num_targets) {
+		return -EINVAL;
+	}
+
+	message->spi = bus->spi;
+	return gapspi_queue(bus, message, dev_id);
+}
+
+static void gapspi_sync_complete(void *arg)
+{
+	complete(arg);
 }
 
 int gap_spi_sync(struct spi_message * message, int dev_id)
 {
-	message->state = (void*) dev_id;
-	return spi_sync(gapspi_spi_device, message);
+	DECLARE_COMPLETION_ONSTACK(done);
+	int err;
+
+	message->complete = gapspi_sync_complete;
+	message->context = &done;
+
+	err = gap_spi_async(message, dev_id);
+	if (err) {
+		return err;
+	}
+	wait_for_completion(&done);
+
+	return message->status;
+}
+
+// Set how the device behind mux output dev_id shares the bus. Higher
+// priority devices are served first; a device with latency_us set is served
+// within roughly that long of a message becoming ready, whatever its
+// priority.
+static int gapspi_set_priority(struct gapspi_bus *bus, int dev_id,
+                               int priority, unsigned int latency_us)
+{
+	unsigned long flags;
+
+	if (dev_id < 0 || dev_id >= bus->num_targets) {
+		return -EINVAL;
+	}
+
+	spin_lock_irqsave(&bus->lock, flags);
+	bus->targets[dev_id].priority = priority;
+	bus->targets[dev_id].latency_ns = (u64) latency_us * NSEC_PER_USEC;
+	spin_unlock_irqrestore(&bus->lock, flags);
+
+	return 0;
+}
+
+// The same for the default bus.
+int gap_spi_set_priority(int dev_id, int priority, unsigned int latency_us)
+{
+	struct gapspi_bus *bus = READ_ONCE(gapspi_default);
+
+	if (bus == NULL) {
+		return -ENODEV;
+	}
+	return gapspi_set_priority(bus, dev_id, priority, latency_us);
+}
+
+static bool gapspi_idle(struct gapspi_bus *bus)
+{
+	unsigned long flags;
+	bool idle;
+
+	spin_lock_irqsave(&bus->lock, flags);
+	idle = bus->inflight == 0;
+	spin_unlock_irqrestore(&bus->lock, flags);
+
+	return idle;
+}
+
+// Fail everything still queued, used when the SPI device goes away.
+static void gapspi_flush(struct gapspi_bus *bus)
+{
+	struct spi_message *msg;
+	unsigned long flags;
+	int i;
+
+	for (i=0; i<bus->num_targets; i++) {
+		while (1) {
+			spin_lock_irqsave(&bus->lock, flags);
+			msg = list_first_entry_or_null(&bus->targets[i].queue,
+			                               struct spi_message, queue);
+			if (msg) {
+				list_del_init(&msg->queue);
+			}
+			spin_unlock_irqrestore(&bus->lock, flags);
+
+			if (msg == NULL) {
+				break;
+			}
+			msg->status = -ESHUTDOWN;
+			if (msg->complete) {
+				msg->complete(msg->context);
+			}
+		}
+	}
 }
 
 EXPORT_SYMBOL(gap_spi_async);
 EXPORT_SYMBOL(gap_spi_sync);
+EXPORT_SYMBOL(gap_spi_set_priority);
 
 /////////////////////
-// SPI
+// debugfs
+/////////////////////
+
+// One line per mux output and a total, plus how much of the time since the
+// stats were cleared the controller was busy. Writing anything clears them.
+static int gapspi_stats_show(struct seq_file *m, void *v)
+{
+	struct gapspi_bus *bus = m->private;
+	struct gapspi_stats stats[GAPSPI_MAX_TARGETS];
+	struct gapspi_stats total;
+	unsigned long flags;
+	u64 elapsed, permille;
+	int i;
+
+	spin_lock_irqsave(&bus->lock, flags);
+	for (i=0; i<bus->num_targets; i++) {
+		stats[i] = bus->targets[i].stats;
+	}
+	elapsed = ktime_get_ns() - bus->stats_since_ns;
+	spin_unlock_irqrestore(&bus->lock, flags);
+
+	memset(&total, 0, sizeof(total));
+	seq_printf(m, "%-6s %10s %12s %8s %12s %12s %10s\n", "output",
+	           "messages", "bytes", "errors", "busy_us", "wait_us", "switches");
+	for (i=0; i<bus->num_targets; i++) {
+		seq_printf(m, "%-6d %10llu %12llu %8llu %12llu %12llu %10llu\n", i,
+		           stats[i].messages, stats[i].bytes, stats[i].errors,
+		           div_u64(stats[i].busy_ns, NSEC_PER_USEC),
+		           div_u64(stats[i].wait_ns, NSEC_PER_USEC),
+		           stats[i].switches);
+		total.messages += stats[i].messages;
+		total.bytes += stats[i].bytes;
+		total.errors += stats[i].errors;
+		total.busy_ns += stats[i].busy_ns;
+		total.wait_ns += stats[i].wait_ns;
+		total.switches += stats[i].switches;
+	}
+	seq_printf(m, "%-6s %10llu %12llu %8llu %12llu %12llu %10llu\n", "total",
+	           total.messages, total.bytes, total.errors,
+	           div_u64(total.busy_ns, NSEC_PER_USEC),
+	           div_u64(total.wait_ns, NSEC_PER_USEC),
+	           total.switches);
+	permille = div64_u64(total.busy_ns, max_t(u64, div_u64(elapsed, 1000), 1));
+	seq_printf(m, "busy %llu.%llu%% of %llu ms\n", permille / 10, permille % 10,
+	           div_u64(elapsed, NSEC_PER_MSEC));
+
+	return 0;
+}
+
+static int gapspi_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, gapspi_stats_show, inode->i_private);
+}
+
+static ssize_t gapspi_stats_write(struct file *file, const char __user *buf,
+                                  size_t count, loff_t *ppos)
+{
+	struct gapspi_bus *bus = ((struct seq_file *) file->private_data)->private;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&bus->lock, flags);
+	for (i=0; i<GAPSPI_MAX_TARGETS; i++) {
+		memset(&bus->targets[i].stats, 0, sizeof(struct gapspi_stats));
+	}
+	bus->stats_since_ns = ktime_get_ns();
+	spin_unlock_irqrestore(&bus->lock, flags);
+
+	return count;
+}
+
+static const struct file_operations gapspi_stats_fops = {
+	.owner   = THIS_MODULE,
+	.open    = gapspi_stats_open,
+	.read    = seq_read,
+	.write   = gapspi_stats_write,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+// /sys/kernel/debug/gapspi/<spi device>/stats. Must hold gapspi_default_lock.
+static void gapspi_debugfs_add(struct gapspi_bus *bus)
+{
+	if (gapspi_num_buses++ == 0) {
+		gapspi_debugfs_root = debugfs_create_dir(gapspi_name, NULL);
+	}
+	bus->debugfs = debugfs_create_dir(dev_name(&bus->spi->dev), gapspi_debugfs_root);
+	debugfs_create_file("stats", 0644, bus->debugfs, bus, &gapspi_stats_fops);
+}
+
+static void gapspi_debugfs_remove(struct gapspi_bus *bus)
+{
+	debugfs_remove_recursive(bus->debugfs);
+	bus->debugfs = NULL;
+	if (--gapspi_num_buses == 0) {
+		debugfs_remove_recursive(gapspi_debugfs_root);
+		gapspi_debugfs_root = NULL;
+	}
+}
+
+/////////////////////
+// Mux outputs
 /////////////////////
 
-// Intercept the "transfer message" function to allow for
-// setting the CS MUX before the message goes out.
-int (*real_transfer_one_message)(struct spi_master *master,
-                                 struct spi_message *mesg);
+// Each mux output is a SPI controller of its own with one chip select, so
+// any SPI device driver can be bound behind it from the device tree. Its
+// messages are sent on the real controller by the scheduler above.
 
-int our_transfer_one_message (struct spi_master *master,
-                               struct spi_message *mesg) {
-	int cs_device_id;
+static int gapspi_output_setup(struct spi_device *spi)
+{
+	struct gapspi_output *out = spi_controller_get_devdata(spi->controller);
+	struct gapspi_bus *bus = out->bus;
+	unsigned long flags;
 
-	// Sse the stored value in mesg to set the mux
-	cs_device_id = (int) (mesg->state);
-	gapspi_cs_mux(cs_device_id);
+	spin_lock_irqsave(&bus->lock, flags);
+	bus->targets[out->id].mode = spi->mode & GAPSPI_MODE_BITS;
+	spin_unlock_irqrestore(&bus->lock, flags);
 
-	return real_transfer_one_message(master, mesg);
+	return 0;
 }
 
+static int gapspi_output_transfer(struct spi_device *spi, struct spi_message *message)
+{
+	struct gapspi_output *out = spi_controller_get_devdata(spi->controller);
+
+	return gapspi_queue(out->bus, message, out->id);
+}
+
+// The device tree node describing output id, if there is one: a child of
+// the gapspi node with reg = <id>.
+static struct device_node *gapspi_output_node(struct gapspi_bus *bus, int id)
+{
+	struct device_node *np = bus->spi->dev.of_node;
+	struct device_node *nc;
+	u32 reg;
+
+	if (np == NULL) {
+		return NULL;
+	}
+	for_each_available_child_of_node(np, nc) {
+		if (of_property_read_u32(nc, "reg", &reg) == 0 && reg == id) {
+			// The node lives as long as its parent, which outlives us.
+			of_node_put(nc);
+			return nc;
+		}
+	}
+	return NULL;
+}
+
+static int gapspi_add_output(struct gapspi_bus *bus, int id)
+{
+	struct spi_controller *real = bus->spi->controller;
+	struct spi_controller *ctlr;
+	struct gapspi_output *out;
+	int err;
+
+	ctlr = spi_alloc_master(&bus->spi->dev, sizeof(struct gapspi_output));
+	if (ctlr == NULL) {
+		return -ENOMEM;
+	}
+	out = spi_controller_get_devdata(ctlr);
+	out->bus = bus;
+	out->id = id;
+
+	ctlr->bus_num = -1;
+	ctlr->num_chipselect = 1;
+	ctlr->mode_bits = real->mode_bits;
+	ctlr->bits_per_word_mask = real->bits_per_word_mask;
+	ctlr->min_speed_hz = real->min_speed_hz;
+	ctlr->max_speed_hz = real->max_speed_hz;
+	ctlr->setup = gapspi_output_setup;
+	ctlr->transfer = gapspi_output_transfer;
+	ctlr->dev.of_node = gapspi_output_node(bus, id);
+
+	err = spi_register_controller(ctlr);
+	if (err) {
+		spi_controller_put(ctlr);
+		return err;
+	}
+	bus->targets[id].ctlr = ctlr;
+
+	INFO(KERN_INFO, "Mux output %i is SPI bus %i\n", id, ctlr->bus_num);
+
+	return 0;
+}
+
+static void gapspi_remove_outputs(struct gapspi_bus *bus)
+{
+	int i;
+
+	for (i=0; i<bus->num_targets; i++) {
+		if (bus->targets[i].ctlr) {
+			spi_unregister_controller(bus->targets[i].ctlr);
+			bus->targets[i].ctlr = NULL;
+		}
+	}
+}
+
+// Start sharing the bus: register the outputs and, if this is the first
+// gapspi, make it the one gap_spi_async() uses.
+static int gapspi_bus_start(struct gapspi_bus *bus)
+{
+	int i;
+	int err;
+
+	spi_set_drvdata(bus->spi, bus);
+
+	for (i=0; i<bus->num_targets; i++) {
+		err = gapspi_add_output(bus, i);
+		if (err) {
+			ERR(KERN_ALERT, "Could not register mux output %i: %i\n", i, err);
+			gapspi_remove_outputs(bus);
+			return err;
+		}
+	}
+
+	mutex_lock(&gapspi_default_lock);
+	if (gapspi_default == NULL) {
+		WRITE_ONCE(gapspi_default, bus);
+	}
+	gapspi_debugfs_add(bus);
+	mutex_unlock(&gapspi_default_lock);
+
+	return 0;
+}
+
+static void gapspi_bus_stop(struct gapspi_bus *bus)
+{
+	mutex_lock(&gapspi_default_lock);
+	if (gapspi_default == bus) {
+		WRITE_ONCE(gapspi_default, NULL);
+	}
+	gapspi_debugfs_remove(bus);
+	mutex_unlock(&gapspi_default_lock);
+
+	// Devices on the outputs are unbound first, then whatever is left in
+	// the queues is failed.
+	gapspi_remove_outputs(bus);
+	cancel_work_sync(&bus->switch_work);
+	gapspi_flush(bus);
+	wait_event(bus->idle_queue, gapspi_idle(bus));
+	flush_work(&bus->fail_work);
+}
+
+/////////////////////
+// SPI
+/////////////////////
+
 static int gapspi_spi_probe(struct spi_device *spi_device)
 {
 	struct device_node *np = spi_device->dev.of_node;
+	struct gapspi_bus *bus;
 	const __be32 *prop;
+	int num_pins;
 	int i;
 	int err;
 
@@ -102,40 +861,54 @@ static int gapspi_spi_probe(struct spi_device *spi_device)
 		ERR(KERN_ALERT, "Got NULL for the number of CS pins.\n");
 		return -EINVAL;
 	}
-	num_demux_ctrl_pins = be32_to_cpup(prop);
-	INFO(KERN_INFO, "Number of DEMUX ctrl pins %i\n", num_demux_ctrl_pins);
+	num_pins = be32_to_cpup(prop);
+	INFO(KERN_INFO, "Number of DEMUX ctrl pins %i\n", num_pins);
+	if (num_pins > GAPSPI_MAX_PINS) {
+		ERR(KERN_ALERT, "At most %i CS pins are supported.\n", GAPSPI_MAX_PINS);
+		return -EINVAL;
+	}
+
+	bus = devm_kzalloc(&spi_device->dev, sizeof(struct gapspi_bus), GFP_KERNEL);
+	if (bus == NULL) {
+		return -ENOMEM;
+	}
+	gapspi_bus_init(bus, spi_device, num_pins);
 
-	for (i=0; i<num_demux_ctrl_pins; i++) {
+	for (i=0; i<num_pins; i++) {
 		char buf[64];
 
 		snprintf(buf, 64, "csmux%i-gpio", i);
-		demux_ctrl_pins[i] = of_get_named_gpio(np, buf, 0);
+		bus->pins[i] = of_get_named_gpio(np, buf, 0);
 
-		if (!gpio_is_valid(demux_ctrl_pins[i])) {
+		if (!gpio_is_valid(bus->pins[i])) {
 			ERR(KERN_ALERT, "gpio csmux%i is not valid\n", i);
 			return -EINVAL;
 		}
-		err = devm_gpio_request_one(&spi_device->dev, demux_ctrl_pins[i], GPIOF_OUT_INIT_LOW, "buf");
+		err = devm_gpio_request_one(&spi_device->dev, bus->pins[i], GPIOF_OUT_INIT_LOW, "buf");
 		if (err) return -EINVAL;
+		bus->descs[i] = gpio_to_desc(bus->pins[i]);
 	}
+	bus->mux = 0;
 
-	// Splice in our transfer one message function so that we can
-	// set the mux before the packet is transfered.
-	real_transfer_one_message = spi_device->master->transfer_one_message;
-	spi_device->master->transfer_one_message = our_transfer_one_message;
+	// Optional bus sharing settings, one entry per mux output
+	for (i=0; i<bus->num_targets; i++) {
+		u32 priority = 0;
+		u32 latency_us = 0;
 
-    gapspi_spi_device = spi_device;
+		of_property_read_u32_index(np, "csmux-priorities", i, &priority);
+		of_property_read_u32_index(np, "csmux-latency-us", i, &latency_us);
+		gapspi_set_priority(bus, i, priority, latency_us);
+	}
 
-    return 0;
+    return gapspi_bus_start(bus);
 }
 
 static int gapspi_spi_remove(struct spi_device *spi_device)
 {
     INFO(KERN_INFO, "Removing SPI protocol driver.");
 
-	spi_device->master->transfer_one_message = real_transfer_one_message;
+	gapspi_bus_stop(spi_get_drvdata(spi_device));
 
-    gapspi_spi_device = NULL;
     return 0;
 }
 
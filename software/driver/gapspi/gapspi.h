@@ -1,7 +1,20 @@
 #ifndef _GAPSPI_H_
 #define _GAPSPI_H_
 
+// Up to three mux select pins, so eight devices share the SPI master.
+#define GAPSPI_MAX_PINS    3
+#define GAPSPI_MAX_TARGETS (1 << GAPSPI_MAX_PINS)
+
+// Messages handed to the SPI master at once. More are queued in gapspi so
+// they can be reordered to save mux switches.
+#define GAPSPI_DEPTH 2
+
+// Messages one device may send in a row while others of the same priority
+// are waiting.
+#define GAPSPI_MAX_BURST 8
+
 extern int gap_spi_async(struct spi_message * message, int dev_id);
 extern int gap_spi_sync(struct spi_message * message, int dev_id);
+extern int gap_spi_set_priority(int dev_id, int priority, unsigned int latency_us);
 
 #endif
\ No newline at end of file
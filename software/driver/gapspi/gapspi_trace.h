@@ -0,0 +1,81 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM gapspi
+
+#if !defined(_GAPSPI_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _GAPSPI_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+// Tracepoints on the shared bus. Enable them with
+//   echo 1 > /sys/kernel/debug/tracing/events/gapspi/enable
+// bus is the SPI bus number of the real controller, output the mux output.
+
+// A message was handed to the real controller after waiting wait_ns at the
+// head of its output's queue.
+TRACE_EVENT(gapspi_message_start,
+	TP_PROTO(int bus, int output, unsigned int len, u64 wait_ns),
+	TP_ARGS(bus, output, len, wait_ns),
+	TP_STRUCT__entry(
+		__field(int, bus)
+		__field(int, output)
+		__field(unsigned int, len)
+		__field(u64, wait_ns)
+	),
+	TP_fast_assign(
+		__entry->bus = bus;
+		__entry->output = output;
+		__entry->len = len;
+		__entry->wait_ns = wait_ns;
+	),
+	TP_printk("bus=%d output=%d len=%u wait_ns=%llu",
+	          __entry->bus, __entry->output, __entry->len,
+	          (unsigned long long) __entry->wait_ns)
+);
+
+// The message finished after occupying the bus for busy_ns.
+TRACE_EVENT(gapspi_message_end,
+	TP_PROTO(int bus, int output, unsigned int len, int status, u64 busy_ns),
+	TP_ARGS(bus, output, len, status, busy_ns),
+	TP_STRUCT__entry(
+		__field(int, bus)
+		__field(int, output)
+		__field(unsigned int, len)
+		__field(int, status)
+		__field(u64, busy_ns)
+	),
+	TP_fast_assign(
+		__entry->bus = bus;
+		__entry->output = output;
+		__entry->len = len;
+		__entry->status = status;
+		__entry->busy_ns = busy_ns;
+	),
+	TP_printk("bus=%d output=%d len=%u status=%d busy_ns=%llu",
+	          __entry->bus, __entry->output, __entry->len, __entry->status,
+	          (unsigned long long) __entry->busy_ns)
+);
+
+// The mux was switched between outputs.
+TRACE_EVENT(gapspi_mux_switch,
+	TP_PROTO(int bus, int from, int to),
+	TP_ARGS(bus, from, to),
+	TP_STRUCT__entry(
+		__field(int, bus)
+		__field(int, from)
+		__field(int, to)
+	),
+	TP_fast_assign(
+		__entry->bus = bus;
+		__entry->from = from;
+		__entry->to = to;
+	),
+	TP_printk("bus=%d from=%d to=%d", __entry->bus, __entry->from, __entry->to)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE gapspi_trace
+#include <trace/define_trace.h>
@@ -5,6 +5,19 @@
 #define BCP_COMMAND_READ_IRQ                  1  // Read whatever caused the interrupt we received.
 #define BCP_COMMAND_SNIFF_ADVERTISEMENTS      2  // Tell the nRF51822 to send us all received advertisements.
 #define BCP_COMMAND_SNIFF_ADVERTISEMENTS_STOP 3  // Stop sending advertisements packets.
+#define BCP_COMMAND_RESEND                    4  // Send the frame with the sequence number in the next byte again.
+#define BCP_COMMAND_BENCHMARK                 5  // Generate synthetic advertisements, see software/nrf51822/bcp_benchmark.h.
+
+// Response types in the second byte of every frame from the nRF51822
+#define BCP_RSP_NONE          0  // Nothing was queued when we read
+#define BCP_RSP_ADVERTISEMENT 1  // Raw advertisement content
+#define BCP_RSP_LOST          2  // A frame asked for again is gone
+
+// Frames from newer firmware are [len][type | BCP_RSP_CHECKED][seq][payload]
+// [crc lo][crc hi], with a CRC-16/CCITT-FALSE over len through the payload.
+// Older firmware sends [len][type][payload].
+#define BCP_RSP_CHECKED    0x80
+#define BCP_FRAME_OVERHEAD 4  // type, seq and the CRC
 
 
 
@@ -13,9 +13,13 @@
 #define DEBUG_PRINT_DBG 3
 
 
+// Set with the debug_print module parameter or the
+// NRF51822_IOCTL_SET_DEBUG_VERBOSITY ioctl.
+extern int nrf51822_debug_print;
+
 // Define the printk macros.
-#define ERR(tag, ...)  do {if (config.debug_print >= DEBUG_PRINT_ERR)  { printk(tag "[nrf51822] " __VA_ARGS__); }} while (0)
-#define INFO(tag, ...) do {if (config.debug_print >= DEBUG_PRINT_INFO) { printk(tag "[nrf51822] " __VA_ARGS__); }} while (0)
-#define DBG(tag, ...)  do {if (config.debug_print >= DEBUG_PRINT_DBG)  { printk(tag "[nrf51822] " __VA_ARGS__); }} while (0)
+#define ERR(tag, ...)  do {if (READ_ONCE(nrf51822_debug_print) >= DEBUG_PRINT_ERR)  { printk(tag "[nrf51822] " __VA_ARGS__); }} while (0)
+#define INFO(tag, ...) do {if (READ_ONCE(nrf51822_debug_print) >= DEBUG_PRINT_INFO) { printk(tag "[nrf51822] " __VA_ARGS__); }} while (0)
+#define DBG(tag, ...)  do {if (READ_ONCE(nrf51822_debug_print) >= DEBUG_PRINT_DBG)  { printk(tag "[nrf51822] " __VA_ARGS__); }} while (0)
 
 #endif
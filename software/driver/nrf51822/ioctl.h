@@ -12,6 +12,7 @@ typedef uint8_t u8;
 typedef uint16_t u16;
 typedef uint32_t u32;
 typedef uint64_t u64;
+typedef int32_t s32;
 #endif
 
 struct nrf51822_set_debug_verbosity_data {
@@ -22,16 +23,108 @@ struct nrf51822_simple_command {
 	u8 command;
 };
 
+// Longest command that can be queued, including the command byte.
+#define NRF51822_CMD_MAX_LEN 32
+// Longest frame that can be returned on the response channel.
+#define NRF51822_RSP_MAX_LEN 64
+
+// Queue a multi-byte command. seq is filled in by the driver and is echoed
+// back in the matching nrf51822_response.
+struct nrf51822_command {
+	u32 seq;
+	u8 len;
+	u8 data[NRF51822_CMD_MAX_LEN];
+};
+
+// One entry on the response channel. Every queued command produces one of
+// these once it has been clocked out (seq != 0, status is the SPI result).
+// Frames from the nRF51822 that are not advertisements are also returned
+// here with seq == 0.
+struct nrf51822_response {
+	u32 seq;
+	s32 status;
+	u8 command;
+	u8 len;
+	u8 data[NRF51822_RSP_MAX_LEN];
+};
+
+// Per open file counters. dropped counts records this reader missed because
+// it fell more than a ring's worth behind the radio.
+struct nrf51822_reader_stats {
+	u64 delivered;
+	u64 dropped;
+	u64 filtered;
+};
+
+#define NRF51822_FILTER_MAX_RULES 8
+#define NRF51822_FILTER_MAX_LEN   16
+
+// Compare the field as a little-endian number. BLE addresses and company IDs
+// are sent least significant byte first.
+#define NRF51822_FILTER_F_LE 0x01
+
+// A rule matches when lo <= (field & mask) <= hi, where field is the len
+// bytes at offset in the record as returned by read() and the comparison is
+// done as an unsigned number. Set lo == hi for an exact match.
+struct nrf51822_filter_rule {
+	u8 offset;
+	u8 len;
+	u8 flags;
+	u8 mask[NRF51822_FILTER_MAX_LEN];
+	u8 lo[NRF51822_FILTER_MAX_LEN];
+	u8 hi[NRF51822_FILTER_MAX_LEN];
+};
+
+// Records are queued for a reader only if they match at least one rule.
+// num_rules == 0 removes the filter.
+struct nrf51822_filter {
+	u8 num_rules;
+	struct nrf51822_filter_rule rules[NRF51822_FILTER_MAX_RULES];
+};
+
+// Prefix every record returned by read() with a nrf51822_record_header.
+#define NRF51822_READ_F_HEADER 0x01
+
+struct nrf51822_read_flags {
+	u32 flags;
+};
+
+// Times are CLOCK_MONOTONIC nanoseconds, so they can be compared directly
+// with clock_gettime(CLOCK_MONOTONIC) in userspace.
+struct nrf51822_record_header {
+	u64 irq_ns;  // when the interrupt that brought the record in fired
+	u64 rx_ns;   // when the SPI transfer carrying it completed
+	u64 seq;     // position of the record in the radio's ring
+	u16 len;     // number of record bytes following this header
+	u16 lost;    // records the radio lost since the previous record
+	u16 reserved[2];
+};
+
 //#define CC2520_IO_RADIO_INIT _IO(BASE, 0)
 #define NRF51822_IOCTL_SET_DEBUG_VERBOSITY _IOW(BASE, 0, struct nrf51822_set_debug_verbosity_data)
 #define NRF51822_IOCTL_SIMPLE_COMMAND      _IOW(BASE, 1, struct nrf51822_simple_command)
+#define NRF51822_IOCTL_COMMAND             _IOWR(BASE, 2, struct nrf51822_command)
+#define NRF51822_IOCTL_READ_RESPONSE       _IOR(BASE, 3, struct nrf51822_response)
+#define NRF51822_IOCTL_GET_READER_STATS    _IOR(BASE, 4, struct nrf51822_reader_stats)
+#define NRF51822_IOCTL_SET_FILTER          _IOW(BASE, 5, struct nrf51822_filter)
+#define NRF51822_IOCTL_SET_READ_FLAGS      _IOW(BASE, 6, struct nrf51822_read_flags)
 
 
+#ifdef __KERNEL__
+struct nrf51822_dev;
+struct nrf51822_reader;
+
 static int nrf51822_ioctl_set_debug_verbosity(struct nrf51822_set_debug_verbosity_data *data);
 static int nrf51822_ioctl_simple_command(struct nrf51822_simple_command *data, struct nrf51822_dev *dev);
+static int nrf51822_ioctl_command(struct nrf51822_command *data, struct nrf51822_dev *dev);
+static int nrf51822_ioctl_read_response(struct nrf51822_response *data, struct nrf51822_dev *dev, bool nonblock);
+static int nrf51822_ioctl_get_reader_stats(struct nrf51822_reader_stats *data, struct nrf51822_reader *reader);
+static int nrf51822_ioctl_set_filter(struct nrf51822_filter *data, struct nrf51822_reader *reader);
+static int nrf51822_ioctl_set_read_flags(struct nrf51822_read_flags *data, struct nrf51822_reader *reader);
 
 static long nrf51822_ioctl(struct file *file,
                            unsigned int ioctl_num,
                            unsigned long ioctl_param);
+#endif
 
 #endif
\ No newline at end of file
@@ -15,6 +15,9 @@
 #include <linux/poll.h>
 #include <linux/of_gpio.h>
 #include <linux/platform_device.h>
+#include <linux/dma-mapping.h>
+#include <linux/math64.h>
+#include <linux/crc-itu-t.h>
 
 #include "../gapspi/gapspi.h"
 
@@ -23,47 +26,155 @@
 #include "ioctl.h"
 #include "debug.h"
 
+#define CREATE_TRACE_POINTS
+#include "nrf51822_trace.h"
+
 #define DRIVER_AUTHOR  "Brad Campbell <bradjc@umich.edu>"
 #define DRIVER_DESC    "A driver for the nRF51822 BLE chip over SPI."
 #define DRIVER_VERSION "0.2"
 
 const char nrf51822_name[] = "nRF51822";
-struct nrf51822_config config;
 
-// Not implemented currently
+// Defines the level of debug output for all radios
+int nrf51822_debug_print = DEBUG_PRINT_ERR;
+module_param_named(debug_print, nrf51822_debug_print, int, 0644);
+MODULE_PARM_DESC(debug_print, "0 off, 1 errors, 2 info, 3 debug");
+
+// Find the fastest SPI clock each radio works at when the driver loads.
+static bool calibrate_spi = false;
+module_param(calibrate_spi, bool, 0444);
+MODULE_PARM_DESC(calibrate_spi, "find the fastest reliable SPI clock and CS setup for each radio at load");
+
+// A radio told to sniff that has not produced a good frame for this long is
+// read once to see if it still answers, and reset only if it does not.
+// Quiet air alone never resets a radio.
+static unsigned int watchdog_idle_ms = 10000;
+module_param(watchdog_idle_ms, uint, 0644);
+MODULE_PARM_DESC(watchdog_idle_ms, "check a sniffing radio that has sent nothing for this long, 0 to disable");
+
+// Called by the write() command from user space. The buffer holds one or
+// more commands, each encoded as a length byte followed by that many command
+// bytes. Every command is queued in order and sent as soon as the SPI bus is
+// free. Returns the number of bytes consumed.
 static ssize_t nrf51822_write(struct file *filp,
-                               const char *in_buf,
+                               const char __user *in_buf,
                                size_t len,
                                loff_t * off)
 {
-		return -EFAULT;
+	struct nrf51822_reader *reader = filp->private_data;
+	struct nrf51822_dev *dev = reader->dev;
+	bool nonblock = filp->f_flags & O_NONBLOCK;
+	u8 cmd[NRF51822_CMD_MAX_LEN];
+	size_t consumed = 0;
+	u8 cmd_len;
+	int result;
+
+	while (consumed < len) {
+		if (get_user(cmd_len, in_buf+consumed)) {
+			return -EFAULT;
+		}
+		if (cmd_len == 0 || cmd_len > NRF51822_CMD_MAX_LEN ||
+		    consumed+1+cmd_len > len) {
+			// Malformed or truncated command. Report what was queued.
+			break;
+		}
+		if (copy_from_user(cmd, in_buf+consumed+1, cmd_len)) {
+			return -EFAULT;
+		}
+
+		result = nrf51822_queue_command(dev, cmd, cmd_len, nonblock);
+		if (result < 0) {
+			// Out of room (or interrupted). Tell the caller about the
+			// commands we did take, if any.
+			return (consumed > 0) ? consumed : result;
+		}
+
+		consumed += 1+cmd_len;
+	}
+
+	return (consumed > 0) ? consumed : -EINVAL;
 }
 
-// Called by the read() command from user space
+// Called by the read() command from user space. Each open file has its own
+// cursor into the radio's record ring, so every reader sees every record
+// unless it falls too far behind.
 static ssize_t nrf51822_read(struct file *filp,
                               char __user *buf,
                               size_t count,
                               loff_t *offp)
 {
-	int result;
+	struct nrf51822_reader *reader = filp->private_data;
+	struct nrf51822_dev *dev = reader->dev;
+	struct nrf51822_record rec;
+	struct nrf51822_record_header hdr;
+	unsigned long flags;
+	bool got;
+	u64 seq = 0;
 	int user_len;
-	struct nrf51822_dev *dev = filp->private_data;
+	int hdr_len = 0;
+
+	if (reader->flags & NRF51822_READ_F_HEADER) {
+		hdr_len = sizeof(struct nrf51822_record_header);
+		if (count < hdr_len) {
+			return -EINVAL;
+		}
+	}
 
-	// Wait for data to be ready to send to the user.
-	wait_event_interruptible(dev->to_user_queue, (dev->buf_to_user_len > 0));
+	while (1) {
+		spin_lock_irqsave(&dev->ring_lock, flags);
+		got = reader->pending > 0;
+		if (got) {
+			// Skip records this reader's filter rejected.
+			while (!(dev->ring[reader->tail & (NRF51822_RING_LEN-1)].readers & BIT_ULL(reader->slot))) {
+				reader->tail++;
+			}
+
+			// Copy out while holding the lock so the producer cannot
+			// overwrite the slot under us.
+			rec = dev->ring[reader->tail & (NRF51822_RING_LEN-1)];
+			seq = reader->tail;
+			reader->tail++;
+			reader->pending--;
+			reader->delivered++;
+			atomic64_inc(&dev->stats.records_delivered);
+		}
+		spin_unlock_irqrestore(&dev->ring_lock, flags);
 
-	// Copy the result from the nRF51822 to the user
-	result  = copy_to_user(buf, dev->buf_to_user, dev->buf_to_user_len);
-	if (result) {
-		return -EFAULT;
+		if (got) {
+			break;
+		}
+		if (filp->f_flags & O_NONBLOCK) {
+			return -EAGAIN;
+		}
+
+		// Wait for data to be ready to send to the user.
+		if (wait_event_interruptible(reader->queue, nrf51822_reader_pending(reader))) {
+			return -ERESTARTSYS;
+		}
 	}
 
-	user_len = dev->buf_to_user_len;
+	trace_nrf51822_record_dequeue(dev->id, reader->slot, seq, ktime_get_ns() - rec.irq_ns);
+
+	// Copy the result from the nRF51822 to the user
+	user_len = min_t(size_t, rec.len, count - hdr_len);
+
+	if (hdr_len) {
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.irq_ns = rec.irq_ns;
+		hdr.rx_ns = rec.rx_ns;
+		hdr.seq = seq;
+		hdr.len = user_len;
+		hdr.lost = rec.lost;
+		if (copy_to_user(buf, &hdr, hdr_len)) {
+			return -EFAULT;
+		}
+	}
 
-	// Reset the buffer length so the user_queue wait doesn't trigger
-	dev->buf_to_user_len = 0;
+	if (copy_to_user(buf + hdr_len, rec.data, user_len)) {
+		return -EFAULT;
+	}
 
-	return user_len;
+	return hdr_len + user_len;
 }
 
 static long nrf51822_ioctl(struct file *file,
@@ -71,7 +182,8 @@ static long nrf51822_ioctl(struct file *file,
 							unsigned long ioctl_param)
 {
 	int result;
-	struct nrf51822_dev *dev = file->private_data;
+	struct nrf51822_reader *reader = file->private_data;
+	struct nrf51822_dev *dev = reader->dev;
 
 	switch (ioctl_num) {
 		case NRF51822_IOCTL_SET_DEBUG_VERBOSITY:
@@ -80,6 +192,22 @@ static long nrf51822_ioctl(struct file *file,
 		case NRF51822_IOCTL_SIMPLE_COMMAND:
 			result = nrf51822_ioctl_simple_command((struct nrf51822_simple_command*) ioctl_param, dev);
 			break;
+		case NRF51822_IOCTL_COMMAND:
+			result = nrf51822_ioctl_command((struct nrf51822_command*) ioctl_param, dev);
+			break;
+		case NRF51822_IOCTL_READ_RESPONSE:
+			result = nrf51822_ioctl_read_response((struct nrf51822_response*) ioctl_param, dev,
+			                                      file->f_flags & O_NONBLOCK);
+			break;
+		case NRF51822_IOCTL_GET_READER_STATS:
+			result = nrf51822_ioctl_get_reader_stats((struct nrf51822_reader_stats*) ioctl_param, reader);
+			break;
+		case NRF51822_IOCTL_SET_FILTER:
+			result = nrf51822_ioctl_set_filter((struct nrf51822_filter*) ioctl_param, reader);
+			break;
+		case NRF51822_IOCTL_SET_READ_FLAGS:
+			result = nrf51822_ioctl_set_read_flags((struct nrf51822_read_flags*) ioctl_param, reader);
+			break;
 		default:
 			result = -ENOTTY;
 	}
@@ -90,37 +218,91 @@ static long nrf51822_ioctl(struct file *file,
 static unsigned int nrf51822_poll (struct file *file, poll_table *wait)
 {
 	unsigned int mask = 0;
-	struct nrf51822_dev *dev = file->private_data;
+	struct nrf51822_reader *reader = file->private_data;
+	struct nrf51822_dev *dev = reader->dev;
 
-	poll_wait(file, &dev->to_user_queue, wait);
+	poll_wait(file, &reader->queue, wait);
+	poll_wait(file, &dev->cmd_space_queue, wait);
+	poll_wait(file, &dev->rsp_queue, wait);
 
-	// always writable
-	mask |= POLLOUT | POLLWRNORM;
+	if (!kfifo_is_full(&dev->cmd_fifo)) {
+		// writable
+		mask |= POLLOUT | POLLWRNORM;
+	}
 
-	if (dev->buf_to_user_len > 0) {
+	if (nrf51822_reader_pending(reader)) {
 		// readable
 		mask |= POLLIN | POLLRDNORM;
 	}
 
+	if (!kfifo_is_empty(&dev->rsp_fifo)) {
+		// something on the response channel
+		mask |= POLLPRI;
+	}
+
 	return mask;
 }
 
+// Every open file gets its own reader. It starts at the head of the ring so
+// it only sees records that arrive after the open.
 static int nrf51822_open(struct inode *inode, struct file *filp)
 {
 	struct nrf51822_dev *dev;
+	struct nrf51822_reader *reader;
+	unsigned long flags;
+
 	dev = container_of(inode->i_cdev, struct nrf51822_dev, cdev);
-	filp->private_data = dev;
+
+	reader = kzalloc(sizeof(struct nrf51822_reader), GFP_KERNEL);
+	if (reader == NULL) {
+		return -ENOMEM;
+	}
+	reader->dev = dev;
+	init_waitqueue_head(&reader->queue);
+
+	spin_lock_irqsave(&dev->ring_lock, flags);
+	reader->slot = find_first_zero_bit(dev->reader_slots, NRF51822_MAX_READERS);
+	if (reader->slot >= NRF51822_MAX_READERS) {
+		spin_unlock_irqrestore(&dev->ring_lock, flags);
+		kfree(reader);
+		return -EBUSY;
+	}
+	__set_bit(reader->slot, dev->reader_slots);
+	reader->tail = dev->ring_head;
+	list_add_tail(&reader->list, &dev->readers);
+	spin_unlock_irqrestore(&dev->ring_lock, flags);
+
+	filp->private_data = reader;
 	DBG(KERN_INFO, "opening radio%d.\n", dev->id);
 
 	return 0;
 }
 
+static int nrf51822_release(struct inode *inode, struct file *filp)
+{
+	struct nrf51822_reader *reader = filp->private_data;
+	struct nrf51822_dev *dev = reader->dev;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->ring_lock, flags);
+	list_del(&reader->list);
+	__clear_bit(reader->slot, dev->reader_slots);
+	spin_unlock_irqrestore(&dev->ring_lock, flags);
+
+	DBG(KERN_INFO, "closing radio%d (delivered %llu, dropped %llu).\n",
+	    dev->id, reader->delivered, reader->dropped);
+
+	kfree(reader);
+
+	return 0;
+}
+
 struct file_operations fops = {
 	.read = nrf51822_read,
 	.write = nrf51822_write,
 	.unlocked_ioctl = nrf51822_ioctl,
 	.open = nrf51822_open,
-	.release = NULL,
+	.release = nrf51822_release,
 	.poll = nrf51822_poll
 };
 
@@ -143,7 +325,7 @@ static int nrf51822_ioctl_set_debug_verbosity(struct nrf51822_set_debug_verbosit
 
 	INFO(KERN_INFO, "setting debug message print: %i", ldata.debug_level);
 
-	config.debug_print = ldata.debug_level;
+	WRITE_ONCE(nrf51822_debug_print, ldata.debug_level);
 
 	return 0;
 }
@@ -166,373 +348,1821 @@ static int nrf51822_ioctl_simple_command(struct nrf51822_simple_command *data, s
 	return nrf51822_issue_simple_command(ldata.command, dev);
 }
 
+// Queue a multi-byte command and tell the caller which sequence number its
+// response will carry.
+static int nrf51822_ioctl_command(struct nrf51822_command *data, struct nrf51822_dev *dev)
+{
+	int result;
+	struct nrf51822_command ldata;
 
-/////////////////////
-// Application logic
-/////////////////////
-
-// Manually check if the interrupt line is high.
-static void nrf51822_check_irq (struct nrf51822_dev *dev) {
-	// Check if we need to read the IRQ again
-	if (gpio_get_value(dev->pin_interrupt) == 1) {
-		// Interrupt is still high.
-		// Read again.
-
-		// Put this delay here so the nRF51822 has time to set the SPI buffer
-		// again.
-		usleep_range(25, 50);
+	result = copy_from_user(&ldata, data, sizeof(struct nrf51822_command));
+	if (result) {
+		return -EFAULT;
+	}
 
-		nrf51822_read_irq(dev);
+	if (ldata.len == 0 || ldata.len > NRF51822_CMD_MAX_LEN) {
+		return -EINVAL;
 	}
-}
 
+	result = nrf51822_queue_command(dev, ldata.data, ldata.len, false);
+	if (result < 0) {
+		return result;
+	}
 
-// The result of the interrupt is in spi_buffer
-static void nrf51822_read_irq_done (void *arg) {
-	struct nrf51822_dev *dev = arg;
-	int len;
+	ldata.seq = result;
+	if (copy_to_user(data, &ldata, sizeof(struct nrf51822_command))) {
+		return -EFAULT;
+	}
 
-	DBG(KERN_INFO, "Got IRQ data from nrf51822\n");
+	return 0;
+}
 
-	// There is an issue where the nRF51822 needs 7.1us between CS and CLK.
-	// We violate that currently, so the first byte may be invalid (0x00).
-	// If the second byte was zero as well, that denotes an error.
-	if (dev->spi_data_buffer[0] == 0 && dev->spi_data_buffer[1] == 0) {
-		// This was an invalid transfer. Some error occurred.
+// Pop the oldest entry off the response channel. Blocks until there is one
+// unless the file was opened O_NONBLOCK.
+static int nrf51822_ioctl_read_response(struct nrf51822_response *data, struct nrf51822_dev *dev, bool nonblock)
+{
+	struct nrf51822_response ldata;
+	unsigned long flags;
+	int got;
 
-		ERR(KERN_INFO, "First two bytes zero. Ignoring response from nRF51822:%i\n", dev->id);
+	while (1) {
+		spin_lock_irqsave(&dev->spi_spin_lock, flags);
+		got = kfifo_get(&dev->rsp_fifo, &ldata);
+		spin_unlock_irqrestore(&dev->spi_spin_lock, flags);
 
-		spin_lock_irqsave(&dev->spi_spin_lock, dev->spi_spin_lock_flags);
-		dev->spi_pending = false;
-		spin_unlock_irqrestore(&dev->spi_spin_lock, dev->spi_spin_lock_flags);
+		if (got) {
+			break;
+		}
+		if (nonblock) {
+			return -EAGAIN;
+		}
+		if (wait_event_interruptible(dev->rsp_queue, !kfifo_is_empty(&dev->rsp_fifo))) {
+			return -ERESTARTSYS;
+		}
+	}
 
-		nrf51822_check_irq(dev);
+	if (copy_to_user(data, &ldata, sizeof(struct nrf51822_response))) {
+		return -EFAULT;
+	}
 
-		return;
+	return 0;
+}
 
-	} else if (dev->spi_data_buffer[0] == 0) {
-		// The first byte was an error. Skip it and use the second byte
-		// as the length.
-		len = dev->spi_data_buffer[1]+1;
 
-		// Move the packet from the SPI buffer to the thing that can be read()
-		memcpy(dev->buf_to_user, dev->spi_data_buffer, len);
-		dev->buf_to_user_len = len;
+// Report how many records this open file has read and how many it lost by
+// falling behind the ring.
+static int nrf51822_ioctl_get_reader_stats(struct nrf51822_reader_stats *data, struct nrf51822_reader *reader)
+{
+	struct nrf51822_reader_stats ldata;
+	unsigned long flags;
 
-	} else {
-		// The first byte was the length
-		len = dev->spi_data_buffer[0]+1;
+	spin_lock_irqsave(&reader->dev->ring_lock, flags);
+	ldata.delivered = reader->delivered;
+	ldata.dropped = reader->dropped;
+	ldata.filtered = reader->filtered;
+	spin_unlock_irqrestore(&reader->dev->ring_lock, flags);
 
-		// Move the packet from the SPI buffer to the thing that can be read()
-		memcpy(dev->buf_to_user, dev->spi_data_buffer, len);
-		dev->buf_to_user_len = len;
+	if (copy_to_user(data, &ldata, sizeof(struct nrf51822_reader_stats))) {
+		return -EFAULT;
 	}
 
-	// Release the lock on the SPI buffer
-	spin_lock_irqsave(&dev->spi_spin_lock, dev->spi_spin_lock_flags);
-	dev->spi_pending = false;
-	spin_unlock_irqrestore(&dev->spi_spin_lock, dev->spi_spin_lock_flags);
-
-	// Notify the read() call that there is data for it.
-	wake_up(&dev->to_user_queue);
-
-	nrf51822_check_irq(dev);
+	return 0;
 }
 
-// Set up the SPI transfer to query the nRF51822 about why it interrupted
-// us.
-static void nrf51822_read_irq(struct nrf51822_dev *dev) {
-
-	// Check if we can get a lock on the SPI rx/tx buffer. If not, ignore
-	// this interrupt.
-	spin_lock_irqsave(&dev->spi_spin_lock, dev->spi_spin_lock_flags);
-	if (dev->spi_pending) {
-		// Something else is using the SPI. Just skip this interrupt.
-		spin_unlock_irqrestore(&dev->spi_spin_lock, dev->spi_spin_lock_flags);
-		return;
-	} else {
-		// Claim the SPI buffer.
-		dev->spi_pending = true;
-		spin_unlock_irqrestore(&dev->spi_spin_lock, dev->spi_spin_lock_flags);
+// Install (or with num_rules == 0, remove) the match table for this open
+// file. Records already queued for the reader are not re-checked.
+static int nrf51822_ioctl_set_filter(struct nrf51822_filter *data, struct nrf51822_reader *reader)
+{
+	struct nrf51822_filter *ldata;
+	unsigned long flags;
+	int i;
+
+	// Too big to comfortably live on the kernel stack
+	ldata = kmalloc(sizeof(struct nrf51822_filter), GFP_KERNEL);
+	if (ldata == NULL) {
+		return -ENOMEM;
 	}
 
-	DBG(KERN_INFO, "setup SPI transfer to investigate interrupt\n");
+	if (copy_from_user(ldata, data, sizeof(struct nrf51822_filter))) {
+		kfree(ldata);
+		return -EFAULT;
+	}
 
-    // Clear the transfer buffers
-    memset(dev->spi_tsfers, 0, sizeof(dev->spi_tsfers));
+	if (ldata->num_rules > NRF51822_FILTER_MAX_RULES) {
+		kfree(ldata);
+		return -EINVAL;
+	}
+	for (i=0; i<ldata->num_rules; i++) {
+		struct nrf51822_filter_rule *rule = &ldata->rules[i];
+		if (rule->len == 0 || rule->len > NRF51822_FILTER_MAX_LEN ||
+		    rule->offset + rule->len > NRF51822_SPI_XFER_LEN) {
+			kfree(ldata);
+			return -EINVAL;
+		}
+	}
 
-	// Setup SPI transfers.
-	// The first byte is the command byte. Because we just want interrupt
-	// data we send the READ_IRQ command. The next bytes are the response
-	// from the nRF51822. In the future we will be able to read the correct
-	// number of bytes from the based on the first response byte from the slave
-    // (the length byte). Right now just read the maximum length.
-	dev->spi_tsfers[0].tx_buf = dev->spi_command_buffer;
-	dev->spi_tsfers[0].rx_buf = dev->spi_data_buffer;
-	dev->spi_tsfers[0].len = 40;
-	dev->spi_tsfers[0].cs_change = 1;
+	spin_lock_irqsave(&reader->dev->ring_lock, flags);
+	reader->filter = *ldata;
+	spin_unlock_irqrestore(&reader->dev->ring_lock, flags);
 
-	dev->spi_command_buffer[0] = BCP_COMMAND_READ_IRQ;
+	INFO(KERN_INFO, "radio%d: reader %d filter has %d rules\n",
+	     reader->dev->id, reader->slot, ldata->num_rules);
 
-	spi_message_init(&dev->spi_msg);
-	dev->spi_msg.complete = nrf51822_read_irq_done;
-	dev->spi_msg.context = dev;
-	spi_message_add_tail(&dev->spi_tsfers[0], &dev->spi_msg);
+	kfree(ldata);
 
-	gap_spi_async(&dev->spi_msg, dev->chipselect_demux_index);
+	return 0;
 }
 
+// Choose what read() returns for this open file.
+static int nrf51822_ioctl_set_read_flags(struct nrf51822_read_flags *data, struct nrf51822_reader *reader)
+{
+	struct nrf51822_read_flags ldata;
 
-//
-// Interrupts
-//
+	if (copy_from_user(&ldata, data, sizeof(struct nrf51822_read_flags))) {
+		return -EFAULT;
+	}
 
-static irqreturn_t nrf51822_interrupt_handler(int irq, void *data)
-{
-    struct nrf51822_dev *dev = data;
-	INFO(KERN_INFO, "got interrupt from nRF51822:%i\n", dev->id);
+	if (ldata.flags & ~NRF51822_READ_F_HEADER) {
+		return -EINVAL;
+	}
 
-	nrf51822_read_irq(dev);
+	reader->flags = ldata.flags;
 
-	return IRQ_HANDLED;
+	return 0;
 }
 
-// Called after a command byte has been sent to the nRF51822.
-// Check if the nRF51822 sent us data.
-void nrf51822_issue_simple_command_done(void *arg) {
-	struct nrf51822_dev *dev = arg;
-	bool received_valid_data = false;
 
-	if (dev->spi_data_buffer[0] == 0 && dev->spi_data_buffer[1] == 0) {
-		// No data to be transfered to the host.
+/////////////////////
+// Application logic
+/////////////////////
 
-	} else {
-		int len;
+// Check a record against a reader's match table. The record is accepted if
+// any rule matches, or if there are no rules.
+static bool nrf51822_filter_match (struct nrf51822_filter *filter, u8 *data, int len) {
+	int i, j;
 
-		received_valid_data = true;
+	if (filter->num_rules == 0) {
+		return true;
+	}
 
-		if (dev->spi_data_buffer[0] == 0) {
-			// The first byte was an error. Skip it and use the second byte
-			// as the length.
-			len = dev->spi_data_buffer[1]+1;
+	for (i=0; i<filter->num_rules; i++) {
+		struct nrf51822_filter_rule *rule = &filter->rules[i];
+		int cmp_lo = 0;
+		int cmp_hi = 0;
 
-			// Move the packet from the SPI buffer to the thing that can be read()
-			memcpy(dev->buf_to_user, dev->spi_data_buffer, len);
-			dev->buf_to_user_len = len;
+		if (rule->offset + rule->len > len) {
+			// Record too short to have this field
+			continue;
+		}
 
-		} else {
-			// The first byte was the length
-			len = dev->spi_data_buffer[0]+1;
+		// Compare from the most significant byte down until both bounds
+		// are decided.
+		for (j=0; j<rule->len && (cmp_lo == 0 || cmp_hi == 0); j++) {
+			int k = (rule->flags & NRF51822_FILTER_F_LE) ? rule->len-1-j : j;
+			u8 b = data[rule->offset+k] & rule->mask[k];
+
+			if (cmp_lo == 0) {
+				cmp_lo = (b > rule->lo[k]) - (b < rule->lo[k]);
+			}
+			if (cmp_hi == 0) {
+				cmp_hi = (b > rule->hi[k]) - (b < rule->hi[k]);
+			}
+		}
 
-			// Move the packet from the SPI buffer to the thing that can be read()
-			memcpy(dev->buf_to_user, dev->spi_data_buffer, len);
-			dev->buf_to_user_len = len;
+		if (cmp_lo >= 0 && cmp_hi <= 0) {
+			return true;
 		}
 	}
 
+	return false;
+}
+
+// Check if there is a record in the ring this reader has not seen yet.
+static bool nrf51822_reader_pending (struct nrf51822_reader *reader) {
+	unsigned long flags;
+	bool pending;
+
+	spin_lock_irqsave(&reader->dev->ring_lock, flags);
+	pending = reader->pending > 0;
+	spin_unlock_irqrestore(&reader->dev->ring_lock, flags);
 
-	spin_lock_irqsave(&dev->spi_spin_lock, dev->spi_spin_lock_flags);
-	dev->spi_pending = false;
-	spin_unlock_irqrestore(&dev->spi_spin_lock, dev->spi_spin_lock_flags);
+	return pending;
+}
 
-	if (received_valid_data) {
-		// Notify the read() call that there is data for it.
-		wake_up(&dev->to_user_queue);
+// Add a record to the shared ring. Each reader's filter is run here, once,
+// and only readers that accept the record are counted and woken up. Readers
+// that still have not consumed the slot being reused are moved forward and
+// lose that record if they had accepted it; faster readers are unaffected.
+static void nrf51822_ring_push (struct nrf51822_dev *dev, u8 *frame, int len,
+                                u64 irq_ns, u16 lost) {
+	struct nrf51822_reader *reader;
+	struct nrf51822_record *rec;
+	unsigned long flags;
+	u64 seq;
+
+	spin_lock_irqsave(&dev->ring_lock, flags);
+
+	seq = dev->ring_head;
+	rec = &dev->ring[seq & (NRF51822_RING_LEN-1)];
+
+	if (seq >= NRF51822_RING_LEN) {
+		u64 oldest = seq - NRF51822_RING_LEN;
+
+		list_for_each_entry(reader, &dev->readers, list) {
+			if (reader->tail <= oldest) {
+				reader->tail = oldest + 1;
+				if (rec->readers & BIT_ULL(reader->slot)) {
+					reader->pending--;
+					reader->dropped++;
+					atomic64_inc(&dev->stats.records_dropped);
+				}
+			}
+		}
 	}
 
-	DBG(KERN_INFO, "Finished writing the command.\n");
+	rec->readers = 0;
+	rec->irq_ns = irq_ns;
+	rec->rx_ns = ktime_get_ns();
+	rec->lost = lost;
+	rec->len = len;
+	memcpy(rec->data, frame, len);
+	dev->ring_head++;
+
+	trace_nrf51822_record_enqueue(dev->id, seq, len, rec->irq_ns);
+	atomic64_inc(&dev->stats.records);
+
+	list_for_each_entry(reader, &dev->readers, list) {
+		if (nrf51822_filter_match(&reader->filter, rec->data, len)) {
+			rec->readers |= BIT_ULL(reader->slot);
+			reader->pending++;
+			if (reader->pending > atomic64_read(&dev->stats.max_queue_depth)) {
+				atomic64_set(&dev->stats.max_queue_depth, reader->pending);
+			}
+			wake_up(&reader->queue);
+		} else {
+			reader->filtered++;
+		}
+	}
 
-	nrf51822_check_irq(dev);
+	spin_unlock_irqrestore(&dev->ring_lock, flags);
 }
 
-// Send command to the nRF51822
-int nrf51822_issue_simple_command(uint8_t command, struct nrf51822_dev *dev) {
+// Manually check if the interrupt line is high after a transfer. Must
+// hold spi_spin_lock.
+static void nrf51822_check_irq (struct nrf51822_dev *dev) {
 
-	// Check if the SPI driver is in use
-	spin_lock_irqsave(&dev->spi_spin_lock, dev->spi_spin_lock_flags);
-	if (dev->spi_pending) {
-		// Something else is using the SPI. Return that we can't issue the
-		// command right now.
-		spin_unlock_irqrestore(&dev->spi_spin_lock, dev->spi_spin_lock_flags);
-		return -EINTR;
+	// Check if we need to read the IRQ again
+	if (gpio_get_value(dev->pin_interrupt) == 1) {
+		// Interrupt is still high. Read again. The nRF51822 has had
+		// NRF51822_SPI_REARM_US to set up the SPI buffer; the controller
+		// waited that long after the last transfer. More frames are
+		// likely queued behind this one so start pipelining reads.
+		if (!dev->irq_pending) {
+			dev->irq_ns = ktime_get_ns();
+		}
+		dev->irq_pending = true;
+		dev->irq_burst = true;
 	} else {
-		// Claim the SPI buffer.
-		dev->spi_pending = true;
-		spin_unlock_irqrestore(&dev->spi_spin_lock, dev->spi_spin_lock_flags);
+		dev->irq_burst = false;
 	}
+}
 
-	DBG(KERN_INFO, "Issuing command %i on radio %i\n", command, dev->id);
-
-    // Clear the transfer buffers
-    memset(dev->spi_tsfers, 0, sizeof(dev->spi_tsfers));
+// Check the CRC of a frame from firmware that sends them. room is how many
+// bytes of the transfer are left from the frame's start.
+static bool nrf51822_frame_crc_ok (u8 *frame, int room) {
+	int len = frame[0];
+	u16 crc;
 
-	// Actually issue the command.
-	// Also be prepared to receive data
-	dev->spi_tsfers[0].tx_buf = dev->spi_command_buffer;
-	dev->spi_tsfers[0].rx_buf = dev->spi_data_buffer;
-	dev->spi_tsfers[0].len = 40;
-	dev->spi_tsfers[0].cs_change = 1;
+	if (!(frame[1] & BCP_RSP_CHECKED) ||
+	    len < BCP_FRAME_OVERHEAD || len+1 > room) {
+		return false;
+	}
 
-	dev->spi_command_buffer[0] = command;
+	crc = frame[len-1] | (frame[len] << 8);
+	return crc_itu_t(0xffff, frame, len-1) == crc;
+}
 
-	spi_message_init(&dev->spi_msg);
-	dev->spi_msg.complete = nrf51822_issue_simple_command_done;
-	dev->spi_msg.context = dev;
-	spi_message_add_tail(&dev->spi_tsfers[0], &dev->spi_msg);
+// Find where the frame starts in the SPI receive buffer. Returns the offset
+// of the length byte, or -1 if the transfer did not contain a frame.
+// checked is set if the frame passed its CRC.
+static int nrf51822_frame_offset (u8 *buf, bool *checked) {
+	int offset;
 
-	gap_spi_async(&dev->spi_msg, dev->chipselect_demux_index);
+	// There is an issue where the nRF51822 needs 7.1us between CS and CLK.
+	// We violate that currently, so the first byte may be invalid (0x00).
+	// A frame with a CRC shows where it starts.
+	for (offset=0; offset<2; offset++) {
+		if (nrf51822_frame_crc_ok(buf+offset, NRF51822_SPI_XFER_LEN-offset)) {
+			*checked = true;
+			return offset;
+		}
+	}
+	*checked = false;
 
+	// Otherwise guess. If the second byte was zero as well, that denotes
+	// an error.
+	if (buf[0] == 0 && buf[1] == 0) {
+		return -1;
+	} else if (buf[0] == 0) {
+		// The first byte was an error. Skip it and use the second byte
+		// as the length.
+		return 1;
+	}
+	// The first byte was the length
 	return 0;
 }
 
+// Count records the nRF51822 could not deliver. The next record handed to
+// read() carries the count.
+static void nrf51822_records_lost (struct nrf51822_dev *dev, int n) {
+	atomic64_add(n, &dev->stats.records_lost);
+	dev->lost_pending = min_t(u32, dev->lost_pending + n, U16_MAX);
+}
 
-/////////////////
-// init/free
-///////////////////
-
-static int nrf51822_probe(struct platform_device *pltf)
-{
-	struct device_node *np = pltf->dev.of_node;
-	int result;
-	const __be32 *prop;
-	struct nrf51822_dev *dev;
+// Forget a record we were waiting for. Returns false if it was not missing.
+static bool nrf51822_missing_take (struct nrf51822_dev *dev, u8 seq) {
 	int i;
-	int err;
-
-	memset(&config, 0, sizeof(struct nrf51822_config));
-	config.debug_print = DEBUG_PRINT_DBG;
-
-	INFO(KERN_INFO, "Loading kernel module !!! v%s\n", DRIVER_VERSION);
 
-	// Make sure that gapspi.ko is loaded first
-	request_module("gapspi");
-
-	// Get the parameters for the driver from the device tree
-	prop = of_get_property(np, "num-radios", NULL);
-	if (!prop) {
-		ERR(KERN_ALERT, "Got NULL for the number of radios.\n");
-		goto error0;
+	for (i=0; i<dev->missing_len; i++) {
+		if (dev->missing[i].seq == seq) {
+			dev->missing[i] = dev->missing[--dev->missing_len];
+			return true;
+		}
 	}
-	config.num_radios = be32_to_cpup(prop);
-	INFO(KERN_INFO, "Number of nRF51822 radios %i\n", config.num_radios);
+	return false;
+}
 
-	// Instantiate the correct number of radios
-	config.radios = (struct nrf51822_dev*) kmalloc(config.num_radios * sizeof(struct nrf51822_dev), GFP_KERNEL);
-	if (config.radios == NULL) {
-		ERR(KERN_INFO, "Could not allocate nrf51822 devices\n");
-		goto error0;
+// Give up on records that were asked for again and never came.
+static void nrf51822_missing_expire (struct nrf51822_dev *dev, u64 now) {
+	int i = 0;
+
+	while (i < dev->missing_len) {
+		if (now >= dev->missing[i].deadline_ns) {
+			dev->missing[i] = dev->missing[--dev->missing_len];
+			nrf51822_records_lost(dev, 1);
+		} else {
+			i++;
+		}
 	}
-	memset(config.radios, 0, config.num_radios * sizeof(struct nrf51822_dev));
+}
 
+// Ask the nRF51822 to send a frame again. Like replayed configuration this
+// is an internal command, sequence number 0, and gets no response.
+static bool nrf51822_request_resend (struct nrf51822_dev *dev, u8 seq) {
+	struct nrf51822_cmd cmd;
+	unsigned long flags;
+	bool queued;
 
-	for (i=0; i<config.num_radios; i++) {
-		char buf[64];
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.len = 2;
+	cmd.data[0] = BCP_COMMAND_RESEND;
+	cmd.data[1] = seq;
 
-		dev = &config.radios[i];
+	spin_lock_irqsave(&dev->spi_spin_lock, flags);
+	queued = kfifo_put(&dev->cmd_fifo, cmd);
+	spin_unlock_irqrestore(&dev->spi_spin_lock, flags);
 
-		// Configure the GPIOs
-		snprintf(buf, 64, "interrupt%i-gpio", i);
-		dev->pin_interrupt = of_get_named_gpio(np, buf, 0);
+	return queued;
+}
 
-		if (!gpio_is_valid(dev->pin_interrupt)) {
-			ERR(KERN_ALERT, "interrupt gpio%i is not valid\n", i);
-			goto error1;
+// Move the expected sequence number up to seq, asking again for every frame
+// skipped on the way. The ones we have no room to track are lost.
+static void nrf51822_seq_skip (struct nrf51822_dev *dev, u8 seq, u64 now) {
+	struct nrf51822_missing *m;
+
+	while (dev->seq_next != seq) {
+		if (dev->missing_len < NRF51822_MISSING_LEN &&
+		    nrf51822_request_resend(dev, dev->seq_next)) {
+			m = &dev->missing[dev->missing_len++];
+			m->seq = dev->seq_next;
+			m->deadline_ns = now + NRF51822_RESEND_TIMEOUT_MS*NSEC_PER_MSEC;
+		} else {
+			nrf51822_records_lost(dev, 1);
 		}
-		err = devm_gpio_request_one(&pltf->dev, dev->pin_interrupt, GPIOF_IN, "interrupt");
-		if (err) goto error1;
+		dev->seq_next++;
+	}
+}
 
-		// Enable the interrupt
-		result = devm_request_irq(&pltf->dev,
-		                          gpio_to_irq(dev->pin_interrupt),
-		                          nrf51822_interrupt_handler,
-		                          IRQF_TRIGGER_RISING,
-		                          "nrf51822_interrupt",
-		                          dev);
-		if (result) goto error1;
+// Track the sequence number of a checked frame. Returns true if the frame's
+// record should be delivered: the next one, one after a gap, or a resent
+// one we were missing. Resent records arrive after newer ones.
+static bool nrf51822_seq_check (struct nrf51822_dev *dev, u8 type, u8 seq) {
+	u64 now = ktime_get_ns();
+	s8 ahead;
 
-		// Get other properties
-		snprintf(buf, 64, "radio%i-csmux", i);
-		prop = of_get_property(np, buf, NULL);
-		if (!prop) {
-			ERR(KERN_ALERT, "Got NULL for the csmux index.\n");
-			goto error1;
-		}
-		dev->chipselect_demux_index = be32_to_cpup(prop);
-		INFO(KERN_INFO, "Got index %i for the mux\n", dev->chipselect_demux_index);
+	nrf51822_missing_expire(dev, now);
 
-		dev->id = i;
-		dev->spi_pending = false;
-		init_waitqueue_head(&dev->to_user_queue);
-		spin_lock_init(&dev->spi_spin_lock);
+	if (!dev->seq_valid) {
+		dev->seq_valid = true;
+		dev->seq_next = seq;
+	}
+	ahead = (s8) (seq - dev->seq_next);
+
+	switch (type) {
+	  case BCP_RSP_NONE:
+		// Carries the sequence number the next record will get, so
+		// anything before it we have not seen was skipped.
+		if (ahead > 0) {
+			nrf51822_seq_skip(dev, seq, now);
+		}
+		return false;
 
-		INFO(KERN_INFO, "GPIO CONFIG radio:%i\n", i);
-		INFO(KERN_INFO, "  INTERRUPT: %i\n", dev->pin_interrupt);
-		INFO(KERN_INFO, "SETTINGS radio:%i\n", i);
-		INFO(KERN_INFO, "  DEMUX: %i\n", dev->chipselect_demux_index);
+	  case BCP_RSP_LOST:
+		// The chip no longer has a record we asked for again.
+		if (nrf51822_missing_take(dev, seq)) {
+			nrf51822_records_lost(dev, 1);
+		}
+		return false;
 	}
 
-	// Allocate a major number for this device
-	err = alloc_chrdev_region(&config.chr_dev, 0, config.num_radios, nrf51822_name);
-	if (err < 0) {
-		ERR(KERN_INFO, "Could not allocate a major number\n");
-		goto error1;
+	if (ahead >= 0) {
+		nrf51822_seq_skip(dev, seq, now);
+		dev->seq_next = seq + 1;
+		return true;
 	}
-	config.major = MAJOR(config.chr_dev);
 
-	// Create device class
-	config.cl = class_create(THIS_MODULE, nrf51822_name);
-	if (config.cl == NULL) {
-		ERR(KERN_INFO, "Could not create device class\n");
-		goto error2;
+	if (nrf51822_missing_take(dev, seq)) {
+		atomic64_inc(&dev->stats.retransmits);
+		return true;
 	}
 
-	for (i=0; i<config.num_radios; i++) {
-		struct device* de;
-		dev = &config.radios[i];
-		dev->devno = MKDEV(config.major, dev->id);
+	if (ahead < -NRF51822_SEQ_WINDOW) {
+		// Far behind: the chip started counting again without us
+		// resetting it.
+		dev->seq_next = seq + 1;
+		return true;
+	}
 
-		// Register the character device
-		cdev_init(&dev->cdev, &fops);
-		dev->cdev.owner = THIS_MODULE;
-		dev->cdev.ops = &fops;
-		result = cdev_add(&dev->cdev, dev->devno, 1);
-		if (result < 0) {
-			ERR(KERN_INFO, "Unable to register char dev\n");
-			goto error3;
-		}
-		INFO(KERN_INFO, "Char interface registered on %d\n", config.major);
+	atomic64_inc(&dev->stats.duplicate_frames);
+	return false;
+}
 
-		de = device_create(config.cl, NULL, dev->devno, NULL, "nrf51822_%d", dev->id);
-		if (de == NULL) {
-			ERR(KERN_INFO, "Could not create device %i\n", dev->id);
-			goto error3;
-		}
+// Push an entry onto the response channel, dropping the oldest entry if
+// userspace is not keeping up. Must hold spi_spin_lock.
+static void nrf51822_push_response (struct nrf51822_dev *dev,
+                                    struct nrf51822_response *rsp) {
+	if (kfifo_is_full(&dev->rsp_fifo)) {
+		kfifo_skip(&dev->rsp_fifo);
+		atomic64_inc(&dev->stats.responses_dropped);
 	}
+	kfifo_put(&dev->rsp_fifo, *rsp);
+}
 
-	return 0;
+// Route a frame received from the nRF51822. Advertisements go to read(),
+// anything else goes to the response channel. Returns false if the transfer
+// did not contain a valid frame; a command write that read back nothing
+// is not an error.
+static bool nrf51822_handle_frame (struct nrf51822_dev *dev,
+                                   struct nrf51822_xfer *xfer) {
+	struct nrf51822_response rsp;
+	u8 record[NRF51822_SPI_XFER_LEN];
+	unsigned long flags;
+	bool deliver = true;
+	bool checked;
+	int offset;
+	int len;
+	u8 *frame;
+	u16 lost;
+
+	atomic64_inc(&dev->stats.spi_transactions);
+	atomic64_add(NRF51822_SPI_XFER_LEN, &dev->stats.spi_bytes);
+	if (xfer->msg.status) {
+		atomic64_inc(&dev->stats.spi_errors);
+	}
+
+	offset = nrf51822_frame_offset(xfer->rx, &checked);
+	if (offset < 0 && xfer->is_cmd) {
+		// Nothing was clocked back while we wrote a command. That is no
+		// data rather than a bad frame; only interrupt-driven reads
+		// count towards invalid_frames.
+		return true;
+	}
+	if (offset >= 0 && !checked &&
+	    (dev->checked || (xfer->rx[offset+1] & BCP_RSP_CHECKED))) {
+		// Looks like a frame, but the CRC does not match. Once the
+		// chip has sent checked frames, unchecked ones are corrupt too.
+		// The sequence gap this leaves gets the frame sent again.
+		atomic64_inc(&dev->stats.crc_errors);
+		offset = -1;
+	}
+	if (offset < 0) {
+		atomic64_inc(&dev->stats.invalid_frames);
+		WRITE_ONCE(dev->wdt_invalid_run, dev->wdt_invalid_run + 1);
+		return false;
+	}
+	WRITE_ONCE(dev->wdt_invalid_run, 0);
+	if (offset > 0) {
+		atomic64_inc(&dev->stats.late_frames);
+	}
+
+	frame = xfer->rx + offset;
+	len = min(frame[0]+1, NRF51822_SPI_XFER_LEN-offset);
+
+	if (checked) {
+		u8 type = frame[1] & ~BCP_RSP_CHECKED;
+		int n = frame[0] - BCP_FRAME_OVERHEAD;
+
+		dev->checked = true;
+		deliver = nrf51822_seq_check(dev, type, frame[2]);
+
+		// Hand userspace the same [len][type][payload] record older
+		// firmware sent.
+		record[0] = n + 1;
+		record[1] = type;
+		memcpy(record+2, frame+3, n);
+		frame = record;
+		len = n + 2;
+	}
+
+	if (frame[1] == BCP_RSP_NONE) {
+		// A pipelined read that found the nRF51822's queue already
+		// drained.
+		atomic64_inc(&dev->stats.empty_reads);
+		return true;
+	}
+
+	// The chip is doing something useful
+	WRITE_ONCE(dev->wdt_frames, dev->wdt_frames + 1);
+	WRITE_ONCE(dev->wdt_progress_ns, ktime_get_ns());
+
+	if (!deliver) {
+		// A duplicate, or word that a record is gone
+		return true;
+	}
+
+	if (frame[1] == BCP_RSP_ADVERTISEMENT) {
+		// Move the packet from the SPI buffer to the ring read() uses
+		lost = dev->lost_pending;
+		dev->lost_pending = 0;
+		nrf51822_ring_push(dev, frame, len, xfer->irq_ns, lost);
+
+	} else {
+		memset(&rsp, 0, sizeof(rsp));
+		rsp.len = min(len, NRF51822_RSP_MAX_LEN);
+		memcpy(rsp.data, frame, rsp.len);
+
+		spin_lock_irqsave(&dev->spi_spin_lock, flags);
+		nrf51822_push_response(dev, &rsp);
+		spin_unlock_irqrestore(&dev->spi_spin_lock, flags);
+
+		wake_up(&dev->rsp_queue);
+	}
+
+	return true;
+}
+
+// Give up a slot on the shared bus and hand it to the next radio.
+static void nrf51822_bus_put (struct nrf51822_config *cfg) {
+	unsigned long flags;
+
+	spin_lock_irqsave(&cfg->bus_lock, flags);
+	cfg->bus_inflight--;
+	spin_unlock_irqrestore(&cfg->bus_lock, flags);
+
+	nrf51822_bus_next(cfg);
+}
+
+// SPI completion of every transaction. Only what decides the next transfer
+// happens here; the frame is handled by rx_work on the radio's workqueue.
+static void nrf51822_xfer_complete (void *arg) {
+	struct nrf51822_xfer *xfer = arg;
+	struct nrf51822_dev *dev = xfer->dev;
+	unsigned long flags;
+
+	trace_nrf51822_spi_complete(dev->id,
+	                            xfer->is_cmd ? xfer->cmd.data[0] : BCP_COMMAND_READ_IRQ,
+	                            xfer->msg.status);
+
+	spin_lock_irqsave(&dev->spi_spin_lock, flags);
+	list_add_tail(&xfer->list, &dev->xfer_done);
+	dev->spi_inflight--;
+	nrf51822_check_irq(dev);
+	spin_unlock_irqrestore(&dev->spi_spin_lock, flags);
+
+	queue_work(dev->wq, &dev->rx_work);
+
+	nrf51822_bus_put(dev->cfg);
+
+	// Last touch of the radio, nrf51822_dev_free() may run after this.
+	spin_lock_irqsave(&dev->spi_spin_lock, flags);
+	if (--dev->spi_refs == 0) {
+		wake_up(&dev->spi_idle_queue);
+	}
+	spin_unlock_irqrestore(&dev->spi_spin_lock, flags);
+}
+
+// Post the completion of a command on the response channel. Commands the
+// watchdog replays have sequence number 0 and nobody waiting for them.
+// Must hold spi_spin_lock.
+static void nrf51822_command_response (struct nrf51822_dev *dev,
+                                       struct nrf51822_xfer *xfer,
+                                       int status) {
+	struct nrf51822_response rsp;
+
+	if (xfer->cmd.seq == 0) {
+		return;
+	}
+
+	memset(&rsp, 0, sizeof(rsp));
+	rsp.seq = xfer->cmd.seq;
+	rsp.status = status;
+	rsp.command = xfer->cmd.data[0];
+	nrf51822_push_response(dev, &rsp);
+}
+
+static int nrf51822_replay_find (struct nrf51822_dev *dev, u8 command) {
+	int i;
+
+	for (i=0; i<dev->replay_len; i++) {
+		if (dev->replay[i].data[0] == command) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Remember a command that changes the chip's state so it can be sent again
+// after a reset. Only the latest of each command is kept, and stopping
+// something forgets the command that started it. Must hold spi_spin_lock.
+static void nrf51822_replay_note (struct nrf51822_dev *dev,
+                                  struct nrf51822_cmd *cmd) {
+	int i;
+
+	switch (cmd->data[0]) {
+	  case BCP_COMMAND_SNIFF_ADVERTISEMENTS:
+		i = nrf51822_replay_find(dev, cmd->data[0]);
+		if (i < 0) {
+			if (dev->replay_len == NRF51822_REPLAY_LEN) {
+				return;
+			}
+			i = dev->replay_len++;
+		}
+		dev->replay[i] = *cmd;
+		dev->replay[i].seq = 0;
+		break;
+
+	  case BCP_COMMAND_SNIFF_ADVERTISEMENTS_STOP:
+		i = nrf51822_replay_find(dev, BCP_COMMAND_SNIFF_ADVERTISEMENTS);
+		if (i >= 0) {
+			dev->replay[i] = dev->replay[--dev->replay_len];
+		}
+		break;
+
+	  default:
+		// One-off commands are not replayed.
+		break;
+	}
+}
+
+// Handle finished transactions in the order they completed and put them
+// back in the pool. For an interrupt read the result is in the rx buffer.
+// For a command, whatever the nRF51822 had queued was clocked in while we
+// sent it, and the command's completion goes on the response channel.
+static void nrf51822_rx_work (struct work_struct *work) {
+	struct nrf51822_dev *dev = container_of(work, struct nrf51822_dev, rx_work);
+	struct nrf51822_xfer *xfer;
+	unsigned long flags;
+	bool is_cmd;
+	bool valid;
+
+	while (1) {
+		spin_lock_irqsave(&dev->spi_spin_lock, flags);
+		xfer = list_first_entry_or_null(&dev->xfer_done, struct nrf51822_xfer, list);
+		if (xfer) {
+			list_del(&xfer->list);
+		}
+		spin_unlock_irqrestore(&dev->spi_spin_lock, flags);
+
+		if (xfer == NULL) {
+			break;
+		}
+
+		is_cmd = xfer->is_cmd;
+		valid = nrf51822_handle_frame(dev, xfer);
+		if (!valid && !is_cmd) {
+			// This was an invalid transfer. Some error occurred. It is
+			// counted in the stats so keep the print out of the default
+			// log level.
+			DBG(KERN_INFO, "First two bytes zero. Ignoring response from nRF51822:%i\n", dev->id);
+		}
+
+		spin_lock_irqsave(&dev->spi_spin_lock, flags);
+		if (!valid && dev->checked && READ_ONCE(dev->wdt_invalid_run) == 1) {
+			// Read once more after a bad frame. Whatever comes next
+			// carries a sequence number that shows what was lost,
+			// even if the bad frame was the last one queued.
+			if (!dev->irq_pending) {
+				dev->irq_ns = ktime_get_ns();
+			}
+			dev->irq_pending = true;
+		}
+		if (is_cmd) {
+			nrf51822_command_response(dev, xfer, xfer->msg.status);
+			if (xfer->msg.status == 0 && xfer->cmd.seq != 0) {
+				nrf51822_replay_note(dev, &xfer->cmd);
+			}
+		}
+		list_add(&xfer->list, &dev->xfer_free);
+		spin_unlock_irqrestore(&dev->spi_spin_lock, flags);
+
+		if (is_cmd) {
+			wake_up(&dev->rsp_queue);
+		}
+	}
+
+	// A transfer may have been waiting for a free slot in the pool.
+	nrf51822_bus_next(dev->cfg);
+}
+
+// Zero whatever the last user of tx left past the first len bytes. Only
+// the bytes that were actually written are cleared.
+static void nrf51822_xfer_clear_tx (struct nrf51822_xfer *xfer, u8 len) {
+	if (xfer->tx_dirty > len) {
+		memset(xfer->tx+len, 0, xfer->tx_dirty-len);
+	}
+	xfer->tx_dirty = len;
+}
+
+// Set up the SPI transfer to query the nRF51822 about why it interrupted
+// us. Called with spi_spin_lock held so transactions go on the bus in the
+// order they were taken from the pool.
+static int nrf51822_read_irq(struct nrf51822_dev *dev, struct nrf51822_xfer *xfer) {
+
+	DBG(KERN_INFO, "setup SPI transfer to investigate interrupt\n");
+
+	// The first byte is the command byte. Because we just want interrupt
+	// data we send the READ_IRQ command. The next bytes are the response
+	// from the nRF51822. In the future we will be able to read the correct
+	// number of bytes from the based on the first response byte from the slave
+	// (the length byte). Right now just read the maximum length.
+	nrf51822_xfer_clear_tx(xfer, 1);
+	xfer->tx[0] = BCP_COMMAND_READ_IRQ;
+
+	trace_nrf51822_spi_submit(dev->id, BCP_COMMAND_READ_IRQ, 0);
+
+	return gap_spi_async(&xfer->msg, dev->chipselect_demux_index);
+}
+
+
+//
+// Interrupts
+//
+
+static irqreturn_t nrf51822_interrupt_handler(int irq, void *data)
+{
+    struct nrf51822_dev *dev = data;
+	unsigned long flags;
+
+	trace_nrf51822_irq(dev->id);
+	atomic64_inc(&dev->stats.interrupts);
+
+	DBG(KERN_INFO, "got interrupt from nRF51822:%i\n", dev->id);
+
+	// Remember the interrupt even if the bus is busy right now. It gets
+	// serviced as soon as a transaction slot is free.
+	spin_lock_irqsave(&dev->spi_spin_lock, flags);
+	if (!dev->irq_pending) {
+		dev->irq_ns = ktime_get_ns();
+	}
+	dev->irq_pending = true;
+	if (dev->spi_inflight >= NRF51822_SPI_PIPELINE ||
+	    READ_ONCE(dev->cfg->bus_inflight) >= NRF51822_BUS_DEPTH) {
+		atomic64_inc(&dev->stats.irq_deferred);
+	}
+	spin_unlock_irqrestore(&dev->spi_spin_lock, flags);
+
+	nrf51822_bus_next(dev->cfg);
+
+	return IRQ_HANDLED;
+}
+
+// Clock out the command in xfer->cmd. Called with spi_spin_lock held so
+// commands go on the bus in the order they were queued.
+static int nrf51822_issue_command(struct nrf51822_dev *dev, struct nrf51822_xfer *xfer) {
+
+	DBG(KERN_INFO, "Issuing command %i on radio %i\n", xfer->cmd.data[0], dev->id);
+
+	// Actually issue the command.
+	// Also be prepared to receive data
+	nrf51822_xfer_clear_tx(xfer, xfer->cmd.len);
+	memcpy(xfer->tx, xfer->cmd.data, xfer->cmd.len);
+
+	trace_nrf51822_spi_submit(dev->id, xfer->cmd.data[0], 0);
+
+	return gap_spi_async(&xfer->msg, dev->chipselect_demux_index);
+}
+
+// Put the radio's next transaction on the bus. Queued commands go before
+// interrupt reads so a busy interrupt line cannot starve them; the
+// interrupt stays pending and is read right after. A single interrupt gets
+// a single read. Only once the line is seen high after a read are further
+// reads queued speculatively, up to NRF51822_SPI_PIPELINE; one that finds
+// the nRF51822 drained comes back as an empty frame. Returns false if the
+// radio had nothing to send. Must hold the board's bus_lock.
+static bool nrf51822_spi_next(struct nrf51822_dev *dev) {
+	struct nrf51822_xfer *xfer;
+	bool have_cmd;
+	int err;
+
+	spin_lock(&dev->spi_spin_lock);
+	if (dev->stopped || dev->resetting ||
+	    dev->spi_inflight >= NRF51822_SPI_PIPELINE ||
+	    list_empty(&dev->xfer_free)) {
+		spin_unlock(&dev->spi_spin_lock);
+		return false;
+	}
+
+	xfer = list_first_entry(&dev->xfer_free, struct nrf51822_xfer, list);
+
+	have_cmd = kfifo_get(&dev->cmd_fifo, &xfer->cmd);
+	if (!have_cmd && !dev->irq_pending && !dev->irq_burst) {
+		// Nothing to do.
+		spin_unlock(&dev->spi_spin_lock);
+		return false;
+	}
+
+	// Any record clocked in by this transfer is charged to the oldest
+	// interrupt we have not serviced yet.
+	xfer->irq_ns = dev->irq_pending ? dev->irq_ns : ktime_get_ns();
+	xfer->is_cmd = have_cmd;
+	if (!have_cmd) {
+		dev->irq_pending = false;
+	}
+
+	list_del(&xfer->list);
+	dev->spi_inflight++;
+	dev->spi_refs++;
+	xfer->tsfer.speed_hz = READ_ONCE(dev->speed_hz);
+	xfer->tsetup.delay_usecs = READ_ONCE(dev->cs_delay_us);
+
+	// Submitted under the lock so transactions go on the bus in the order
+	// they were taken.
+	if (have_cmd) {
+		err = nrf51822_issue_command(dev, xfer);
+	} else {
+		err = nrf51822_read_irq(dev, xfer);
+	}
+
+	if (err) {
+		// The bus would not take it. A failed command still gets its
+		// completion; a failed read is retried on the next interrupt.
+		ERR(KERN_ALERT, "SPI submit failed on radio %i: %i\n", dev->id, err);
+		atomic64_inc(&dev->stats.spi_errors);
+		if (have_cmd) {
+			nrf51822_command_response(dev, xfer, err);
+		}
+		dev->irq_burst = false;
+		dev->spi_inflight--;
+		dev->spi_refs--;
+		list_add(&xfer->list, &dev->xfer_free);
+	}
+	spin_unlock(&dev->spi_spin_lock);
+
+	if (have_cmd) {
+		wake_up(&dev->cmd_space_queue);
+		if (err) {
+			wake_up(&dev->rsp_queue);
+		}
+	}
+
+	return err == 0;
+}
+
+// Hand out free slots on the shared bus round robin, one transaction per
+// radio per turn, so a radio with a busy interrupt line cannot crowd out
+// the others behind the mux.
+static void nrf51822_bus_next(struct nrf51822_config *cfg) {
+	unsigned long flags;
+	int idle = 0;
+
+	spin_lock_irqsave(&cfg->bus_lock, flags);
+	while (cfg->bus_inflight < NRF51822_BUS_DEPTH && idle < cfg->num_radios) {
+		struct nrf51822_dev *dev = &cfg->radios[cfg->bus_rr];
+
+		cfg->bus_rr = (cfg->bus_rr + 1) % cfg->num_radios;
+
+		if (nrf51822_spi_next(dev)) {
+			cfg->bus_inflight++;
+			idle = 0;
+		} else {
+			idle++;
+		}
+	}
+	spin_unlock_irqrestore(&cfg->bus_lock, flags);
+}
+
+// Add a command to the radio's queue. If the queue is full this sleeps
+// until there is room, or returns -EAGAIN if nonblock is set. Returns the
+// sequence number assigned to the command.
+int nrf51822_queue_command(struct nrf51822_dev *dev, const u8 *data, u8 len, bool nonblock) {
+	struct nrf51822_cmd cmd;
+	unsigned long flags;
+	int queued;
+
+	if (len == 0 || len > NRF51822_CMD_MAX_LEN) {
+		return -EINVAL;
+	}
+
+	memset(&cmd, 0, sizeof(cmd));
+	memcpy(cmd.data, data, len);
+	cmd.len = len;
+
+	while (1) {
+		spin_lock_irqsave(&dev->spi_spin_lock, flags);
+		queued = !kfifo_is_full(&dev->cmd_fifo);
+		if (queued) {
+			// Zero is never handed out so it can mean "not a command"
+			// on the response channel.
+			if (++dev->cmd_seq == 0) {
+				dev->cmd_seq = 1;
+			}
+			cmd.seq = dev->cmd_seq;
+			kfifo_put(&dev->cmd_fifo, cmd);
+			atomic64_inc(&dev->stats.commands);
+		}
+		spin_unlock_irqrestore(&dev->spi_spin_lock, flags);
+
+		if (queued) {
+			break;
+		}
+		if (nonblock) {
+			return -EAGAIN;
+		}
+		if (wait_event_interruptible(dev->cmd_space_queue, !kfifo_is_full(&dev->cmd_fifo))) {
+			return -ERESTARTSYS;
+		}
+	}
+
+	DBG(KERN_INFO, "Queued command %i (seq %u) on radio %i\n", cmd.data[0], cmd.seq, dev->id);
+
+	nrf51822_bus_next(dev->cfg);
+
+	return cmd.seq;
+}
+
+// Send a one byte command to the nRF51822
+int nrf51822_issue_simple_command(uint8_t command, struct nrf51822_dev *dev) {
+	int result;
+
+	result = nrf51822_queue_command(dev, &command, 1, false);
+
+	return (result < 0) ? result : 0;
+}
+
+
+/////////////////
+// SPI clock
+/////////////////
+
+// Clocks the calibration tries. The nRF51822's SPI slave runs at up to
+// 8 MHz.
+static const u32 nrf51822_spi_speeds[NRF51822_NUM_SPEEDS] = {
+	500000, 1000000, 2000000, 4000000, 8000000,
+};
+
+// CS setup delays the calibration tries, in microseconds. The nRF51822
+// wants 7.1 us; shorter often works, and a lost first byte is recovered
+// from anyway.
+static const u32 nrf51822_cs_delays[NRF51822_NUM_CS_DELAYS] = {
+	0, 2, 4, 8,
+};
+
+static void nrf51822_set_speed(struct nrf51822_dev *dev, int idx) {
+	dev->speed_idx = idx;
+	WRITE_ONCE(dev->speed_hz, idx < 0 ? 0 : nrf51822_spi_speeds[idx]);
+}
+
+// Clock count reads through the nRF51822 one at a time and return nonzero
+// at the first one that comes back invalid or fails, or with its first byte
+// lost if strict is set. Frames read are handled as usual, so records are
+// not lost. Sleeps.
+static int nrf51822_test_reads (struct nrf51822_dev *dev, int count, bool strict) {
+	u64 invalid = atomic64_read(&dev->stats.invalid_frames);
+	u64 errors = atomic64_read(&dev->stats.spi_errors);
+	u64 late = atomic64_read(&dev->stats.late_frames);
+	unsigned long flags;
+	int i;
+
+	for (i=0; i<count; i++) {
+		spin_lock_irqsave(&dev->spi_spin_lock, flags);
+		if (!dev->irq_pending) {
+			dev->irq_pending = true;
+			dev->irq_ns = ktime_get_ns();
+		}
+		spin_unlock_irqrestore(&dev->spi_spin_lock, flags);
+		nrf51822_bus_next(dev->cfg);
+
+		if (!wait_event_timeout(dev->spi_idle_queue, nrf51822_spi_idle(dev),
+		                        msecs_to_jiffies(NRF51822_CAL_TIMEOUT_MS))) {
+			return 1;
+		}
+		flush_workqueue(dev->wq);
+
+		if (atomic64_read(&dev->stats.invalid_frames) != invalid ||
+		    atomic64_read(&dev->stats.spi_errors) != errors ||
+		    (strict && atomic64_read(&dev->stats.late_frames) != late)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Step the clock up until reads start failing, then settle one step below
+// the fastest clock that worked, or on it if nothing failed. At that clock,
+// take the shortest CS setup delay that gets every frame whole. Sleeps.
+static void nrf51822_calibrate (struct nrf51822_dev *dev) {
+	int best = -1;
+	bool failed = false;
+	int i;
+
+	WRITE_ONCE(dev->calibrating, true);
+
+	// The clock is searched with the longest CS setup delay, so only the
+	// clock can make reads fail.
+	WRITE_ONCE(dev->cs_delay_us, nrf51822_cs_delays[NRF51822_NUM_CS_DELAYS-1]);
+
+	for (i=0; i<NRF51822_NUM_SPEEDS; i++) {
+		nrf51822_set_speed(dev, i);
+		if (nrf51822_test_reads(dev, NRF51822_CAL_READS, false)) {
+			failed = true;
+			break;
+		}
+		best = i;
+	}
+
+	if (failed && best > 0) {
+		best--;
+	}
+	if (best < 0) {
+		ERR(KERN_ALERT, "radio %i: no SPI clock gave clean reads, using the default\n", dev->id);
+	}
+	nrf51822_set_speed(dev, best);
+
+	// If none is clean the longest is kept.
+	i = NRF51822_NUM_CS_DELAYS-1;
+	if (best >= 0) {
+		for (i=0; i<NRF51822_NUM_CS_DELAYS-1; i++) {
+			WRITE_ONCE(dev->cs_delay_us, nrf51822_cs_delays[i]);
+			if (!nrf51822_test_reads(dev, NRF51822_CAL_READS, true)) {
+				break;
+			}
+		}
+	}
+	WRITE_ONCE(dev->cs_delay_us, nrf51822_cs_delays[i]);
+
+	INFO(KERN_INFO, "radio %i: SPI clock %u Hz, CS setup %u us\n", dev->id,
+	     dev->speed_hz, dev->cs_delay_us);
+
+	// What the fast clocks got wrong is not the chip's fault.
+	dev->speed_last_invalid = atomic64_read(&dev->stats.invalid_frames);
+	WRITE_ONCE(dev->wdt_invalid_run, 0);
+	WRITE_ONCE(dev->calibrating, false);
+}
+
+static void nrf51822_cal_work (struct work_struct *work) {
+	struct nrf51822_dev *dev = container_of(work, struct nrf51822_dev, cal_work);
+
+	nrf51822_calibrate(dev);
+}
+
+// Called from the watchdog: drop a calibrated radio's clock a step if
+// invalid frames are coming in again.
+static void nrf51822_speed_check (struct nrf51822_dev *dev) {
+	u64 invalid = atomic64_read(&dev->stats.invalid_frames);
+	u64 new_invalid = invalid - dev->speed_last_invalid;
+
+	dev->speed_last_invalid = invalid;
+
+	if (dev->speed_idx > 0 && new_invalid > NRF51822_SPEED_MAX_INVALID) {
+		nrf51822_set_speed(dev, dev->speed_idx - 1);
+		atomic64_inc(&dev->stats.speed_fallbacks);
+		ERR(KERN_WARNING, "radio %i: %llu invalid frames, SPI clock down to %u Hz\n",
+		    dev->id, (unsigned long long) new_invalid, dev->speed_hz);
+	}
+}
+
+
+/////////////////
+// Watchdog
+/////////////////
+
+static const char *nrf51822_reset_reasons[] = {
+	[NRF51822_RESET_NONE]           = "ok",
+	[NRF51822_RESET_STUCK_IRQ]      = "interrupt line stuck high",
+	[NRF51822_RESET_INVALID_FRAMES] = "too many invalid frames",
+	[NRF51822_RESET_NO_PROGRESS]    = "no data while sniffing and no answer to a read",
+};
+
+// Look for signs that the nRF51822 stopped working since the last check.
+// Returns why it should be reset, or NRF51822_RESET_NONE. May read from the
+// chip, and sleep.
+static int nrf51822_watchdog_check (struct nrf51822_dev *dev) {
+	u64 frames = READ_ONCE(dev->wdt_frames);
+	bool progress = frames != dev->wdt_last_frames;
+	bool line_high = gpio_get_value(dev->pin_interrupt) == 1;
+	unsigned int idle_ms = READ_ONCE(watchdog_idle_ms);
+	int reason = NRF51822_RESET_NONE;
+	unsigned long flags;
+	bool sniffing;
+	u64 quiet_since;
+
+	spin_lock_irqsave(&dev->spi_spin_lock, flags);
+	sniffing = nrf51822_replay_find(dev, BCP_COMMAND_SNIFF_ADVERTISEMENTS) >= 0;
+	spin_unlock_irqrestore(&dev->spi_spin_lock, flags);
+
+	if (READ_ONCE(dev->wdt_invalid_run) >= NRF51822_WDT_MAX_INVALID) {
+		reason = NRF51822_RESET_INVALID_FRAMES;
+	} else if (line_high && dev->wdt_line_high && !progress) {
+		reason = NRF51822_RESET_STUCK_IRQ;
+	} else if (sniffing && idle_ms > 0) {
+		quiet_since = max(READ_ONCE(dev->wdt_progress_ns), dev->wdt_probe_ns);
+		if (ktime_get_ns() - quiet_since > (u64) idle_ms * NSEC_PER_MSEC) {
+			// Maybe nothing is advertising nearby. A chip that still
+			// works answers a read with an empty frame.
+			if (nrf51822_test_reads(dev, 1, false)) {
+				reason = NRF51822_RESET_NO_PROGRESS;
+			} else {
+				dev->wdt_probe_ns = ktime_get_ns();
+			}
+		}
+	}
+
+	dev->wdt_last_frames = frames;
+	dev->wdt_line_high = line_high;
+	if (progress) {
+		dev->wdt_resets_in_row = 0;
+	}
+
+	return reason;
+}
+
+// Pulse the reset line, if there is one, and bring the radio back to the
+// state userspace had put it in. Sleeps.
+static void nrf51822_reset (struct nrf51822_dev *dev, int reason) {
+	unsigned long flags;
+	u64 downtime;
+	int i;
+
+	// Keep the radio off the bus and let what is on it finish.
+	spin_lock_irqsave(&dev->spi_spin_lock, flags);
+	dev->resetting = true;
+	spin_unlock_irqrestore(&dev->spi_spin_lock, flags);
+	wait_event_timeout(dev->spi_idle_queue, nrf51822_spi_idle(dev),
+	                   msecs_to_jiffies(NRF51822_WDT_INTERVAL_MS));
+	flush_workqueue(dev->wq);
+
+	// The chip starts counting from scratch, and records we asked for
+	// again are not coming.
+	nrf51822_records_lost(dev, dev->missing_len);
+	dev->missing_len = 0;
+	dev->seq_valid = false;
+
+	if (gpio_is_valid(dev->pin_reset)) {
+		gpio_set_value(dev->pin_reset, 0);
+		usleep_range(NRF51822_RESET_PULSE_US, 2*NRF51822_RESET_PULSE_US);
+		gpio_set_value(dev->pin_reset, 1);
+		msleep(NRF51822_BOOT_MS);
+	}
+
+	downtime = ktime_get_ns() - READ_ONCE(dev->wdt_progress_ns);
+	atomic64_inc(&dev->stats.resets);
+	atomic64_add(div64_u64(downtime, NSEC_PER_MSEC), &dev->stats.downtime_ms);
+	trace_nrf51822_reset(dev->id, reason, downtime);
+	ERR(KERN_WARNING, "radio %i: %s, %s after %llu ms without data\n",
+	    dev->id, nrf51822_reset_reasons[reason],
+	    gpio_is_valid(dev->pin_reset) ? "reset" : "reconfigured",
+	    (unsigned long long) div64_u64(downtime, NSEC_PER_MSEC));
+
+	// Whatever was pending belonged to the old session. Read the new one
+	// if the chip already has something, and queue the configuration
+	// after any commands userspace queued meanwhile.
+	spin_lock_irqsave(&dev->spi_spin_lock, flags);
+	dev->resetting = false;
+	dev->irq_pending = false;
+	dev->irq_burst = false;
+	nrf51822_check_irq(dev);
+	for (i=0; i<dev->replay_len; i++) {
+		if (!kfifo_put(&dev->cmd_fifo, dev->replay[i])) {
+			ERR(KERN_ALERT, "radio %i: command queue full, configuration not restored\n", dev->id);
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&dev->spi_spin_lock, flags);
+
+	WRITE_ONCE(dev->wdt_invalid_run, 0);
+	WRITE_ONCE(dev->wdt_progress_ns, ktime_get_ns());
+	dev->wdt_line_high = false;
+
+	nrf51822_bus_next(dev->cfg);
+}
+
+static void nrf51822_watchdog (struct work_struct *work) {
+	struct nrf51822_dev *dev = container_of(to_delayed_work(work),
+	                                        struct nrf51822_dev, wdt_work);
+	int reason;
+
+	if (READ_ONCE(dev->calibrating)) {
+		// Invalid frames are expected while the clock is being pushed.
+		goto out;
+	}
+
+	nrf51822_speed_check(dev);
+
+	reason = nrf51822_watchdog_check(dev);
+	if (reason != NRF51822_RESET_NONE) {
+		nrf51822_reset(dev, reason);
+		if (dev->wdt_resets_in_row < NRF51822_WDT_MAX_BACKOFF) {
+			dev->wdt_resets_in_row++;
+		}
+	}
+
+out:
+	schedule_delayed_work(&dev->wdt_work,
+	    msecs_to_jiffies(NRF51822_WDT_INTERVAL_MS << dev->wdt_resets_in_row));
+}
+
+
+/////////////////
+// sysfs
+/////////////////
+
+// Every counter is a read-only file in
+// /sys/class/nRF51822/nrf51822_N/stats/.
+#define NRF51822_STAT_ATTR(_name)                                          \
+static ssize_t _name##_show(struct device *d,                              \
+                            struct device_attribute *attr,                 \
+                            char *buf) {                                   \
+	struct nrf51822_dev *dev = dev_get_drvdata(d);                         \
+	return sprintf(buf, "%llu\n",                                         \
+	               (unsigned long long) atomic64_read(&dev->stats._name)); \
+}                                                                          \
+static DEVICE_ATTR_RO(_name)
+
+NRF51822_STAT_ATTR(interrupts);
+NRF51822_STAT_ATTR(irq_deferred);
+NRF51822_STAT_ATTR(spi_transactions);
+NRF51822_STAT_ATTR(spi_bytes);
+NRF51822_STAT_ATTR(spi_errors);
+NRF51822_STAT_ATTR(invalid_frames);
+NRF51822_STAT_ATTR(empty_reads);
+NRF51822_STAT_ATTR(commands);
+NRF51822_STAT_ATTR(responses_dropped);
+NRF51822_STAT_ATTR(records);
+NRF51822_STAT_ATTR(records_delivered);
+NRF51822_STAT_ATTR(records_dropped);
+NRF51822_STAT_ATTR(max_queue_depth);
+NRF51822_STAT_ATTR(resets);
+NRF51822_STAT_ATTR(downtime_ms);
+NRF51822_STAT_ATTR(speed_fallbacks);
+NRF51822_STAT_ATTR(late_frames);
+NRF51822_STAT_ATTR(crc_errors);
+NRF51822_STAT_ATTR(retransmits);
+NRF51822_STAT_ATTR(duplicate_frames);
+NRF51822_STAT_ATTR(records_lost);
+
+// Throughput over the last NRF51822_RATE_INTERVAL_MS.
+#define NRF51822_RATE_ATTR(_name)                                          \
+static ssize_t _name##_show(struct device *d,                              \
+                            struct device_attribute *attr,                 \
+                            char *buf) {                                   \
+	struct nrf51822_dev *dev = dev_get_drvdata(d);                         \
+	return sprintf(buf, "%llu\n", (unsigned long long) READ_ONCE(dev->_name)); \
+}                                                                          \
+static DEVICE_ATTR_RO(_name)
+
+NRF51822_RATE_ATTR(records_per_sec);
+NRF51822_RATE_ATTR(spi_bytes_per_sec);
+
+static struct attribute *nrf51822_stats_attrs[] = {
+	&dev_attr_interrupts.attr,
+	&dev_attr_irq_deferred.attr,
+	&dev_attr_spi_transactions.attr,
+	&dev_attr_spi_bytes.attr,
+	&dev_attr_spi_errors.attr,
+	&dev_attr_invalid_frames.attr,
+	&dev_attr_empty_reads.attr,
+	&dev_attr_commands.attr,
+	&dev_attr_responses_dropped.attr,
+	&dev_attr_records.attr,
+	&dev_attr_records_delivered.attr,
+	&dev_attr_records_dropped.attr,
+	&dev_attr_max_queue_depth.attr,
+	&dev_attr_resets.attr,
+	&dev_attr_downtime_ms.attr,
+	&dev_attr_speed_fallbacks.attr,
+	&dev_attr_late_frames.attr,
+	&dev_attr_crc_errors.attr,
+	&dev_attr_retransmits.attr,
+	&dev_attr_duplicate_frames.attr,
+	&dev_attr_records_lost.attr,
+	&dev_attr_records_per_sec.attr,
+	&dev_attr_spi_bytes_per_sec.attr,
+	NULL,
+};
+
+static const struct attribute_group nrf51822_stats_group = {
+	.name = "stats",
+	.attrs = nrf51822_stats_attrs,
+};
+
+// /sys/class/nRF51822/nrf51822_N/spi_speed_hz is the SPI clock the radio
+// runs at, 0 for the controller's default. Writing a clock uses it from
+// then on; writing 0 starts the calibration again in the background.
+static ssize_t spi_speed_hz_show(struct device *d, struct device_attribute *attr,
+                                 char *buf) {
+	struct nrf51822_dev *dev = dev_get_drvdata(d);
+	return sprintf(buf, "%u\n", READ_ONCE(dev->speed_hz));
+}
+
+static ssize_t spi_speed_hz_store(struct device *d, struct device_attribute *attr,
+                                  const char *buf, size_t count) {
+	struct nrf51822_dev *dev = dev_get_drvdata(d);
+	u32 speed;
+	int i;
+	int err;
+
+	err = kstrtou32(buf, 0, &speed);
+	if (err) {
+		return err;
+	}
+
+	if (speed == 0) {
+		schedule_work(&dev->cal_work);
+		return count;
+	}
+
+	// Not at the same time as a calibration
+	flush_work(&dev->cal_work);
+
+	// A clock set by hand can still fall back through the slower table
+	// entries.
+	for (i=NRF51822_NUM_SPEEDS-1; i>=0; i--) {
+		if (nrf51822_spi_speeds[i] < speed) {
+			break;
+		}
+	}
+	dev->speed_idx = i+1;
+	WRITE_ONCE(dev->speed_hz, speed);
+
+	return count;
+}
+static DEVICE_ATTR_RW(spi_speed_hz);
+
+// spi_cs_delay_us is the time from chip select to the first clock. The
+// calibration sets it too.
+static ssize_t spi_cs_delay_us_show(struct device *d, struct device_attribute *attr,
+                                    char *buf) {
+	struct nrf51822_dev *dev = dev_get_drvdata(d);
+	return sprintf(buf, "%u\n", READ_ONCE(dev->cs_delay_us));
+}
+
+static ssize_t spi_cs_delay_us_store(struct device *d, struct device_attribute *attr,
+                                     const char *buf, size_t count) {
+	struct nrf51822_dev *dev = dev_get_drvdata(d);
+	u32 delay;
+	int err;
+
+	err = kstrtou32(buf, 0, &delay);
+	if (err) {
+		return err;
+	}
+	if (delay > USHRT_MAX) {
+		return -EINVAL;
+	}
+
+	flush_work(&dev->cal_work);
+	WRITE_ONCE(dev->cs_delay_us, delay);
+
+	return count;
+}
+static DEVICE_ATTR_RW(spi_cs_delay_us);
+
+static struct attribute *nrf51822_attrs[] = {
+	&dev_attr_spi_speed_hz.attr,
+	&dev_attr_spi_cs_delay_us.attr,
+	NULL,
+};
+
+static const struct attribute_group nrf51822_group = {
+	.attrs = nrf51822_attrs,
+};
+
+static const struct attribute_group *nrf51822_attr_groups[] = {
+	&nrf51822_group,
+	&nrf51822_stats_group,
+	NULL,
+};
+
+// Totals for the whole board are in the stats/ directory of the platform
+// device. Counters are summed over the radios when read.
+#define NRF51822_BOARD_STAT_ATTR(_name)                                    \
+static ssize_t board_##_name##_show(struct device *d,                      \
+                                    struct device_attribute *attr,         \
+                                    char *buf) {                           \
+	struct nrf51822_config *cfg = dev_get_drvdata(d);                      \
+	u64 total = 0;                                                         \
+	int i;                                                                 \
+	for (i=0; i<cfg->num_radios; i++) {                                    \
+		total += atomic64_read(&cfg->radios[i].stats._name);               \
+	}                                                                      \
+	return sprintf(buf, "%llu\n", (unsigned long long) total);             \
+}                                                                          \
+static struct device_attribute dev_attr_board_##_name =                    \
+	__ATTR(_name, 0444, board_##_name##_show, NULL)
+
+#define NRF51822_BOARD_RATE_ATTR(_name)                                    \
+static ssize_t board_##_name##_show(struct device *d,                      \
+                                    struct device_attribute *attr,         \
+                                    char *buf) {                           \
+	struct nrf51822_config *cfg = dev_get_drvdata(d);                      \
+	return sprintf(buf, "%llu\n", (unsigned long long) READ_ONCE(cfg->_name)); \
+}                                                                          \
+static struct device_attribute dev_attr_board_##_name =                    \
+	__ATTR(_name, 0444, board_##_name##_show, NULL)
+
+NRF51822_BOARD_STAT_ATTR(interrupts);
+NRF51822_BOARD_STAT_ATTR(spi_transactions);
+NRF51822_BOARD_STAT_ATTR(spi_bytes);
+NRF51822_BOARD_STAT_ATTR(records);
+NRF51822_BOARD_STAT_ATTR(records_dropped);
+NRF51822_BOARD_STAT_ATTR(records_lost);
+NRF51822_BOARD_STAT_ATTR(resets);
+NRF51822_BOARD_STAT_ATTR(downtime_ms);
+NRF51822_BOARD_RATE_ATTR(records_per_sec);
+NRF51822_BOARD_RATE_ATTR(spi_bytes_per_sec);
+
+static struct attribute *nrf51822_board_stats_attrs[] = {
+	&dev_attr_board_interrupts.attr,
+	&dev_attr_board_spi_transactions.attr,
+	&dev_attr_board_spi_bytes.attr,
+	&dev_attr_board_records.attr,
+	&dev_attr_board_records_dropped.attr,
+	&dev_attr_board_records_lost.attr,
+	&dev_attr_board_resets.attr,
+	&dev_attr_board_downtime_ms.attr,
+	&dev_attr_board_records_per_sec.attr,
+	&dev_attr_board_spi_bytes_per_sec.attr,
+	NULL,
+};
+
+static const struct attribute_group nrf51822_board_stats_group = {
+	.name = "stats",
+	.attrs = nrf51822_board_stats_attrs,
+};
+
+// Recompute the throughput of every radio and of the board.
+static void nrf51822_rate_work(struct work_struct *work)
+{
+	struct nrf51822_config *cfg = container_of(to_delayed_work(work),
+	                                           struct nrf51822_config, rate_work);
+	u64 records_per_sec = 0;
+	u64 spi_bytes_per_sec = 0;
+	u64 now = ktime_get_ns();
+	u64 elapsed = now - cfg->rate_ns;
+	int i;
+
+	cfg->rate_ns = now;
+
+	for (i=0; i<cfg->num_radios && elapsed > 0; i++) {
+		struct nrf51822_dev *dev = &cfg->radios[i];
+		u64 records = atomic64_read(&dev->stats.records);
+		u64 spi_bytes = atomic64_read(&dev->stats.spi_bytes);
+
+		WRITE_ONCE(dev->records_per_sec,
+		           div64_u64((records - dev->rate_records) * NSEC_PER_SEC, elapsed));
+		WRITE_ONCE(dev->spi_bytes_per_sec,
+		           div64_u64((spi_bytes - dev->rate_spi_bytes) * NSEC_PER_SEC, elapsed));
+		dev->rate_records = records;
+		dev->rate_spi_bytes = spi_bytes;
+
+		records_per_sec += dev->records_per_sec;
+		spi_bytes_per_sec += dev->spi_bytes_per_sec;
+	}
+
+	WRITE_ONCE(cfg->records_per_sec, records_per_sec);
+	WRITE_ONCE(cfg->spi_bytes_per_sec, spi_bytes_per_sec);
+
+	schedule_delayed_work(&cfg->rate_work, msecs_to_jiffies(NRF51822_RATE_INTERVAL_MS));
+}
+
+
+/////////////////
+// init/free
+///////////////////
+
+// Allocate the radio's SPI transactions. The messages are built once here
+// so the hot path only has to fill in the command byte.
+static int nrf51822_xfer_pool_init(struct nrf51822_dev *dev)
+{
+	// Each buffer gets whole cache lines to itself so the CPU never
+	// touches a line the controller is DMAing into.
+	size_t stride = ALIGN(NRF51822_SPI_XFER_LEN, dma_get_cache_alignment());
+	int i;
+
+	INIT_LIST_HEAD(&dev->xfer_free);
+	INIT_LIST_HEAD(&dev->xfer_done);
+	dev->spi_inflight = 0;
+
+	dev->xfer_bufs = kzalloc(2 * NRF51822_XFER_POOL_LEN * stride, GFP_KERNEL | GFP_DMA);
+	if (dev->xfer_bufs == NULL) {
+		return -ENOMEM;
+	}
+
+	for (i=0; i<NRF51822_XFER_POOL_LEN; i++) {
+		struct nrf51822_xfer *xfer = &dev->xfers[i];
+
+		xfer->dev = dev;
+		xfer->tx = dev->xfer_bufs + (2*i)*stride;
+		xfer->rx = dev->xfer_bufs + (2*i+1)*stride;
+
+		xfer->tsetup.len = 0;
+		xfer->tsfer.tx_buf = xfer->tx;
+		xfer->tsfer.rx_buf = xfer->rx;
+		xfer->tsfer.len = NRF51822_SPI_XFER_LEN;
+		xfer->tsfer.cs_change = 1;
+		xfer->tsfer.delay_usecs = NRF51822_SPI_REARM_US;
+
+		spi_message_init(&xfer->msg);
+		xfer->msg.complete = nrf51822_xfer_complete;
+		xfer->msg.context = xfer;
+		spi_message_add_tail(&xfer->tsetup, &xfer->msg);
+		spi_message_add_tail(&xfer->tsfer, &xfer->msg);
+
+		list_add_tail(&xfer->list, &dev->xfer_free);
+	}
+
+	return 0;
+}
+
+// Set up the board-wide state. The config must be zeroed.
+static void nrf51822_config_init(struct nrf51822_config *cfg)
+{
+	spin_lock_init(&cfg->bus_lock);
+	INIT_DELAYED_WORK(&cfg->rate_work, nrf51822_rate_work);
+	cfg->rate_ns = ktime_get_ns();
+}
+
+// Set up the software state of one radio. The device must be zeroed.
+static int nrf51822_dev_init(struct nrf51822_dev *dev, struct nrf51822_config *cfg, int id)
+{
+	int err;
+
+	dev->id = id;
+	dev->cfg = cfg;
+	dev->irq_pending = false;
+	INIT_LIST_HEAD(&dev->readers);
+	spin_lock_init(&dev->ring_lock);
+	init_waitqueue_head(&dev->cmd_space_queue);
+	init_waitqueue_head(&dev->rsp_queue);
+	init_waitqueue_head(&dev->spi_idle_queue);
+	spin_lock_init(&dev->spi_spin_lock);
+	INIT_KFIFO(dev->cmd_fifo);
+	INIT_KFIFO(dev->rsp_fifo);
+	INIT_WORK(&dev->rx_work, nrf51822_rx_work);
+	INIT_DELAYED_WORK(&dev->wdt_work, nrf51822_watchdog);
+	INIT_WORK(&dev->cal_work, nrf51822_cal_work);
+	dev->speed_idx = -1;
+	dev->speed_hz = 0;
+	dev->pin_reset = -1;
+	dev->wdt_progress_ns = ktime_get_ns();
+
+	dev->wq = alloc_ordered_workqueue("nrf51822_%d", WQ_HIGHPRI, id);
+	if (dev->wq == NULL) {
+		return -ENOMEM;
+	}
+
+	err = nrf51822_xfer_pool_init(dev);
+	if (err) {
+		destroy_workqueue(dev->wq);
+		dev->wq = NULL;
+	}
+	return err;
+}
+
+static bool nrf51822_spi_idle(struct nrf51822_dev *dev)
+{
+	unsigned long flags;
+	bool idle;
+
+	spin_lock_irqsave(&dev->spi_spin_lock, flags);
+	idle = dev->spi_refs == 0;
+	spin_unlock_irqrestore(&dev->spi_spin_lock, flags);
+
+	return idle;
+}
+
+// Wait for the bus to drain and free what nrf51822_dev_init() allocated.
+// The interrupt must already be released. Safe to call on a radio that
+// failed to initialize.
+static void nrf51822_dev_free(struct nrf51822_dev *dev)
+{
+	unsigned long flags;
+
+	if (dev->wq == NULL) {
+		return;
+	}
+
+	cancel_work_sync(&dev->cal_work);
+	cancel_delayed_work_sync(&dev->wdt_work);
+
+	spin_lock_irqsave(&dev->spi_spin_lock, flags);
+	dev->stopped = true;
+	spin_unlock_irqrestore(&dev->spi_spin_lock, flags);
+
+	wait_event(dev->spi_idle_queue, nrf51822_spi_idle(dev));
+	// Handles whatever finished last
+	destroy_workqueue(dev->wq);
+	dev->wq = NULL;
+
+	kfree(dev->xfer_bufs);
+	dev->xfer_bufs = NULL;
+}
+
+static int nrf51822_probe(struct platform_device *pltf)
+{
+	struct device_node *np = pltf->dev.of_node;
+	struct nrf51822_config *cfg;
+	int result;
+	const __be32 *prop;
+	struct nrf51822_dev *dev;
+	int i;
+	int err;
+
+	INFO(KERN_INFO, "Loading kernel module !!! v%s\n", DRIVER_VERSION);
+
+	// Make sure that gapspi.ko is loaded first
+	request_module("gapspi");
+
+	cfg = devm_kzalloc(&pltf->dev, sizeof(struct nrf51822_config), GFP_KERNEL);
+	if (cfg == NULL) {
+		goto error0;
+	}
+	nrf51822_config_init(cfg);
+	platform_set_drvdata(pltf, cfg);
+
+	// Get the parameters for the driver from the device tree
+	prop = of_get_property(np, "num-radios", NULL);
+	if (!prop) {
+		ERR(KERN_ALERT, "Got NULL for the number of radios.\n");
+		goto error0;
+	}
+	cfg->num_radios = be32_to_cpup(prop);
+	INFO(KERN_INFO, "Number of nRF51822 radios %i\n", cfg->num_radios);
+
+	// Instantiate the correct number of radios
+	cfg->radios = devm_kcalloc(&pltf->dev, cfg->num_radios, sizeof(struct nrf51822_dev), GFP_KERNEL);
+	if (cfg->radios == NULL) {
+		ERR(KERN_INFO, "Could not allocate nrf51822 devices\n");
+		goto error0;
+	}
+
+	// An interrupt on any radio can put any other radio on the bus, so all
+	// of them have to be ready before the first interrupt is requested.
+	for (i=0; i<cfg->num_radios; i++) {
+		if (nrf51822_dev_init(&cfg->radios[i], cfg, i)) {
+			ERR(KERN_ALERT, "Could not allocate SPI buffers for radio %i\n", i);
+			goto error1;
+		}
+	}
+
+	for (i=0; i<cfg->num_radios; i++) {
+		char buf[64];
+
+		dev = &cfg->radios[i];
+
+		// Get other properties
+		snprintf(buf, 64, "radio%i-csmux", i);
+		prop = of_get_property(np, buf, NULL);
+		if (!prop) {
+			ERR(KERN_ALERT, "Got NULL for the csmux index.\n");
+			goto error1;
+		}
+		dev->chipselect_demux_index = be32_to_cpup(prop);
+		INFO(KERN_INFO, "Got index %i for the mux\n", dev->chipselect_demux_index);
+
+		// Configure the GPIOs
+		snprintf(buf, 64, "interrupt%i-gpio", i);
+		dev->pin_interrupt = of_get_named_gpio(np, buf, 0);
+
+		if (!gpio_is_valid(dev->pin_interrupt)) {
+			ERR(KERN_ALERT, "interrupt gpio%i is not valid\n", i);
+			goto error1;
+		}
+		err = devm_gpio_request_one(&pltf->dev, dev->pin_interrupt, GPIOF_IN, "interrupt");
+		if (err) goto error1;
+
+		// The reset line is optional. Without it the watchdog can only
+		// send the configuration again.
+		snprintf(buf, 64, "rst%i-gpio", i);
+		dev->pin_reset = of_get_named_gpio(np, buf, 0);
+		if (gpio_is_valid(dev->pin_reset)) {
+			err = devm_gpio_request_one(&pltf->dev, dev->pin_reset, GPIOF_OUT_INIT_HIGH, "reset");
+			if (err) goto error1;
+		} else {
+			dev->pin_reset = -1;
+		}
+
+		// Enable the interrupt
+		result = devm_request_irq(&pltf->dev,
+		                          gpio_to_irq(dev->pin_interrupt),
+		                          nrf51822_interrupt_handler,
+		                          IRQF_TRIGGER_RISING,
+		                          "nrf51822_interrupt",
+		                          dev);
+		if (result) goto error1;
+
+		INFO(KERN_INFO, "GPIO CONFIG radio:%i\n", i);
+		INFO(KERN_INFO, "  INTERRUPT: %i\n", dev->pin_interrupt);
+		INFO(KERN_INFO, "  RESET: %i\n", dev->pin_reset);
+		INFO(KERN_INFO, "SETTINGS radio:%i\n", i);
+		INFO(KERN_INFO, "  DEMUX: %i\n", dev->chipselect_demux_index);
+	}
+
+	// Allocate a major number for this device
+	err = alloc_chrdev_region(&cfg->chr_dev, 0, cfg->num_radios, nrf51822_name);
+	if (err < 0) {
+		ERR(KERN_INFO, "Could not allocate a major number\n");
+		goto error1;
+	}
+	cfg->major = MAJOR(cfg->chr_dev);
+
+	// Create device class
+	cfg->cl = class_create(THIS_MODULE, nrf51822_name);
+	if (cfg->cl == NULL) {
+		ERR(KERN_INFO, "Could not create device class\n");
+		goto error2;
+	}
+
+	for (i=0; i<cfg->num_radios; i++) {
+		struct device* de;
+		dev = &cfg->radios[i];
+		dev->devno = MKDEV(cfg->major, dev->id);
+
+		// Register the character device
+		cdev_init(&dev->cdev, &fops);
+		dev->cdev.owner = THIS_MODULE;
+		dev->cdev.ops = &fops;
+		result = cdev_add(&dev->cdev, dev->devno, 1);
+		if (result < 0) {
+			ERR(KERN_INFO, "Unable to register char dev\n");
+			goto error3;
+		}
+		INFO(KERN_INFO, "Char interface registered on %d\n", cfg->major);
+
+		de = device_create_with_groups(cfg->cl, NULL, dev->devno, dev,
+		                               nrf51822_attr_groups, "nrf51822_%d", dev->id);
+		if (de == NULL) {
+			ERR(KERN_INFO, "Could not create device %i\n", dev->id);
+			goto error3;
+		}
+	}
+
+	// Board totals
+	err = devm_device_add_group(&pltf->dev, &nrf51822_board_stats_group);
+	if (err) goto error3;
+
+	schedule_delayed_work(&cfg->rate_work, msecs_to_jiffies(NRF51822_RATE_INTERVAL_MS));
+	for (i=0; i<cfg->num_radios; i++) {
+		if (calibrate_spi) {
+			schedule_work(&cfg->radios[i].cal_work);
+		}
+		schedule_delayed_work(&cfg->radios[i].wdt_work, msecs_to_jiffies(NRF51822_WDT_INTERVAL_MS));
+	}
+
+	return 0;
 
 	error3:
-		class_destroy(config.cl);
+		class_destroy(cfg->cl);
 	error2:
-		unregister_chrdev_region(config.chr_dev, config.num_radios);
+		unregister_chrdev_region(cfg->chr_dev, cfg->num_radios);
 	error1:
-		kfree(config.radios);
+		for (i=0; i<cfg->num_radios; i++) {
+			nrf51822_dev_free(&cfg->radios[i]);
+		}
 	error0:
 		return -1;
 }
 
 static int nrf51822_remove(struct platform_device *pltf)
 {
+	struct nrf51822_config *cfg = platform_get_drvdata(pltf);
 	int i;
 
-	for (i=0; i<config.num_radios; i++) {
-		struct nrf51822_dev *dev = &config.radios[i];
+	cancel_delayed_work_sync(&cfg->rate_work);
+
+	for (i=0; i<cfg->num_radios; i++) {
+		struct nrf51822_dev *dev = &cfg->radios[i];
+
+		// Stop new reads before the transfer pool goes away.
+		devm_free_irq(&pltf->dev, gpio_to_irq(dev->pin_interrupt), dev);
+		nrf51822_dev_free(dev);
+
 		cdev_del(&dev->cdev);
-		unregister_chrdev(dev->devno, nrf51822_name);
-		device_destroy(config.cl, dev->devno);
+		device_destroy(cfg->cl, dev->devno);
 	}
 
-	class_destroy(config.cl);
+	unregister_chrdev_region(cfg->chr_dev, cfg->num_radios);
+	class_destroy(cfg->cl);
 
 	INFO(KERN_INFO, "Removed character device\n");
 
@@ -1,37 +1,314 @@
 #ifndef _nrf51822_H_
 #define _nrf51822_H_
 
-#define SPI_BUF_LEN 128
+#include <linux/kfifo.h>
+#include <linux/spi/spi.h>
+
+#include "ioctl.h"
+
 #define CHAR_DEVICE_BUFFER_LEN 256
 
+// Number of bytes clocked on every BCP transaction. Room for the longest
+// advertisement record plus the sequence number and CRC.
+#define NRF51822_SPI_XFER_LEN 48
+
+// Depth of the per-radio command and response queues. Must be a power of 2.
+#define NRF51822_CMD_QUEUE_LEN 32
+#define NRF51822_RSP_QUEUE_LEN 32
+
+// Number of records kept in the ring shared by all readers of a radio.
+// Must be a power of 2.
+#define NRF51822_RING_LEN 64
+
+// Maximum number of files that can have a radio open at the same time.
+#define NRF51822_MAX_READERS 64
+
+// SPI transactions preallocated per radio, and how many of them may be
+// queued on the bus at once. While the interrupt line stays high the next
+// read is queued behind the one on the wire so the controller never idles
+// between completions.
+#define NRF51822_XFER_POOL_LEN 4
+#define NRF51822_SPI_PIPELINE  2
+
+// SPI transactions queued on the shared, muxed bus across all radios. Free
+// slots are handed to radios round robin.
+#define NRF51822_BUS_DEPTH 2
+
+// How often the records/s and bytes/s figures in sysfs are updated.
+#define NRF51822_RATE_INTERVAL_MS 1000
+
+// Watchdog. It checks every radio every NRF51822_WDT_INTERVAL_MS and
+// resets it after NRF51822_WDT_MAX_INVALID invalid frames in a row, or if
+// the interrupt line stayed high for a whole interval without a good frame.
+// Repeated resets without progress back the interval off exponentially,
+// up to 2^NRF51822_WDT_MAX_BACKOFF times.
+#define NRF51822_WDT_INTERVAL_MS  500
+#define NRF51822_WDT_MAX_INVALID  16
+#define NRF51822_WDT_MAX_BACKOFF  7
+
+// Length of the pulse on the reset line, and how long the nRF51822 takes
+// to boot and start the SoftDevice afterwards.
+#define NRF51822_RESET_PULSE_US 1000
+#define NRF51822_BOOT_MS        100
+
+// Number of configuration commands remembered for replay after a reset.
+#define NRF51822_REPLAY_LEN 8
+
+// Why the watchdog reset a radio.
+#define NRF51822_RESET_NONE           0
+#define NRF51822_RESET_STUCK_IRQ      1
+#define NRF51822_RESET_INVALID_FRAMES 2
+#define NRF51822_RESET_NO_PROGRESS    3
+
+// Time the nRF51822 needs after chip select goes high to load its next
+// frame. The controller waits this long after every transfer.
+#define NRF51822_SPI_REARM_US 25
+
+// SPI clock calibration. Each speed is tried with NRF51822_CAL_READS reads,
+// slowest first, and the first invalid frame ends the search. Then each CS
+// setup delay, the pause between chip select and the first clock, is tried
+// at that speed, shortest first, until one never loses the first byte of a
+// frame. More than NRF51822_SPEED_MAX_INVALID invalid frames in one
+// watchdog interval steps a calibrated radio down a speed.
+#define NRF51822_NUM_SPEEDS        5
+#define NRF51822_NUM_CS_DELAYS     4
+#define NRF51822_CAL_READS         64
+#define NRF51822_CAL_TIMEOUT_MS    100
+#define NRF51822_SPEED_MAX_INVALID 4
+
+// Records missing from the sequence that have been asked for again, and how
+// long to wait for them before counting them lost. A frame more than
+// NRF51822_SEQ_WINDOW behind the sequence means the chip started over.
+#define NRF51822_MISSING_LEN        8
+#define NRF51822_RESEND_TIMEOUT_MS  100
+#define NRF51822_SEQ_WINDOW         32
+
+// One frame from the nRF51822 as handed to read().
+struct nrf51822_record {
+	// Bit n is set if the reader in slot n accepted this record.
+	u64 readers;
+	// When the interrupt for this record fired and when its SPI transfer
+	// completed, from ktime_get_ns().
+	u64 irq_ns;
+	u64 rx_ns;
+	// Records the nRF51822 was found to have lost since the previous one.
+	u16 lost;
+	u8 len;
+	u8 data[NRF51822_SPI_XFER_LEN];
+};
+
+// A record the sequence numbers say we missed and asked for again.
+struct nrf51822_missing {
+	u8 seq;
+	u64 deadline_ns;
+};
+
+// A command waiting for its turn on the SPI bus.
+struct nrf51822_cmd {
+	u32 seq;
+	u8 len;
+	u8 data[NRF51822_CMD_MAX_LEN];
+};
+
+struct nrf51822_dev;
+
+// One preallocated SPI transaction. The message and transfer are set up
+// once and reused; tx and rx point into DMA-safe, cache line aligned
+// memory that nothing else shares.
+struct nrf51822_xfer {
+	struct nrf51822_dev *dev;
+	struct list_head list;
+
+	struct spi_message msg;
+	// Moves no data. Its delay is the CS setup time before tsfer.
+	struct spi_transfer tsetup;
+	struct spi_transfer tsfer;
+	u8 *tx;
+	u8 *rx;
+	// How many bytes at the start of tx may be non-zero.
+	u8 tx_dirty;
+
+	// Time of the interrupt any record clocked in by this transfer is
+	// charged to.
+	u64 irq_ns;
+
+	// The command being sent, if this is not an interrupt read.
+	bool is_cmd;
+	struct nrf51822_cmd cmd;
+};
+
+// Counters exported in sysfs. Updated from interrupt and SPI completion
+// context, so they are atomics rather than lock protected.
+struct nrf51822_stats {
+	atomic64_t interrupts;         // rising edges on the interrupt line
+	atomic64_t irq_deferred;       // interrupts that arrived while the bus was busy
+	atomic64_t spi_transactions;
+	atomic64_t spi_bytes;
+	atomic64_t spi_errors;         // transfers the SPI controller failed
+	atomic64_t invalid_frames;     // transfers with no valid frame in them
+	atomic64_t empty_reads;        // transfers the nRF51822 had nothing for
+	atomic64_t commands;           // commands queued
+	atomic64_t responses_dropped;  // response channel overflows
+	atomic64_t records;            // records added to the ring
+	atomic64_t records_delivered;  // records copied out by read(), all readers
+	atomic64_t records_dropped;    // records lost by slow readers, all readers
+	atomic64_t max_queue_depth;    // most records any reader had waiting
+	atomic64_t resets;             // resets by the watchdog
+	atomic64_t downtime_ms;        // time without good frames before those resets
+	atomic64_t speed_fallbacks;    // SPI clock steps down after errors
+	atomic64_t late_frames;        // frames whose first byte was lost after chip select
+	atomic64_t crc_errors;         // frames that failed the CRC
+	atomic64_t retransmits;        // missed records that arrived when resent
+	atomic64_t duplicate_frames;   // records that arrived twice
+	atomic64_t records_lost;       // records the nRF51822 could not deliver
+};
+
+struct nrf51822_config;
+
 struct nrf51822_dev {
 	int id;
 
+	// The board this radio is on.
+	struct nrf51822_config *cfg;
+
 	unsigned int chipselect_demux_index;
 
 	int pin_interrupt;
+	// Active low reset line, or -1 if the board does not have one.
+	int pin_reset;
 
 	struct cdev cdev;
 	int devno;
 
-	wait_queue_head_t to_user_queue;
+	// Records for read(), shared by every open file. Each reader keeps its
+	// own cursor. Protected by ring_lock.
+	struct nrf51822_record ring[NRF51822_RING_LEN];
+	u64 ring_head;
+	struct list_head readers;
+	DECLARE_BITMAP(reader_slots, NRF51822_MAX_READERS);
+	spinlock_t ring_lock;
 
-	u8 spi_command_buffer[SPI_BUF_LEN];
-	u8 spi_data_buffer[SPI_BUF_LEN];
+	// SPI transactions. Idle ones are on xfer_free, spi_inflight of them
+	// are queued on the bus, and finished ones wait on xfer_done for
+	// rx_work. Protected by spi_spin_lock.
+	struct nrf51822_xfer xfers[NRF51822_XFER_POOL_LEN];
+	struct list_head xfer_free;
+	struct list_head xfer_done;
+	int spi_inflight;
+	// Like spi_inflight, but only dropped once the completion handler no
+	// longer touches the radio.
+	int spi_refs;
+	u8 *xfer_bufs;
+	wait_queue_head_t spi_idle_queue;
 
-	struct spi_transfer spi_tsfers[4];
-	struct spi_message spi_msg;
+	// Received frames are handled on the radio's own ordered workqueue,
+	// so radios do not queue up behind each other in the SPI
+	// controller's completion context.
+	struct workqueue_struct *wq;
+	struct work_struct rx_work;
 
 	spinlock_t spi_spin_lock;
-	unsigned long spi_spin_lock_flags;
-	bool spi_pending;
+	bool irq_pending;
+	// The interrupt line was still high after a read, so keep the
+	// pipeline full of reads until it goes low.
+	bool irq_burst;
+	// Set on removal, nothing new goes on the bus.
+	bool stopped;
+	// Set while the watchdog resets the chip.
+	bool resetting;
+
+	// Time of the oldest unserviced interrupt.
+	u64 irq_ns;
+
+	// Commands are queued here and sent in order whenever the SPI bus is
+	// free. Protected by spi_spin_lock.
+	DECLARE_KFIFO(cmd_fifo, struct nrf51822_cmd, NRF51822_CMD_QUEUE_LEN);
+	u32 cmd_seq;
+	wait_queue_head_t cmd_space_queue;
+
+	// Completions and non-advertisement frames for the ioctl response
+	// channel. Protected by spi_spin_lock.
+	DECLARE_KFIFO(rsp_fifo, struct nrf51822_response, NRF51822_RSP_QUEUE_LEN);
+	wait_queue_head_t rsp_queue;
+
+	// Commands that put the chip in its current state, sent again after a
+	// reset. Protected by spi_spin_lock.
+	struct nrf51822_cmd replay[NRF51822_REPLAY_LEN];
+	int replay_len;
+
+	// Watchdog state. wdt_frames counts good frames and wdt_progress_ns is
+	// when the last one arrived; both are only written by rx_work and the
+	// reset. wdt_invalid_run counts invalid frames since the last good one.
+	// The rest belongs to wdt_work; wdt_probe_ns is when a quiet radio last
+	// answered the watchdog's read.
+	struct delayed_work wdt_work;
+	u64 wdt_frames;
+	u64 wdt_progress_ns;
+	u32 wdt_invalid_run;
+	u64 wdt_last_frames;
+	u64 wdt_probe_ns;
+	bool wdt_line_high;
+	int wdt_resets_in_row;
+
+	// SPI clock for this radio's transfers, 0 for the controller's
+	// default. speed_idx indexes nrf51822_spi_speeds, -1 if not
+	// calibrated. Only the calibration and the watchdog change them.
+	u32 speed_hz;
+	int speed_idx;
+	// Microseconds between chip select and the first clock.
+	u32 cs_delay_us;
+	bool calibrating;
+	u64 speed_last_invalid;
+	struct work_struct cal_work;
+
+	// Frame sequence numbers. seq_next is the next one expected, missing
+	// holds older ones that were skipped and asked for again, and
+	// lost_pending counts lost records not yet reported with a record.
+	// The first frame after loading or a reset sets the sequence.
+	// checked is set once the chip has sent a frame with a CRC; from then
+	// on frames without one are not trusted. Only rx_work and the reset
+	// touch these.
+	bool checked;
+	bool seq_valid;
+	u8 seq_next;
+	struct nrf51822_missing missing[NRF51822_MISSING_LEN];
+	int missing_len;
+	u16 lost_pending;
 
 	u8 buf_to_nrf51822[CHAR_DEVICE_BUFFER_LEN];
-	u8 buf_to_user[CHAR_DEVICE_BUFFER_LEN];
 	size_t buf_to_nrf51822_len;
-	size_t buf_to_user_len;
+
+	struct nrf51822_stats stats;
+
+	// Throughput over the last NRF51822_RATE_INTERVAL_MS, and the counter
+	// values it was computed from.
+	u64 records_per_sec;
+	u64 spi_bytes_per_sec;
+	u64 rate_records;
+	u64 rate_spi_bytes;
 };
 
+// State for one open file of a radio.
+struct nrf51822_reader {
+	struct nrf51822_dev *dev;
+	struct list_head list;
+	int slot;
+
+	// Sequence number of the next record in the ring to look at, and how
+	// many records from there on were accepted by this reader's filter.
+	u64 tail;
+	u64 pending;
+	u64 delivered;
+	u64 dropped;
+	u64 filtered;
+
+	struct nrf51822_filter filter;
+	u32 flags;
+
+	wait_queue_head_t queue;
+};
+
+// State for one board, shared by its radios.
 struct nrf51822_config {
 	dev_t chr_dev;
 	unsigned int major;
@@ -41,10 +318,24 @@ struct nrf51822_config {
 
 	struct nrf51822_dev *radios;
 
-	int debug_print;
+	// Transactions all radios have queued on the bus, and the radio that
+	// gets the next free slot. Protected by bus_lock.
+	spinlock_t bus_lock;
+	int bus_inflight;
+	int bus_rr;
+
+	// Updates the throughput figures of the board and every radio.
+	struct delayed_work rate_work;
+	u64 rate_ns;
+	u64 records_per_sec;
+	u64 spi_bytes_per_sec;
 };
 
 int nrf51822_issue_simple_command(uint8_t command, struct nrf51822_dev *dev);
-static void nrf51822_read_irq(struct nrf51822_dev *dev);
+int nrf51822_queue_command(struct nrf51822_dev *dev, const u8 *data, u8 len, bool nonblock);
+static int nrf51822_read_irq(struct nrf51822_dev *dev, struct nrf51822_xfer *xfer);
+static void nrf51822_bus_next(struct nrf51822_config *cfg);
+static bool nrf51822_reader_pending(struct nrf51822_reader *reader);
+static bool nrf51822_spi_idle(struct nrf51822_dev *dev);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,129 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM nrf51822
+
+#if !defined(_NRF51822_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _NRF51822_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+// Tracepoints along the receive path. Enable them with
+//   echo 1 > /sys/kernel/debug/tracing/events/nrf51822/enable
+// and compare timestamps between events to see where the time goes.
+
+// The nRF51822 raised its interrupt line.
+TRACE_EVENT(nrf51822_irq,
+	TP_PROTO(int radio),
+	TP_ARGS(radio),
+	TP_STRUCT__entry(
+		__field(int, radio)
+	),
+	TP_fast_assign(
+		__entry->radio = radio;
+	),
+	TP_printk("radio=%d", __entry->radio)
+);
+
+DECLARE_EVENT_CLASS(nrf51822_spi,
+	TP_PROTO(int radio, u8 command, int status),
+	TP_ARGS(radio, command, status),
+	TP_STRUCT__entry(
+		__field(int, radio)
+		__field(u8, command)
+		__field(int, status)
+	),
+	TP_fast_assign(
+		__entry->radio = radio;
+		__entry->command = command;
+		__entry->status = status;
+	),
+	TP_printk("radio=%d command=%u status=%d",
+	          __entry->radio, __entry->command, __entry->status)
+);
+
+// A BCP transaction was handed to gapspi.
+DEFINE_EVENT(nrf51822_spi, nrf51822_spi_submit,
+	TP_PROTO(int radio, u8 command, int status),
+	TP_ARGS(radio, command, status)
+);
+
+// The SPI completion callback for a BCP transaction ran.
+DEFINE_EVENT(nrf51822_spi, nrf51822_spi_complete,
+	TP_PROTO(int radio, u8 command, int status),
+	TP_ARGS(radio, command, status)
+);
+
+// A record was added to the radio's ring.
+TRACE_EVENT(nrf51822_record_enqueue,
+	TP_PROTO(int radio, u64 seq, int len, u64 irq_ns),
+	TP_ARGS(radio, seq, len, irq_ns),
+	TP_STRUCT__entry(
+		__field(int, radio)
+		__field(u64, seq)
+		__field(int, len)
+		__field(u64, irq_ns)
+	),
+	TP_fast_assign(
+		__entry->radio = radio;
+		__entry->seq = seq;
+		__entry->len = len;
+		__entry->irq_ns = irq_ns;
+	),
+	TP_printk("radio=%d seq=%llu len=%d irq_ns=%llu",
+	          __entry->radio, (unsigned long long) __entry->seq,
+	          __entry->len, (unsigned long long) __entry->irq_ns)
+);
+
+// A reader copied a record out with read(). latency_ns is measured from the
+// interrupt that brought the record in.
+TRACE_EVENT(nrf51822_record_dequeue,
+	TP_PROTO(int radio, int reader, u64 seq, u64 latency_ns),
+	TP_ARGS(radio, reader, seq, latency_ns),
+	TP_STRUCT__entry(
+		__field(int, radio)
+		__field(int, reader)
+		__field(u64, seq)
+		__field(u64, latency_ns)
+	),
+	TP_fast_assign(
+		__entry->radio = radio;
+		__entry->reader = reader;
+		__entry->seq = seq;
+		__entry->latency_ns = latency_ns;
+	),
+	TP_printk("radio=%d reader=%d seq=%llu latency_ns=%llu",
+	          __entry->radio, __entry->reader,
+	          (unsigned long long) __entry->seq,
+	          (unsigned long long) __entry->latency_ns)
+);
+
+// The watchdog reset the radio. downtime_ns is measured from the last good
+// frame.
+TRACE_EVENT(nrf51822_reset,
+	TP_PROTO(int radio, int reason, u64 downtime_ns),
+	TP_ARGS(radio, reason, downtime_ns),
+	TP_STRUCT__entry(
+		__field(int, radio)
+		__field(int, reason)
+		__field(u64, downtime_ns)
+	),
+	TP_fast_assign(
+		__entry->radio = radio;
+		__entry->reason = reason;
+		__entry->downtime_ns = downtime_ns;
+	),
+	TP_printk("radio=%d reason=%s downtime_ns=%llu",
+	          __entry->radio,
+	          __print_symbolic(__entry->reason,
+	                           { NRF51822_RESET_STUCK_IRQ, "stuck_irq" },
+	                           { NRF51822_RESET_INVALID_FRAMES, "invalid_frames" },
+	                           { NRF51822_RESET_NO_PROGRESS, "no_progress" }),
+	          (unsigned long long) __entry->downtime_ns)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE nrf51822_trace
+#include <trace/define_trace.h>
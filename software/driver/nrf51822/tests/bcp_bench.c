@@ -0,0 +1,140 @@
+// Benchmark the nRF51822 -> SPI -> driver -> userspace path with synthetic
+// records generated by the chip at a fixed rate.
+//
+//   bcp_bench [-d /dev/nrf51822_0] [-r rate] [-s size] [-n count] [-t idle_s]
+//
+// Sniffing should be off so only benchmark records are queued; anything
+// else that arrives is skipped.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "../ioctl.h"
+#include "../bcp.h"
+#include "bcp_bench.h"
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bcp_bench_command(int fd, uint16_t rate, uint8_t size, uint32_t count)
+{
+	struct nrf51822_command cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.len = 8;
+	cmd.data[0] = BCP_COMMAND_BENCHMARK;
+	cmd.data[1] = rate & 0xff;
+	cmd.data[2] = rate >> 8;
+	cmd.data[3] = size;
+	cmd.data[4] = count & 0xff;
+	cmd.data[5] = (count >> 8) & 0xff;
+	cmd.data[6] = (count >> 16) & 0xff;
+	cmd.data[7] = count >> 24;
+
+	return ioctl(fd, NRF51822_IOCTL_COMMAND, &cmd);
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = "/dev/nrf51822_0";
+	unsigned long rate = 1000;
+	unsigned long size = 20;
+	unsigned long count = 10000;
+	int idle_s = 2;
+	struct nrf51822_read_flags flags = { .flags = NRF51822_READ_F_HEADER };
+	struct nrf51822_record_header *hdr;
+	struct bcp_bench_report report;
+	struct bcp_bench bench;
+	struct pollfd pfd;
+	uint8_t buf[256];
+	uint64_t other = 0;
+	uint32_t seq, tick;
+	ssize_t got;
+	int fd;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:r:s:n:t:")) != -1) {
+		switch (opt) {
+		  case 'd': path = optarg; break;
+		  case 'r': rate = strtoul(optarg, NULL, 0); break;
+		  case 's': size = strtoul(optarg, NULL, 0); break;
+		  case 'n': count = strtoul(optarg, NULL, 0); break;
+		  case 't': idle_s = atoi(optarg); break;
+		  default:
+			fprintf(stderr, "usage: %s [-d device] [-r rate] [-s size] [-n count] [-t idle_s]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (rate == 0 || rate > 65535 || size > 255 || count == 0) {
+		fprintf(stderr, "rate must be 1-65535, size at most 255, count at least 1\n");
+		return 1;
+	}
+
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		perror(path);
+		return 1;
+	}
+
+	if (ioctl(fd, NRF51822_IOCTL_SET_READ_FLAGS, &flags) < 0) {
+		perror("NRF51822_IOCTL_SET_READ_FLAGS");
+		return 1;
+	}
+
+	bcp_bench_init(&bench);
+
+	printf("%lu records of %lu bytes at %lu records/s from %s\n", count, size, rate, path);
+	if (bcp_bench_command(fd, rate, size, count) < 0) {
+		perror("NRF51822_IOCTL_COMMAND");
+		return 1;
+	}
+
+	// Read until everything arrived or nothing did for idle_s.
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (bench.n < count) {
+		if (poll(&pfd, 1, idle_s * 1000) <= 0) {
+			break;
+		}
+
+		got = read(fd, buf, sizeof(buf));
+		if (got < (ssize_t) sizeof(struct nrf51822_record_header)) {
+			continue;
+		}
+
+		hdr = (struct nrf51822_record_header*) buf;
+		if (bcp_bench_parse(buf + sizeof(*hdr), hdr->len, &seq, &tick) < 0) {
+			other++;
+			continue;
+		}
+		if (bcp_bench_add(&bench, seq, tick, hdr->irq_ns, hdr->rx_ns,
+		                  now_ns(), hdr->lost) < 0) {
+			fprintf(stderr, "out of memory\n");
+			break;
+		}
+	}
+
+	bcp_bench_command(fd, 0, 0, 0);
+	close(fd);
+
+	bcp_bench_compute(&bench, count, &report);
+	bcp_bench_print(&report, stdout);
+	if (other) {
+		printf("skipped %llu records that were not from the benchmark\n",
+		       (unsigned long long) other);
+	}
+
+	bcp_bench_free(&bench);
+	return 0;
+}
@@ -0,0 +1,89 @@
+#ifndef _BCP_BENCH_H_
+#define _BCP_BENCH_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stddef.h>
+
+// Host side of the BCP benchmark: collects the synthetic records the
+// nRF51822 generates for BCP_COMMAND_BENCHMARK (see
+// software/nrf51822/bcp_benchmark.h) and works out rate, loss and latency.
+// Nothing here touches the device, so it also runs against simulated input.
+
+#define BCP_BENCH_MAGIC       0xbe
+#define BCP_BENCH_HEADER_LEN  9
+#define BCP_BENCH_TICKS       32768
+#define BCP_BENCH_TICK_MASK   0xffffff
+
+// Percentiles reported for every latency.
+#define BCP_BENCH_NUM_PCT 5
+extern const double bcp_bench_pct[BCP_BENCH_NUM_PCT];
+
+// One received record. Host times are CLOCK_MONOTONIC nanoseconds.
+struct bcp_bench_sample {
+	uint64_t tick_ns;   // when the chip generated it, on the chip's clock
+	uint64_t irq_ns;    // interrupt, from the record header
+	uint64_t rx_ns;     // SPI completion, from the record header
+	uint64_t read_ns;   // when read() returned it
+};
+
+struct bcp_bench {
+	struct bcp_bench_sample *samples;
+	size_t n;
+	size_t cap;
+
+	// One bit per sequence number received.
+	uint8_t *seen;
+	size_t seen_len;
+	uint32_t min_seq;
+	uint32_t max_seq;
+	uint64_t duplicates;
+
+	// Records the driver reported lost in the record headers.
+	uint64_t driver_lost;
+
+	// The chip's 24 bit tick counter, unwrapped.
+	uint32_t last_tick;
+	uint64_t last_abs;
+};
+
+struct bcp_bench_report {
+	uint64_t received;
+	uint64_t lost;
+	uint64_t duplicates;
+	uint64_t driver_lost;
+	double loss_pct;
+	double offered_rate;   // records/s the chip generated
+	double achieved_rate;  // records/s that reached the host
+
+	// Latency percentiles in ns. chip is generation to interrupt, measured
+	// against the fastest records at the start and end of the run, which
+	// takes out the offset and drift between the two clocks. driver is
+	// interrupt to SPI completion, user SPI completion to read().
+	uint64_t chip[BCP_BENCH_NUM_PCT];
+	uint64_t driver[BCP_BENCH_NUM_PCT];
+	uint64_t user[BCP_BENCH_NUM_PCT];
+	uint64_t total[BCP_BENCH_NUM_PCT];
+};
+
+void bcp_bench_init(struct bcp_bench *bench);
+void bcp_bench_free(struct bcp_bench *bench);
+
+// Pull the sequence number and tick out of a record as read() returns it,
+// [len][type][payload]. Returns -1 if it is not a benchmark record.
+int bcp_bench_parse(const uint8_t *rec, size_t len, uint32_t *seq, uint32_t *tick);
+
+// Add a received record. lost is the header's lost field. Returns -1 if
+// out of memory.
+int bcp_bench_add(struct bcp_bench *bench, uint32_t seq, uint32_t tick,
+                  uint64_t irq_ns, uint64_t rx_ns, uint64_t read_ns,
+                  uint16_t lost);
+
+// expected is how many records the chip was asked for, or 0 if unknown;
+// without it, records lost after the last one received are not counted.
+void bcp_bench_compute(struct bcp_bench *bench, uint64_t expected,
+                       struct bcp_bench_report *report);
+void bcp_bench_print(const struct bcp_bench_report *report, FILE *f);
+
+#endif
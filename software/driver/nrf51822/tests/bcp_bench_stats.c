@@ -0,0 +1,273 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "bcp_bench.h"
+
+const double bcp_bench_pct[BCP_BENCH_NUM_PCT] = {0.5, 0.9, 0.99, 0.999, 1.0};
+
+static uint32_t get_u32(const uint8_t *buf)
+{
+	return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t) buf[3] << 24);
+}
+
+void bcp_bench_init(struct bcp_bench *bench)
+{
+	memset(bench, 0, sizeof(struct bcp_bench));
+}
+
+void bcp_bench_free(struct bcp_bench *bench)
+{
+	free(bench->samples);
+	free(bench->seen);
+	bcp_bench_init(bench);
+}
+
+int bcp_bench_parse(const uint8_t *rec, size_t len, uint32_t *seq, uint32_t *tick)
+{
+	const uint8_t *payload = rec + 2;
+
+	if (len < 2 + BCP_BENCH_HEADER_LEN || payload[0] != BCP_BENCH_MAGIC) {
+		return -1;
+	}
+
+	*seq = get_u32(payload+1);
+	*tick = get_u32(payload+5);
+	return 0;
+}
+
+// Ticks are 24 bits and records can arrive out of order when they were
+// resent, so unwrap each one relative to the last.
+static uint64_t bcp_bench_unwrap(struct bcp_bench *bench, uint32_t tick)
+{
+	uint32_t ahead = (tick - bench->last_tick) & BCP_BENCH_TICK_MASK;
+	uint64_t abs;
+
+	if (bench->n == 0) {
+		abs = tick;
+	} else if (ahead < BCP_BENCH_TICK_MASK/2) {
+		abs = bench->last_abs + ahead;
+	} else {
+		return bench->last_abs - ((bench->last_tick - tick) & BCP_BENCH_TICK_MASK);
+	}
+
+	bench->last_tick = tick;
+	bench->last_abs = abs;
+	return abs;
+}
+
+int bcp_bench_add(struct bcp_bench *bench, uint32_t seq, uint32_t tick,
+                  uint64_t irq_ns, uint64_t rx_ns, uint64_t read_ns,
+                  uint16_t lost)
+{
+	struct bcp_bench_sample *s;
+	size_t byte = seq / 8;
+	uint64_t abs;
+
+	bench->driver_lost += lost;
+
+	if (byte >= bench->seen_len) {
+		size_t len = bench->seen_len ? bench->seen_len : 1024;
+		uint8_t *seen;
+
+		while (len <= byte) {
+			len *= 2;
+		}
+		seen = realloc(bench->seen, len);
+		if (seen == NULL) {
+			return -1;
+		}
+		memset(seen + bench->seen_len, 0, len - bench->seen_len);
+		bench->seen = seen;
+		bench->seen_len = len;
+	}
+
+	if (bench->seen[byte] & (1 << (seq % 8))) {
+		bench->duplicates++;
+		return 0;
+	}
+	bench->seen[byte] |= 1 << (seq % 8);
+
+	if (bench->n == bench->cap) {
+		size_t cap = bench->cap ? bench->cap*2 : 4096;
+		struct bcp_bench_sample *samples;
+
+		samples = realloc(bench->samples, cap * sizeof(struct bcp_bench_sample));
+		if (samples == NULL) {
+			return -1;
+		}
+		bench->samples = samples;
+		bench->cap = cap;
+	}
+
+	abs = bcp_bench_unwrap(bench, tick);
+	if (bench->n == 0 || seq > bench->max_seq) {
+		bench->max_seq = seq;
+	}
+	if (bench->n == 0 || seq < bench->min_seq) {
+		bench->min_seq = seq;
+	}
+
+	s = &bench->samples[bench->n++];
+	s->tick_ns = abs * 1000000000ULL / BCP_BENCH_TICKS;
+	s->irq_ns = irq_ns;
+	s->rx_ns = rx_ns;
+	s->read_ns = read_ns;
+
+	return 0;
+}
+
+static int bcp_bench_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*) a;
+	uint64_t y = *(const uint64_t*) b;
+
+	return (x > y) - (x < y);
+}
+
+static int bcp_bench_cmp_tick(const void *a, const void *b)
+{
+	const struct bcp_bench_sample *x = a;
+	const struct bcp_bench_sample *y = b;
+
+	return (x->tick_ns > y->tick_ns) - (x->tick_ns < y->tick_ns);
+}
+
+// Sort values and fill out with the percentiles in bcp_bench_pct.
+static void bcp_bench_percentiles(uint64_t *values, size_t n, uint64_t *out)
+{
+	size_t idx;
+	int i;
+
+	qsort(values, n, sizeof(uint64_t), bcp_bench_cmp_u64);
+	for (i=0; i<BCP_BENCH_NUM_PCT; i++) {
+		idx = (size_t) ceil(bcp_bench_pct[i] * n);
+		out[i] = values[idx > 0 ? idx-1 : 0];
+	}
+}
+
+// The smallest interrupt-minus-generation offset among samples [from, to).
+// The chip and host clocks are unrelated, so this is the best guess at the
+// offset between them around that time.
+static void bcp_bench_min_offset(struct bcp_bench_sample *s, size_t from, size_t to,
+                                 int64_t *offset, uint64_t *at)
+{
+	size_t i;
+
+	*offset = (int64_t) (s[from].irq_ns - s[from].tick_ns);
+	*at = s[from].tick_ns;
+	for (i=from+1; i<to; i++) {
+		int64_t o = (int64_t) (s[i].irq_ns - s[i].tick_ns);
+		if (o < *offset) {
+			*offset = o;
+			*at = s[i].tick_ns;
+		}
+	}
+}
+
+void bcp_bench_compute(struct bcp_bench *bench, uint64_t expected,
+                       struct bcp_bench_report *report)
+{
+	struct bcp_bench_sample *s = bench->samples;
+	uint64_t *chip, *driver, *user, *total;
+	uint64_t first_rx, last_rx;
+	uint64_t at1, at2;
+	int64_t off1, off2;
+	double slope = 0;
+	size_t window;
+	size_t i;
+
+	memset(report, 0, sizeof(struct bcp_bench_report));
+	report->received = bench->n;
+	report->duplicates = bench->duplicates;
+	report->driver_lost = bench->driver_lost;
+
+	if (bench->n == 0) {
+		report->lost = expected;
+		report->loss_pct = expected ? 100 : 0;
+		return;
+	}
+
+	if (expected < (uint64_t) bench->max_seq + 1) {
+		expected = (uint64_t) bench->max_seq + 1;
+	}
+	report->lost = expected - bench->n;
+	report->loss_pct = 100.0 * report->lost / expected;
+
+	qsort(s, bench->n, sizeof(struct bcp_bench_sample), bcp_bench_cmp_tick);
+
+	if (s[bench->n-1].tick_ns > s[0].tick_ns) {
+		report->offered_rate = (double) (bench->max_seq - bench->min_seq) * 1e9 /
+		                       (s[bench->n-1].tick_ns - s[0].tick_ns);
+	}
+
+	first_rx = last_rx = s[0].rx_ns;
+	for (i=1; i<bench->n; i++) {
+		if (s[i].rx_ns < first_rx) first_rx = s[i].rx_ns;
+		if (s[i].rx_ns > last_rx) last_rx = s[i].rx_ns;
+	}
+	if (last_rx > first_rx) {
+		report->achieved_rate = (double) (bench->n - 1) * 1e9 / (last_rx - first_rx);
+	}
+
+	// Offset at the start and the end of the run. The line through them
+	// also takes out the drift of the chip's RC clock.
+	window = bench->n / 10 ? bench->n / 10 : 1;
+	bcp_bench_min_offset(s, 0, window, &off1, &at1);
+	bcp_bench_min_offset(s, bench->n - window, bench->n, &off2, &at2);
+	if (at2 > at1) {
+		slope = (double) (off2 - off1) / (at2 - at1);
+	}
+
+	chip = malloc(4 * bench->n * sizeof(uint64_t));
+	if (chip == NULL) {
+		return;
+	}
+	driver = chip + bench->n;
+	user = driver + bench->n;
+	total = user + bench->n;
+
+	for (i=0; i<bench->n; i++) {
+		int64_t base = off1 + (int64_t) (slope * ((double) s[i].tick_ns - at1));
+		int64_t c = (int64_t) (s[i].irq_ns - s[i].tick_ns) - base;
+
+		chip[i] = c > 0 ? c : 0;
+		driver[i] = s[i].rx_ns - s[i].irq_ns;
+		user[i] = s[i].read_ns - s[i].rx_ns;
+		total[i] = chip[i] + driver[i] + user[i];
+	}
+
+	bcp_bench_percentiles(chip, bench->n, report->chip);
+	bcp_bench_percentiles(driver, bench->n, report->driver);
+	bcp_bench_percentiles(user, bench->n, report->user);
+	bcp_bench_percentiles(total, bench->n, report->total);
+
+	free(chip);
+}
+
+static void bcp_bench_print_row(FILE *f, const char *name, const uint64_t *v)
+{
+	int i;
+
+	fprintf(f, "  %-8s", name);
+	for (i=0; i<BCP_BENCH_NUM_PCT; i++) {
+		fprintf(f, " %10.1f", v[i] / 1000.0);
+	}
+	fprintf(f, "\n");
+}
+
+void bcp_bench_print(const struct bcp_bench_report *report, FILE *f)
+{
+	fprintf(f, "offered   %.1f records/s\n", report->offered_rate);
+	fprintf(f, "achieved  %.1f records/s\n", report->achieved_rate);
+	fprintf(f, "received  %llu, lost %llu (%.2f%%), duplicates %llu, lost per driver %llu\n",
+	        (unsigned long long) report->received,
+	        (unsigned long long) report->lost, report->loss_pct,
+	        (unsigned long long) report->duplicates,
+	        (unsigned long long) report->driver_lost);
+	fprintf(f, "latency (us)     p50        p90        p99      p99.9        max\n");
+	bcp_bench_print_row(f, "chip", report->chip);
+	bcp_bench_print_row(f, "driver", report->driver);
+	bcp_bench_print_row(f, "user", report->user);
+	bcp_bench_print_row(f, "total", report->total);
+}
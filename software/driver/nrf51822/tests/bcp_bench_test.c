@@ -0,0 +1,249 @@
+// Runs the firmware's benchmark generator and the host's reporting against
+// a simulated chip queue and driver, so both can be checked without the
+// hardware:
+//
+//   make test
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bcp_benchmark.h"
+#include "bcp_bench.h"
+
+#define SIM_QUEUE_LEN 4  // INTERRUPT_EVENT_QUEUE_LEN
+
+static int failures;
+
+#define CHECK(cond) do {                                             \
+	if (!(cond)) {                                                   \
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);   \
+		failures++;                                                  \
+	}                                                                \
+} while (0)
+
+struct sim_record {
+	uint8_t data[2 + BCP_BENCHMARK_MAX_SIZE];
+	uint8_t len;
+};
+
+struct sim {
+	struct sim_record queue[SIM_QUEUE_LEN];
+	int head;
+	int count;
+	uint64_t dropped;
+};
+
+static void sim_add(struct sim *sim, uint8_t *payload, uint8_t len)
+{
+	struct sim_record *rec;
+
+	if (sim->count == SIM_QUEUE_LEN) {
+		sim->dropped++;
+		return;
+	}
+
+	// As read() returns it
+	rec = &sim->queue[(sim->head + sim->count) % SIM_QUEUE_LEN];
+	rec->data[0] = len + 1;
+	rec->data[1] = 1;
+	memcpy(rec->data+2, payload, len);
+	rec->len = len + 2;
+	sim->count++;
+}
+
+static struct sim_record *sim_take(struct sim *sim)
+{
+	struct sim_record *rec;
+
+	if (sim->count == 0) {
+		return NULL;
+	}
+	rec = &sim->queue[sim->head];
+	sim->head = (sim->head + 1) % SIM_QUEUE_LEN;
+	sim->count--;
+	return rec;
+}
+
+// Run the generator for duration_ms, starting the chip's counter at
+// start_tick. The host reads up to per_ms records every millisecond. The
+// host clock runs drift_ppm fast relative to the chip's.
+static void sim_run(struct bcp_bench *bench, struct sim *sim,
+                    uint16_t rate, uint8_t size, uint32_t count,
+                    uint32_t start_tick, int duration_ms, int per_ms,
+                    double drift_ppm)
+{
+	bcp_benchmark_t gen;
+	uint8_t payload[BCP_BENCHMARK_MAX_SIZE];
+	struct sim_record *rec;
+	uint32_t seq, tick;
+	uint64_t host;
+	uint32_t due;
+	int ms, i;
+
+	memset(sim, 0, sizeof(struct sim));
+	bcp_benchmark_start(&gen, rate, size, count, start_tick);
+
+	for (ms=1; ms<=duration_ms; ms++) {
+		uint64_t t_ns = (uint64_t) ms * 1000000;
+		uint32_t now = start_tick + (uint32_t) (t_ns * BCP_BENCH_TICKS / 1000000000ULL);
+
+		due = bcp_benchmark_due(&gen, now);
+		while (due-- > 0) {
+			sim_add(sim, payload, bcp_benchmark_record(&gen, now, payload));
+		}
+
+		// The host clock is unrelated to the chip's
+		host = 5000000000ULL + (uint64_t) (t_ns * (1 + drift_ppm / 1e6));
+		for (i=0; i<per_ms; i++) {
+			rec = sim_take(sim);
+			if (rec == NULL) {
+				break;
+			}
+			CHECK(bcp_bench_parse(rec->data, rec->len, &seq, &tick) == 0);
+			// 20 us to the interrupt, 50 us on SPI, 10 us to read()
+			bcp_bench_add(bench, seq, tick, host + 20000, host + 70000,
+			              host + 80000, 0);
+		}
+	}
+}
+
+// The generator keeps its schedule: rate per second, exactly count
+// records, then it stops.
+static void test_generator(void)
+{
+	bcp_benchmark_t gen;
+	uint8_t cmd[BCP_BENCHMARK_CMD_LEN] = {0xe8, 0x03, 20, 0x10, 0x27, 0, 0};
+	uint8_t buf[BCP_BENCHMARK_MAX_SIZE];
+	uint32_t total = 0;
+	uint32_t seq, tick;
+	uint8_t rec[2 + BCP_BENCHMARK_MAX_SIZE];
+	int ms;
+
+	// 1000/s, 20 bytes, 10000 records
+	CHECK(bcp_benchmark_command(&gen, cmd, sizeof(cmd), 100));
+	CHECK(gen.rate == 1000 && gen.size == 20 && gen.count == 10000);
+
+	for (ms=1; ms<=500; ms++) {
+		uint32_t now = 100 + (uint32_t) ((uint64_t) ms * BCP_BENCH_TICKS / 1000);
+		uint32_t due = bcp_benchmark_due(&gen, now);
+		total += due;
+		while (due-- > 0) {
+			CHECK(bcp_benchmark_record(&gen, now, buf) == 20);
+		}
+	}
+	CHECK(total == 500);
+
+	memcpy(rec+2, buf, 20);
+	CHECK(bcp_bench_parse(rec, 22, &seq, &tick) == 0);
+	CHECK(seq == 499);
+	CHECK(tick == 100 + BCP_BENCH_TICKS/2);
+
+	// Stops after count
+	bcp_benchmark_start(&gen, 1000, 20, 3, 0);
+	CHECK(bcp_benchmark_due(&gen, BCP_BENCH_TICKS) == 3);
+	bcp_benchmark_record(&gen, 0, buf);
+	bcp_benchmark_record(&gen, 0, buf);
+	bcp_benchmark_record(&gen, 0, buf);
+	CHECK(!gen.running);
+	CHECK(bcp_benchmark_due(&gen, 2*BCP_BENCH_TICKS) == 0);
+
+	// Sizes are kept within what fits a record
+	bcp_benchmark_start(&gen, 1, 200, 0, 0);
+	CHECK(gen.size == BCP_BENCHMARK_MAX_SIZE);
+	bcp_benchmark_start(&gen, 1, 1, 0, 0);
+	CHECK(gen.size == BCP_BENCHMARK_HEADER_LEN);
+
+	// Rate 0 stops
+	cmd[0] = cmd[1] = 0;
+	CHECK(!bcp_benchmark_command(&gen, cmd, sizeof(cmd), 0));
+}
+
+// Offered twice what the host reads: half is dropped by the chip's queue
+// and the report counts exactly those. The tick counter wraps during the
+// run.
+static void test_overload(void)
+{
+	struct bcp_bench_report r;
+	struct bcp_bench bench;
+	struct sim sim;
+
+	bcp_bench_init(&bench);
+	sim_run(&bench, &sim, 2000, 20, 4000, BCP_BENCH_TICK_MASK - 10000, 2100, 1, 0);
+	bcp_bench_compute(&bench, 4000, &r);
+	bcp_bench_print(&r, stdout);
+
+	CHECK(r.received + r.lost == 4000);
+	CHECK(r.lost == sim.dropped);
+	CHECK(r.duplicates == 0);
+	CHECK(r.offered_rate > 1980 && r.offered_rate < 2020);
+	CHECK(r.achieved_rate > 990 && r.achieved_rate < 1010);
+	CHECK(r.driver[0] == 50000 && r.driver[4] == 50000);
+	CHECK(r.user[0] == 10000);
+	// Records wait in the full queue for a few ms
+	CHECK(r.chip[2] > 2000000);
+
+	bcp_bench_free(&bench);
+}
+
+// Below capacity nothing is lost, and the chip latency stays within a tick
+// even with the host clock 250 ppm off, like the chip's RC oscillator.
+static void test_drift(void)
+{
+	struct bcp_bench_report r;
+	struct bcp_bench bench;
+	struct sim sim;
+
+	bcp_bench_init(&bench);
+	sim_run(&bench, &sim, 500, 39, 5000, 0, 10100, 4, 250);
+	bcp_bench_compute(&bench, 5000, &r);
+	bcp_bench_print(&r, stdout);
+
+	CHECK(r.received == 5000);
+	CHECK(r.lost == 0);
+	CHECK(r.chip[4] < 1000000000ULL / BCP_BENCH_TICKS + 1000);
+
+	bcp_bench_free(&bench);
+}
+
+// Duplicates and records that are not from the benchmark.
+static void test_parse(void)
+{
+	struct bcp_bench_report r;
+	struct bcp_bench bench;
+	uint8_t rec[2 + BCP_BENCH_HEADER_LEN] = {BCP_BENCH_HEADER_LEN + 1, 1, BCP_BENCH_MAGIC};
+	uint32_t seq, tick;
+
+	CHECK(bcp_bench_parse(rec, sizeof(rec), &seq, &tick) == 0);
+	CHECK(bcp_bench_parse(rec, sizeof(rec) - 1, &seq, &tick) < 0);
+	rec[2] = 0;
+	CHECK(bcp_bench_parse(rec, sizeof(rec), &seq, &tick) < 0);
+
+	bcp_bench_init(&bench);
+	bcp_bench_add(&bench, 0, 0, 1000, 2000, 3000, 0);
+	bcp_bench_add(&bench, 2, 66, 2000, 3000, 4000, 1);
+	bcp_bench_add(&bench, 2, 66, 2000, 3000, 4000, 0);
+	bcp_bench_compute(&bench, 0, &r);
+
+	CHECK(r.received == 2);
+	CHECK(r.lost == 1);
+	CHECK(r.duplicates == 1);
+	CHECK(r.driver_lost == 1);
+
+	bcp_bench_free(&bench);
+}
+
+int main(void)
+{
+	test_generator();
+	test_overload();
+	test_drift();
+	test_parse();
+
+	if (failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}
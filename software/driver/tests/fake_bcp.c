@@ -0,0 +1,435 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/delay.h>
+#include <linux/spi/spi.h>
+#include <linux/platform_device.h>
+#include <linux/crc-itu-t.h>
+
+#include "../nrf51822/bcp.h"
+
+#include "fake_bcp.h"
+
+// The GPIO stand-ins need to find the controller without a handle.
+static struct fake_bcp *fake_bcp_active;
+
+// Build the next synthetic advertisement record. Its payload is a 32 bit
+// counter padded to record_len bytes.
+static void fake_bcp_make_record(struct fake_bcp *bcp, struct fake_bcp_frame *frame)
+{
+	u32 n = bcp->next_record++;
+
+	memset(frame, 0, sizeof(struct fake_bcp_frame));
+	frame->type = BCP_RSP_ADVERTISEMENT;
+	frame->seq = bcp->seq++;
+	memcpy(frame->data, &n, sizeof(n));
+	frame->len = bcp->record_len;
+}
+
+// Put a frame in the TX buffer in the BCP wire format. Must hold lock.
+static void fake_bcp_put(struct fake_bcp *bcp, struct fake_bcp_frame *frame)
+{
+	int offset = bcp->corrupt_first_byte ? 1 : 0;
+	u8 *out = bcp->tx + offset;
+	u16 crc;
+
+	memset(bcp->tx, 0, FAKE_BCP_BUF_LEN);
+
+	if (bcp->legacy_frames) {
+		// [length][response type][payload]
+		out[0] = frame->len + 1;
+		out[1] = frame->type;
+		memcpy(out+2, frame->data, frame->len);
+		return;
+	}
+
+	// [length][response type][seq][payload][crc]
+	out[0] = frame->len + BCP_FRAME_OVERHEAD;
+	out[1] = frame->type | BCP_RSP_CHECKED;
+	out[2] = frame->seq;
+	memcpy(out+3, frame->data, frame->len);
+	crc = crc_itu_t(0xffff, out, frame->len + 3);
+	out[frame->len+3] = crc & 0xff;
+	out[frame->len+4] = crc >> 8;
+}
+
+static struct fake_bcp_frame *fake_bcp_history_find(struct fake_bcp *bcp, u8 seq)
+{
+	int i;
+
+	for (i=0; i<bcp->history_count; i++) {
+		if (bcp->history[i].seq == seq) {
+			return &bcp->history[i];
+		}
+	}
+	return NULL;
+}
+
+// Load the next frame into the slave's TX buffer, the way
+// spi_slave_load_next() does when chip select goes high. Must hold lock.
+static void fake_bcp_load_next(struct fake_bcp *bcp)
+{
+	struct fake_bcp_frame *frame;
+	struct fake_bcp_frame none;
+	u8 seq;
+
+	if (bcp->resend_count > 0) {
+		seq = bcp->resend[0];
+		bcp->resend_count--;
+		memmove(bcp->resend, bcp->resend+1, bcp->resend_count);
+
+		frame = fake_bcp_history_find(bcp, seq);
+		if (frame == NULL) {
+			memset(&none, 0, sizeof(none));
+			none.type = BCP_RSP_LOST;
+			none.seq = seq;
+			frame = &none;
+		}
+		fake_bcp_put(bcp, frame);
+		bcp->tx_full = true;
+		goto out;
+	}
+
+	if (bcp->queue_count == 0 && bcp->records_left > 0) {
+		fake_bcp_make_record(bcp, &bcp->queue[bcp->queue_head]);
+		bcp->queue_count++;
+		bcp->records_left--;
+	}
+
+	if (bcp->queue_count > 0) {
+		frame = &bcp->history[bcp->history_next];
+		*frame = bcp->queue[bcp->queue_head];
+		bcp->history_next = (bcp->history_next + 1) % FAKE_BCP_HISTORY_LEN;
+		if (bcp->history_count < FAKE_BCP_HISTORY_LEN) {
+			bcp->history_count++;
+		}
+		bcp->queue_head = (bcp->queue_head + 1) % FAKE_BCP_QUEUE_LEN;
+		bcp->queue_count--;
+
+		fake_bcp_put(bcp, frame);
+		bcp->tx_full = true;
+	} else {
+		// Reads with nothing queued get an empty frame carrying the
+		// next sequence number.
+		memset(&none, 0, sizeof(none));
+		none.type = BCP_RSP_NONE;
+		none.seq = bcp->seq;
+		fake_bcp_put(bcp, &none);
+		bcp->tx_full = false;
+	}
+
+out:
+	bcp->irq_line = bcp->tx_full || bcp->stuck_irq;
+}
+
+// The master's command, from the start of what it clocked out. Must hold
+// lock.
+static void fake_bcp_command(struct fake_bcp *bcp, const u8 *cmd, unsigned int len)
+{
+	if (bcp->cmd_count < FAKE_BCP_CMD_LOG_LEN) {
+		bcp->cmd_log[bcp->cmd_count++] = cmd[0];
+	}
+
+	if (cmd[0] == BCP_COMMAND_RESEND && len > 1 &&
+	    bcp->resend_count < FAKE_BCP_HISTORY_LEN) {
+		bcp->resend[bcp->resend_count++] = cmd[1];
+	}
+}
+
+// Raise the interrupt if the line just went high. Call without the lock.
+static void fake_bcp_edge(struct fake_bcp *bcp, bool was_high)
+{
+	if (!was_high && bcp->irq_line && bcp->irq_handler) {
+		bcp->irq_handler(bcp->irq_ctx);
+	}
+}
+
+static int fake_bcp_transfer_one_message(struct spi_master *master,
+                                         struct spi_message *msg)
+{
+	struct fake_bcp *bcp = spi_master_get_devdata(master);
+	struct spi_transfer *t;
+	unsigned long flags;
+	unsigned int cs_setup = 0;
+	bool was_high;
+
+	list_for_each_entry(t, &msg->transfers, transfer_list) {
+		if (t->len == 0) {
+			// Only holds chip select before the next transfer
+			cs_setup = t->delay_usecs;
+			continue;
+		}
+
+		spin_lock_irqsave(&bcp->lock, flags);
+
+		bcp->gpios_at_xfer = bcp->gpios;
+		bcp->mode_at_xfer = msg->spi->mode;
+		bcp->transfers++;
+
+		if (bcp->gpios & FAKE_BCP_MUX_MASK) {
+			// Not our output. Nobody drives MISO.
+			if (t->rx_buf) {
+				memset(t->rx_buf, 0, t->len);
+			}
+			spin_unlock_irqrestore(&bcp->lock, flags);
+			msg->actual_length += t->len;
+			continue;
+		}
+
+		if (t->tx_buf && t->len > 0) {
+			fake_bcp_command(bcp, t->tx_buf, t->len);
+		}
+
+		was_high = bcp->irq_line;
+		if ((bcp->invalid_every && bcp->transfers % bcp->invalid_every == 0) ||
+		    (bcp->max_good_hz && t->speed_hz > bcp->max_good_hz)) {
+			// Garbage on the wire. The slave still thinks it sent the
+			// frame in its buffer.
+			if (bcp->tx_full) {
+				bcp->garbled++;
+			}
+			if (t->rx_buf) {
+				memset(t->rx_buf, 0, t->len);
+			}
+		} else if (t->rx_buf) {
+			memset(t->rx_buf, 0, t->len);
+			memcpy(t->rx_buf, bcp->tx, min_t(unsigned int, t->len, FAKE_BCP_BUF_LEN));
+			if (cs_setup < bcp->min_cs_setup_us && t->len > 1) {
+				// Clocked before the slave was ready for it
+				memmove((u8*) t->rx_buf + 1, t->rx_buf, t->len - 1);
+				((u8*) t->rx_buf)[0] = 0;
+			}
+			if (bcp->corrupt_next && bcp->tx_full && t->len > 4) {
+				// One bit error in the payload
+				((u8*) t->rx_buf)[4] ^= 0x01;
+				bcp->corrupt_next = false;
+				bcp->corrupted++;
+			}
+		}
+		fake_bcp_load_next(bcp);
+
+		spin_unlock_irqrestore(&bcp->lock, flags);
+
+		fake_bcp_edge(bcp, was_high);
+
+		msg->actual_length += t->len;
+		cs_setup = 0;
+	}
+
+	msg->status = 0;
+	spi_finalize_current_message(master);
+
+	return 0;
+}
+
+void fake_bcp_add_record(struct fake_bcp *bcp)
+{
+	unsigned long flags;
+	bool was_high;
+	int slot;
+
+	spin_lock_irqsave(&bcp->lock, flags);
+	was_high = bcp->irq_line;
+	if (bcp->queue_count == FAKE_BCP_QUEUE_LEN) {
+		// Dropped, but it still uses up a sequence number
+		bcp->slave_dropped++;
+		bcp->next_record++;
+		bcp->seq++;
+	} else {
+		slot = (bcp->queue_head + bcp->queue_count) % FAKE_BCP_QUEUE_LEN;
+		fake_bcp_make_record(bcp, &bcp->queue[slot]);
+		bcp->queue_count++;
+		if (!bcp->tx_full) {
+			fake_bcp_load_next(bcp);
+		}
+	}
+	spin_unlock_irqrestore(&bcp->lock, flags);
+
+	fake_bcp_edge(bcp, was_high);
+}
+
+void fake_bcp_stream(struct fake_bcp *bcp, u32 count)
+{
+	unsigned long flags;
+	bool was_high;
+
+	spin_lock_irqsave(&bcp->lock, flags);
+	was_high = bcp->irq_line;
+	bcp->records_left += count;
+	if (!bcp->tx_full) {
+		fake_bcp_load_next(bcp);
+	}
+	spin_unlock_irqrestore(&bcp->lock, flags);
+
+	fake_bcp_edge(bcp, was_high);
+}
+
+static enum hrtimer_restart fake_bcp_timer(struct hrtimer *timer)
+{
+	struct fake_bcp *bcp = container_of(timer, struct fake_bcp, timer);
+
+	if (bcp->rate == 0) {
+		return HRTIMER_NORESTART;
+	}
+
+	fake_bcp_add_record(bcp);
+	hrtimer_forward_now(timer, ns_to_ktime(NSEC_PER_SEC / bcp->rate));
+
+	return HRTIMER_RESTART;
+}
+
+void fake_bcp_set_rate(struct fake_bcp *bcp, u32 rate)
+{
+	hrtimer_cancel(&bcp->timer);
+	bcp->rate = rate;
+	if (rate) {
+		hrtimer_start(&bcp->timer, ns_to_ktime(NSEC_PER_SEC / rate), HRTIMER_MODE_REL);
+	}
+}
+
+void fake_bcp_set_stuck_irq(struct fake_bcp *bcp, bool stuck)
+{
+	unsigned long flags;
+	bool was_high;
+
+	spin_lock_irqsave(&bcp->lock, flags);
+	was_high = bcp->irq_line;
+	bcp->stuck_irq = stuck;
+	bcp->irq_line = bcp->tx_full || bcp->stuck_irq;
+	spin_unlock_irqrestore(&bcp->lock, flags);
+
+	fake_bcp_edge(bcp, was_high);
+}
+
+void fake_bcp_set_irq_handler(struct fake_bcp *bcp, void (*handler)(void *ctx), void *ctx)
+{
+	bcp->irq_handler = handler;
+	bcp->irq_ctx = ctx;
+}
+
+int fake_bcp_gpio_get_value(unsigned int gpio)
+{
+	if (fake_bcp_active == NULL || gpio >= FAKE_BCP_NUM_GPIOS) {
+		return 0;
+	}
+	if (gpio == FAKE_BCP_IRQ_GPIO) {
+		return fake_bcp_active->irq_line;
+	}
+	return (fake_bcp_active->gpios >> gpio) & 1;
+}
+
+// Pulling the reset pin low reboots the slave: everything it had queued is
+// lost and its faults clear.
+static void fake_bcp_reset(struct fake_bcp *bcp)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&bcp->lock, flags);
+	bcp->queue_count = 0;
+	bcp->records_left = 0;
+	bcp->seq = 0;
+	bcp->history_count = 0;
+	bcp->resend_count = 0;
+	bcp->stuck_irq = false;
+	bcp->invalid_every = 0;
+	bcp->resets++;
+	fake_bcp_load_next(bcp);
+	spin_unlock_irqrestore(&bcp->lock, flags);
+}
+
+void fake_bcp_gpio_set_value(unsigned int gpio, int value)
+{
+	if (fake_bcp_active == NULL || gpio >= FAKE_BCP_NUM_GPIOS) {
+		return;
+	}
+	if (gpio == FAKE_BCP_RST_GPIO && !value &&
+	    (fake_bcp_active->gpios & BIT(gpio))) {
+		fake_bcp_reset(fake_bcp_active);
+	}
+	if (value) {
+		fake_bcp_active->gpios |= BIT(gpio);
+	} else {
+		fake_bcp_active->gpios &= ~BIT(gpio);
+	}
+}
+
+// All pins from 0 to n-1 change together, like gpiod_set_array_value() on
+// one GPIO bank.
+void fake_bcp_gpio_set_array(unsigned int n, unsigned long *values)
+{
+	u32 mask = BIT(n) - 1;
+
+	if (fake_bcp_active == NULL || n >= FAKE_BCP_NUM_GPIOS) {
+		return;
+	}
+	fake_bcp_active->gpios = (fake_bcp_active->gpios & ~mask) | (*values & mask);
+	fake_bcp_active->array_writes++;
+}
+
+struct fake_bcp *fake_bcp_create(void)
+{
+	struct platform_device *pdev;
+	struct spi_master *master;
+	struct fake_bcp *bcp;
+	struct spi_board_info info = {
+		.modalias = "fake-bcp",
+		.max_speed_hz = 4000000,
+		.chip_select = 0,
+		.mode = SPI_MODE_0,
+	};
+
+	pdev = platform_device_register_simple("fake-bcp", PLATFORM_DEVID_AUTO, NULL, 0);
+	if (IS_ERR(pdev)) {
+		return NULL;
+	}
+
+	master = spi_alloc_master(&pdev->dev, sizeof(struct fake_bcp));
+	if (master == NULL) {
+		platform_device_unregister(pdev);
+		return NULL;
+	}
+
+	bcp = spi_master_get_devdata(master);
+	bcp->pdev = pdev;
+	bcp->master = master;
+	bcp->record_len = 8;
+	spin_lock_init(&bcp->lock);
+	fake_bcp_load_next(bcp);
+	hrtimer_init(&bcp->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	bcp->timer.function = fake_bcp_timer;
+
+	master->bus_num = -1;
+	master->num_chipselect = 1;
+	master->mode_bits = SPI_CPOL | SPI_CPHA;
+	master->transfer_one_message = fake_bcp_transfer_one_message;
+
+	if (spi_register_master(master)) {
+		spi_master_put(master);
+		platform_device_unregister(pdev);
+		return NULL;
+	}
+
+	bcp->spi = spi_new_device(master, &info);
+	if (bcp->spi == NULL) {
+		spi_unregister_master(master);
+		platform_device_unregister(pdev);
+		return NULL;
+	}
+
+	fake_bcp_active = bcp;
+
+	return bcp;
+}
+
+void fake_bcp_destroy(struct fake_bcp *bcp)
+{
+	struct platform_device *pdev = bcp->pdev;
+
+	hrtimer_cancel(&bcp->timer);
+	fake_bcp_active = NULL;
+
+	spi_unregister_device(bcp->spi);
+	// Frees bcp along with the master
+	spi_unregister_master(bcp->master);
+	platform_device_unregister(pdev);
+}
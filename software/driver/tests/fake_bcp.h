@@ -0,0 +1,137 @@
+#ifndef _FAKE_BCP_H_
+#define _FAKE_BCP_H_
+
+#include <linux/delay.h>
+#include <linux/spi/spi.h>
+#include <linux/hrtimer.h>
+#include <linux/platform_device.h>
+#include <kunit/test.h>
+
+// A fake SPI controller with the nRF51822 BCP slave behind it. It follows
+// bcp_spi_slave.c: the next frame is loaded into the slave's buffer when
+// chip select goes high and the interrupt line stays high while frames are
+// waiting. The slave sits on mux output 0; transfers to other outputs read
+// back zeros.
+
+#define FAKE_BCP_BUF_LEN     64
+#define FAKE_BCP_QUEUE_LEN   4   // same as INTERRUPT_EVENT_QUEUE_LEN
+#define FAKE_BCP_CMD_LOG_LEN 256
+#define FAKE_BCP_NUM_GPIOS   32
+#define FAKE_BCP_HISTORY_LEN 4   // same as BCP_HISTORY_LEN
+#define FAKE_BCP_MUX_MASK    0xff
+
+// A frame's content before it is put on the wire.
+struct fake_bcp_frame {
+	u8 type;
+	u8 seq;
+	u8 len;
+	u8 data[FAKE_BCP_BUF_LEN];
+};
+
+struct fake_bcp {
+	struct platform_device *pdev;
+	struct spi_master *master;
+	struct spi_device *spi;
+
+	spinlock_t lock;
+
+	// What the slave clocks out on the next transfer.
+	u8 tx[FAKE_BCP_BUF_LEN];
+	bool tx_full;
+
+	// Frames waiting behind tx, like interrupt_event_queue.c.
+	struct fake_bcp_frame queue[FAKE_BCP_QUEUE_LEN];
+	int queue_head;
+	int queue_count;
+
+	// Sequence number of the next record, frames sent recently, and
+	// sequence numbers the master asked for again.
+	u8 seq;
+	struct fake_bcp_frame history[FAKE_BCP_HISTORY_LEN];
+	int history_next;
+	int history_count;
+	u8 resend[FAKE_BCP_HISTORY_LEN];
+	int resend_count;
+	// Send frames without sequence number and CRC, like older firmware.
+	bool legacy_frames;
+
+	bool irq_line;
+	void (*irq_handler)(void *ctx);
+	void *irq_ctx;
+
+	// Fault injection.
+	bool corrupt_first_byte;  // prepend the 0x00 the 7.1us CS issue causes
+	int invalid_every;        // every Nth transfer returns all zeros
+	bool stuck_irq;           // interrupt line stuck high
+	u32 max_good_hz;          // faster transfers come back all zeros, 0 for no limit
+	u32 min_cs_setup_us;      // shorter CS setup loses the first byte
+	bool corrupt_next;        // flip a bit in the next record on the wire
+
+	// Record generation. Records carry a 32 bit counter as payload.
+	u32 next_record;
+	u32 records_left;         // generate this many as fast as they are read
+	u32 rate;                 // or this many per second from a timer
+	u8 record_len;            // payload bytes per record (>= 4)
+	struct hrtimer timer;
+
+	// What the master sent us.
+	u8 cmd_log[FAKE_BCP_CMD_LOG_LEN];
+	int cmd_count;
+
+	// Records that did not fit in the slave's queue, and records lost to
+	// an injected all-zero transfer.
+	u32 slave_dropped;
+	u32 garbled;
+	u32 corrupted;
+	u32 transfers;
+	u32 resets;
+
+	// Fake GPIO pins, and their values when the last transfer started.
+	u32 gpios;
+	u32 gpios_at_xfer;
+	u32 array_writes;
+
+	// SPI mode of the device the last transfer was sent for.
+	u32 mode_at_xfer;
+};
+
+struct fake_bcp *fake_bcp_create(void);
+void fake_bcp_destroy(struct fake_bcp *bcp);
+
+void fake_bcp_set_irq_handler(struct fake_bcp *bcp, void (*handler)(void *ctx), void *ctx);
+
+// Queue one record on the slave, raising the interrupt line if needed.
+void fake_bcp_add_record(struct fake_bcp *bcp);
+// Have the slave produce count records back to back.
+void fake_bcp_stream(struct fake_bcp *bcp, u32 count);
+// Produce records at rate per second until stopped with rate 0.
+void fake_bcp_set_rate(struct fake_bcp *bcp, u32 rate);
+
+void fake_bcp_set_stuck_irq(struct fake_bcp *bcp, bool stuck);
+
+// Stand-ins for the GPIO calls the drivers make.
+int fake_bcp_gpio_get_value(unsigned int gpio);
+void fake_bcp_gpio_set_value(unsigned int gpio, int value);
+void fake_bcp_gpio_set_array(unsigned int n, unsigned long *values);
+
+// Hook gapspi up to the fake controller, as its probe would.
+void gapspi_kunit_attach(struct spi_device *spi, int num_pins);
+void gapspi_kunit_detach(struct spi_device *spi);
+
+extern struct kunit_suite nrf51822_kunit_suite;
+extern struct kunit_suite gapspi_kunit_suite;
+
+// Pin numbers that read back the fake interrupt line and reset the slave.
+#define FAKE_BCP_IRQ_GPIO 31
+#define FAKE_BCP_RST_GPIO 30
+
+// Poll cond for up to timeout_ms, sleeping in between.
+#define fake_bcp_wait(cond, timeout_ms) ({                  \
+	int __t = (timeout_ms);                                  \
+	while (!(cond) && __t-- > 0) {                           \
+		msleep(1);                                           \
+	}                                                        \
+	(cond);                                                  \
+})
+
+#endif
@@ -0,0 +1,414 @@
+// KUnit tests for gapspi.c, run against the fake BCP controller.
+//
+// The mux pins are fake GPIOs so the tests can check which output was
+// selected while each transfer was on the wire and how often it changed.
+
+#include <linux/module.h>
+#include <linux/gpio.h>
+#include <linux/spi/spi.h>
+#include <kunit/test.h>
+
+#include "fake_bcp.h"
+
+#undef gpio_set_value
+#define gpio_set_value(gpio, value) fake_bcp_gpio_set_value(gpio, value)
+#undef gpiod_set_array_value
+#define gpiod_set_array_value(n, descs, info, values) fake_bcp_gpio_set_array(n, values)
+#undef module_spi_driver
+#define module_spi_driver(__spi_driver) \
+	static struct spi_driver *__maybe_unused gapspi_kunit_driver = &(__spi_driver)
+#undef MODULE_DEVICE_TABLE
+#define MODULE_DEVICE_TABLE(type, name)
+
+#include "../gapspi/gapspi.c"
+
+#define GAPSPI_KUNIT_PINS 2
+
+void gapspi_kunit_attach(struct spi_device *spi, int num_pins)
+{
+	struct gapspi_bus *bus;
+	int i;
+
+	bus = kzalloc(sizeof(struct gapspi_bus), GFP_KERNEL);
+	if (bus == NULL) {
+		return;
+	}
+	gapspi_bus_init(bus, spi, num_pins);
+	for (i=0; i<num_pins; i++) {
+		bus->pins[i] = i;
+	}
+	bus->mux = 0;
+
+	gapspi_bus_start(bus);
+}
+
+void gapspi_kunit_detach(struct spi_device *spi)
+{
+	struct gapspi_bus *bus = spi_get_drvdata(spi);
+
+	gapspi_bus_stop(bus);
+	kfree(bus);
+}
+
+struct gapspi_kunit_xfer {
+	struct spi_message msg;
+	struct spi_transfer t;
+	u8 tx[2];
+	u8 rx[2];
+	u32 mux;
+	atomic_t *done;
+	int *order;
+};
+
+static void gapspi_kunit_init_xfer(struct gapspi_kunit_xfer *x)
+{
+	memset(x, 0, sizeof(struct gapspi_kunit_xfer));
+	x->t.tx_buf = x->tx;
+	x->t.rx_buf = x->rx;
+	x->t.len = sizeof(x->tx);
+	spi_message_init(&x->msg);
+	spi_message_add_tail(&x->t, &x->msg);
+}
+
+static int gapspi_kunit_init(struct kunit *test)
+{
+	struct fake_bcp *bcp;
+
+	bcp = fake_bcp_create();
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, bcp);
+	gapspi_kunit_attach(bcp->spi, GAPSPI_KUNIT_PINS);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, gapspi_default);
+
+	test->priv = bcp;
+	return 0;
+}
+
+static void gapspi_kunit_exit(struct kunit *test)
+{
+	struct fake_bcp *bcp = test->priv;
+
+	gapspi_kunit_detach(bcp->spi);
+	fake_bcp_destroy(bcp);
+}
+
+// Each message goes out with the mux set to its device id.
+static void gapspi_kunit_mux(struct kunit *test)
+{
+	struct fake_bcp *bcp = test->priv;
+	struct gapspi_kunit_xfer x;
+	int id;
+
+	for (id=(1<<GAPSPI_KUNIT_PINS)-1; id>=0; id--) {
+		gapspi_kunit_init_xfer(&x);
+		KUNIT_ASSERT_EQ(test, gap_spi_sync(&x.msg, id), 0);
+		KUNIT_EXPECT_EQ(test, bcp->gpios_at_xfer & ((1<<GAPSPI_KUNIT_PINS)-1), (u32) id);
+	}
+}
+
+static void gapspi_kunit_complete(void *arg)
+{
+	struct gapspi_kunit_xfer *x = arg;
+	struct fake_bcp *bcp = spi_master_get_devdata(x->msg.spi->master);
+
+	x->mux = bcp->gpios_at_xfer & ((1<<GAPSPI_KUNIT_PINS)-1);
+	if (x->order) {
+		x->order[atomic_read(x->done)] = x->mux;
+	}
+	atomic_inc(x->done);
+}
+
+// Keep the scheduler from handing anything to the controller, so a test
+// can queue messages and then see the order they are released in.
+static void gapspi_kunit_hold(void)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&gapspi_default->lock, flags);
+	gapspi_default->inflight += GAPSPI_DEPTH;
+	spin_unlock_irqrestore(&gapspi_default->lock, flags);
+}
+
+static void gapspi_kunit_release(void)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&gapspi_default->lock, flags);
+	gapspi_default->inflight -= GAPSPI_DEPTH;
+	spin_unlock_irqrestore(&gapspi_default->lock, flags);
+
+	gapspi_dispatch(gapspi_default, NULL);
+}
+
+// Queue count messages while the scheduler is held, to the mux outputs in
+// ids, and return the outputs in the order they went out.
+static void gapspi_kunit_run(struct kunit *test, const int *ids, int count,
+                             int *order, int delay_ms)
+{
+	struct gapspi_kunit_xfer *xfers;
+	atomic_t done = ATOMIC_INIT(0);
+	int i;
+
+	xfers = kunit_kcalloc(test, count, sizeof(struct gapspi_kunit_xfer), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, xfers);
+
+	gapspi_kunit_hold();
+	for (i=0; i<count; i++) {
+		gapspi_kunit_init_xfer(&xfers[i]);
+		xfers[i].done = &done;
+		xfers[i].order = order;
+		xfers[i].msg.complete = gapspi_kunit_complete;
+		xfers[i].msg.context = &xfers[i];
+		KUNIT_ASSERT_EQ(test, gap_spi_async(&xfers[i].msg, ids[i]), 0);
+	}
+	msleep(delay_ms);
+	gapspi_kunit_release();
+
+	KUNIT_ASSERT_TRUE(test, fake_bcp_wait(atomic_read(&done) == count, 1000));
+}
+
+// Back to back messages to one device set the mux once.
+static void gapspi_kunit_redundant_mux(struct kunit *test)
+{
+	struct fake_bcp *bcp = test->priv;
+	struct gapspi_kunit_xfer x;
+	int i;
+
+	for (i=0; i<10; i++) {
+		gapspi_kunit_init_xfer(&x);
+		KUNIT_ASSERT_EQ(test, gap_spi_sync(&x.msg, 3), 0);
+	}
+	KUNIT_EXPECT_EQ(test, bcp->array_writes, 1U);
+	KUNIT_EXPECT_EQ(test, bcp->gpios & 3, 3U);
+}
+
+// Messages for two devices queued interleaved go out grouped.
+static void gapspi_kunit_grouping(struct kunit *test)
+{
+	struct fake_bcp *bcp = test->priv;
+	const int ids[] = {1, 2, 1, 2, 1, 2, 1, 2};
+	int order[ARRAY_SIZE(ids)];
+	int i;
+
+	gapspi_kunit_run(test, ids, ARRAY_SIZE(ids), order, 0);
+
+	for (i=0; i<ARRAY_SIZE(ids); i++) {
+		KUNIT_EXPECT_EQ(test, order[i], i < 4 ? 1 : 2);
+	}
+	KUNIT_EXPECT_EQ(test, bcp->array_writes, 2U);
+}
+
+// Every message, byte and mux switch is counted against its output.
+static void gapspi_kunit_stats(struct kunit *test)
+{
+	const int ids[] = {1, 2, 1, 2, 1, 2};
+	int order[ARRAY_SIZE(ids)];
+	struct gapspi_stats *stats;
+	int id;
+
+	gapspi_kunit_run(test, ids, ARRAY_SIZE(ids), order, 1);
+
+	for (id=1; id<=2; id++) {
+		stats = &gapspi_default->targets[id].stats;
+		KUNIT_EXPECT_EQ(test, stats->messages, 3ULL);
+		KUNIT_EXPECT_EQ(test, stats->bytes, 6ULL);
+		KUNIT_EXPECT_EQ(test, stats->errors, 0ULL);
+		KUNIT_EXPECT_EQ(test, stats->switches, 1ULL);
+		KUNIT_EXPECT_GT(test, stats->busy_ns, 0ULL);
+	}
+	// Both waited through the 1 ms hold
+	KUNIT_EXPECT_GE(test, gapspi_default->targets[1].stats.wait_ns, (u64) NSEC_PER_MSEC);
+	KUNIT_EXPECT_GE(test, gapspi_default->targets[2].stats.wait_ns, (u64) NSEC_PER_MSEC);
+	KUNIT_EXPECT_EQ(test, gapspi_default->targets[0].stats.messages, 0ULL);
+}
+
+// One device cannot hold the mux for more than GAPSPI_MAX_BURST messages
+// while another of the same priority waits.
+static void gapspi_kunit_burst(struct kunit *test)
+{
+	int ids[GAPSPI_MAX_BURST+2];
+	int order[GAPSPI_MAX_BURST+2];
+	int i;
+
+	for (i=0; i<GAPSPI_MAX_BURST+1; i++) {
+		ids[i] = 1;
+	}
+	ids[GAPSPI_MAX_BURST+1] = 2;
+
+	gapspi_kunit_run(test, ids, ARRAY_SIZE(ids), order, 0);
+
+	KUNIT_EXPECT_EQ(test, order[GAPSPI_MAX_BURST-1], 1);
+	KUNIT_EXPECT_EQ(test, order[GAPSPI_MAX_BURST], 2);
+	KUNIT_EXPECT_EQ(test, order[GAPSPI_MAX_BURST+1], 1);
+}
+
+// A higher priority device goes first, unless a lower priority one has
+// waited past its latency budget.
+static void gapspi_kunit_priority(struct kunit *test)
+{
+	const int ids[] = {0, 0, 0, 3};
+	int order[ARRAY_SIZE(ids)];
+
+	KUNIT_ASSERT_EQ(test, gap_spi_set_priority(3, 1, 0), 0);
+	gapspi_kunit_run(test, ids, ARRAY_SIZE(ids), order, 0);
+	KUNIT_EXPECT_EQ(test, order[0], 3);
+
+	KUNIT_ASSERT_EQ(test, gap_spi_set_priority(0, 0, 100), 0);
+	gapspi_kunit_run(test, ids, ARRAY_SIZE(ids), order, 2);
+	KUNIT_EXPECT_EQ(test, order[0], 0);
+}
+
+// A message the controller will not take is handed back to gap_spi_async()'s
+// caller without being completed. One that was waiting behind others when
+// it failed is completed later, with the error.
+static void gapspi_kunit_submit_error(struct kunit *test)
+{
+	struct gapspi_kunit_xfer x;
+	atomic_t done = ATOMIC_INIT(0);
+	int i;
+
+	for (i=0; i<2; i++) {
+		// spi_async() refuses a one byte transfer of 16 bit words
+		gapspi_kunit_init_xfer(&x);
+		x.t.bits_per_word = 16;
+		x.t.len = 1;
+		x.done = &done;
+		x.msg.complete = gapspi_kunit_complete;
+		x.msg.context = &x;
+
+		if (i == 0) {
+			KUNIT_EXPECT_EQ(test, gap_spi_async(&x.msg, 1), -EINVAL);
+			msleep(10);
+			KUNIT_EXPECT_EQ(test, atomic_read(&done), 0);
+		} else {
+			gapspi_kunit_hold();
+			KUNIT_ASSERT_EQ(test, gap_spi_async(&x.msg, 1), 0);
+			gapspi_kunit_release();
+			KUNIT_ASSERT_TRUE(test, fake_bcp_wait(atomic_read(&done) == 1, 1000));
+			KUNIT_EXPECT_EQ(test, x.msg.status, -EINVAL);
+		}
+	}
+	KUNIT_EXPECT_EQ(test, gapspi_default->targets[1].stats.errors, 2ULL);
+	KUNIT_EXPECT_EQ(test, gapspi_default->inflight, 0);
+}
+
+// Async messages to alternating devices each see their own mux setting,
+// and how many messages per second make it through the hook.
+static void gapspi_kunit_async(struct kunit *test)
+{
+	const int count = 10000;
+	const int batch = 16;
+	struct gapspi_kunit_xfer *xfers;
+	atomic_t done = ATOMIC_INIT(0);
+	u64 start, elapsed;
+	int sent = 0;
+	int i;
+
+	xfers = kunit_kcalloc(test, batch, sizeof(struct gapspi_kunit_xfer), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, xfers);
+
+	start = ktime_get_ns();
+	while (sent < count) {
+		atomic_set(&done, 0);
+		for (i=0; i<batch; i++) {
+			gapspi_kunit_init_xfer(&xfers[i]);
+			xfers[i].done = &done;
+			xfers[i].msg.complete = gapspi_kunit_complete;
+			xfers[i].msg.context = &xfers[i];
+			KUNIT_ASSERT_EQ(test, gap_spi_async(&xfers[i].msg, i % (1<<GAPSPI_KUNIT_PINS)), 0);
+		}
+		KUNIT_ASSERT_TRUE(test, fake_bcp_wait(atomic_read(&done) == batch, 1000));
+		for (i=0; i<batch; i++) {
+			KUNIT_EXPECT_EQ(test, xfers[i].mux, (u32) (i % (1<<GAPSPI_KUNIT_PINS)));
+		}
+		sent += batch;
+	}
+	elapsed = ktime_get_ns() - start;
+
+	kunit_info(test, "%d messages in %llu us, %llu messages/s\n", sent,
+	           elapsed / NSEC_PER_USEC, div64_u64((u64) sent * NSEC_PER_SEC, elapsed));
+}
+
+// Add a device behind a mux output's own controller, the way a device tree
+// child node would.
+static struct spi_device *gapspi_kunit_add_device(struct kunit *test, int id, u32 mode)
+{
+	struct spi_board_info info = {
+		.modalias = "gapspi-kunit",
+		.max_speed_hz = 1000000,
+		.chip_select = 0,
+		.mode = mode,
+	};
+	struct spi_device *spi;
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, gapspi_default->targets[id].ctlr);
+	spi = spi_new_device(gapspi_default->targets[id].ctlr, &info);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, spi);
+
+	return spi;
+}
+
+// A plain SPI device on an output's controller goes out on the real
+// controller with the mux set to that output, and gets its own spi_device
+// back in the completed message.
+static void gapspi_kunit_output(struct kunit *test)
+{
+	struct fake_bcp *bcp = test->priv;
+	struct gapspi_kunit_xfer x;
+	struct spi_device *spi;
+	int id;
+
+	for (id=0; id<(1<<GAPSPI_KUNIT_PINS); id++) {
+		spi = gapspi_kunit_add_device(test, id, SPI_MODE_0);
+
+		gapspi_kunit_init_xfer(&x);
+		KUNIT_EXPECT_EQ(test, spi_sync(spi, &x.msg), 0);
+		KUNIT_EXPECT_EQ(test, bcp->gpios_at_xfer & ((1<<GAPSPI_KUNIT_PINS)-1), (u32) id);
+		KUNIT_EXPECT_PTR_EQ(test, x.msg.spi, spi);
+
+		spi_unregister_device(spi);
+	}
+}
+
+// The real controller is switched to each device's SPI mode before its
+// messages go out.
+static void gapspi_kunit_output_mode(struct kunit *test)
+{
+	struct fake_bcp *bcp = test->priv;
+	struct gapspi_kunit_xfer x;
+	struct spi_device *spi[2];
+
+	spi[0] = gapspi_kunit_add_device(test, 1, SPI_MODE_0);
+	spi[1] = gapspi_kunit_add_device(test, 2, SPI_MODE_3);
+
+	gapspi_kunit_init_xfer(&x);
+	KUNIT_EXPECT_EQ(test, spi_sync(spi[1], &x.msg), 0);
+	KUNIT_EXPECT_EQ(test, bcp->mode_at_xfer & SPI_MODE_3, (u32) SPI_MODE_3);
+
+	gapspi_kunit_init_xfer(&x);
+	KUNIT_EXPECT_EQ(test, spi_sync(spi[0], &x.msg), 0);
+	KUNIT_EXPECT_EQ(test, bcp->mode_at_xfer & SPI_MODE_3, (u32) SPI_MODE_0);
+
+	spi_unregister_device(spi[0]);
+	spi_unregister_device(spi[1]);
+}
+
+static struct kunit_case gapspi_kunit_cases[] = {
+	KUNIT_CASE(gapspi_kunit_mux),
+	KUNIT_CASE(gapspi_kunit_redundant_mux),
+	KUNIT_CASE(gapspi_kunit_grouping),
+	KUNIT_CASE(gapspi_kunit_stats),
+	KUNIT_CASE(gapspi_kunit_burst),
+	KUNIT_CASE(gapspi_kunit_priority),
+	KUNIT_CASE(gapspi_kunit_submit_error),
+	KUNIT_CASE(gapspi_kunit_output),
+	KUNIT_CASE(gapspi_kunit_output_mode),
+	KUNIT_CASE(gapspi_kunit_async),
+	{}
+};
+
+struct kunit_suite gapspi_kunit_suite = {
+	.name = "gapspi",
+	.init = gapspi_kunit_init,
+	.exit = gapspi_kunit_exit,
+	.test_cases = gapspi_kunit_cases,
+};
@@ -0,0 +1,567 @@
+// KUnit tests for nrf51822.c, run against the fake BCP controller.
+//
+// The driver source is included directly so the tests can reach its static
+// functions. The interrupt GPIO is read from the fake, and the platform
+// driver registration is compiled out so this module does not bind to real
+// hardware.
+
+#include <linux/module.h>
+#include <linux/gpio.h>
+#include <linux/platform_device.h>
+#include <kunit/test.h>
+
+#include "fake_bcp.h"
+
+#undef gpio_get_value
+#define gpio_get_value(gpio) fake_bcp_gpio_get_value(gpio)
+#undef gpio_set_value
+#define gpio_set_value(gpio, value) fake_bcp_gpio_set_value(gpio, value)
+#undef module_platform_driver
+#define module_platform_driver(__platform_driver) \
+	static struct platform_driver *__maybe_unused nrf51822_kunit_driver = &(__platform_driver)
+#undef MODULE_DEVICE_TABLE
+#define MODULE_DEVICE_TABLE(type, name)
+
+#include "../nrf51822/nrf51822.c"
+
+#define NRF51822_KUNIT_RADIOS 2
+
+// Radio 0 is wired to the fake. Radio 1 shares the bus but its interrupt
+// line never goes high.
+struct nrf51822_kunit {
+	struct fake_bcp *bcp;
+	struct nrf51822_config *cfg;
+	struct nrf51822_dev *dev;
+	struct inode *inode;
+	struct file *filp;
+	struct nrf51822_reader *reader;
+};
+
+static void nrf51822_kunit_irq(void *ctx)
+{
+	nrf51822_interrupt_handler(0, ctx);
+}
+
+// Open the radio the way the VFS would and return the new reader.
+static struct nrf51822_reader *nrf51822_kunit_open(struct kunit *test,
+                                                   struct nrf51822_kunit *ctx,
+                                                   struct file **filp)
+{
+	*filp = kunit_kzalloc(test, sizeof(struct file), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, *filp);
+	(*filp)->f_flags = O_NONBLOCK;
+
+	KUNIT_ASSERT_EQ(test, nrf51822_open(ctx->inode, *filp), 0);
+
+	return (*filp)->private_data;
+}
+
+static bool nrf51822_kunit_idle(struct nrf51822_dev *dev)
+{
+	unsigned long flags;
+	bool idle;
+
+	flush_workqueue(dev->wq);
+
+	spin_lock_irqsave(&dev->spi_spin_lock, flags);
+	idle = dev->spi_refs == 0 && !dev->irq_pending &&
+	       list_empty(&dev->xfer_done) && kfifo_is_empty(&dev->cmd_fifo);
+	spin_unlock_irqrestore(&dev->spi_spin_lock, flags);
+
+	return idle;
+}
+
+static u32 nrf51822_kunit_record_number(struct nrf51822_dev *dev, u64 seq)
+{
+	u32 n;
+
+	memcpy(&n, dev->ring[seq & (NRF51822_RING_LEN-1)].data+2, sizeof(n));
+	return n;
+}
+
+static int nrf51822_kunit_init(struct kunit *test)
+{
+	struct nrf51822_kunit *ctx;
+	int i;
+
+	ctx = kunit_kzalloc(test, sizeof(struct nrf51822_kunit), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, ctx);
+
+	ctx->bcp = fake_bcp_create();
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, ctx->bcp);
+	gapspi_kunit_attach(ctx->bcp->spi, 1);
+
+	ctx->cfg = kunit_kzalloc(test, sizeof(struct nrf51822_config), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, ctx->cfg);
+	nrf51822_config_init(ctx->cfg);
+	ctx->cfg->num_radios = NRF51822_KUNIT_RADIOS;
+	ctx->cfg->radios = kunit_kcalloc(test, NRF51822_KUNIT_RADIOS,
+	                                 sizeof(struct nrf51822_dev), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, ctx->cfg->radios);
+	for (i=0; i<NRF51822_KUNIT_RADIOS; i++) {
+		KUNIT_ASSERT_EQ(test, nrf51822_dev_init(&ctx->cfg->radios[i], ctx->cfg, i), 0);
+		ctx->cfg->radios[i].chipselect_demux_index = i;
+		ctx->cfg->radios[i].pin_interrupt = i;
+	}
+
+	ctx->dev = &ctx->cfg->radios[0];
+	ctx->dev->pin_interrupt = FAKE_BCP_IRQ_GPIO;
+
+	ctx->inode = kunit_kzalloc(test, sizeof(struct inode), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, ctx->inode);
+	ctx->inode->i_cdev = &ctx->dev->cdev;
+
+	test->priv = ctx;
+	ctx->reader = nrf51822_kunit_open(test, ctx, &ctx->filp);
+
+	fake_bcp_set_irq_handler(ctx->bcp, nrf51822_kunit_irq, ctx->dev);
+
+	return 0;
+}
+
+static void nrf51822_kunit_exit(struct kunit *test)
+{
+	struct nrf51822_kunit *ctx = test->priv;
+	int i;
+
+	fake_bcp_set_rate(ctx->bcp, 0);
+	fake_bcp_set_stuck_irq(ctx->bcp, false);
+	fake_bcp_wait(nrf51822_kunit_idle(ctx->dev), 1000);
+
+	fake_bcp_set_irq_handler(ctx->bcp, NULL, NULL);
+	for (i=0; i<NRF51822_KUNIT_RADIOS; i++) {
+		nrf51822_dev_free(&ctx->cfg->radios[i]);
+	}
+	nrf51822_release(ctx->inode, ctx->filp);
+	gapspi_kunit_detach(ctx->bcp->spi);
+	fake_bcp_destroy(ctx->bcp);
+}
+
+// An interrupt leads to a READ_IRQ transfer and the record lands in the ring.
+static void nrf51822_kunit_read_irq(struct kunit *test)
+{
+	struct nrf51822_kunit *ctx = test->priv;
+	struct nrf51822_dev *dev = ctx->dev;
+
+	fake_bcp_add_record(ctx->bcp);
+
+	KUNIT_ASSERT_TRUE(test, fake_bcp_wait(dev->ring_head == 1, 1000));
+	KUNIT_EXPECT_EQ(test, ctx->bcp->cmd_log[0], BCP_COMMAND_READ_IRQ);
+	KUNIT_EXPECT_EQ(test, dev->ring[0].data[0], ctx->bcp->record_len + 1);
+	KUNIT_EXPECT_EQ(test, dev->ring[0].data[1], BCP_RSP_ADVERTISEMENT);
+	KUNIT_EXPECT_EQ(test, nrf51822_kunit_record_number(dev, 0), 0U);
+	KUNIT_EXPECT_EQ(test, ctx->reader->pending, 1ULL);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&dev->stats.interrupts), 1LL);
+}
+
+// Frames that start with the stray 0x00 are realigned.
+static void nrf51822_kunit_corrupt_first_byte(struct kunit *test)
+{
+	struct nrf51822_kunit *ctx = test->priv;
+	struct nrf51822_dev *dev = ctx->dev;
+
+	ctx->bcp->corrupt_first_byte = true;
+	fake_bcp_add_record(ctx->bcp);
+	fake_bcp_add_record(ctx->bcp);
+
+	KUNIT_ASSERT_TRUE(test, fake_bcp_wait(dev->ring_head == 2, 1000));
+	KUNIT_EXPECT_EQ(test, dev->ring[1].data[0], ctx->bcp->record_len + 1);
+	KUNIT_EXPECT_EQ(test, nrf51822_kunit_record_number(dev, 1), 1U);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&dev->stats.invalid_frames), 0LL);
+}
+
+// All-zero transfers are counted without wedging the radio, and the records
+// they carried are asked for again. A resend that is garbled as well is
+// counted lost.
+static void nrf51822_kunit_invalid_frames(struct kunit *test)
+{
+	struct nrf51822_kunit *ctx = test->priv;
+	struct nrf51822_dev *dev = ctx->dev;
+
+	ctx->bcp->invalid_every = 2;
+	fake_bcp_stream(ctx->bcp, 10);
+
+	KUNIT_ASSERT_TRUE(test, fake_bcp_wait(
+		dev->ring_head + atomic64_read(&dev->stats.records_lost) == 10 &&
+		nrf51822_kunit_idle(dev), 1000));
+	KUNIT_EXPECT_GT(test, ctx->bcp->garbled, 0U);
+	KUNIT_EXPECT_GT(test, atomic64_read(&dev->stats.retransmits), 0LL);
+	KUNIT_EXPECT_GE(test, atomic64_read(&dev->stats.invalid_frames), (s64) ctx->bcp->garbled);
+}
+
+// A record that fails its CRC is sent again and arrives after the ones
+// behind it.
+static void nrf51822_kunit_crc_resend(struct kunit *test)
+{
+	struct nrf51822_kunit *ctx = test->priv;
+	struct nrf51822_dev *dev = ctx->dev;
+	u32 sum = 0;
+	u64 i;
+
+	// The first frame the driver sees sets the sequence.
+	fake_bcp_add_record(ctx->bcp);
+	KUNIT_ASSERT_TRUE(test, fake_bcp_wait(dev->ring_head == 1 && nrf51822_kunit_idle(dev), 1000));
+
+	ctx->bcp->corrupt_next = true;
+	fake_bcp_stream(ctx->bcp, 5);
+
+	KUNIT_ASSERT_TRUE(test, fake_bcp_wait(dev->ring_head == 6 && nrf51822_kunit_idle(dev), 1000));
+	KUNIT_EXPECT_EQ(test, ctx->bcp->corrupted, 1U);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&dev->stats.crc_errors), 1LL);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&dev->stats.retransmits), 1LL);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&dev->stats.records_lost), 0LL);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&dev->stats.duplicate_frames), 0LL);
+
+	for (i=1; i<6; i++) {
+		sum += nrf51822_kunit_record_number(dev, i);
+	}
+	KUNIT_EXPECT_EQ(test, sum, 1U+2+3+4+5);
+	KUNIT_EXPECT_EQ(test, nrf51822_kunit_record_number(dev, 5), 1U);
+}
+
+// Records the slave's queue had no room for show up as a sequence gap. The
+// slave answers the resend with BCP_RSP_LOST, and a following record says
+// how many were lost.
+static void nrf51822_kunit_records_lost(struct kunit *test)
+{
+	struct nrf51822_kunit *ctx = test->priv;
+	struct nrf51822_dev *dev = ctx->dev;
+	int i;
+
+	// Fill the slave while the driver is not looking: one in its buffer,
+	// FAKE_BCP_QUEUE_LEN queued and one dropped.
+	fake_bcp_set_irq_handler(ctx->bcp, NULL, NULL);
+	for (i=0; i<FAKE_BCP_QUEUE_LEN+2; i++) {
+		fake_bcp_add_record(ctx->bcp);
+	}
+	KUNIT_EXPECT_EQ(test, ctx->bcp->slave_dropped, 1U);
+	fake_bcp_set_irq_handler(ctx->bcp, nrf51822_kunit_irq, dev);
+	nrf51822_interrupt_handler(0, dev);
+	KUNIT_ASSERT_TRUE(test, fake_bcp_wait(dev->ring_head == FAKE_BCP_QUEUE_LEN+1 &&
+	                                      nrf51822_kunit_idle(dev), 1000));
+
+	// The gap is seen once something comes after it, and the loss is
+	// reported with the record after the slave's answer.
+	for (i=0; i<2; i++) {
+		fake_bcp_add_record(ctx->bcp);
+		KUNIT_ASSERT_TRUE(test, fake_bcp_wait(dev->ring_head == FAKE_BCP_QUEUE_LEN+2+i &&
+		                                      nrf51822_kunit_idle(dev), 1000));
+	}
+	KUNIT_EXPECT_EQ(test, atomic64_read(&dev->stats.records_lost), 1LL);
+	KUNIT_EXPECT_EQ(test, dev->ring[FAKE_BCP_QUEUE_LEN].lost, 0);
+	KUNIT_EXPECT_EQ(test, dev->ring[FAKE_BCP_QUEUE_LEN+1].lost +
+	                      dev->ring[FAKE_BCP_QUEUE_LEN+2].lost, 1);
+	KUNIT_EXPECT_EQ(test, nrf51822_kunit_record_number(dev, FAKE_BCP_QUEUE_LEN+1),
+	                (u32) FAKE_BCP_QUEUE_LEN+2);
+}
+
+// Firmware without sequence numbers and CRCs still works.
+static void nrf51822_kunit_legacy_frames(struct kunit *test)
+{
+	struct nrf51822_kunit *ctx = test->priv;
+	struct nrf51822_dev *dev = ctx->dev;
+
+	ctx->bcp->legacy_frames = true;
+	fake_bcp_stream(ctx->bcp, 10);
+
+	KUNIT_ASSERT_TRUE(test, fake_bcp_wait(dev->ring_head == 10 && nrf51822_kunit_idle(dev), 1000));
+	KUNIT_EXPECT_EQ(test, nrf51822_kunit_record_number(dev, 9), 9U);
+	KUNIT_EXPECT_FALSE(test, dev->checked);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&dev->stats.invalid_frames), 0LL);
+}
+
+// A stuck interrupt line keeps the driver reading but it recovers once the
+// line is released.
+static void nrf51822_kunit_stuck_irq(struct kunit *test)
+{
+	struct nrf51822_kunit *ctx = test->priv;
+	struct nrf51822_dev *dev = ctx->dev;
+
+	fake_bcp_set_stuck_irq(ctx->bcp, true);
+	KUNIT_ASSERT_TRUE(test, fake_bcp_wait(atomic64_read(&dev->stats.empty_reads) > 10, 1000));
+
+	fake_bcp_set_stuck_irq(ctx->bcp, false);
+	KUNIT_ASSERT_TRUE(test, fake_bcp_wait(nrf51822_kunit_idle(dev), 1000));
+
+	fake_bcp_add_record(ctx->bcp);
+	KUNIT_EXPECT_TRUE(test, fake_bcp_wait(dev->ring_head == 1, 1000));
+}
+
+// A radio whose interrupt line sticks is reset by the watchdog and gets its
+// sniffing command back without userspace seeing a second response.
+static void nrf51822_kunit_watchdog_reset(struct kunit *test)
+{
+	struct nrf51822_kunit *ctx = test->priv;
+	struct nrf51822_dev *dev = ctx->dev;
+	struct nrf51822_response rsp;
+	u8 cmd = BCP_COMMAND_SNIFF_ADVERTISEMENTS;
+	unsigned long flags;
+	int i, sniffs = 0;
+
+	dev->pin_reset = FAKE_BCP_RST_GPIO;
+	fake_bcp_gpio_set_value(FAKE_BCP_RST_GPIO, 1);
+
+	KUNIT_ASSERT_EQ(test, nrf51822_queue_command(dev, &cmd, 1, true), 1);
+	KUNIT_ASSERT_TRUE(test, fake_bcp_wait(nrf51822_kunit_idle(dev), 1000));
+	KUNIT_ASSERT_TRUE(test, kfifo_get(&dev->rsp_fifo, &rsp));
+	KUNIT_EXPECT_EQ(test, dev->replay_len, 1);
+
+	KUNIT_EXPECT_EQ(test, nrf51822_watchdog_check(dev), NRF51822_RESET_NONE);
+	fake_bcp_set_stuck_irq(ctx->bcp, true);
+	KUNIT_EXPECT_EQ(test, nrf51822_watchdog_check(dev), NRF51822_RESET_NONE);
+	KUNIT_ASSERT_EQ(test, nrf51822_watchdog_check(dev), NRF51822_RESET_STUCK_IRQ);
+
+	// The stuck line keeps the bus busy with empty reads, so only look
+	// at what is sent from here on.
+	spin_lock_irqsave(&ctx->bcp->lock, flags);
+	ctx->bcp->cmd_count = 0;
+	spin_unlock_irqrestore(&ctx->bcp->lock, flags);
+
+	nrf51822_reset(dev, NRF51822_RESET_STUCK_IRQ);
+	KUNIT_ASSERT_TRUE(test, fake_bcp_wait(nrf51822_kunit_idle(dev), 1000));
+
+	KUNIT_EXPECT_EQ(test, ctx->bcp->resets, 1U);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&dev->stats.resets), 1LL);
+	for (i=0; i<min(ctx->bcp->cmd_count, FAKE_BCP_CMD_LOG_LEN); i++) {
+		if (ctx->bcp->cmd_log[i] == BCP_COMMAND_SNIFF_ADVERTISEMENTS) {
+			sniffs++;
+		}
+	}
+	KUNIT_EXPECT_EQ(test, sniffs, 1);
+	KUNIT_EXPECT_TRUE(test, kfifo_is_empty(&dev->rsp_fifo));
+
+	// Still works afterwards
+	fake_bcp_add_record(ctx->bcp);
+	KUNIT_EXPECT_TRUE(test, fake_bcp_wait(dev->ring_head == 1, 1000));
+}
+
+// A sniffing radio that has been quiet for watchdog_idle_ms is only reset
+// if it does not answer a read either.
+static void nrf51822_kunit_watchdog_quiet(struct kunit *test)
+{
+	struct nrf51822_kunit *ctx = test->priv;
+	struct nrf51822_dev *dev = ctx->dev;
+	struct nrf51822_response rsp;
+	u8 cmd = BCP_COMMAND_SNIFF_ADVERTISEMENTS;
+	u64 quiet = 2ULL * watchdog_idle_ms * NSEC_PER_MSEC;
+
+	KUNIT_ASSERT_GT(test, watchdog_idle_ms, 0U);
+	KUNIT_ASSERT_EQ(test, nrf51822_queue_command(dev, &cmd, 1, true), 1);
+	KUNIT_ASSERT_TRUE(test, fake_bcp_wait(nrf51822_kunit_idle(dev), 1000));
+	KUNIT_ASSERT_TRUE(test, kfifo_get(&dev->rsp_fifo, &rsp));
+
+	// Nothing heard, but the chip answers with an empty frame
+	WRITE_ONCE(dev->wdt_progress_ns, ktime_get_ns() - quiet);
+	KUNIT_EXPECT_EQ(test, nrf51822_watchdog_check(dev), NRF51822_RESET_NONE);
+	KUNIT_EXPECT_GT(test, atomic64_read(&dev->stats.empty_reads), 0LL);
+	// and is not read again until it has been quiet that long once more
+	KUNIT_EXPECT_EQ(test, nrf51822_watchdog_check(dev), NRF51822_RESET_NONE);
+
+	// Now every read comes back as zeros
+	ctx->bcp->invalid_every = 1;
+	dev->wdt_probe_ns = ktime_get_ns() - quiet;
+	KUNIT_EXPECT_EQ(test, nrf51822_watchdog_check(dev), NRF51822_RESET_NO_PROGRESS);
+	ctx->bcp->invalid_every = 0;
+}
+
+// Calibration settles one step below the first clock that fails, on the
+// shortest CS setup delay that keeps frames whole, and the watchdog steps
+// down again when errors start at the calibrated clock.
+static void nrf51822_kunit_calibrate(struct kunit *test)
+{
+	struct nrf51822_kunit *ctx = test->priv;
+	struct nrf51822_dev *dev = ctx->dev;
+
+	ctx->bcp->max_good_hz = 2000000;
+	ctx->bcp->min_cs_setup_us = 3;
+	nrf51822_calibrate(dev);
+	KUNIT_EXPECT_EQ(test, dev->speed_hz, 1000000U);
+	KUNIT_EXPECT_EQ(test, dev->cs_delay_us, 4U);
+	KUNIT_EXPECT_FALSE(test, dev->calibrating);
+
+	// Clean at the calibrated clock
+	fake_bcp_stream(ctx->bcp, 10);
+	KUNIT_ASSERT_TRUE(test, fake_bcp_wait(dev->ring_head == 10 && nrf51822_kunit_idle(dev), 1000));
+	nrf51822_speed_check(dev);
+	KUNIT_EXPECT_EQ(test, dev->speed_hz, 1000000U);
+
+	ctx->bcp->max_good_hz = 500000;
+	fake_bcp_stream(ctx->bcp, 10);
+	KUNIT_ASSERT_TRUE(test, fake_bcp_wait(nrf51822_kunit_idle(dev), 1000));
+	nrf51822_speed_check(dev);
+	KUNIT_EXPECT_EQ(test, dev->speed_hz, 500000U);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&dev->stats.speed_fallbacks), 1LL);
+}
+
+// A burst of records keeps reads pipelined, and at most the reads queued
+// behind the last record come back empty.
+static void nrf51822_kunit_pipeline(struct kunit *test)
+{
+	struct nrf51822_kunit *ctx = test->priv;
+	struct nrf51822_dev *dev = ctx->dev;
+
+	fake_bcp_stream(ctx->bcp, 50);
+
+	KUNIT_ASSERT_TRUE(test, fake_bcp_wait(dev->ring_head == 50 && nrf51822_kunit_idle(dev), 1000));
+	KUNIT_EXPECT_EQ(test, nrf51822_kunit_record_number(dev, 49), 49U);
+	KUNIT_EXPECT_LE(test, atomic64_read(&dev->stats.empty_reads), (s64) NRF51822_SPI_PIPELINE-1);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&dev->stats.invalid_frames), 0LL);
+}
+
+// Commands queued while records are streaming are all sent, in order, and
+// each gets a completion on the response channel.
+static void nrf51822_kunit_command_queue(struct kunit *test)
+{
+	struct nrf51822_kunit *ctx = test->priv;
+	struct nrf51822_dev *dev = ctx->dev;
+	struct nrf51822_response rsp;
+	u8 expect = 0x10;
+	int i;
+
+	fake_bcp_stream(ctx->bcp, 20);
+	for (i=0; i<3; i++) {
+		u8 cmd = 0x10 + i;
+		KUNIT_EXPECT_EQ(test, nrf51822_queue_command(dev, &cmd, 1, true), i+1);
+	}
+
+	KUNIT_ASSERT_TRUE(test, fake_bcp_wait(kfifo_len(&dev->rsp_fifo) == 3 &&
+	                                      nrf51822_kunit_idle(dev), 1000));
+	KUNIT_EXPECT_EQ(test, dev->ring_head, 20ULL);
+
+	for (i=0; i<ctx->bcp->cmd_count; i++) {
+		if (ctx->bcp->cmd_log[i] != BCP_COMMAND_READ_IRQ) {
+			KUNIT_EXPECT_EQ(test, ctx->bcp->cmd_log[i], expect);
+			expect++;
+		}
+	}
+	KUNIT_EXPECT_EQ(test, expect, 0x13);
+
+	for (i=0; i<3; i++) {
+		KUNIT_ASSERT_TRUE(test, kfifo_get(&dev->rsp_fifo, &rsp));
+		KUNIT_EXPECT_EQ(test, rsp.seq, (u32) i+1);
+		KUNIT_EXPECT_EQ(test, rsp.command, 0x10 + i);
+		KUNIT_EXPECT_EQ(test, rsp.status, 0);
+	}
+}
+
+// A radio with a busy interrupt line does not hold up commands for another
+// radio on the same bus: they get every other slot. Nothing drives MISO for
+// the other radio, and a command that reads back zeros is not an invalid
+// frame.
+static void nrf51822_kunit_fair_bus(struct kunit *test)
+{
+	struct nrf51822_kunit *ctx = test->priv;
+	struct nrf51822_dev *other = &ctx->cfg->radios[1];
+	const u32 count = 2000;
+	u8 cmd = 0x20;
+	int i;
+
+	fake_bcp_stream(ctx->bcp, count);
+	for (i=0; i<8; i++) {
+		KUNIT_EXPECT_GT(test, nrf51822_queue_command(other, &cmd, 1, true), 0);
+	}
+
+	KUNIT_ASSERT_TRUE(test, fake_bcp_wait(kfifo_len(&other->rsp_fifo) == 8, 1000));
+	KUNIT_EXPECT_LT(test, ctx->dev->ring_head, (u64) count / 2);
+
+	KUNIT_ASSERT_TRUE(test, fake_bcp_wait(nrf51822_kunit_idle(ctx->dev) &&
+	                                      nrf51822_kunit_idle(other), 10000));
+	KUNIT_EXPECT_EQ(test, ctx->dev->ring_head, (u64) count);
+	KUNIT_EXPECT_EQ(test, other->ring_head, 0ULL);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&other->stats.invalid_frames), 0LL);
+}
+
+// Two readers see the same records, and a filter only lets matching
+// records through to its reader.
+static void nrf51822_kunit_readers_and_filters(struct kunit *test)
+{
+	struct nrf51822_kunit *ctx = test->priv;
+	struct nrf51822_dev *dev = ctx->dev;
+	struct nrf51822_reader *second;
+	struct file *filp;
+
+	second = nrf51822_kunit_open(test, ctx, &filp);
+
+	// Only accept record number 1 (little-endian counter at offset 2).
+	second->filter.num_rules = 1;
+	second->filter.rules[0].offset = 2;
+	second->filter.rules[0].len = 4;
+	second->filter.rules[0].flags = NRF51822_FILTER_F_LE;
+	memset(second->filter.rules[0].mask, 0xff, 4);
+	second->filter.rules[0].lo[0] = 1;
+	second->filter.rules[0].hi[0] = 1;
+
+	fake_bcp_stream(ctx->bcp, 3);
+	KUNIT_ASSERT_TRUE(test, fake_bcp_wait(dev->ring_head == 3, 1000));
+
+	KUNIT_EXPECT_EQ(test, ctx->reader->pending, 3ULL);
+	KUNIT_EXPECT_EQ(test, second->pending, 1ULL);
+	KUNIT_EXPECT_EQ(test, second->filtered, 2ULL);
+
+	nrf51822_release(ctx->inode, filp);
+}
+
+// Records generated on a timer are either captured or counted as dropped
+// by the slave.
+static void nrf51822_kunit_rate(struct kunit *test)
+{
+	struct nrf51822_kunit *ctx = test->priv;
+	struct nrf51822_dev *dev = ctx->dev;
+
+	fake_bcp_set_rate(ctx->bcp, 2000);
+	msleep(200);
+	fake_bcp_set_rate(ctx->bcp, 0);
+
+	KUNIT_ASSERT_TRUE(test, fake_bcp_wait(nrf51822_kunit_idle(dev), 1000));
+	KUNIT_EXPECT_EQ(test, dev->ring_head + ctx->bcp->slave_dropped,
+	                (u64) ctx->bcp->next_record);
+	kunit_info(test, "2000 records/s offered: %llu captured, %u dropped by the slave\n",
+	           dev->ring_head, ctx->bcp->slave_dropped);
+}
+
+// How many records per second the driver can pull through the fake bus.
+static void nrf51822_kunit_benchmark(struct kunit *test)
+{
+	struct nrf51822_kunit *ctx = test->priv;
+	struct nrf51822_dev *dev = ctx->dev;
+	const u32 count = 20000;
+	u64 start, elapsed;
+
+	start = ktime_get_ns();
+	fake_bcp_stream(ctx->bcp, count);
+	KUNIT_ASSERT_TRUE(test, fake_bcp_wait(dev->ring_head == count, 60000));
+	elapsed = ktime_get_ns() - start;
+
+	KUNIT_EXPECT_EQ(test, ctx->reader->pending + ctx->reader->dropped, (u64) count);
+	kunit_info(test, "%u records in %llu us, %llu records/s\n", count,
+	           elapsed / NSEC_PER_USEC, div64_u64((u64) count * NSEC_PER_SEC, elapsed));
+}
+
+static struct kunit_case nrf51822_kunit_cases[] = {
+	KUNIT_CASE(nrf51822_kunit_read_irq),
+	KUNIT_CASE(nrf51822_kunit_corrupt_first_byte),
+	KUNIT_CASE(nrf51822_kunit_invalid_frames),
+	KUNIT_CASE(nrf51822_kunit_crc_resend),
+	KUNIT_CASE(nrf51822_kunit_records_lost),
+	KUNIT_CASE(nrf51822_kunit_legacy_frames),
+	KUNIT_CASE(nrf51822_kunit_stuck_irq),
+	KUNIT_CASE(nrf51822_kunit_watchdog_reset),
+	KUNIT_CASE(nrf51822_kunit_watchdog_quiet),
+	KUNIT_CASE(nrf51822_kunit_calibrate),
+	KUNIT_CASE(nrf51822_kunit_pipeline),
+	KUNIT_CASE(nrf51822_kunit_command_queue),
+	KUNIT_CASE(nrf51822_kunit_fair_bus),
+	KUNIT_CASE(nrf51822_kunit_readers_and_filters),
+	KUNIT_CASE(nrf51822_kunit_rate),
+	KUNIT_CASE(nrf51822_kunit_benchmark),
+	{}
+};
+
+struct kunit_suite nrf51822_kunit_suite = {
+	.name = "nrf51822",
+	.init = nrf51822_kunit_init,
+	.exit = nrf51822_kunit_exit,
+	.test_cases = nrf51822_kunit_cases,
+};
+
+kunit_test_suites(&nrf51822_kunit_suite, &gapspi_kunit_suite);
@@ -8,15 +8,31 @@
 // commands
 #define BCP_CMD_READ_IRQ             1 // read what caused us to interrupt the host
 #define BCP_CMD_SNIFF_ADVERTISEMENTS 2 // notify host on all advertisements
+#define BCP_CMD_RESEND               4 // send the frame with sequence number
+                                       // in the next byte again
+#define BCP_CMD_BENCHMARK            5 // generate synthetic advertisements,
+                                       // see bcp_benchmark.h
 
 
 // response types
+#define BCP_RSP_NONE          0  // nothing queued, sent when the host reads anyway
 #define BCP_RSP_ADVERTISEMENT 1  // send the raw advertisement content
+#define BCP_RSP_LOST          2  // a resent frame is gone, seq says which
+
+// Frames are [len][type | BCP_RSP_CHECKED][seq][payload][crc lo][crc hi].
+// len counts everything after itself. The CRC is CRC-16/CCITT-FALSE (poly
+// 0x1021, init 0xffff) over len through the end of the payload.
+#define BCP_RSP_CHECKED       0x80
+#define BCP_FRAME_OVERHEAD    4  // type, seq and CRC bytes
 
 
 // Send all received advertisements to the host
 void bcp_sniff_advertisements ();
 
+// Start or stop the synthetic record generator. data is what followed the
+// command byte.
+void bcp_benchmark (uint8_t* data, uint8_t len);
+
 void bcp_interrupt_host ();
 void bcp_interupt_host_clear ();
 
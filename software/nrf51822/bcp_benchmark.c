@@ -0,0 +1,86 @@
+#include <string.h>
+
+#include "bcp_benchmark.h"
+
+static void put_u32 (uint8_t* buf, uint32_t v) {
+	buf[0] = v & 0xff;
+	buf[1] = (v >> 8) & 0xff;
+	buf[2] = (v >> 16) & 0xff;
+	buf[3] = (v >> 24) & 0xff;
+}
+
+static uint32_t get_u32 (uint8_t* buf) {
+	return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t) buf[3] << 24);
+}
+
+void bcp_benchmark_start (bcp_benchmark_t* bench,
+                          uint16_t rate,
+                          uint8_t size,
+                          uint32_t count,
+                          uint32_t now) {
+	if (size < BCP_BENCHMARK_HEADER_LEN) {
+		size = BCP_BENCHMARK_HEADER_LEN;
+	} else if (size > BCP_BENCHMARK_MAX_SIZE) {
+		size = BCP_BENCHMARK_MAX_SIZE;
+	}
+
+	bench->running = rate > 0;
+	bench->rate = rate;
+	bench->size = size;
+	bench->count = count;
+	bench->seq = 0;
+	bench->last_tick = now & BCP_BENCHMARK_TICK_MASK;
+	bench->elapsed = 0;
+}
+
+bool bcp_benchmark_command (bcp_benchmark_t* bench,
+                            uint8_t* data,
+                            uint8_t len,
+                            uint32_t now) {
+	if (len < BCP_BENCHMARK_CMD_LEN) {
+		bench->running = false;
+		return false;
+	}
+
+	bcp_benchmark_start(bench, data[0] | (data[1] << 8), data[2],
+	                    get_u32(data+3), now);
+	return bench->running;
+}
+
+uint32_t bcp_benchmark_due (bcp_benchmark_t* bench, uint32_t now) {
+	uint64_t target;
+
+	if (!bench->running) {
+		return 0;
+	}
+
+	// The counter wraps every 512 s
+	now &= BCP_BENCHMARK_TICK_MASK;
+	bench->elapsed += (now - bench->last_tick) & BCP_BENCHMARK_TICK_MASK;
+	bench->last_tick = now;
+
+	// Keep to the schedule from the start rather than from the last
+	// call, so timer jitter does not add up.
+	target = bench->elapsed * bench->rate / BCP_BENCHMARK_TICKS_PER_SEC;
+	if (bench->count > 0 && target > bench->count) {
+		target = bench->count;
+	}
+
+	return target - bench->seq;
+}
+
+uint8_t bcp_benchmark_record (bcp_benchmark_t* bench,
+                              uint32_t now,
+                              uint8_t* buf) {
+	memset(buf, 0, bench->size);
+	buf[0] = BCP_BENCHMARK_MAGIC;
+	put_u32(buf+1, bench->seq);
+	put_u32(buf+5, now & BCP_BENCHMARK_TICK_MASK);
+
+	bench->seq++;
+	if (bench->count > 0 && bench->seq >= bench->count) {
+		bench->running = false;
+	}
+
+	return bench->size;
+}
@@ -0,0 +1,67 @@
+#ifndef BCP_BENCHMARK_H__
+#define BCP_BENCHMARK_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Synthetic advertisement records for benchmarking the chip -> SPI ->
+// driver -> userspace path. Started with BCP_CMD_BENCHMARK:
+//
+//   [BCP_CMD_BENCHMARK][rate lo][rate hi][size][count, 4 bytes LE]
+//
+// rate is records per second, 0 stops a running benchmark. size is the
+// record payload length. count is the number of records to send, 0 for no
+// limit. Each record is sent as a BCP_RSP_ADVERTISEMENT with payload
+//
+//   [BCP_BENCHMARK_MAGIC][seq, 4 bytes LE][tick, 4 bytes LE][0 padding]
+//
+// where seq counts from 0 for every run and tick is the RTC tick the
+// record was generated at. Real advertisement reports start with the
+// address type, which is never BCP_BENCHMARK_MAGIC.
+//
+// This file only does the bookkeeping and has no SDK dependencies, so it
+// can be built and tested on a normal Linux machine. main.c drives it from
+// a timer and hands the records to interrupt_event_queue_add().
+
+#define BCP_BENCHMARK_MAGIC         0xbe
+#define BCP_BENCHMARK_HEADER_LEN    9
+#define BCP_BENCHMARK_MAX_SIZE      39   // longest advertisement report
+#define BCP_BENCHMARK_CMD_LEN       7    // not counting the command byte
+
+// RTC1 runs from the 32.768 kHz clock and counts 24 bits.
+#define BCP_BENCHMARK_TICKS_PER_SEC 32768
+#define BCP_BENCHMARK_TICK_MASK     0xffffff
+
+typedef struct {
+	bool     running;
+	uint16_t rate;
+	uint8_t  size;
+	uint32_t count;      // records to send, 0 for no limit
+	uint32_t seq;        // records generated so far
+	uint32_t last_tick;
+	uint64_t elapsed;    // ticks since the start, unwrapped
+} bcp_benchmark_t;
+
+// Parse a BCP_CMD_BENCHMARK payload and start or stop the generator.
+// Returns true if it is running afterwards.
+bool bcp_benchmark_command (bcp_benchmark_t* bench,
+                            uint8_t* data,
+                            uint8_t len,
+                            uint32_t now);
+
+void bcp_benchmark_start (bcp_benchmark_t* bench,
+                          uint16_t rate,
+                          uint8_t size,
+                          uint32_t count,
+                          uint32_t now);
+
+// Number of records that should have been generated by tick now but have
+// not been yet.
+uint32_t bcp_benchmark_due (bcp_benchmark_t* bench, uint32_t now);
+
+// Write the next record's payload to buf. Returns its length.
+uint8_t bcp_benchmark_record (bcp_benchmark_t* bench,
+                              uint32_t now,
+                              uint8_t* buf);
+
+#endif
@@ -1,4 +1,6 @@
 
+#include <string.h>
+
 #include "app_error.h"
 #include "spi_slave.h"
 
@@ -15,40 +17,151 @@ uint8_t spi_rx_buf[SPI_BUF_LEN] = {0};
 // Keep track of whether we have put data into the SPI buffer or not.
 bool buffer_full = false;
 
-// This function is called to put data in the SPI buffer when data is added
-// to the queue.
-void spi_slave_notify() {
-	uint32_t err_code;
+// The last few frames we sent. If the host gets a frame with a bad CRC it
+// asks for it again with BCP_CMD_RESEND.
+#define BCP_HISTORY_LEN 4
+interrupt_event_queue_item_t history[BCP_HISTORY_LEN];
+uint8_t history_next = 0;
+uint8_t history_count = 0;
+
+// Sequence numbers the host asked for again, sent before anything new.
+#define BCP_RESEND_LEN 4
+uint8_t resend[BCP_RESEND_LEN];
+uint8_t resend_count = 0;
+
+
+// CRC-16/CCITT-FALSE, bit at a time. Frames are short enough that a table
+// is not worth the flash.
+static uint16_t bcp_crc16 (uint8_t* data, uint8_t len) {
+	uint16_t crc = 0xffff;
+	uint8_t i, j;
+
+	for (i=0; i<len; i++) {
+		crc ^= ((uint16_t) data[i]) << 8;
+		for (j=0; j<8; j++) {
+			if (crc & 0x8000) {
+				crc = (crc << 1) ^ 0x1021;
+			} else {
+				crc <<= 1;
+			}
+		}
+	}
 
-	if (!buffer_full) {
-		// Check if we need to repopulate the SPI buffer with the next
-		// thing from the queue
-		uint8_t data_len;
-		uint8_t len;
-		uint8_t  response_type;
+	return crc;
+}
 
-		data_len = interrupt_event_queue_get(&response_type, spi_tx_buf+2);
+// Write a checked frame into the TX buffer.
+static void bcp_frame_build (uint8_t response_type,
+                             uint8_t seq,
+                             uint8_t* data,
+                             uint8_t data_len) {
+	uint16_t crc;
 
-		if (data_len > 0) {
-			buffer_full = true;
+	if (data_len > SPI_BUF_LEN - BCP_FRAME_OVERHEAD - 1) {
+		data_len = SPI_BUF_LEN - BCP_FRAME_OVERHEAD - 1;
+	}
 
-			len = data_len + 1; // for the response type byte
+	spi_tx_buf[0] = data_len + BCP_FRAME_OVERHEAD;
+	spi_tx_buf[1] = response_type | BCP_RSP_CHECKED;
+	spi_tx_buf[2] = seq;
+	memcpy(spi_tx_buf+3, data, data_len);
 
-			// Create the response SPI buffer.
-			spi_tx_buf[0] = len;
-			spi_tx_buf[1] = response_type;
+	crc = bcp_crc16(spi_tx_buf, data_len + 3);
+	spi_tx_buf[data_len+3] = crc & 0xff;
+	spi_tx_buf[data_len+4] = crc >> 8;
+}
 
-			// Send the TX buffer to the SPI module
-			err_code = spi_slave_buffers_set(spi_tx_buf,
-			                                 spi_rx_buf,
-			                                 SPI_BUF_LEN,
-			                                 SPI_BUF_LEN);
+static interrupt_event_queue_item_t* bcp_history_find (uint8_t seq) {
+	uint8_t i;
 
-			APP_ERROR_CHECK(err_code);
+	for (i=0; i<history_count; i++) {
+		if (history[i].seq == seq) {
+			return history + i;
+		}
+	}
 
-			// Set the interrupt line high
-			bcp_interrupt_host();
+	return NULL;
+}
+
+// The host wants the frame with this sequence number again.
+static void bcp_resend (uint8_t seq) {
+	// If we cannot take the request the host times out and counts the
+	// frame as lost.
+	if (resend_count < BCP_RESEND_LEN) {
+		resend[resend_count++] = seq;
+	}
+}
+
+// Put the next frame in the TX buffer: a resend the host asked for, then the
+// next thing from the queue, and an empty frame if there is nothing. Returns
+// true if there is something the host should come and read.
+static bool spi_slave_load_next () {
+	interrupt_event_queue_item_t* item;
+	uint8_t data_len;
+	uint8_t seq;
+	uint8_t i;
+
+	if (resend_count > 0) {
+		seq = resend[0];
+		resend_count--;
+		for (i=0; i<resend_count; i++) {
+			resend[i] = resend[i+1];
+		}
+
+		item = bcp_history_find(seq);
+		if (item) {
+			bcp_frame_build(item->interrupt_event, item->seq, item->buffer,
+			                item->len);
+		} else {
+			// Too old, or dropped because the queue was full
+			bcp_frame_build(BCP_RSP_LOST, seq, NULL, 0);
 		}
+		return true;
+	}
+
+	// Pull straight into the history so the frame can be resent
+	item = history + history_next;
+	data_len = interrupt_event_queue_get(&item->interrupt_event, &item->seq,
+	                                     item->buffer);
+
+	if (data_len > 0) {
+		item->len = data_len;
+		history_next = (history_next + 1) % BCP_HISTORY_LEN;
+		if (history_count < BCP_HISTORY_LEN) {
+			history_count++;
+		}
+
+		bcp_frame_build(item->interrupt_event, item->seq, item->buffer,
+		                data_len);
+		return true;
+	}
+
+	// Nothing left to send. The host may have another read queued already,
+	// so make sure it gets an empty frame rather than the one it just read.
+	// It carries the next sequence number so the host can tell if the last
+	// events before it were dropped.
+	bcp_frame_build(BCP_RSP_NONE, interrupt_event_queue_next_seq(), NULL, 0);
+	return false;
+}
+
+// This function is called to put data in the SPI buffer when data is added
+// to the queue.
+void spi_slave_notify() {
+	uint32_t err_code;
+
+	if (!buffer_full && spi_slave_load_next()) {
+		buffer_full = true;
+
+		// Send the TX buffer to the SPI module
+		err_code = spi_slave_buffers_set(spi_tx_buf,
+		                                 spi_rx_buf,
+		                                 SPI_BUF_LEN,
+		                                 SPI_BUF_LEN);
+
+		APP_ERROR_CHECK(err_code);
+
+		// Set the interrupt line high
+		bcp_interrupt_host();
 	}
 }
 
@@ -60,9 +173,6 @@ static void spi_slave_event_handle(spi_slave_evt_t event) {
 	// Check the event type. There are only two events, and only one is useful.
 	if (event.evt_type == SPI_SLAVE_XFER_DONE) {
 
-
-
-
 		// The first byte is the command byte
 		switch (spi_rx_buf[0]) {
 
@@ -76,55 +186,37 @@ static void spi_slave_event_handle(spi_slave_evt_t event) {
 			bcp_sniff_advertisements();
 			break;
 
-		  default:
+		  case BCP_CMD_BENCHMARK:
+			bcp_benchmark(spi_rx_buf+1, SPI_BUF_LEN-1);
 			break;
-		}
-
-
-		{
-			// Check if we need to repopulate the SPI buffer with the next
-			// thing from the queue
-			uint8_t data_len;
-			uint8_t len;
-			uint8_t  response_type;
 
-			data_len = interrupt_event_queue_get(&response_type, spi_tx_buf+2);
-
-			if (data_len > 0) {
-
-				len = data_len + 1; // for the response type byte
-
-				// Create the response SPI buffer.
-				spi_tx_buf[0] = len;
-				spi_tx_buf[1] = response_type;
-
-				// Send the TX buffer to the SPI module
-				err_code = spi_slave_buffers_set(spi_tx_buf,
-				                                 spi_rx_buf,
-				                                 SPI_BUF_LEN,
-				                                 SPI_BUF_LEN);
-
-		nrf_gpio_pin_toggle(3);
-				APP_ERROR_CHECK(err_code);
+		  case BCP_CMD_RESEND:
+			// The host got a frame it could not check
+			bcp_resend(spi_rx_buf[1]);
+			break;
 
-				// Set the interrupt line high
-				bcp_interrupt_host();
-				buffer_full = true;
+		  default:
+			break;
+		}
 
-			} else {
+		// Check if we need to repopulate the SPI buffer with the next
+		// thing from the queue
+		buffer_full = spi_slave_load_next();
 
-				// Still need to set the RX buffer as the reception
-				// destination
-				err_code = spi_slave_buffers_set(spi_tx_buf,
-				                                 spi_rx_buf,
-				                                 SPI_BUF_LEN,
-				                                 SPI_BUF_LEN);
+		// Still need to set the RX buffer as the reception destination
+		// even if there is nothing to send
+		err_code = spi_slave_buffers_set(spi_tx_buf,
+		                                 spi_rx_buf,
+		                                 SPI_BUF_LEN,
+		                                 SPI_BUF_LEN);
+		APP_ERROR_CHECK(err_code);
 
-				buffer_full = false;
-				bcp_interupt_host_clear();
-			}
+		if (buffer_full) {
+			// Set the interrupt line high
+			bcp_interrupt_host();
+		} else {
+			bcp_interupt_host_clear();
 		}
-
 	}
 
 }
@@ -152,7 +244,9 @@ uint32_t spi_slave_example_init(void)
 	err_code = spi_slave_init(&spi_slave_config);
 	APP_ERROR_CHECK(err_code);
 
-	// Set buffers.
+	// Set buffers. Until there is something to send, reads get an empty
+	// frame.
+	bcp_frame_build(BCP_RSP_NONE, interrupt_event_queue_next_seq(), NULL, 0);
 	err_code = spi_slave_buffers_set(spi_tx_buf,
 									 spi_rx_buf,
 									 SPI_BUF_LEN,
@@ -12,11 +12,16 @@ uint8_t queue_head = 0;
 uint8_t queue_tail = 0;
 uint8_t items_in_queue = 0;
 
+// Every event gets the next sequence number, even if the queue is full and it
+// is dropped. The host sees the gap and knows exactly how many it missed.
+uint8_t queue_seq = 0;
+
 
 uint32_t interrupt_event_queue_add (uint8_t interrupt_event,
                                     uint8_t len,
                                     uint8_t* data) {
 	interrupt_event_queue_item_t* queue_entry;
+	uint8_t seq = queue_seq++;
 
 	if (items_in_queue == INTERRUPT_EVENT_QUEUE_LEN) {
 		return NRF_ERROR_NO_MEM;
@@ -28,6 +33,7 @@ uint32_t interrupt_event_queue_add (uint8_t interrupt_event,
 	memcpy(queue_entry->buffer, data, fmin(len, 64));
 	queue_entry->len = len;
 	queue_entry->interrupt_event = interrupt_event;
+	queue_entry->seq = seq;
 
 	// Update counters
 	items_in_queue++;
@@ -40,7 +46,9 @@ uint32_t interrupt_event_queue_add (uint8_t interrupt_event,
 	return NRF_SUCCESS;
 }
 
-uint16_t interrupt_event_queue_get (uint8_t* interrupt_event, uint8_t* data) {
+uint16_t interrupt_event_queue_get (uint8_t* interrupt_event,
+                                    uint8_t* seq,
+                                    uint8_t* data) {
 	uint8_t len;
 
 	if (items_in_queue == 0) {
@@ -49,6 +57,7 @@ uint16_t interrupt_event_queue_get (uint8_t* interrupt_event, uint8_t* data) {
 
 	// Copy to the arguments
 	*interrupt_event = queue[queue_tail].interrupt_event;
+	*seq = queue[queue_tail].seq;
 	memcpy(data, queue[queue_tail].buffer, fmin(queue[queue_tail].len, 64));
 	len = queue[queue_tail].len;
 
@@ -58,3 +67,7 @@ uint16_t interrupt_event_queue_get (uint8_t* interrupt_event, uint8_t* data) {
 
 	return len;
 }
+
+uint8_t interrupt_event_queue_next_seq () {
+	return queue_seq;
+}
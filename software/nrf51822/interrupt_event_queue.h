@@ -8,6 +8,7 @@ typedef struct {
 	uint8_t  buffer[64];
 	uint8_t len;
 	uint8_t  interrupt_event;
+	uint8_t  seq;
 } interrupt_event_queue_item_t;
 
 
@@ -15,4 +16,9 @@ uint32_t interrupt_event_queue_add (uint8_t interrupt_event,
                                     uint8_t len,
                                     uint8_t* data);
 
-uint16_t interrupt_event_queue_get (uint8_t* interrupt_event, uint8_t* data);
+uint16_t interrupt_event_queue_get (uint8_t* interrupt_event,
+                                    uint8_t* seq,
+                                    uint8_t* data);
+
+// Sequence number the next added event will get
+uint8_t interrupt_event_queue_next_seq ();
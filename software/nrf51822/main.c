@@ -27,12 +27,14 @@ See bcp.h for the list of valid commands the SPI master can issue.
 #include "ble_hrs_c.h"
 #include "ble_bas_c.h"
 #include "app_util.h"
+#include "app_timer.h"
 
 #include "led.h"
 
 #include "bcp.h"
 #include "interrupt_event_queue.h"
 #include "bcp_spi_slave.h"
+#include "bcp_benchmark.h"
 
 
 #define LED_GOT_ADV_PACKET               LED_0                                          /**< Is on when application has asserted. */
@@ -57,6 +59,12 @@ See bcp.h for the list of valid commands the SPI master can issue.
 #define SLAVE_LATENCY              0                                  /**< Determines slave latency in counts of connection events. */
 #define SUPERVISION_TIMEOUT        MSEC_TO_UNITS(4000, UNIT_10_MS)    /**< Determines supervision time-out in units of 10 millisecond. */
 
+#define APP_TIMER_PRESCALER        0                                  /**< RTC1 at the full 32.768 kHz, so ticks are 30.5 us. */
+#define APP_TIMER_MAX_TIMERS       1                                  /**< The benchmark generator. */
+#define APP_TIMER_OP_QUEUE_SIZE    4
+
+#define BENCHMARK_INTERVAL         APP_TIMER_TICKS(1, APP_TIMER_PRESCALER) /**< How often the benchmark generator catches up with its schedule. */
+
 #define TARGET_UUID                0x180D                             /**< Target device name that application is looking for. */
 #define MAX_PEER_COUNT             DEVICE_MANAGER_MAX_CONNECTIONS     /**< Maximum number of peer's application intends to manage. */
 #define UUID16_SIZE                2                                  /**< Size of 16 bit UUID */
@@ -132,6 +140,9 @@ static void scan_start(void);
 bool bcp_irq_advertisements = false;
 //bool bcp_irq_advertisements = true;
 
+static app_timer_id_t  m_benchmark_timer_id;
+static bcp_benchmark_t m_benchmark;
+
 
 
 
@@ -191,6 +202,50 @@ void bcp_sniff_advertisements () {
 
 
 
+// Queue whatever synthetic records are due. They go through the same queue
+// as real advertisements; the ones that do not fit are dropped there and
+// show up on the host as gaps in the benchmark sequence numbers.
+static void benchmark_timeout_handler (void* p_context) {
+    uint8_t  buf[BCP_BENCHMARK_MAX_SIZE];
+    uint32_t now;
+    uint32_t due;
+    uint8_t  len;
+
+    app_timer_cnt_get(&now);
+
+    due = bcp_benchmark_due(&m_benchmark, now);
+    while (due-- > 0) {
+        len = bcp_benchmark_record(&m_benchmark, now, buf);
+        interrupt_event_queue_add(BCP_RSP_ADVERTISEMENT, len, buf);
+    }
+
+    if (!m_benchmark.running) {
+        app_timer_stop(m_benchmark_timer_id);
+    }
+}
+
+void bcp_benchmark (uint8_t* data, uint8_t len) {
+    uint32_t now;
+
+    app_timer_stop(m_benchmark_timer_id);
+    app_timer_cnt_get(&now);
+
+    if (bcp_benchmark_command(&m_benchmark, data, len, now)) {
+        app_timer_start(m_benchmark_timer_id, BENCHMARK_INTERVAL, NULL);
+    }
+}
+
+static void benchmark_init (void) {
+    uint32_t err_code;
+
+    APP_TIMER_INIT(APP_TIMER_PRESCALER, APP_TIMER_MAX_TIMERS, APP_TIMER_OP_QUEUE_SIZE, false);
+
+    err_code = app_timer_create(&m_benchmark_timer_id,
+                                APP_TIMER_MODE_REPEATED,
+                                benchmark_timeout_handler);
+    APP_ERROR_CHECK(err_code);
+}
+
 void bcp_interrupt_host () {
     nrf_gpio_pin_set(INTERRUPT_PIN);
 }
@@ -842,6 +897,7 @@ int main(void)
 
 
     ble_stack_init();
+    benchmark_init();
 
     spi_slave_example_init();
 